@@ -0,0 +1,79 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "error.h"
+#include "arena.h"
+
+
+/* Size of block header rounded up, so data part is aligned. */
+#define RT_ARENA_HEADER ((sizeof(RT_ArenaBlock) + RT_ARENA_ALIGN-1) & ~(size_t)(RT_ARENA_ALIGN-1))
+
+
+///////////////////////////////////////////////////////////////
+RT_Arena* rtArenaCreate(size_t blocksize) {
+  RT_Arena *res = malloc(sizeof(RT_Arena));
+  if(!res) {
+    errno = E_MEMORY;
+    return NULL;
+  }
+  res->head = NULL;
+  res->blocksize = blocksize > 0? blocksize: RT_ARENA_BLOCK;
+  res->nblocks = 0;
+  res->total = 0;
+  return res;
+}
+///////////////////////////////////////////////////////////////
+void rtArenaDestroy(RT_Arena **self) {
+  RT_Arena *ptr=*self;
+  RT_ArenaBlock *block, *next;
+  if(!ptr)
+    return;
+  for(block=ptr->head; block; block=next) {
+    next = block->next;
+    free(block);
+  }
+  free(ptr);
+  *self = NULL;
+}
+///////////////////////////////////////////////////////////////
+void* rtArenaAlloc(RT_Arena *self, size_t size) {
+  RT_ArenaBlock *block=self->head;
+  void *res;
+
+  size = (size + RT_ARENA_ALIGN-1) & ~(size_t)(RT_ARENA_ALIGN-1);
+  if(!block || block->size - block->used < size) {
+    /* Oversized request gets block of its own, placed behind current one,
+     * so space left in current block is not wasted. */
+    size_t bsize = size > self->blocksize? size: self->blocksize;
+    RT_ArenaBlock *tmp = malloc(RT_ARENA_HEADER + bsize);
+    if(!tmp) {
+      errno = E_MEMORY;
+      return NULL;
+    }
+    tmp->size = bsize;
+    tmp->used = 0;
+    if(block && bsize > self->blocksize) {
+      tmp->next = block->next;
+      block->next = tmp;
+    } else {
+      tmp->next = block;
+      self->head = tmp;
+    }
+    self->nblocks++;
+    block = tmp;
+  }
+
+  res = (char*)block + RT_ARENA_HEADER + block->used;
+  block->used += size;
+  self->total += size;
+  return res;
+}
+///////////////////////////////////////////////////////////////
+void* rtArenaAllocZero(RT_Arena *self, size_t size) {
+  void *res = rtArenaAlloc(self, size);
+  if(res)
+    memset(res, 0, size);
+  return res;
+}
+
+// vim: tabstop=2 shiftwidth=2 softtabstop=2
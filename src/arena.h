@@ -0,0 +1,63 @@
+/*
+  Region (arena) allocator. Memory is taken from large blocks by moving
+  pointer and is never released separately; all blocks are released at once
+  when arena is destroyed. Used for data living as long as its owner (f.e.
+  triangles and shadow caches of scene or triangle lists of voxel grid), so
+  building it takes few malloc() calls and destroying it takes no walk over
+  its items.
+*/
+#ifndef __ARENA_H
+#define __ARENA_H
+
+#include <stddef.h>
+#include "types.h"
+
+
+//// CONSTANTS ////////////////////////////////////////////////
+
+/* Default size of single block (bytes). Larger requests get block of their
+ * own size. */
+#define RT_ARENA_BLOCK    (1024*1024)
+
+/* Alignment of all allocations (enough for any type used by renderer). */
+#define RT_ARENA_ALIGN    16
+
+
+//// STRUCTURES ///////////////////////////////////////////////
+
+/* Single block of memory. Data follows header. */
+typedef struct _RT_ArenaBlock {
+  struct _RT_ArenaBlock *next;  // previously allocated block
+  size_t size;                  // size of data part
+  size_t used;                  // number of bytes of data part already taken
+} RT_ArenaBlock;
+
+/* Arena - list of blocks, newest first. */
+typedef struct _RT_Arena {
+  RT_ArenaBlock *head;    // block allocations are currently taken from
+  size_t blocksize;       // size of data part of new blocks
+  int32_t nblocks;        // number of allocated blocks
+  size_t total;           // number of bytes given out
+} RT_Arena;
+
+
+//// FUNCTIONS ////////////////////////////////////////////////
+
+/* Creates empty arena allocating blocks of `blocksize` bytes (0 -
+ * RT_ARENA_BLOCK). First block is allocated on first request. */
+RT_Arena* rtArenaCreate(size_t blocksize);
+
+/* Releases all blocks of arena (and all memory taken from it). */
+void rtArenaDestroy(RT_Arena **self);
+
+/* Returns `size` bytes of uninitialized memory aligned to RT_ARENA_ALIGN
+ * bytes or NULL (with `errno` set) if new block could not be allocated.
+ * Memory stays valid until arena is destroyed. */
+void* rtArenaAlloc(RT_Arena *self, size_t size);
+
+/* Like rtArenaAlloc(), but memory is filled with zeros. */
+void* rtArenaAllocZero(RT_Arena *self, size_t size);
+
+#endif
+
+// vim: tabstop=2 shiftwidth=2 softtabstop=2
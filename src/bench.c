@@ -0,0 +1,402 @@
+/*
+  Benchmark driver. Renders fixed set of scenes with fixed resolution and
+  configuration and reports wall time of each rendering stage (load,
+  preprocess, voxelize, trace, tonemap, save) and ray throughput as JSON, so
+  results of different program versions can be compared. Throughput counts
+  primary rays only, unless built with `make STATS=1`, which counts all traced
+  rays and includes ray counters of each scene too.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "error.h"
+#include "stringtools.h"
+#include "bitmap.h"
+#include "scene.h"
+#include "raytrace.h"
+#include "threadpool.h"
+#include "common.h"
+#include "stats.h"
+
+#ifndef RT_BENCH_VERSION
+#define RT_BENCH_VERSION "unknown"
+#endif
+
+
+/* Scene rendered by benchmark. */
+typedef struct _RT_BenchScene {
+  const char *name;       // name used in report
+  const char *prefix;     // scene files prefix (relative to source tree)
+  int32_t width, height;  // image resolution
+} RT_BenchScene;
+
+
+/* Scenes rendered by default. Resolution of `ulica` scene (64 lights, most of
+ * them visible from every point) is kept low so whole run takes reasonable
+ * time. */
+static RT_BenchScene rtBenchDefaultScenes[] = {
+  {"s2", "scenes/s2/s2", 400, 300},
+  {"s3", "scenes/s3/s3", 400, 300},
+  {"s5", "scenes/s5/s5", 400, 300},
+  {"pokoj", "scenes/pokoj/s2", 400, 300},
+  {"temple", "scenes/temple/temple", 400, 300},
+  {"ulica", "scenes/ulica/ulica", 80, 60},
+  {NULL, NULL, 0, 0}
+};
+
+/* Forces `fastmath` config of all scenes (-F option). */
+static int32_t rtBenchFastmath = 0;
+
+/* Forces `raster` config of all scenes (-R option; number of threads). */
+static int32_t rtBenchRaster = 0;
+
+/* Forces `epsilon` config of all scenes (-E option; 0 - config is kept). */
+static float rtBenchEpsilon = 0.0f;
+
+
+/* Wall times of single scene rendering (seconds). */
+typedef struct _RT_BenchResult {
+  double load;
+  double preprocess;
+  double voxelize;
+  double trace;
+  double tonemap;
+  double save;
+  double rays;    // rays traced in trace stage (primary rays without RT_STATS)
+  int32_t nt;     // number of triangles
+  int32_t nl;     // number of point lights
+  int32_t npl;    // number of planar lights
+} RT_BenchResult;
+
+
+/* Loads all files of scene `prefix` (like `-s` option of raytrace does). */
+static RT_Scene* rtBenchLoadScene(const char *prefix, RT_Camera **camera) {
+  uint32_t n;
+  char *path;
+  RT_Scene *scene;
+
+  errno = 0;
+  path = rtStringConcat(prefix, ".brs");
+  scene = rtSceneLoad(path);
+  rtStringDestroy(&path);
+  if(!scene || errno > 0) {
+    rtSceneDestroy(&scene);
+    return NULL;
+  }
+
+  // renderer configuration and lights are optional
+  path = rtStringConcat(prefix, ".cfg");
+  rtSceneConfigureRenderer(scene, path);
+  rtStringDestroy(&path);
+  errno = 0;
+  if(rtBenchFastmath)
+    scene->cfg.fastmath = 1;
+  if(rtBenchRaster)
+    scene->cfg.raster = rtBenchRaster;
+  if(rtBenchEpsilon > 0.0f)
+    scene->cfg.epsilon = rtBenchEpsilon;
+  path = rtStringConcat(prefix, ".lgt");
+  RT_Light *lgt = rtLightLoad(path, &n);
+  rtStringDestroy(&path);
+  if(errno > 0) {
+    errno = 0;
+  } else {
+    rtSceneSetLights(scene, lgt, n);
+  }
+  path = rtStringConcat(prefix, ".pnr");
+  RT_PlanarLight *pl = rtPlanarLightLoad(path, &n);
+  rtStringDestroy(&path);
+  if(errno > 0) {
+    errno = 0;
+  } else {
+    rtSceneSetPlanarLights(scene, pl, n);
+  }
+
+  // surface attributes and camera are required
+  path = rtStringConcat(prefix, ".atr");
+  RT_Surface *surf = rtSurfaceLoad(path, &n);
+  rtStringDestroy(&path);
+  if(errno > 0 || !rtSceneSetSurfaces(scene, surf, n)) {
+    rtSceneDestroy(&scene);
+    return NULL;
+  }
+  path = rtStringConcat(prefix, ".cam");
+  *camera = rtCameraLoad(path);
+  rtStringDestroy(&path);
+  if(!*camera || errno > 0) {
+    rtCameraDestroy(camera);
+    rtSceneDestroy(&scene);
+    return NULL;
+  }
+  return scene;
+}
+
+
+/* Runs all stages of rendering scene `prefix` once and stores their times in
+ * `res`. Returns 1 on success or 0 on failure (`errno` is set). */
+static int rtBenchRun(const char *prefix, int32_t width, int32_t height, int32_t nthreads, const char *output, RT_BenchResult *res) {
+  RT_Camera *camera=NULL;
+  RT_RenderContext *ctx=NULL;
+  RT_VisualizedScene *vs=NULL;
+  RT_Bitmap *bmp=NULL;
+  RT_Stats s0, s1;
+  double t;
+  int ok=0;
+
+  t = rtStatsClock();
+  RT_STATS_START(LOAD);
+  RT_Scene *scene = rtBenchLoadScene(prefix, &camera);
+  RT_STATS_STOP(LOAD);
+  if(!scene)
+    goto cleanup;
+  res->load = rtStatsClock() - t;
+  res->nt = scene->nt;
+  res->nl = scene->nl;
+  res->npl = scene->npl;
+
+  // fixed resolution, camera's screen rectangle is left untouched
+  camera->sw = width;
+  camera->sh = height;
+
+  ctx = rtRenderContextCreate(scene);
+  if(!ctx)
+    goto cleanup;
+  res->preprocess = ctx->preprocess_time;
+  res->voxelize = ctx->voxelize_time;
+
+  errno = 0;
+  rtStatsGet(&s0);
+  t = rtStatsClock();
+  RT_STATS_START(TRACE);
+  vs = rtVisualizedSceneRender(ctx, camera);
+  if(vs)
+    rtVisualizedSceneDenoise(vs, scene, nthreads);
+  RT_STATS_STOP(TRACE);
+  res->trace = rtStatsClock() - t;
+  if(!vs)
+    goto cleanup;
+  if(RT_STATS) {
+    rtStatsGet(&s1);
+    res->rays = (double)(s1.primary_rays + s1.reflected_rays + s1.refracted_rays + s1.shadow_rays)
+      - (double)(s0.primary_rays + s0.reflected_rays + s0.refracted_rays + s0.shadow_rays);
+  } else {
+    res->rays = (double)width*height;
+  }
+
+  t = rtStatsClock();
+  RT_STATS_START(TONEMAP);
+  bmp = rtVisualizedSceneToBitmapParallel(vs, F_HDR, NULL, nthreads);
+  RT_STATS_STOP(TONEMAP);
+  res->tonemap = rtStatsClock() - t;
+  if(!bmp) {
+    errno = E_MEMORY;
+    goto cleanup;
+  }
+
+  errno = 0;
+  t = rtStatsClock();
+  RT_STATS_START(SAVE);
+  rtBitmapSaveAs(bmp, output, nthreads);
+  RT_STATS_STOP(SAVE);
+  res->save = rtStatsClock() - t;
+  ok = errno == 0;
+
+cleanup:
+  rtBitmapDestroy(&bmp);
+  rtVisualizedSceneDestroy(&vs);
+  rtRenderContextDestroy(&ctx);
+  rtCameraDestroy(&camera);
+  rtSceneDestroy(&scene);
+  return ok;
+}
+
+
+/* Keeps shortest time of each stage in `best`. */
+static void rtBenchKeepBest(RT_BenchResult *best, const RT_BenchResult *r, int first) {
+  if(first) {
+    *best = *r;
+    return;
+  }
+  if(r->load < best->load) best->load = r->load;
+  if(r->preprocess < best->preprocess) best->preprocess = r->preprocess;
+  if(r->voxelize < best->voxelize) best->voxelize = r->voxelize;
+  if(r->trace < best->trace) {
+    best->trace = r->trace;
+    best->rays = r->rays;
+  }
+  if(r->tonemap < best->tonemap) best->tonemap = r->tonemap;
+  if(r->save < best->save) best->save = r->save;
+}
+
+
+/* Writes `str` to `fd` as JSON string literal (with quotes). */
+static void rtBenchWriteJsonString(FILE *fd, const char *str) {
+  fputc('"', fd);
+  for(; *str; str++) {
+    if(*str == '"' || *str == '\\')
+      fprintf(fd, "\\%c", *str);
+    else if((unsigned char)*str < 0x20)
+      fprintf(fd, "\\u%04x", (unsigned char)*str);
+    else
+      fputc(*str, fd);
+  }
+  fputc('"', fd);
+}
+
+
+/* Print command line options help. */
+static void print_help(const char *executable) {
+  printf("usage: %s [options] [NAME=PREFIX]...\n\n", executable);
+  printf("Renders benchmark scenes and writes per-stage wall times as JSON.\n"
+      "Without NAME=PREFIX arguments default scenes are used (s2, s3, s5,\n"
+      "pokoj, temple, ulica).\n\n"
+      "options:\n"
+      "    -w WIDTH    image width (default: 400, 80 for `ulica`)\n"
+      "    -h HEIGHT   image height (default: 300, 60 for `ulica`)\n"
+      "    -n N        run each scene N times and report shortest times (default: 1)\n"
+      "    -j N        use N threads for tone mapping and image encoding (default: 0,\n"
+      "                one per CPU)\n"
+      "    -d DIR      store rendered images in DIR as NAME.bmp (default: images are\n"
+      "                encoded and written to /dev/null)\n"
+      "    -o PATH     write JSON report to PATH (default: bench.json)\n"
+      "    -F          render with `fastmath` config turned on\n"
+      "    -R          rasterize primary visibility (with -j threads) before tracing\n"
+      "                (`raster` config)\n"
+      "    -E E        approximate point light shadows with shadow maps using depth\n"
+      "                bias E (`epsilon` config)\n"
+      "    -?          show this help\n");
+}
+
+
+/* Bootstrap function */
+int main(int argc, char* argv[]) {
+  int32_t width=0, height=0, repeat=1, nthreads=0, i, k, failed=0;
+  const char *dir=NULL, *report="bench.json";
+  RT_BenchScene *scenes=rtBenchDefaultScenes, *sc;
+  char *output;
+  FILE *fd;
+  int opt;
+
+  while((opt = getopt(argc, argv, "w:h:n:j:d:o:FRE:?")) != -1) {
+    switch(opt) {
+      case 'w': width = atoi(optarg); break;
+      case 'h': height = atoi(optarg); break;
+      case 'n': repeat = atoi(optarg); break;
+      case 'j': nthreads = atoi(optarg); break;
+      case 'd': dir = optarg; break;
+      case 'o': report = optarg; break;
+      case 'F': rtBenchFastmath = 1; break;
+      case 'R': rtBenchRaster = 1; break;
+      case 'E': rtBenchEpsilon = atof(optarg); break;
+      default:
+        print_help(argv[0]);
+        return 2;
+    }
+  }
+  if(width < 0 || height < 0 || repeat <= 0) {
+    print_help(argv[0]);
+    return 2;
+  }
+  if(nthreads <= 0)
+    nthreads = rtThreadPoolDefaultSize();
+  if(rtBenchRaster)
+    rtBenchRaster = nthreads;
+
+  // scenes given on command line as NAME=PREFIX pairs
+  if(optind < argc) {
+    scenes = malloc((argc-optind+1)*sizeof(RT_BenchScene));
+    if(!scenes) {
+      RT_EERROR("out of memory")
+      return 1;
+    }
+    for(i=optind, k=0; i<argc; i++, k++) {
+      char *eq = strchr(argv[i], '=');
+      if(!eq) {
+        RT_ERROR("expected NAME=PREFIX, got: %s", argv[i])
+        free(scenes);
+        return 2;
+      }
+      *eq = 0;
+      scenes[k].name = argv[i];
+      scenes[k].prefix = eq+1;
+      scenes[k].width = 400;
+      scenes[k].height = 300;
+    }
+    scenes[k].name = NULL;
+  }
+
+  if(!(fd = fopen(report, "w"))) {
+    RT_ERROR("unable to open report file: %s", report)
+    return 1;
+  }
+  fprintf(fd, "{\n  \"version\": \"%s\",\n  \"repeat\": %d,\n  \"threads\": %d,\n  \"fastmath\": %d,\n  \"raster\": %d,\n  \"epsilon\": %g,\n  \"scenes\": [",
+      RT_BENCH_VERSION, repeat, nthreads, rtBenchFastmath, rtBenchRaster > 0, rtBenchEpsilon);
+
+  for(sc=scenes; sc->name; sc++) {
+    RT_BenchResult best, r;
+    int32_t w = width>0? width: sc->width;
+    int32_t h = height>0? height: sc->height;
+    memset(&best, 0, sizeof(best));
+
+    if(dir) {
+      output = malloc(strlen(dir) + strlen(sc->name) + 6);
+      sprintf(output, "%s/%s.bmp", dir, sc->name);
+    } else {
+      output = rtStringCopy("/dev/null");
+    }
+
+    RT_INFO("benchmarking scene %s (%s) at %dx%d", sc->name, sc->prefix, w, h)
+    rtStatsReset();
+    for(k=0; k<repeat; k++) {
+      memset(&r, 0, sizeof(r));
+      if(!rtBenchRun(sc->prefix, w, h, nthreads, output, &r))
+        break;
+      rtBenchKeepBest(&best, &r, k==0);
+    }
+    free(output);
+
+    fprintf(fd, "%s\n    {\"name\": ", sc!=scenes? ",": "");
+    rtBenchWriteJsonString(fd, sc->name);
+    fprintf(fd, ", \"prefix\": ");
+    rtBenchWriteJsonString(fd, sc->prefix);
+    fprintf(fd, ", \"width\": %d, \"height\": %d", w, h);
+    if(k < repeat) {
+      RT_ERROR("scene %s failed: %s", sc->name, rtGetErrorDesc())
+      fprintf(fd, ", \"error\": ");
+      rtBenchWriteJsonString(fd, rtGetErrorDesc());
+      fprintf(fd, "}");
+      failed++;
+      errno = 0;
+      continue;
+    }
+
+    double total = best.load + best.preprocess + best.voxelize + best.trace + best.tonemap + best.save;
+    fprintf(fd, ",\n     \"triangles\": %d, \"lights\": %d, \"planar_lights\": %d,\n"
+        "     \"load\": %.6f, \"preprocess\": %.6f, \"voxelize\": %.6f,\n"
+        "     \"trace\": %.6f, \"tonemap\": %.6f, \"save\": %.6f, \"total\": %.6f,\n"
+        "     \"%s\": %.0f, \"%s\": %.1f",
+        best.nt, best.nl, best.npl,
+        best.load, best.preprocess, best.voxelize,
+        best.trace, best.tonemap, best.save, total,
+        RT_STATS? "rays": "primary_rays", best.rays,
+        RT_STATS? "rays_per_second": "primary_rays_per_second",
+        best.trace > 0.0? best.rays/best.trace: 0.0);
+    if(RT_STATS) {
+      // counters are summed over all runs of scene
+      fprintf(fd, ",\n     \"stats\": ");
+      rtStatsWriteJson(fd);
+    }
+    fprintf(fd, "}");
+    RT_INFO("%s: trace %.3f s, total %.3f s", sc->name, best.trace, total)
+  }
+  fprintf(fd, "\n  ]\n}\n");
+  fclose(fd);
+
+  if(scenes != rtBenchDefaultScenes)
+    free(scenes);
+  return failed? 1: 0;
+}
+
+// vim: tabstop=2 shiftwidth=2 softtabstop=2
@@ -1,9 +1,25 @@
 #include "bitmap.h"
 #include "error.h"
+#include "png.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+/* Stores BMP header in `out` buffer (54 bytes) in the same layout as
+ * rtBitmapSave() writes it. */
+static void rtBmpHeaderPack(const RT_BmpHeader *hdr, unsigned char *out) {
+  #define PACK(field) memcpy(out, &hdr->field, sizeof(hdr->field)); out += sizeof(hdr->field);
+  PACK(bfType) PACK(bfSize) PACK(bfReserved1) PACK(bfReserved2) PACK(bfOffBits)
+  PACK(biSize) PACK(biWidth) PACK(biHeight) PACK(biPlanes) PACK(biBitCount)
+  PACK(biCompression) PACK(biSizeImage) PACK(biXPelsPerMeter) PACK(biYPelsPerMeter)
+  PACK(biClrUsed) PACK(biClrImportant) PACK(biClrRotation) PACK(biReserved)
+  #undef PACK
+}
 
 
 ///////////////////////////////////////////////////////////////
@@ -245,16 +261,192 @@ garbage_collect:
 }
 
 
+/* Size of buffer used to encode image rows before writing them to file. */
+#define RT_BMP_BLOCK_SIZE   (1<<20)
+
+
+/* Fills `palette` buffer used by `bpp` bits per pixel images (1, 4 or 8). */
+static void rtBitmapMakePalette(uint16_t bpp, unsigned char *palette) {
+  uint32_t i, j;
+
+  switch(bpp) {
+    case 1:
+      //create palette containing two colors - black and white
+      palette[0] = palette[1] = palette[2] = 0;
+      palette[3] = 0;
+      palette[4] = palette[5] = palette[6] = 255;
+      palette[7] = 0;
+      break;
+
+    case 4:
+      /* create palette. The idea behind is that we treat each
+       * 0..16 number as RGB color, where 1 bit is used for R
+       * component, 2 bits for G component and 1 bit for B
+       * component. After splitting each number, each bits are
+       * scaled to 0..255 range by shifting left to oldest
+       * possible bit positions */
+      for(j=0, i=0; j<15; j++, i+=4) {
+        *(palette+i)=(j&1)<<7;
+        *(palette+i+1)=((j>>1)&3)<<6;
+        *(palette+i+2)=((j>>3)&1)<<7;
+        *(palette+i+3)=0;
+      }
+
+      //add white color to palette
+      palette[i]=palette[i+1]=palette[i+2]=255;
+      palette[i+3]=0;
+      break;
+
+    case 8:
+      /* create palette. Idea is the same as for 4bit color.
+       * However, since we have more bits we can assign 3 bits
+       * for "red" and "green" and 2 bits for "blue" */
+      for(j=0, i=0; j<255; j++, i+=4) {
+        *(palette+i)=(j&3)<<6;
+        *(palette+i+1)=((j>>2)&7)<<5;
+        *(palette+i+2)=((j>>5)&7)<<5;
+        *(palette+i+3)=0;
+      }
+
+      //add white color to palette
+      palette[i]=palette[i+1]=palette[i+2]=255;
+      palette[i+3]=0;
+      break;
+  }
+}
+
+
+/* Encodes row `y` of bitmap in `bpp` bits per pixel format and stores it in
+ * `buffer` (`buf_size` bytes, including padding). */
+static void rtBitmapEncodeRow(const RT_Bitmap* self, int32_t y, uint16_t bpp, unsigned char *buffer, uint32_t buf_size) {
+  int32_t x, w=self->width;
+  uint32_t i, p, p1, p2, col16;
+  uint16_t k;
+  const uint32_t *row = self->pixels + y*w;
+
+  memset(buffer, 0, buf_size);
+  switch(bpp) {
+    case 1:
+      for(x=0, i=0; x<w; x+=8, i++) {
+        for(k=0; k<8; k++) {
+          if (x+k >= w)
+            break;
+          p = row[x+k];
+          p = (rtColorGetR(p)+rtColorGetG(p)+rtColorGetB(p))/3;  //grayscale (0..255)
+          p >>= 7;  //p>127 -> p=1, p<=127 -> p=0
+          *(buffer+i) |= p<<(7-k);
+        }
+      }
+      break;
+
+    case 4:
+      for(x=0, i=0; x<w; x+=2, i++) {
+        p1 = row[x];
+        p2 = x+1 < w? row[x+1]: 0;
+        *(buffer+i) = (rtColorGetR(p1)>>7)<<7 | (rtColorGetG(p1)>>6)<<5 | (rtColorGetB(p1)>>7)<<4 | 
+          (rtColorGetR(p2)>>7)<<3 | (rtColorGetG(p2)>>6)<<1 | (rtColorGetB(p2)>>7);
+      }
+      break;
+
+    case 8:
+      for(x=0; x<w; x++) {
+        p = row[x];
+        *(buffer+x) = (rtColorGetR(p)>>5)<<5 | (rtColorGetG(p)>>5)<<2 | rtColorGetB(p)>>6;
+      }
+      break;
+
+    //16bit color (R -> 5 bits, G -> 5 bits, B -> 5 bits)
+    case 16:
+      for(x=0, i=0; x<w; x++, i+=2) {
+        p = row[x];
+        col16 = ((rtColorGetR(p)>>3)<<10) | ((rtColorGetG(p)>>3)<<5) | (rtColorGetB(p)>>3);
+        *(buffer+i+1) = (col16>>8)&0xff;
+        *(buffer+i) = col16&0xff;
+      }
+      break;
+
+    //True color (pixel is 0xRRGGBBAA, file stores B, G, R bytes)
+    case 24:
+      for(x=0, i=0; x<w; x++, i+=3) {
+        p = row[x];
+        buffer[i] = p >> 8;
+        buffer[i+1] = p >> 16;
+        buffer[i+2] = p >> 24;
+      }
+      break;
+
+    case 32:
+      for(x=0, i=0; x<w; x++, i+=4) {
+        p = row[x];
+        buffer[i] = p >> 8;
+        buffer[i+1] = p >> 16;
+        buffer[i+2] = p >> 24;
+      }
+      break;
+  }
+}
+
+
+/* Opens file `filename` for writing (`-` - standard output, `fd:N` - already
+ * opened descriptor N). Returns descriptor and sets `close_fd` if it should be
+ * closed by caller, or returns -1 on failure. */
+static int rtOpenOutput(const char *filename, int *close_fd) {
+  int fd;
+  *close_fd = 0;
+  if(!strcmp(filename, "-")) {
+    fflush(stdout);
+    return STDOUT_FILENO;
+  }
+  if(sscanf(filename, "fd:%d", &fd) == 1) {
+    return fd;
+  }
+  *close_fd = 1;
+  return open(filename, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+}
+
+
+/* Writes `size` bytes of `buf` to file descriptor `fd`. Returns 1 on success
+ * or 0 on failure. */
+static int rtWriteAll(int fd, const unsigned char *buf, size_t size) {
+  ssize_t r;
+  while(size > 0) {
+    r = write(fd, buf, size);
+    if(r < 0) {
+      if(errno == EINTR)
+        continue;
+      return 0;
+    }
+    buf += r;
+    size -= r;
+  }
+  return 1;
+}
+
+
 ///////////////////////////////////////////////////////////////
 void rtBitmapSave(const RT_Bitmap* self, const char* filename, uint16_t bpp) {
-  RT_BmpHeader hdr;
-  uint32_t palette_size=bpp<=8? 4*(uint32_t)pow(2.0f, bpp): 0;  //palette is used only in 1, 4 and 8 bpp bitmaps
+  int close_fd;
 
-  /* dynamically allocated variables 
-   * (released at the end of function call) */
-  FILE *fd=NULL;
-  unsigned char *buffer=NULL;
-  unsigned char *palette=NULL;
+  //open file for binary write mode
+  int fd = rtOpenOutput(filename, &close_fd);
+  if (fd < 0) {
+    errno = E_IO;  //unable to write to file
+    return;
+  }
+  rtBitmapSaveFd(self, fd, bpp);
+  if(close_fd && close(fd) != 0) {
+    errno = E_IO;
+  }
+}
+
+
+///////////////////////////////////////////////////////////////
+void rtBitmapSaveFd(const RT_Bitmap* self, int fd, uint16_t bpp) {
+  RT_BmpHeader hdr;
+  uint32_t palette_size=bpp<=8? 4*(1u<<bpp): 0;  //palette is used only in 1, 4 and 8 bpp bitmaps
+  uint32_t buf_size, rows, used;
+  int32_t y;
+  unsigned char *block=NULL;
 
   memset(&hdr, 0, sizeof(hdr));
   
@@ -264,17 +456,13 @@ void rtBitmapSave(const RT_Bitmap* self, const char* filename, uint16_t bpp) {
     return;
   }
 
-  //open file for binary write mode
-  fd=fopen(filename, "wb");
-  if (!fd) {
-    errno = E_IO;  //unable to read from file
-    goto garbage_collect;
-  }
+  //size of single (padded) scanline
+  buf_size=(uint32_t)(4*ceil(bpp*self->width/32.0));
 
   //prepare header
   hdr.bfType[0] = 'B';
   hdr.bfType[1] = 'M';
-  hdr.bfSize = (uint32_t)(54+4*ceil(bpp*self->width/32.0)*self->height+palette_size);
+  hdr.bfSize = 54+buf_size*self->height+palette_size;
   hdr.bfOffBits = 54+palette_size;
   hdr.biSize = 40;
   hdr.biWidth = self->width;
@@ -283,199 +471,201 @@ void rtBitmapSave(const RT_Bitmap* self, const char* filename, uint16_t bpp) {
   hdr.biBitCount = bpp;
   hdr.biSizeImage = hdr.bfSize-54-palette_size;
 
-  //write header to file
-  fwrite(&hdr.bfType, sizeof(hdr.bfType), 1, fd);
-  fwrite(&hdr.bfSize, sizeof(hdr.bfSize), 1, fd);
-  fwrite(&hdr.bfReserved1, sizeof(hdr.bfReserved1), 1, fd);
-  fwrite(&hdr.bfReserved2, sizeof(hdr.bfReserved2), 1, fd);
-  fwrite(&hdr.bfOffBits, sizeof(hdr.bfOffBits), 1, fd);
-  fwrite(&hdr.biSize, sizeof(hdr.biSize), 1, fd);
-  fwrite(&hdr.biWidth, sizeof(hdr.biWidth), 1, fd);
-  fwrite(&hdr.biHeight, sizeof(hdr.biHeight), 1, fd);
-  fwrite(&hdr.biPlanes, sizeof(hdr.biPlanes), 1, fd);
-  fwrite(&hdr.biBitCount, sizeof(hdr.biBitCount), 1, fd);
-  fwrite(&hdr.biCompression, sizeof(hdr.biCompression), 1, fd);
-  fwrite(&hdr.biSizeImage, sizeof(hdr.biSizeImage), 1, fd);
-  fwrite(&hdr.biXPelsPerMeter, sizeof(hdr.biXPelsPerMeter), 1, fd);
-  fwrite(&hdr.biYPelsPerMeter, sizeof(hdr.biYPelsPerMeter), 1, fd);
-  fwrite(&hdr.biClrUsed, sizeof(hdr.biClrUsed), 1, fd);
-  fwrite(&hdr.biClrImportant, sizeof(hdr.biClrImportant), 1, fd);
-  fwrite(&hdr.biClrRotation, sizeof(hdr.biClrRotation), 1, fd);
-  fwrite(&hdr.biReserved, sizeof(hdr.biReserved), 1, fd);
-
-  //create scanline buffer
-  uint32_t buf_size=(uint32_t)(4*ceil(bpp*self->width/32.0));
-  buffer=malloc(buf_size);
-  if(!buffer) {
+  /* Header, palette and scanlines are encoded into block buffer, which is
+   * written to file whenever next scanline would not fit. */
+  rows = (RT_BMP_BLOCK_SIZE-54-palette_size)/buf_size;
+  if(rows < 1)
+    rows = 1;
+  block = malloc(54+palette_size+rows*buf_size);
+  if(!block) {
     errno = E_MEMORY;
-    goto garbage_collect;
+    return;
   }
-
-  switch(bpp) {
-    case 1:
-    case 4:
-    case 8: {
-      //create palette buffer
-      palette=malloc(palette_size);
-      if (!palette) {
-        errno = E_MEMORY;
+  rtBmpHeaderPack(&hdr, block);
+  rtBitmapMakePalette(bpp, block+54);
+  used = 54+palette_size;
+
+  //scanlines are stored from bottom to top
+  for(y=self->height-1; y>=0; y--) {
+    if(used+buf_size > 54+palette_size+rows*buf_size) {
+      if(!rtWriteAll(fd, block, used)) {
+        errno = E_IO;
         goto garbage_collect;
       }
+      used = 0;
+    }
+    rtBitmapEncodeRow(self, y, bpp, block+used, buf_size);
+    used += buf_size;
+  }
+  if(!rtWriteAll(fd, block, used)) {
+    errno = E_IO;
+  }
 
-      switch(bpp) {
-        case 1: {
-          int32_t x, y, w=self->width, h=self->height;
-          uint32_t p, i;
-          uint16_t k;
-
-          //create palette containing two colors - black and white
-          palette[0] = palette[1] = palette[2] = 0;
-          palette[3] = 0;
-          palette[4] = palette[5] = palette[6] = 255;
-          palette[7] = 0;
+garbage_collect:
+  free(block);
+}
 
-          //write palette to file
-          fwrite(palette, palette_size, 1, fd);
 
-          for(y=h-1; y>=0; y--) {
-            memset(buffer, 0, buf_size);
-            for(x=0, i=0; x<w; x+=8, i++) {
-              for(k=0; k<8; k++) {
-                if (x+k >= w)
-                  break;
-                p = rtBitmapGetPixel(self, x+k, y);
-                p = (rtColorGetR(p)+rtColorGetG(p)+rtColorGetB(p))/3;  //grayscale (0..255)
-                p >>= 7;  //p>127 -> p=1, p<=127 -> p=0
-                *(buffer+i) |= p<<(7-k);
-              }
-            }
-            //write image data scanline to file
-            fwrite(buffer, buf_size, 1, fd);
-          }
-          break;
-        }
+///////////////////////////////////////////////////////////////
+void rtBitmapSavePpm(const RT_Bitmap* self, const char* filename) {
+  int32_t x, y, rows, k;
+  uint32_t p, used, row_size=3*self->width;
+  unsigned char *block, *ptr;
+  int close_fd, fd;
+
+  rows = RT_BMP_BLOCK_SIZE/row_size;
+  if(rows < 1)
+    rows = 1;
+  block = malloc(64+rows*row_size);
+  if(!block) {
+    errno = E_MEMORY;
+    return;
+  }
+  fd = rtOpenOutput(filename, &close_fd);
+  if(fd < 0) {
+    errno = E_IO;
+    free(block);
+    return;
+  }
 
-        case 4: {
-          int32_t x, y, w=self->width, h=self->height;
-          uint32_t i, j, p1, p2;
-
-          /* create palette. The idea behind is that we treat each
-           * 0..16 number as RGB color, where 1 bit is used for R
-           * component, 2 bits for G component and 1 bit for B
-           * component. After splitting each number, each bits are
-           * scaled to 0..255 range by shifting left to oldest
-           * possible bit positions */
-          for(j=0, i=0; j<15; j++, i+=4) {
-            *(palette+i)=(j&1)<<7;
-            *(palette+i+1)=((j>>1)&3)<<6;
-            *(palette+i+2)=((j>>3)&1)<<7;
-            *(palette+i+3)=0;
-          }
+  used = sprintf((char*)block, "P6\n%d %d\n255\n", self->width, self->height);
+  for(y=0, k=0; y<self->height; y++) {
+    if(k == rows) {
+      if(!rtWriteAll(fd, block, used)) {
+        errno = E_IO;
+        goto garbage_collect;
+      }
+      used = k = 0;
+    }
+    const uint32_t *row = self->pixels + y*self->width;
+    for(x=0, ptr=block+used; x<self->width; x++) {
+      p = row[x];
+      *(ptr++) = rtColorGetR(p);
+      *(ptr++) = rtColorGetG(p);
+      *(ptr++) = rtColorGetB(p);
+    }
+    used += row_size;
+    k++;
+  }
+  if(!rtWriteAll(fd, block, used)) {
+    errno = E_IO;
+  }
 
-          //add white color to palette
-          palette[i]=palette[i+1]=palette[i+2]=255;
-          palette[i+3]=0;
+garbage_collect:
+  if(close_fd && close(fd) != 0)
+    errno = E_IO;
+  free(block);
+}
 
-          //save palette to file
-          fwrite(palette, palette_size, 1, fd);
 
-          for(y=h-1; y>=0; y--) {
-            memset(buffer, 0, buf_size);
-            for(x=0, i=0; x<w; x+=2, i++) {
-              p1 = rtBitmapGetPixel(self, x, y);
-              if (x+1 < w) {
-                p2 = rtBitmapGetPixel(self, x+1, y);
-              } else {
-                p2=0;
-              }
-              *(buffer+i) = (rtColorGetR(p1)>>7)<<7 | (rtColorGetG(p1)>>6)<<5 | (rtColorGetB(p1)>>7)<<4 | 
-                (rtColorGetR(p2)>>7)<<3 | (rtColorGetG(p2)>>6)<<1 | (rtColorGetB(p2)>>7);
-            }
-            fwrite(buffer, buf_size, 1, fd);
-          }
-          break;
-        }
+///////////////////////////////////////////////////////////////
+void rtBitmapSaveAs(const RT_Bitmap* self, const char* filename, int32_t nthreads) {
+  const char *ext = strrchr(filename, '.');
+  if(ext && !strcasecmp(ext, ".png")) {
+    rtBitmapSavePng(self, filename, nthreads);
+  } else if(ext && !strcasecmp(ext, ".ppm")) {
+    rtBitmapSavePpm(self, filename);
+  } else {
+    rtBitmapSave(self, filename, 24);
+  }
+}
 
-        case 8: {
-          int32_t x, y, w=self->width, h=self->height;
-          uint32_t i, j, p;
-
-          /* create palette. Idea is the same as for 4bit color.
-           * However, since we have more bits we can assign 3 bits
-           * for "red" and "green" and 2 bits for "blue" */
-          for(j=0, i=0; j<255; j++, i+=4) {
-            *(palette+i)=(j&3)<<6;
-            *(palette+i+1)=((j>>2)&7)<<5;
-            *(palette+i+2)=((j>>5)&7)<<5;
-            *(palette+i+3)=0;
-          }
 
-          //add white color to palette
-          palette[i]=palette[i+1]=palette[i+2]=255;
-          palette[i+3]=0;
+///////////////////////////////////////////////////////////////
+RT_BitmapStream* rtBitmapStreamCreate(const char *filename, int32_t width, int32_t height) {
+  RT_BmpHeader hdr;
+  unsigned char buf[54];
+  const char *ext = strrchr(filename, '.');
+  if(!ext || strcasecmp(ext, ".bmp")) {
+    errno = E_INVALID_PARAM_VALUE;  // other formats can not be written row by row
+    return NULL;
+  }
+  RT_BitmapStream *res = malloc(sizeof(RT_BitmapStream));
+  if(!res) {
+    errno = E_MEMORY;
+    return NULL;
+  }
+  res->width = width;
+  res->height = height;
+  res->row_size = (uint32_t)(4*ceil(24*width/32.0));
+  res->fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if(res->fd < 0) {
+    free(res);
+    errno = E_IO;
+    return NULL;
+  }
 
-          //save palette to file
-          fwrite(palette, palette_size, 1, fd);
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.bfType[0] = 'B';
+  hdr.bfType[1] = 'M';
+  hdr.bfSize = 54+res->row_size*height;
+  hdr.bfOffBits = 54;
+  hdr.biSize = 40;
+  hdr.biWidth = width;
+  hdr.biHeight = height;
+  hdr.biPlanes = 1;
+  hdr.biBitCount = 24;
+  hdr.biSizeImage = hdr.bfSize-54;
+  rtBmpHeaderPack(&hdr, buf);
 
-          for(y=h-1; y>=0; y--) {
-            memset(buffer, 0, buf_size);
-            for(x=0, i=0; x<w; x++, i++) {
-              p = rtBitmapGetPixel(self, x, y);
-              *(buffer+i) = (rtColorGetR(p)>>5)<<5 | (rtColorGetG(p)>>5)<<2 | rtColorGetB(p)>>6;
-            }
-            fwrite(buffer, buf_size, 1, fd);
-          }
-          break;
-        }
-      }
-      break;
-    }
+  // set final file size at once, so rows can be written in any order
+  if(pwrite(res->fd, buf, sizeof(buf), 0) != sizeof(buf) || ftruncate(res->fd, hdr.bfSize) != 0) {
+    close(res->fd);
+    free(res);
+    errno = E_IO;
+    return NULL;
+  }
+  return res;
+}
 
-    //16bit color (R -> 5 bits, G -> 5 bits, B -> 5 bits)
-    case 16: {
-      int32_t x, y, w=self->width, h=self->height;
-      uint32_t i, p, col16;
 
-      for(y=h-1; y>=0; y--) {
-        memset(buffer, 0, buf_size);
-        for(x=0, i=0; x<w; x++, i+=2) {
-          p = rtBitmapGetPixel(self, x, y);
-          col16 = ((rtColorGetR(p)>>3)<<10) | ((rtColorGetG(p)>>3)<<5) | (rtColorGetB(p)>>3);
-          *(buffer+i+1) = (col16>>8)&0xff;
-          *(buffer+i) = col16&0xff;
-        }
-        fwrite(buffer, buf_size, 1, fd);
-      }
-      break;
-    }
+///////////////////////////////////////////////////////////////
+int rtBitmapStreamWrite(RT_BitmapStream *self, int32_t y, int32_t nrows, const uint32_t *pixels) {
+  int32_t x, k;
+  uint32_t p;
+  unsigned char *buffer, *ptr;
 
-    //True color
-    case 24:
-    case 32: {
-      int32_t x, y, w=self->width, h=self->height;
-      uint32_t i, p;
+  buffer = malloc(self->row_size*nrows);
+  if(!buffer) {
+    errno = E_MEMORY;
+    return 0;
+  }
 
-      for(y=h-1; y>=0; y--) {
-        memset(buffer, 0, buf_size);
-        for(x=0, i=0; x<w; x++, i+=bpp==24? 3: 4) {
-          p = rtBitmapGetPixel(self, x, y);
-          *(buffer+i) = rtColorGetB(p);
-          *(buffer+i+1) = rtColorGetG(p);
-          *(buffer+i+2) = rtColorGetR(p);
-        }
-        fwrite(buffer, buf_size, 1, fd);
-      }
-      break;
+  // rows are stored bottom to top, so last row of block goes first
+  for(k=nrows-1, ptr=buffer; k>=0; k--) {
+    const uint32_t *row = pixels + k*self->width;
+    for(x=0; x<self->width; x++) {
+      p = row[x];
+      *(ptr++) = rtColorGetB(p);
+      *(ptr++) = rtColorGetG(p);
+      *(ptr++) = rtColorGetR(p);
+    }
+    for(x=3*self->width; x<(int32_t)self->row_size; x++) {
+      *(ptr++) = 0;
     }
   }
 
-garbage_collect:
-  if(fd)
-    fclose(fd);
-  if(buffer)
-    free(buffer);
-  if(palette)
-    free(palette);
+  off_t offset = 54 + (off_t)(self->height-y-nrows)*self->row_size;
+  ssize_t size = (ssize_t)self->row_size*nrows;
+  ssize_t written = pwrite(self->fd, buffer, size, offset);
+  free(buffer);
+  if(written != size) {
+    errno = E_IO;
+    return 0;
+  }
+  return 1;
+}
+
+
+///////////////////////////////////////////////////////////////
+void rtBitmapStreamClose(RT_BitmapStream **self) {
+  RT_BitmapStream *ptr=*self;
+  if(ptr) {
+    if(close(ptr->fd) != 0)
+      errno = E_IO;
+    free(ptr);
+    *self = NULL;
+  }
 }
 
 // vim: tabstop=2 shiftwidth=2 softtabstop=2
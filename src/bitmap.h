@@ -47,9 +47,18 @@ typedef struct _RT_Bitmap {
   uint32_t *pixels;       //bitmap pixel array
 } RT_Bitmap;
 
+/* BMP file written in parts. Rows can be written in any order, also by
+ * several threads at once, so whole image never has to be kept in memory. */
+typedef struct _RT_BitmapStream {
+  int fd;                 // output file descriptor
+  int32_t width;          // image width
+  int32_t height;         // image height
+  uint32_t row_size;      // size of single (padded) row in file
+} RT_BitmapStream;
+
 /* Object that represents RGBA color vector. */
 typedef struct _RT_Color {
-  float c[4];  // color (c[0]=R, c[1]=G, c[2]=B, c[3]=A)
+  float c[4] __ALIGN_16;  // color (c[0]=R, c[1]=G, c[2]=B, c[3]=A)
 } RT_Color;
 
 
@@ -114,10 +123,58 @@ RT_Bitmap* rtBitmapLoad(const char* filename);
  * count. 
 
 :param: self: pointer to RT_Bitmap object
-:param: filename: pointer to file name where bitmap will be stored
+:param: filename: pointer to file name where bitmap will be stored (`-` -
+    standard output, `fd:N` - already opened file descriptor N)
 :param: bpp: bit count (1, 4, 8, 16, 24 or 32) */
 void rtBitmapSave(const RT_Bitmap* self, const char* filename, uint16_t bpp);
 
+/* Works like rtBitmapSave(), but writes BMP file to already opened file
+ * descriptor (f.e. pipe or socket). Descriptor is left open.
+
+:param: self: pointer to RT_Bitmap object
+:param: fd: file descriptor opened for writing
+:param: bpp: bit count (1, 4, 8, 16, 24 or 32) */
+void rtBitmapSaveFd(const RT_Bitmap* self, int fd, uint16_t bpp);
+
+/* Saves given RT_Bitmap object into binary PPM (P6) file. 
+
+:param: self: pointer to RT_Bitmap object
+:param: filename: pointer to file name where image will be stored (`-` and
+    `fd:N` like in rtBitmapSave()) */
+void rtBitmapSavePpm(const RT_Bitmap* self, const char* filename);
+
+/* Saves given RT_Bitmap object in format chosen by `filename` extension:
+ * `.png` (compressed with `nthreads` threads, <= 0 - one per CPU), `.ppm` or
+ * 24bpp BMP (any other name).
+
+:param: self: pointer to RT_Bitmap object
+:param: filename: pointer to file name where image will be stored
+:param: nthreads: number of threads used to compress PNG image */
+void rtBitmapSaveAs(const RT_Bitmap* self, const char* filename, int32_t nthreads);
+
+/* Creates 24bpp BMP file of given size and returns stream object used to
+ * fill it with rtBitmapStreamWrite(). Returns NULL on failure (also when
+ * `filename` does not end with `.bmp`).
+
+:param: filename: path to image file
+:param: width: image width
+:param: height: image height */
+RT_BitmapStream* rtBitmapStreamCreate(const char *filename, int32_t width, int32_t height);
+
+/* Writes `nrows` rows of RGBA pixels, starting from row `y` (counting from
+ * top of image). Can be called from several threads at once. Returns 1 on
+ * success or 0 on failure.
+
+:param: self: pointer to RT_BitmapStream object
+:param: y: first row to write
+:param: nrows: number of rows
+:param: pixels: `nrows`*width pixels in RT_Bitmap format */
+int rtBitmapStreamWrite(RT_BitmapStream *self, int32_t y, int32_t nrows, const uint32_t *pixels);
+
+/* Closes file and releases memory occupied by given RT_BitmapStream object.
+ * Sets `errno` if file could not be closed properly. */
+void rtBitmapStreamClose(RT_BitmapStream **self);
+
 #endif
 
 // vim: tabstop=2 shiftwidth=2 softtabstop=2
@@ -0,0 +1,70 @@
+/*
+  Command line client of render server. Sends request built from command line
+  arguments and prints server's response (see server.h for request format).
+*/
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+
+/* Bootstrap function */
+int main(int argc, char* argv[]) {
+  struct sockaddr_un addr;
+  char buf[4096];
+  size_t len=0;
+  ssize_t r;
+  int i, fd;
+
+  if(argc < 3) {
+    printf("usage: %s SOCKET REQUEST...\n\n", argv[0]);
+    printf("examples:\n"
+        "    %s /tmp/raytrace.sock load s3 scenes/s3/s3\n"
+        "    %s /tmp/raytrace.sock render s3 output s3.bmp gamma 2.0\n"
+        "    %s /tmp/raytrace.sock shutdown\n", argv[0], argv[0], argv[0]);
+    return 2;
+  }
+
+  // build request line from arguments
+  buf[0] = 0;
+  for(i=2; i<argc; i++) {
+    if(len + strlen(argv[i]) + 2 >= sizeof(buf)) {
+      fprintf(stderr, "request too long\n");
+      return 2;
+    }
+    len += sprintf(buf+len, "%s%s", i>2? " ": "", argv[i]);
+  }
+  buf[len++] = '\n';
+
+  // connect to server
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, argv[1], sizeof(addr.sun_path)-1);
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+    perror(argv[1]);
+    return 2;
+  }
+
+  // send request and print response
+  if(write(fd, buf, len) != (ssize_t)len) {
+    perror("write");
+    close(fd);
+    return 2;
+  }
+  shutdown(fd, SHUT_WR);
+  len = 0;
+  while((r=read(fd, buf+len, sizeof(buf)-1-len)) > 0) {
+    len += r;
+    if(len == sizeof(buf)-1)
+      break;
+  }
+  buf[len] = 0;
+  close(fd);
+  fputs(buf, stdout);
+
+  return strncmp(buf, "ok", 2)? 1: 0;
+}
+
+// vim: tabstop=2 shiftwidth=2 softtabstop=2
@@ -1,7 +1,9 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <time.h>
 #include <errno.h>
 #include <string.h>
+#include <strings.h>
 #include "error.h"
 #include "stringtools.h"
 #include "bitmap.h"
@@ -9,6 +11,88 @@
 #include "rdtsc.h"
 #include "common.h"
 #include "raytrace.h"
+#include "threadpool.h"
+#include "server.h"
+#include "stats.h"
+#include "tune.h"
+#include <pthread.h>
+#include <unistd.h>
+
+
+/* Renderer options that were given on command line (RT_Options.given). */
+#define RT_OPTION_EPSILON     0x001
+#define RT_OPTION_GAMMA       0x002
+#define RT_OPTION_DISTMOD     0x004
+#define RT_OPTION_AASAMPLES   0x008
+#define RT_OPTION_AATHRESHOLD 0x010
+#define RT_OPTION_PLSAMPLES   0x020
+#define RT_OPTION_DENOISE     0x040
+#define RT_OPTION_LIGHTCUTOFF 0x080
+#define RT_OPTION_FASTMATH    0x100
+#define RT_OPTION_RASTER      0x200
+
+
+/* Single frame rendered in batch mode. */
+typedef struct _RT_BatchFrame {
+  RT_RenderContext *ctx;  // shared scene state
+  RT_Camera *camera;      // camera of this frame
+  char *output;           // output image path
+  int32_t index;          // frame index
+  int status;             // errno value set while rendering this frame
+} RT_BatchFrame;
+
+
+/* Observer of progressive rendering. Runs in background thread, saving
+ * preview images and cancelling render when time limit is exceeded. */
+typedef struct _RT_Monitor {
+  RT_Progress *progress;  // observed render
+  const char *preview;    // preview image path (NULL - no previews)
+  float interval;         // seconds between preview images
+  float limit;            // render time limit in seconds (<= 0 - no limit)
+  int32_t done;           // set when render is finished
+  pthread_mutex_t lock;   // protects `done`
+  pthread_cond_t cond;    // signalled when `done` is set
+} RT_Monitor;
+
+
+/* Command line options (see print_help()). */
+typedef struct _RT_Options {
+  char *geometry;         // -g: geometry file
+  char *lights;           // -l: light file
+  char *planar;           // -L: planar light file
+  char *attributes;       // -a: attribute file
+  char *camera;           // -c: camera file
+  char *config;           // -C: renderer config file
+  char *prefix;           // -s: prefix of all scene files
+  char *output;           // -o: result image (pattern in batch and relighting modes)
+  char *batch;            // -b: batch file
+  char *server;           // -d: server socket
+  char *relight;          // -r: light list of relighting mode
+  char *preview;          // -p: preview image of progressive mode
+  char *pfm;              // -f: float image
+  char *gammalist;        // -H: comma separated list of gammas
+  char *tonemap;          // --tonemap-only: float image to tone map
+  char *stats;            // --stats: statistics file
+  char *heatmap;          // --heatmap: per-pixel cost image
+  char *heatmapmetric;    // --heatmap-metric: cost metric name
+  float gamma;            // -G
+  float epsilon;          // -E
+  float distmod;          // -D
+  float interval;         // -P
+  float limit;            // -t
+  float aathreshold;      // -T
+  float exposure;         // -x
+  float lightcutoff;      // --light-cutoff
+  int32_t jobs;           // -j
+  int32_t aasamples;      // -A
+  int32_t stream;         // -S (-1 - not streamed)
+  int32_t tune;           // --tune-grid (-1 - no tuning)
+  int32_t plsamples;      // --plsamples
+  int32_t denoise;        // --denoise
+  int32_t fastmath;       // --fastmath
+  int32_t raster;         // --raster
+  uint32_t given;         // RT_OPTION_* flags of renderer options given on command line
+} RT_Options;
 
 
 /* Print command line options help. 
@@ -22,24 +106,543 @@ void print_help(const char *executable) {
       "    -l PATH     use light file PATH\n"
       "    -a PATH     use attribute file PATH\n"
       "    -c PATH     use camera file PATH\n"
-      "    -C PATH     use renderer config file PATH\n"
+      "    -C PATH     use renderer config file PATH (renderer options given on\n"
+      "                command line override its values)\n"
       "    -s PATH     use PATH as prefix that will be appended with file extensions.\n"
       "                This argument allows to pass all files (*.brs, *.atr, *.cam, *.lgt)\n"
       "                at once (-g, -l, -a, -c can be used to override some of them)\n"
       "\n"
+      "    Batch rendering options:\n"
+      "    -b PATH     render all cameras listed in batch file PATH (one `CAMERA [N]`\n"
+      "                entry per line, N frames are interpolated towards next camera)\n"
+      "                reusing preprocessed and voxelized scene for each frame\n"
+      "    -j N        render N frames (or server jobs) in parallel (default: 1,\n"
+      "                0 - number of CPUs)\n"
+      "\n"
+      "    Relighting options:\n"
+      "    -r PATH     trace primary rays once and create one image per light file\n"
+      "                listed in PATH (one *.lgt path per line, all with the same\n"
+      "                number of lights); only changed lights are shaded again.\n"
+      "                Output file names are created like in batch mode\n"
+      "\n"
+      "    Progressive rendering options:\n"
+      "    -p PATH     render coarse to fine and periodically save image rendered so\n"
+      "                far to file PATH (format chosen like for -o)\n"
+      "    -P SEC      seconds between preview images (default: 5)\n"
+      "    -t SEC      stop rendering after SEC seconds and save image made of\n"
+      "                finished passes\n"
+      "\n"
+      "    Anti-aliasing options:\n"
+      "    -A N        trace up to N rays per pixel where neighbouring pixels differ\n"
+      "                (N is rounded down to square number; default: 1 - disabled)\n"
+      "    -T T        relative color difference that triggers supersampling\n"
+      "                (default: 0.1)\n"
+      "\n"
+      "    Soft shadow options:\n"
+      "    --plsamples N\n"
+      "                approximate each planar light with N point lights sharing its\n"
+      "                flux (default: 16)\n"
+      "    --denoise N\n"
+      "                smooth planar lights contribution with N passes of\n"
+      "                edge-preserving filter (each pass doubles its reach; default:\n"
+      "                0 - disabled), so fewer --plsamples give clean soft shadows;\n"
+      "                not applied in progressive, streaming and relighting modes\n"
+      "\n"
+      "    Shadow options:\n"
+      "    --light-cutoff T\n"
+      "                skip shadow rays of least contributing point lights that\n"
+      "                together give at most fraction T of direct light at surface\n"
+      "                point (their visibility is estimated from tested lights;\n"
+      "                default: 0 - all lights are tested)\n"
+      "    -E E        look point light shadows up in shadow maps built for each\n"
+      "                frame instead of tracing shadow rays, with depth bias E in\n"
+      "                scene units (image is approximate; default: 0 - disabled;\n"
+      "                not applied in relighting mode)\n"
+      "\n"
+      "    Precision options:\n"
+      "    --fastmath  shade with float approximations of pow, square root and\n"
+      "                Perlin noise (bundled scenes differ from exact mode by at\n"
+      "                most 1/255 per channel)\n"
+      "\n"
+      "    Primary visibility options:\n"
+      "    --raster N  rasterize scene with N threads (< 0 - one per CPU) before\n"
+      "                tracing, so primary rays skip intersection tests in front of\n"
+      "                visible surfaces (image is the same; default: 0 - disabled;\n"
+      "                not applied in progressive and streaming modes)\n"
+      "\n"
+      "    Server options:\n"
+      "    -d PATH     run as render server listening on Unix socket PATH; scenes\n"
+      "                stay loaded between jobs (use rtclient to submit requests)\n"
+      "\n"
       "    Output image options:\n"
-      "    -o PATH     store rendered image in file PATH\n");
+      "    -o PATH     store rendered image in file PATH (PNG if it ends with .png, PPM\n"
+      "                if with .ppm, BMP otherwise). In batch mode PATH is\n"
+      "                pattern with single %%d conversion for frame index (f.e.\n"
+      "                frame%%04d.bmp); if it contains no %%, frame index is added\n"
+      "                before extension.\n"
+      "                `-` writes image to standard output (messages are printed to\n"
+      "                standard error then) and `fd:N` to open file descriptor N\n"
+      "    -S ROWS     stream image to -o BMP file (PATH must end with .bmp) in bands\n"
+      "                of ROWS rows (0 - default size), so whole image is never kept\n"
+      "                in memory; -j bands are traced in parallel. Colors are\n"
+      "                normalized with range estimated from low resolution pass\n"
+      "                unless -x is given\n"
+      "    -x MAX      fixed exposure of streamed image: colors are normalized to\n"
+      "                0..MAX range\n"
+      "    -f PATH     also store not normalized image in float PFM file PATH, so it\n"
+      "                can be tone mapped again with --tonemap-only\n"
+      "    -G G        gamma correction of result image (default: 2.5)\n"
+      "    -H LIST     combine images made with comma separated list of gammas\n"
+      "                (f.e. 0.5,1.5,2.5) instead of single -G gamma\n"
+      "    --tonemap-only PATH\n"
+      "                do not render anything; load float image PATH stored with -f\n"
+      "                and save it as -o image using -G or -H gammas\n"
+      "\n"
+      "    Profiling options:\n"
+      "    --tune-grid STEP\n"
+      "                do not render anything; build voxel grids of several densities,\n"
+      "                print their quality (occupancy, average triangle list length,\n"
+      "                estimated traversal cost) and store voxmode/voxparams of best\n"
+      "                one in renderer config file (-C). When STEP > 0, every STEP-th\n"
+      "                primary ray is traced to measure each grid\n"
+      "    --heatmap PATH\n"
+      "                also store image of per-pixel rendering cost in file PATH\n"
+      "                (format chosen like for -o); not available in progressive,\n"
+      "                streaming, batch and relighting modes\n"
+      "    --heatmap-metric NAME\n"
+      "                cost shown by heatmap: `cycles` (default), `rays` or `tests`\n"
+      "                (ray-triangle intersection tests); last two require build\n"
+      "                with `make STATS=1`\n"
+      "    --stats PATH\n"
+      "                write ray counters and per-stage timers as JSON to file PATH\n"
+      "                (`-` - standard output); requires build with `make STATS=1`\n");
+}
+
+
+/* Parse comma separated list of gamma values `list` into 0-terminated array
+ * `out` of at most `size` elements (including terminator). Returns `out` or
+ * NULL if list contains no valid values. */
+static float* parse_gammas(const char *list, float *out, int32_t size) {
+  int32_t n=0;
+  const char *ptr=list;
+  while(ptr && n < size-1) {
+    if(sscanf(ptr, "%f", &out[n]) == 1 && out[n] > 0.0f)
+      n++;
+    ptr = strchr(ptr, ',');
+    if(ptr)
+      ptr++;
+  }
+  out[n] = 0.0f;
+  return n > 0? out: NULL;
 }
 
 
-/* Parse command line arguments. */
-int parse_args(
-    int argc, char* argv[], 
-    char **g, char **l, char **a, char **c,
-    char **s, char **o, float *gamma, float *epsilon, float *distmod, char **C, char **L) {
+/* Finds frame index conversion of output `pattern` (single `%d` with
+ * optional zero flag and width, f.e. `%04d`). Returns its position (with
+ * conversion length in `len`, field width in `width` and zero flag in
+ * `zero`), NULL if pattern has no `%` at all, or NULL with `errno` set if it
+ * has any other conversion. */
+static const char* frame_pattern(const char *pattern, int32_t *len, int32_t *width, int *zero) {
+  const char *res = strchr(pattern, '%'), *ptr;
+  if(!res)
+    return NULL;
+  ptr = res+1;
+  *zero = *ptr == '0';
+  *width = 0;
+  while(*ptr >= '0' && *ptr <= '9' && *width < 100) {
+    *width = *width*10 + (*ptr++ - '0');
+  }
+  if(*ptr != 'd' || strchr(ptr, '%')) {
+    errno = E_INVALID_PARAM_VALUE;
+    return NULL;
+  }
+  *len = ptr+1 - res;
+  return res;
+}
+
+
+/* Make output file name of batch frame `index` using `pattern`. Returns NULL
+ * if pattern is invalid (`errno` is set). */
+static char* frame_filename(const char *pattern, int32_t index) {
+  char *res;
+  const char *ext, *conv;
+  int32_t clen=0, width=0, len=strlen(pattern)+128;
+  int zero=0;
+
+  errno = 0;
+  conv = frame_pattern(pattern, &clen, &width, &zero);
+  if(errno > 0)
+    return NULL;
+  res = rtStringCreate(len);
+  if(!res)
+    return NULL;
+  if(conv) {
+    // index is substituted here, pattern itself is never used as format
+    snprintf(res, len, zero? "%.*s%0*d%s": "%.*s%*d%s", (int)(conv-pattern), pattern, (int)width, index, conv+clen);
+  } else {
+    ext = strrchr(pattern, '.');
+    if(!ext || strchr(ext, '/'))
+      ext = pattern+strlen(pattern);
+    snprintf(res, len, "%.*s_%04d%s", (int)(ext-pattern), pattern, index, ext);
+  }
+  return res;
+}
+
+
+/* Render single batch frame and save it. Executed by thread pool workers. */
+static void render_frame(void *arg) {
+  RT_BatchFrame *frame = (RT_BatchFrame*)arg;
+  double start = rtStatsClock();
+
+  errno = 0;
+  RT_VisualizedScene *vs = rtVisualizedSceneRender(frame->ctx, frame->camera);
+  if(vs) {
+    rtVisualizedSceneDenoise(vs, frame->ctx->scene, 1);
+    RT_Bitmap *bmp = rtVisualizedSceneToBitmap(vs, F_HDR, NULL);
+    if(bmp) {
+      rtBitmapSaveAs(bmp, frame->output, 1);
+      rtBitmapDestroy(&bmp);
+    } else {
+      errno = E_MEMORY;
+    }
+    rtVisualizedSceneDestroy(&vs);
+  }
+  frame->status = errno;
+  if(frame->status > 0) {
+    RT_ERROR("frame %d: %s: %s", frame->index, frame->output, rtGetErrorDesc())
+  } else {
+    RT_INFO("frame %d: %s done (%.3f seconds)", frame->index, frame->output, rtStatsClock()-start)
+  }
+}
+
+
+/* Render all cameras from batch file `b` using shared state of `scene`.
+ * Returns 1 if all frames were rendered or 0 otherwise. */
+static int render_batch(RT_Scene *scene, const char *b, const char *o, int32_t jobs) {
+  uint32_t n, k;
+  int res=1;
+  RT_RenderContext *ctx=NULL;
+  RT_ThreadPool *pool=NULL;
+  RT_BatchFrame *frames=NULL;
+
+  RT_INFO("loading batch file: %s", b)
+  RT_Camera *cams = rtCameraLoadBatch(b, &n);
+  if(!cams) {
+    RT_ERROR("unable to load batch file: %s", rtGetErrorDesc())
+    return 0;
+  }
+  RT_INFO("%u frames to render", n)
+
+  frames = malloc(n*sizeof(RT_BatchFrame));
+  if(!frames) {
+    errno = E_MEMORY;
+    res = 0;
+    goto cleanup;
+  }
+  memset(frames, 0, n*sizeof(RT_BatchFrame));
+
+  // preprocess and voxelize scene once for all frames
+  ctx = rtRenderContextCreate(scene);
+  if(!ctx) {
+    RT_ERROR("unable to prepare scene: %s", rtGetErrorDesc())
+    res = 0;
+    goto cleanup;
+  }
+
+  pool = rtThreadPoolCreate(jobs);
+  if(!pool) {
+    RT_ERROR("unable to create rendering threads: %s", rtGetErrorDesc())
+    res = 0;
+    goto cleanup;
+  }
+  RT_INFO("rendering with %d threads", pool->nthreads)
+
+  for(k=0; k<n; k++) {
+    frames[k].ctx = ctx;
+    frames[k].camera = &cams[k];
+    frames[k].index = k;
+    frames[k].output = frame_filename(o, k);
+    if(!frames[k].output || !rtThreadPoolSubmit(pool, render_frame, &frames[k])) {
+      res = 0;
+      break;
+    }
+  }
+  rtThreadPoolWait(pool);
+
+  for(k=0; k<n; k++) {
+    if(frames[k].status > 0) {
+      errno = frames[k].status;
+      res = 0;
+    }
+  }
+
+cleanup:
+  rtThreadPoolDestroy(&pool);
+  rtRenderContextDestroy(&ctx);
+  if(frames) {
+    for(k=0; k<n; k++) {
+      rtStringDestroy(&frames[k].output);
+    }
+    free(frames);
+  }
+  free(cams);
+  return res;
+}
+
 
+/* Render image from camera `cam` once into geometry buffer and relight it
+ * with each light file listed in file `r` (one path per line). Returns 1 if
+ * all images were created or 0 otherwise. */
+static int render_relight(RT_Scene *scene, RT_Camera *cam, const char *r, const char *o) {
+  char line[1024], path[1024], *out;
+  uint32_t n;
+  int32_t index=0;
+  int res=1;
+  RT_RenderContext *ctx=NULL;
+  RT_GBuffer *gbuf=NULL;
+  RT_Light *lgt;
+
+  FILE *fd = fopen(r, "r");
+  if(!fd) {
+    errno = E_IO;
+    RT_ERROR("unable to open light list %s: %s", r, rtGetErrorDesc())
+    return 0;
+  }
+
+  ctx = rtRenderContextCreate(scene);
+  if(!ctx) {
+    res = 0;
+    goto cleanup;
+  }
+  double start = rtStatsClock();
+  gbuf = rtGBufferCreate(ctx, cam);
+  if(!gbuf) {
+    res = 0;
+    goto cleanup;
+  }
+  RT_INFO("geometry buffer created. Time taken: %.3f seconds", rtStatsClock()-start)
+
+  while(fgets(line, sizeof(line), fd)) {
+    if(sscanf(line, "%1023s", path) != 1 || rtStringStartsWith(path, "//"))
+      continue;
+    lgt = rtLightLoad(path, &n);
+    if(!lgt) {
+      RT_ERROR("unable to load lights %s: %s", path, rtGetErrorDesc())
+      res = 0;
+      break;
+    }
+
+    start = rtStatsClock();
+    RT_VisualizedScene *vs = rtVisualizedSceneRelight(ctx, gbuf, lgt, n);
+    free(lgt);
+    if(!vs) {
+      RT_ERROR("unable to relight with %s: %s", path, rtGetErrorDesc())
+      res = 0;
+      break;
+    }
+    out = frame_filename(o, index++);
+    if(!out) {
+      rtVisualizedSceneDestroy(&vs);
+      res = 0;
+      break;
+    }
+    RT_INFO("relit with %s in %.3f seconds, saving %s", path, rtStatsClock()-start, out)
+    RT_Bitmap *bmp = rtVisualizedSceneToBitmapParallel(vs, F_HDR, NULL, 0);
+    errno = 0;  // math functions used by tone mapping may leave EDOM behind
+    rtBitmapSaveAs(bmp, out, 0);
+    rtBitmapDestroy(&bmp);
+    rtVisualizedSceneDestroy(&vs);
+    rtStringDestroy(&out);
+    if(errno > 0) {
+      res = 0;
+      break;
+    }
+  }
+
+cleanup:
+  rtGBufferDestroy(&gbuf);
+  rtRenderContextDestroy(&ctx);
+  fclose(fd);
+  return res;
+}
+
+
+/* Monitor thread main loop. Wakes up every `interval` seconds (or when time
+ * limit is reached) until render is done. */
+static void* monitor_thread(void *arg) {
+  RT_Monitor *m = (RT_Monitor*)arg;
+  double start=rtStatsClock(), next=start+m->interval, wake, now;
+  struct timespec ts;
+  char *tmp=NULL;
+
+  // temporary file keeps extension (and so format) of preview file
+  if(m->preview) {
+    const char *ext = strrchr(m->preview, '.');
+    if(!ext || strchr(ext, '/'))
+      ext = m->preview+strlen(m->preview);
+    tmp = rtStringCreate(strlen(m->preview)+8);
+    if(tmp)
+      sprintf(tmp, "%.*s.tmp%s", (int)(ext-m->preview), m->preview, ext);
+  }
+
+  pthread_mutex_lock(&m->lock);
+  while(!m->done) {
+    wake = m->preview? next: start+m->limit;
+    if(m->limit > 0 && start+m->limit < wake)
+      wake = start+m->limit;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    now = rtStatsClock();
+    if(wake > now) {
+      double t = ts.tv_sec + ts.tv_nsec*1e-9 + (wake-now);
+      ts.tv_sec = (time_t)t;
+      ts.tv_nsec = (long)((t-ts.tv_sec)*1e9);
+      pthread_cond_timedwait(&m->cond, &m->lock, &ts);
+      if(m->done)
+        break;
+    }
+    pthread_mutex_unlock(&m->lock);
+
+    now = rtStatsClock();
+    if(m->limit > 0 && now >= start+m->limit) {
+      RT_INFO("time limit of %.1f seconds exceeded, stopping render", m->limit)
+      rtProgressCancel(m->progress);
+      pthread_mutex_lock(&m->lock);
+      break;
+    }
+    if(tmp && now >= next) {
+      // write to temporary file first, so preview file is always complete
+      RT_Bitmap *bmp = rtProgressSnapshot(m->progress, F_HDR, NULL);
+      if(bmp) {
+        errno = 0;
+        rtBitmapSaveAs(bmp, tmp, 1);
+        if(errno > 0 || rename(tmp, m->preview) != 0) {
+          RT_WARN("unable to save preview image %s: %s", m->preview, rtGetErrorDesc())
+        } else {
+          RT_INFO("preview saved: %s (1/%d resolution)", m->preview, m->progress->step)
+        }
+        rtBitmapDestroy(&bmp);
+      }
+      next = now+m->interval;
+    }
+    pthread_mutex_lock(&m->lock);
+  }
+  pthread_mutex_unlock(&m->lock);
+
+  rtStringDestroy(&tmp);
+  return NULL;
+}
+
+
+/* Render image from camera `cam` progressively, saving preview images to
+ * file `p` every `interval` seconds (if `p` is set) and stopping after `limit`
+ * seconds (if greater than 0). Returns rendered image or NULL on failure. */
+static RT_VisualizedScene* render_progressive(RT_Scene *scene, RT_Camera *cam, const char *p, float interval, float limit) {
+  RT_VisualizedScene *res=NULL;
+  RT_RenderContext *ctx=NULL;
+  RT_Monitor m;
+  pthread_t thread;
+
+  memset(&m, 0, sizeof(m));
+  m.preview = p;
+  m.interval = interval > 0? interval: 5.0f;
+  m.limit = limit;
+  m.progress = rtProgressCreate();
+  if(!m.progress)
+    return NULL;
+  pthread_mutex_init(&m.lock, NULL);
+  pthread_cond_init(&m.cond, NULL);
+
+  // time limit covers scene preparation too
+  if(pthread_create(&thread, NULL, monitor_thread, &m) != 0) {
+    errno = E_MEMORY;
+    goto cleanup;
+  }
+  ctx = rtRenderContextCreate(scene);
+  if(ctx) {
+    RT_STATS_START(TRACE);
+    res = rtVisualizedSceneRenderProgressive(ctx, cam, m.progress);
+    RT_STATS_STOP(TRACE);
+  }
+
+  pthread_mutex_lock(&m.lock);
+  m.done = 1;
+  pthread_cond_signal(&m.cond);
+  pthread_mutex_unlock(&m.lock);
+  pthread_join(thread, NULL);
+
+cleanup:
+  rtRenderContextDestroy(&ctx);
+  pthread_cond_destroy(&m.cond);
+  pthread_mutex_destroy(&m.lock);
+  rtProgressDestroy(&m.progress);
+  return res;
+}
+
+
+/* Builds voxel grids of several densities for `scene`, prints their quality
+ * and stores voxelization parameters of best one in config file `cfg` (if
+ * set). Every `step`-th primary ray of `cam` is traced to measure grids (0 -
+ * grids are compared by estimated cost only). Returns 1 on success or 0 on
+ * failure. */
+static int tune_grid(RT_Scene *scene, RT_Camera *cam, int32_t step, const char *cfg) {
+  RT_GridQuality q[RT_TUNE_NCOEFFS];
+  int32_t k, n, best;
+  char value[64];
+  int ok;
+
+  RT_RenderContext *ctx = rtRenderContextCreate(scene);
+  if(!ctx)
+    return 0;
+  n = rtGridTune(ctx, cam, step, q, RT_TUNE_NCOEFFS, &best);
+  rtRenderContextDestroy(&ctx);
+  if(best < 0)
+    return 0;
+
+  RT_IINFO("coeff   grid           voxels  empty  avg.list  dup.  est.cost  build[s]  trace[s]")
+  for(k=0; k<n; k++) {
+    RT_INFO("%5.2f  %4dx%4dx%4d %9d  %5.3f  %8.2f  %4.2f  %8.2f  %8.3f  %8.3f%s",
+        q[k].coeff, q[k].nv[0], q[k].nv[1], q[k].nv[2], q[k].nvoxels, q[k].empty_ratio,
+        q[k].avg_list, q[k].duplication, q[k].est_cost, q[k].build_time,
+        q[k].trace_time, k == best? "  <- best": "")
+  }
+
+  if(!cfg) {
+    RT_WWARN("no renderer config file given (-C or -s), best parameters not stored")
+    return 1;
+  }
+  if(q[best].coeff == 1.0f) {
+    ok = rtSceneConfigSet(cfg, "voxmode", "DEFAULT");
+  } else {
+    snprintf(value, sizeof(value), "%g %g %g", q[best].coeff, q[best].coeff, q[best].coeff);
+    ok = rtSceneConfigSet(cfg, "voxmode", "MODIFIED_DEFAULT") &&
+      rtSceneConfigSet(cfg, "voxparams", value);
+  }
+  if(!ok) {
+    RT_ERROR("unable to update renderer config file %s: %s", cfg, rtGetErrorDesc())
+    return 0;
+  }
+  RT_INFO("voxelization parameters stored in %s", cfg)
+  return 1;
+}
+
+
+/* Fills `opt` with default values overridden by command line arguments.
+ * Returns 0 if help was printed or required options are missing. */
+int parse_args(int argc, char* argv[], RT_Options *opt) {
   int i=1, alen;
   char *tmp, **dst=NULL;
+
+  memset(opt, 0, sizeof(RT_Options));
+  opt->gamma = 2.5f;
+  opt->distmod = 2.0f;
+  opt->interval = 5.0f;
+  opt->aathreshold = 0.1f;
+  opt->jobs = 1;
+  opt->aasamples = 1;
+  opt->stream = -1;
+  opt->tune = -1;
+  opt->plsamples = 16;
+
   if(argc <= 1) {
     print_help(argv[0]);
     return 0;
@@ -47,44 +650,171 @@ int parse_args(
     while(i < argc) {
       tmp = argv[i];
       alen = strlen(tmp);
-      if(rtStringStartsWith(tmp, "-g")) {
-        dst = g;
+      if(!strcmp(tmp, "--tonemap-only")) {
+        if(i+1 < argc)
+          opt->tonemap = rtStringCopy(argv[++i]);
+        i++;
+        continue;
+      } else if(!strcmp(tmp, "--stats")) {
+        if(i+1 < argc)
+          opt->stats = rtStringCopy(argv[++i]);
+        i++;
+        continue;
+      } else if(!strcmp(tmp, "--tune-grid")) {
+        if(i+1 < argc)
+          sscanf(argv[++i], "%d", &opt->tune);
+        i++;
+        continue;
+      } else if(!strcmp(tmp, "--plsamples")) {
+        if(i+1 < argc)
+          sscanf(argv[++i], "%d", &opt->plsamples);
+        opt->given |= RT_OPTION_PLSAMPLES;
+        i++;
+        continue;
+      } else if(!strcmp(tmp, "--denoise")) {
+        if(i+1 < argc)
+          sscanf(argv[++i], "%d", &opt->denoise);
+        opt->given |= RT_OPTION_DENOISE;
+        i++;
+        continue;
+      } else if(!strcmp(tmp, "--light-cutoff")) {
+        if(i+1 < argc)
+          sscanf(argv[++i], "%f", &opt->lightcutoff);
+        opt->given |= RT_OPTION_LIGHTCUTOFF;
+        i++;
+        continue;
+      } else if(!strcmp(tmp, "--fastmath")) {
+        opt->fastmath = 1;
+        opt->given |= RT_OPTION_FASTMATH;
+        i++;
+        continue;
+      } else if(!strcmp(tmp, "--raster")) {
+        if(i+1 < argc)
+          sscanf(argv[++i], "%d", &opt->raster);
+        opt->given |= RT_OPTION_RASTER;
+        i++;
+        continue;
+      } else if(!strcmp(tmp, "--heatmap")) {
+        if(i+1 < argc)
+          opt->heatmap = rtStringCopy(argv[++i]);
+        i++;
+        continue;
+      } else if(!strcmp(tmp, "--heatmap-metric")) {
+        if(i+1 < argc)
+          opt->heatmapmetric = rtStringCopy(argv[++i]);
+        i++;
+        continue;
+      } else if(rtStringStartsWith(tmp, "-g")) {
+        dst = &opt->geometry;
       } else if(rtStringStartsWith(tmp, "-l")) {
-        dst = l;
+        dst = &opt->lights;
       } else if(rtStringStartsWith(tmp, "-L")) {
-        dst = L;
+        dst = &opt->planar;
       } else if(rtStringStartsWith(tmp, "-a")) {
-        dst = a;
+        dst = &opt->attributes;
       } else if(rtStringStartsWith(tmp, "-c")) {
-        dst = c;
+        dst = &opt->camera;
       } else if(rtStringStartsWith(tmp, "-C")) {
-        dst = C;
+        dst = &opt->config;
       } else if(rtStringStartsWith(tmp, "-s")) {
-        dst = s;
+        dst = &opt->prefix;
       } else if(rtStringStartsWith(tmp, "-o")) {
-        dst = o;
+        dst = &opt->output;
+      } else if(rtStringStartsWith(tmp, "-b")) {
+        dst = &opt->batch;
+      } else if(rtStringStartsWith(tmp, "-d")) {
+        dst = &opt->server;
+      } else if(rtStringStartsWith(tmp, "-r")) {
+        dst = &opt->relight;
+      } else if(rtStringStartsWith(tmp, "-S")) {
+        if(alen == 2) {
+          sscanf(argv[++i], "%d", &opt->stream);
+        } else {
+          sscanf((char*)(tmp+2), "%d", &opt->stream);
+        }
+        i++;
+        continue;
+      } else if(rtStringStartsWith(tmp, "-x")) {
+        if(alen == 2) {
+          sscanf(argv[++i], "%f", &opt->exposure);
+        } else {
+          sscanf((char*)(tmp+2), "%f", &opt->exposure);
+        }
+        i++;
+        continue;
+      } else if(rtStringStartsWith(tmp, "-f")) {
+        dst = &opt->pfm;
+      } else if(rtStringStartsWith(tmp, "-H")) {
+        dst = &opt->gammalist;
+      } else if(rtStringStartsWith(tmp, "-p")) {
+        dst = &opt->preview;
+      } else if(rtStringStartsWith(tmp, "-P")) {
+        if(alen == 2) {
+          sscanf(argv[++i], "%f", &opt->interval);
+        } else {
+          sscanf((char*)(tmp+2), "%f", &opt->interval);
+        }
+        i++;
+        continue;
+      } else if(rtStringStartsWith(tmp, "-t")) {
+        if(alen == 2) {
+          sscanf(argv[++i], "%f", &opt->limit);
+        } else {
+          sscanf((char*)(tmp+2), "%f", &opt->limit);
+        }
+        i++;
+        continue;
+      } else if(rtStringStartsWith(tmp, "-A")) {
+        if(alen == 2) {
+          sscanf(argv[++i], "%d", &opt->aasamples);
+        } else {
+          sscanf((char*)(tmp+2), "%d", &opt->aasamples);
+        }
+        opt->given |= RT_OPTION_AASAMPLES;
+        i++;
+        continue;
+      } else if(rtStringStartsWith(tmp, "-T")) {
+        if(alen == 2) {
+          sscanf(argv[++i], "%f", &opt->aathreshold);
+        } else {
+          sscanf((char*)(tmp+2), "%f", &opt->aathreshold);
+        }
+        opt->given |= RT_OPTION_AATHRESHOLD;
+        i++;
+        continue;
+      } else if(rtStringStartsWith(tmp, "-j")) {
+        if(alen == 2) {
+          sscanf(argv[++i], "%d", &opt->jobs);
+        } else {
+          sscanf((char*)(tmp+2), "%d", &opt->jobs);
+        }
+        i++;
+        continue;
       } else if(rtStringStartsWith(tmp, "-G")) {
         if(alen == 2) {
-          sscanf(argv[++i], "%f", gamma);
+          sscanf(argv[++i], "%f", &opt->gamma);
         } else {
-          sscanf((char*)(tmp+2), "%f", gamma);
+          sscanf((char*)(tmp+2), "%f", &opt->gamma);
         }
+        opt->given |= RT_OPTION_GAMMA;
         i++;
         continue;
       } else if(rtStringStartsWith(tmp, "-E")) {
         if(alen == 2) {
-          sscanf(argv[++i], "%f", epsilon);
+          sscanf(argv[++i], "%f", &opt->epsilon);
         } else {
-          sscanf((char*)(tmp+2), "%f", epsilon);
+          sscanf((char*)(tmp+2), "%f", &opt->epsilon);
         }
+        opt->given |= RT_OPTION_EPSILON;
         i++;
         continue;
       } else if(rtStringStartsWith(tmp, "-D")) {
         if(alen == 2) {
-          sscanf(argv[++i], "%f", distmod);
+          sscanf(argv[++i], "%f", &opt->distmod);
         } else {
-          sscanf((char*)(tmp+2), "%f", distmod);
+          sscanf((char*)(tmp+2), "%f", &opt->distmod);
         }
+        opt->given |= RT_OPTION_DISTMOD;
         i++;
         continue;
       }
@@ -96,7 +826,13 @@ int parse_args(
       i++;
     }
   }
-  if((!*s && (!*g || (!*l && !*L) || !*a || !*c)) || !*o) {
+  if(opt->server) {
+    return 1;  // server mode - scenes are loaded on request
+  }
+  if(opt->tonemap && opt->output) {
+    return 1;  // only tone mapping of stored image
+  }
+  if((!opt->prefix && (!opt->geometry || (!opt->lights && !opt->planar) || !opt->attributes || (!opt->camera && !opt->batch))) || (!opt->output && opt->tune < 0)) {
     RT_EERROR("some of required options are missing")
     return 0;
   }
@@ -104,51 +840,198 @@ int parse_args(
 }
 
 
+/* Copies renderer options of `opt` to config of `scene`. If `given` is set,
+ * only options given on command line are copied, so they override values
+ * read from renderer config file. */
+void apply_options(RT_Scene *scene, const RT_Options *opt, int given) {
+  uint32_t mask = given? opt->given: ~0u;
+  if(mask & RT_OPTION_EPSILON)
+    scene->cfg.epsilon = opt->epsilon;
+  if(mask & RT_OPTION_GAMMA)
+    scene->cfg.gamma = opt->gamma;
+  if(mask & RT_OPTION_DISTMOD)
+    scene->cfg.distmod = opt->distmod;
+  if(mask & RT_OPTION_AASAMPLES)
+    scene->cfg.aasamples = opt->aasamples;
+  if(mask & RT_OPTION_AATHRESHOLD)
+    scene->cfg.aathreshold = opt->aathreshold;
+  if(mask & RT_OPTION_PLSAMPLES)
+    scene->cfg.plsamples = opt->plsamples;
+  if(mask & RT_OPTION_DENOISE)
+    scene->cfg.denoise = opt->denoise;
+  if(mask & RT_OPTION_LIGHTCUTOFF)
+    scene->cfg.lightcutoff = opt->lightcutoff;
+  if(mask & RT_OPTION_FASTMATH)
+    scene->cfg.fastmath = opt->fastmath;
+  if(mask & RT_OPTION_RASTER)
+    scene->cfg.raster = opt->raster;
+}
+
+
+/* Releases strings of given command line options. */
+void free_options(RT_Options *opt) {
+  rtStringDestroy(&opt->geometry);
+  rtStringDestroy(&opt->lights);
+  rtStringDestroy(&opt->planar);
+  rtStringDestroy(&opt->attributes);
+  rtStringDestroy(&opt->camera);
+  rtStringDestroy(&opt->config);
+  rtStringDestroy(&opt->prefix);
+  rtStringDestroy(&opt->output);
+  rtStringDestroy(&opt->batch);
+  rtStringDestroy(&opt->server);
+  rtStringDestroy(&opt->relight);
+  rtStringDestroy(&opt->preview);
+  rtStringDestroy(&opt->pfm);
+  rtStringDestroy(&opt->gammalist);
+  rtStringDestroy(&opt->tonemap);
+  rtStringDestroy(&opt->stats);
+  rtStringDestroy(&opt->heatmap);
+  rtStringDestroy(&opt->heatmapmetric);
+}
+
+
 /* Bootstrap function */
 int main(int argc, char* argv[]) {
-  char *g=NULL, *l=NULL, *a=NULL, *c=NULL, *s=NULL, *o=NULL, *C=NULL, *L=NULL;
-  float gamma=2.5f, epsilon=0.0f, distmod=2.0f;
+  RT_Options opt;
+  int32_t costmetric=RT_COST_NONE;
   uint32_t n;
+  float gammas_buf[16], *gammas=NULL;
 
   // parse command line arguments
-  if(!parse_args(argc, argv, &g, &l, &a, &c, &s, &o, &gamma, &epsilon, &distmod, &C, &L)) {
+  if(!parse_args(argc, argv, &opt)) {
     goto garbage_collect;
   }
   if(errno>0) {
     RT_CRITICAL("unable to parse args: %s\n", rtGetErrorDesc());
     goto garbage_collect;
   }
+  if(opt.stats && !RT_STATS) {
+    RT_WWARN("statistics are not compiled in (rebuild with `make STATS=1`)")
+  }
+  rtStatsReset();
+  if(opt.heatmap) {
+    costmetric = opt.heatmapmetric? rtStatsCostMetric(opt.heatmapmetric): RT_COST_CYCLES;
+    if(costmetric == RT_COST_NONE) {
+      errno = E_INVALID_PARAM_VALUE;
+      RT_ERROR("unknown heatmap metric %s: %s", opt.heatmapmetric, rtGetErrorDesc())
+      goto garbage_collect;
+    }
+    if(costmetric != RT_COST_CYCLES && !RT_STATS) {
+      RT_WARN("heatmap metric %s is not compiled in (rebuild with `make STATS=1`), using cycles", opt.heatmapmetric)
+      costmetric = RT_COST_CYCLES;
+    }
+  }
+
+  // streamed rows are written in place, which only BMP file allows
+  if(opt.stream >= 0) {
+    const char *ext = opt.output? strrchr(opt.output, '.'): NULL;
+    if(!ext || strcasecmp(ext, ".bmp")) {
+      errno = E_INVALID_PARAM_VALUE;
+      RT_ERROR("streamed image %s must be BMP file with .bmp extension: %s", opt.output, rtGetErrorDesc())
+      goto garbage_collect;
+    }
+  }
+
+  // keep standard output for image only
+  if(opt.output && !strcmp(opt.output, "-")) {
+    int fd = dup(STDOUT_FILENO);
+    if(fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+      errno = E_IO;
+      RT_ERROR("unable to redirect standard output: %s", rtGetErrorDesc())
+      goto garbage_collect;
+    }
+    rtStringDestroy(&opt.output);
+    opt.output = rtStringCreate(32);
+    snprintf(opt.output, 32, "fd:%d", fd);
+  }
+
+  // output pattern of batch frames
+  if((opt.batch || opt.relight) && opt.output) {
+    char *tmp = frame_filename(opt.output, 0);
+    if(!tmp) {
+      RT_ERROR("invalid output pattern %s: %s", opt.output, rtGetErrorDesc())
+      goto garbage_collect;
+    }
+    rtStringDestroy(&tmp);
+  }
+
+  if(opt.gammalist) {
+    gammas = parse_gammas(opt.gammalist, gammas_buf, sizeof(gammas_buf)/sizeof(float));
+    if(!gammas) {
+      errno = E_INVALID_PARAM_VALUE;
+      RT_ERROR("invalid gamma list %s: %s", opt.gammalist, rtGetErrorDesc())
+      goto garbage_collect;
+    }
+  }
+
+  // tone map image rendered before
+  if(opt.tonemap) {
+    RT_INFO("loading float image: %s", opt.tonemap)
+    RT_VisualizedScene *vs = rtVisualizedSceneLoadPfm(opt.tonemap);
+    if(!vs) {
+      RT_ERROR("unable to load float image %s: %s", opt.tonemap, rtGetErrorDesc())
+      goto garbage_collect;
+    }
+    vs->gamma = opt.gamma;
+    RT_INFO("creating result image: %s", opt.output)
+    double start = rtStatsClock();
+    RT_Bitmap *bmp = rtVisualizedSceneToBitmapParallel(vs, F_HDR, gammas, 0);
+    rtVisualizedSceneDestroy(&vs);
+    if(!bmp) {
+      errno = E_MEMORY;
+      RT_ERROR("unable to create result image: %s", rtGetErrorDesc())
+      goto garbage_collect;
+    }
+    rtBitmapSaveAs(bmp, opt.output, 0);
+    rtBitmapDestroy(&bmp);
+    if(errno>0) {
+      RT_ERROR("problem while creating result image: %d, %s", errno, rtGetErrorDesc());
+      goto garbage_collect;
+    }
+    RT_INFO("all done. Time taken: %.3f seconds", rtStatsClock()-start)
+    goto garbage_collect;
+  }
+
+  // run as render server
+  if(opt.server) {
+    if(!rtServerRun(opt.server, opt.jobs)) {
+      RT_ERROR("unable to start render server on %s: %s", opt.server, rtGetErrorDesc())
+    }
+    goto garbage_collect;
+  }
 
   // prepare data
-  if(s) {
-    if(!g) g = rtStringConcat(s, ".brs");
-    if(!l) l = rtStringConcat(s, ".lgt");
-    if(!a) a = rtStringConcat(s, ".atr");
-    if(!c) c = rtStringConcat(s, ".cam");
-    if(!C) C = rtStringConcat(s, ".cfg");
-    if(!L) L = rtStringConcat(s, ".pnr");
+  if(opt.prefix) {
+    if(!opt.geometry) opt.geometry = rtStringConcat(opt.prefix, ".brs");
+    if(!opt.lights) opt.lights = rtStringConcat(opt.prefix, ".lgt");
+    if(!opt.attributes) opt.attributes = rtStringConcat(opt.prefix, ".atr");
+    if(!opt.camera) opt.camera = rtStringConcat(opt.prefix, ".cam");
+    if(!opt.config) opt.config = rtStringConcat(opt.prefix, ".cfg");
+    if(!opt.planar) opt.planar = rtStringConcat(opt.prefix, ".pnr");
   }
 
   // load scene geometry
-  RT_INFO("loading scene geometry: %s", g);
-  RT_Scene *scene = rtSceneLoad(g);
+  RT_STATS_START(LOAD);
+  RT_INFO("loading scene geometry: %s", opt.geometry);
+  RT_Scene *scene = rtSceneLoad(opt.geometry);
   if(errno>0) {
     RT_ERROR("unable to load scene geometry: %s", rtGetErrorDesc())
     goto garbage_collect;
   }
-  scene->cfg.epsilon = epsilon;
-  scene->cfg.gamma = gamma;
-  scene->cfg.distmod = distmod;
-  RT_INFO("loading renderer configuration file: %s", C)
-  rtSceneConfigureRenderer(scene, C);
+  apply_options(scene, &opt, 0);
+  scene->cfg.costmetric = costmetric;
+  RT_INFO("loading renderer configuration file: %s", opt.config)
+  rtSceneConfigureRenderer(scene, opt.config);
   if(errno > 0) {
     RT_WARN("unable to load renderer configuration file: %s", rtGetErrorDesc())
     errno = 0;
   }
+  apply_options(scene, &opt, 1);  // command line wins over config file
 
   // load lights and add to scene
-  RT_INFO("loading lights: %s", l);
-  RT_Light *lgt = rtLightLoad(l, &n);
+  RT_INFO("loading lights: %s", opt.lights);
+  RT_Light *lgt = rtLightLoad(opt.lights, &n);
   if(errno>0) {
     RT_WARN("unable to load scene's lights: %s", rtGetErrorDesc());
     errno=0;
@@ -157,8 +1040,8 @@ int main(int argc, char* argv[]) {
   }
 
   // load planar lights and add to scene
-  RT_INFO("loading planar lights: %s", L)
-  RT_PlanarLight *pl = rtPlanarLightLoad(L, &n);
+  RT_INFO("loading planar lights: %s", opt.planar)
+  RT_PlanarLight *pl = rtPlanarLightLoad(opt.planar, &n);
   if(errno>0) {
     RT_WARN("unable to load planar lights: %s", rtGetErrorDesc());
     errno = 0;
@@ -167,26 +1050,92 @@ int main(int argc, char* argv[]) {
   }
 
   // load surface attributes and add to scene
-  RT_INFO("loading surface attributes: %s", a);
-  RT_Surface *surf = rtSurfaceLoad(a, &n);
+  RT_INFO("loading surface attributes: %s", opt.attributes);
+  RT_Surface *surf = rtSurfaceLoad(opt.attributes, &n);
   if(errno>0) {
     RT_ERROR("unable to load scene's attributes: %s", rtGetErrorDesc());
     goto garbage_collect;
   }
   rtSceneSetSurfaces(scene, surf, n);
+  RT_STATS_STOP(LOAD);
+
+  // render all frames of batch file
+  if(opt.batch) {
+    RT_IINFO("batch ray-tracing in progress...");
+    if(render_batch(scene, opt.batch, opt.output, opt.jobs)) {
+      RT_IINFO("all done.")
+    }
+    goto garbage_collect;
+  }
 
   // load camera configuration
-  RT_INFO("loading camera configuration: %s", c);
-  RT_Camera *cam = rtCameraLoad(c);
+  RT_INFO("loading camera configuration: %s", opt.camera);
+  RT_Camera *cam = rtCameraLoad(opt.camera);
   if(errno>0) {
     RT_ERROR("unable to load camera RT_INFO: %s", rtGetErrorDesc());
     goto garbage_collect;
   }
 
+  // choose voxelization parameters
+  if(opt.tune >= 0) {
+    RT_IINFO("voxel grid tuning in progress...");
+    if(tune_grid(scene, cam, opt.tune, opt.config)) {
+      RT_IINFO("all done.")
+    }
+    goto garbage_collect;
+  }
+
+  // relight single view with several light sets
+  if(opt.relight) {
+    RT_IINFO("relighting in progress...");
+    if(render_relight(scene, cam, opt.relight, opt.output)) {
+      RT_IINFO("all done.")
+    }
+    goto garbage_collect;
+  }
+
+  // trace image directly into output file
+  if(opt.stream >= 0) {
+    RT_IINFO("streaming ray-tracing in progress...");
+    RT_Color min={{0.0f, 0.0f, 0.0f, 0.0f}}, max={{opt.exposure, opt.exposure, opt.exposure, 0.0f}};
+    RT_RenderContext *ctx = rtRenderContextCreate(scene);
+    if(!ctx) {
+      RT_ERROR("unable to prepare scene: %s", rtGetErrorDesc())
+      goto garbage_collect;
+    }
+    errno = 0;
+    int ok = rtVisualizedSceneRenderStream(ctx, cam, opt.output, opt.stream,
+        opt.exposure > 0.0f? &min: NULL, opt.exposure > 0.0f? &max: NULL, gammas, opt.jobs);
+    rtRenderContextDestroy(&ctx);
+    if(!ok) {
+      RT_ERROR("problem while creating result image: %d, %s", errno, rtGetErrorDesc());
+      goto garbage_collect;
+    }
+    RT_IINFO("all done.")
+    goto garbage_collect;
+  }
+
   // execute raytrace process
   RT_IINFO("ray-tracing in progress...");
-  clock_t start = clock();
-  RT_VisualizedScene *vs = rtVisualizedSceneRaytrace(scene, cam);
+  if(opt.heatmap && (opt.preview || opt.limit > 0)) {
+    RT_WWARN("heatmap is not available in progressive mode")
+  }
+  double start = rtStatsClock();
+  RT_VisualizedScene *vs=NULL;
+  if(opt.preview || opt.limit > 0) {
+    vs = render_progressive(scene, cam, opt.preview, opt.interval, opt.limit);
+  } else {
+    // preprocess and voxelize stages are measured by context itself
+    RT_RenderContext *ctx = rtRenderContextCreate(scene);
+    if(ctx) {
+      RT_STATS_START(TRACE);
+      vs = rtVisualizedSceneRender(ctx, cam);
+      if(vs)
+        rtVisualizedSceneDenoise(vs, scene, 0);
+      RT_STATS_STOP(TRACE);
+      rtRenderContextDestroy(&ctx);
+    }
+  }
   if(errno>0) {
     RT_WARN("errno set by ray-trace process: %d, %s", errno, rtGetErrorDesc());
     errno = 0;
@@ -194,12 +1143,42 @@ int main(int argc, char* argv[]) {
   if(!vs) {
     goto garbage_collect;
   }
-  RT_INFO("...ray-tracing done. Time taken: %.3f seconds", (double)(clock()-start)/CLOCKS_PER_SEC);
+  RT_INFO("...ray-tracing done. Time taken: %.3f seconds", rtStatsClock()-start);
+
+  // store per-pixel cost image
+  if(opt.heatmap && vs->cost) {
+    RT_INFO("storing heatmap: %s", opt.heatmap)
+    RT_Bitmap *heat = rtVisualizedSceneCostToBitmap(vs);
+    if(heat) {
+      rtBitmapSaveAs(heat, opt.heatmap, 0);
+      rtBitmapDestroy(&heat);
+    }
+    if(errno>0) {
+      RT_ERROR("unable to store heatmap: %s", rtGetErrorDesc())
+      rtVisualizedSceneDestroy(&vs);
+      goto garbage_collect;
+    }
+  }
+
+  // store not normalized image
+  if(opt.pfm) {
+    RT_INFO("storing float image: %s", opt.pfm)
+    rtVisualizedSceneSavePfm(vs, opt.pfm);
+    if(errno>0) {
+      RT_ERROR("unable to store float image: %s", rtGetErrorDesc())
+      rtVisualizedSceneDestroy(&vs);
+      goto garbage_collect;
+    }
+  }
 
   // create and save result bitmap
-  RT_INFO("creating result image: %s", o);
-  RT_Bitmap *bmp = rtVisualizedSceneToBitmap(vs, F_HDR, NULL);
-  rtBitmapSave(bmp, o, 24);
+  RT_INFO("creating result image: %s", opt.output);
+  RT_STATS_START(TONEMAP);
+  RT_Bitmap *bmp = rtVisualizedSceneToBitmapParallel(vs, F_HDR, gammas, 0);
+  RT_STATS_STOP(TONEMAP);
+  RT_STATS_START(SAVE);
+  rtBitmapSaveAs(bmp, opt.output, 0);
+  RT_STATS_STOP(SAVE);
   rtBitmapDestroy(&bmp);
   rtVisualizedSceneDestroy(&vs);
   if(errno>0) {
@@ -209,12 +1188,20 @@ int main(int argc, char* argv[]) {
   RT_IINFO("all done.")
 
 garbage_collect:
-  rtStringDestroy(&g);
-  rtStringDestroy(&l);
-  rtStringDestroy(&a);
-  rtStringDestroy(&c);
-  rtStringDestroy(&s);
-  rtStringDestroy(&o);
+  if(RT_STATS) {
+    int err = errno;
+    rtStatsPrint();
+    if(opt.stats) {
+      errno = 0;
+      rtStatsSave(opt.stats);
+      if(errno > 0) {
+        RT_ERROR("unable to write statistics to %s: %s", opt.stats, rtGetErrorDesc())
+      }
+    }
+    if(err > 0)
+      errno = err;
+  }
+  free_options(&opt);
   if(errno>0) {
     return 1;
   } else {
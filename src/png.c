@@ -0,0 +1,476 @@
+#include "png.h"
+#include "error.h"
+#include "threadpool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+//// DEFLATE //////////////////////////////////////////////////
+
+#define RT_DEFLATE_WINDOW     32768   // maximal match distance
+#define RT_DEFLATE_MIN_MATCH  3
+#define RT_DEFLATE_MAX_MATCH  258
+#define RT_DEFLATE_HASH_BITS  15
+#define RT_DEFLATE_MAX_CHAIN  32      // number of candidates checked per position
+#define RT_DEFLATE_GOOD_MATCH 64      // match length that stops searching
+#define RT_PNG_MIN_ROWS       16      // minimal number of rows in band
+
+static const uint16_t rtLengthBase[29] = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const unsigned char rtLengthExtra[29] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t rtDistBase[30] = {
+  1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+  257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const unsigned char rtDistExtra[30] = {
+  0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+  7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+
+/* Output bit stream (bits are stored starting from least significant). */
+typedef struct _RT_BitWriter {
+  unsigned char *out;   // output buffer (large enough for all data)
+  uint32_t size;        // number of complete bytes stored
+  uint32_t bits;        // pending bits
+  int32_t nbits;        // number of pending bits
+} RT_BitWriter;
+
+
+/* Appends `n` lowest bits of `value` to stream. */
+static inline void rtBitsPut(RT_BitWriter *w, uint32_t value, int32_t n) {
+  w->bits |= value << w->nbits;
+  w->nbits += n;
+  while(w->nbits >= 8) {
+    w->out[w->size++] = w->bits & 0xff;
+    w->bits >>= 8;
+    w->nbits -= 8;
+  }
+}
+
+
+/* Pads stream with zero bits to byte boundary. */
+static inline void rtBitsAlign(RT_BitWriter *w) {
+  if(w->nbits > 0)
+    rtBitsPut(w, 0, 8-w->nbits);
+}
+
+
+/* Returns `n` lowest bits of `code` in reversed order (Huffman codes are
+ * stored starting from most significant bit). */
+static inline uint32_t rtBitsReverse(uint32_t code, int32_t n) {
+  uint32_t res=0;
+  while(n-- > 0) {
+    res = (res << 1) | (code & 1);
+    code >>= 1;
+  }
+  return res;
+}
+
+
+/* Fixed Huffman codes of literal/length alphabet (RFC 1951, 3.2.6), already
+ * reversed, with their lengths and lookup tables mapping match lengths and
+ * distances to symbols. */
+typedef struct _RT_DeflateTables {
+  uint16_t code[288];
+  unsigned char len[288];
+  unsigned char lsym[RT_DEFLATE_MAX_MATCH+1];   // length -> index of length code
+  unsigned char dsym[512];                      // distance -> distance code (see rtDistSymbol)
+} RT_DeflateTables;
+
+
+/* Fills deflate lookup tables. */
+static void rtDeflateInitTables(RT_DeflateTables *t) {
+  int32_t k, i;
+  for(k=0; k<288; k++) {
+    if(k < 144) {
+      t->len[k] = 8;
+      t->code[k] = rtBitsReverse(0x30+k, 8);
+    } else if(k < 256) {
+      t->len[k] = 9;
+      t->code[k] = rtBitsReverse(0x190+k-144, 9);
+    } else if(k < 280) {
+      t->len[k] = 7;
+      t->code[k] = rtBitsReverse(k-256, 7);
+    } else {
+      t->len[k] = 8;
+      t->code[k] = rtBitsReverse(0xc0+k-280, 8);
+    }
+  }
+  for(k=0; k<29; k++) {
+    for(i=rtLengthBase[k]; i<=RT_DEFLATE_MAX_MATCH && (k == 28 || i < rtLengthBase[k+1]); i++) {
+      t->lsym[i] = k;
+    }
+  }
+  for(k=0; k<30; k++) {
+    for(i=rtDistBase[k]; i<=RT_DEFLATE_WINDOW && (k == 29 || i < rtDistBase[k+1]); i++) {
+      if(i <= 256) {
+        t->dsym[i-1] = k;
+      } else {
+        t->dsym[256+((i-1)>>7)] = k;
+      }
+    }
+  }
+}
+
+
+/* Returns distance code of match distance `d`. */
+static inline int32_t rtDistSymbol(RT_DeflateTables *t, int32_t d) {
+  return d <= 256? t->dsym[d-1]: t->dsym[256+((d-1)>>7)];
+}
+
+
+/* Compresses `n` bytes of `in` as single fixed Huffman block. If `last` is
+ * not set, block is followed by empty stored block, so stream ends on byte
+ * boundary and can be joined with stream of next band. */
+static void rtDeflate(const unsigned char *in, uint32_t n, int32_t last, RT_BitWriter *w, int32_t *head, int32_t *prev) {
+  RT_DeflateTables t;
+  uint32_t pos, h, best, dist, len, k;
+  int32_t cand, chain, sym;
+
+  rtDeflateInitTables(&t);
+  for(k=0; k<(1<<RT_DEFLATE_HASH_BITS); k++) {
+    head[k] = -1;
+  }
+
+  #define HASH(p) ((((uint32_t)in[p] << 10) ^ ((uint32_t)in[(p)+1] << 5) ^ in[(p)+2]) & ((1<<RT_DEFLATE_HASH_BITS)-1))
+  #define INSERT(p) { h = HASH(p); prev[(p) & (RT_DEFLATE_WINDOW-1)] = head[h]; head[h] = (p); }
+
+  rtBitsPut(w, last? 1: 0, 1);  // BFINAL
+  rtBitsPut(w, 1, 2);           // BTYPE: fixed Huffman codes
+
+  pos = 0;
+  while(pos < n) {
+    best = 0;
+    dist = 0;
+    if(pos+RT_DEFLATE_MIN_MATCH <= n) {
+      // find longest match among previous positions with the same hash
+      h = HASH(pos);
+      cand = head[h];
+      chain = RT_DEFLATE_MAX_CHAIN;
+      while(cand >= 0 && pos-cand <= RT_DEFLATE_WINDOW && chain-- > 0) {
+        if(pos+best < n && in[cand+best] == in[pos+best]) {
+          for(len=0; pos+len < n && len < RT_DEFLATE_MAX_MATCH && in[cand+len] == in[pos+len]; len++);
+          if(len > best) {
+            best = len;
+            dist = pos-cand;
+            if(len >= RT_DEFLATE_GOOD_MATCH)
+              break;
+          }
+        }
+        cand = prev[cand & (RT_DEFLATE_WINDOW-1)];
+      }
+      INSERT(pos)
+    }
+
+    if(best >= RT_DEFLATE_MIN_MATCH) {
+      sym = t.lsym[best];
+      rtBitsPut(w, t.code[257+sym], t.len[257+sym]);
+      rtBitsPut(w, best-rtLengthBase[sym], rtLengthExtra[sym]);
+      sym = rtDistSymbol(&t, dist);
+      rtBitsPut(w, rtBitsReverse(sym, 5), 5);
+      rtBitsPut(w, dist-rtDistBase[sym], rtDistExtra[sym]);
+      for(k=pos+1; k<pos+best && k+RT_DEFLATE_MIN_MATCH <= n; k++) {
+        INSERT(k)
+      }
+      pos += best;
+    } else {
+      rtBitsPut(w, t.code[in[pos]], t.len[in[pos]]);
+      pos++;
+    }
+  }
+  rtBitsPut(w, t.code[256], t.len[256]);  // end of block
+
+  #undef INSERT
+  #undef HASH
+
+  if(!last) {
+    // empty stored block aligns stream to byte boundary
+    rtBitsPut(w, 0, 3);
+    rtBitsAlign(w);
+    rtBitsPut(w, 0x0000, 16);
+    rtBitsPut(w, 0xffff, 16);
+  } else {
+    rtBitsAlign(w);
+  }
+}
+
+
+//// CHECKSUMS ////////////////////////////////////////////////
+
+#define RT_ADLER_BASE 65521
+
+/* Returns Adler-32 checksum of `n` bytes of `buf`. */
+static uint32_t rtAdler32(const unsigned char *buf, uint32_t n) {
+  uint32_t a=1, b=0, k, chunk;
+  while(n > 0) {
+    chunk = n < 5552? n: 5552;  // largest chunk that can not overflow `b`
+    n -= chunk;
+    for(k=0; k<chunk; k++) {
+      a += buf[k];
+      b += a;
+    }
+    buf += chunk;
+    a %= RT_ADLER_BASE;
+    b %= RT_ADLER_BASE;
+  }
+  return (b << 16) | a;
+}
+
+
+/* Returns Adler-32 checksum of concatenation of two buffers, given their
+ * checksums and length of second buffer `len2`. */
+static uint32_t rtAdler32Combine(uint32_t adler1, uint32_t adler2, uint32_t len2) {
+  uint64_t rem = len2 % RT_ADLER_BASE;
+  uint64_t sum1 = adler1 & 0xffff;
+  uint64_t sum2 = (rem * sum1) % RT_ADLER_BASE;
+  sum1 += (adler2 & 0xffff) + RT_ADLER_BASE - 1;
+  sum2 += (adler1 >> 16) + (adler2 >> 16) + RT_ADLER_BASE - rem;
+  sum1 %= RT_ADLER_BASE;
+  sum2 %= RT_ADLER_BASE;
+  return (uint32_t)((sum2 << 16) | sum1);
+}
+
+
+/* Updates CRC-32 checksum `crc` with `n` bytes of `buf` using lookup
+ * `table`. */
+static uint32_t rtCrc32(const uint32_t *table, uint32_t crc, const unsigned char *buf, uint32_t n) {
+  crc = ~crc;
+  while(n-- > 0) {
+    crc = table[(crc ^ *(buf++)) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+
+//// PNG //////////////////////////////////////////////////////
+
+/* Returns Paeth predictor of pixel component (PNG specification, 9.4). */
+static inline int32_t rtPaeth(int32_t a, int32_t b, int32_t c) {
+  int32_t p=a+b-c, pa=abs(p-a), pb=abs(p-b), pc=abs(p-c);
+  if(pa <= pb && pa <= pc)
+    return a;
+  return pb <= pc? b: c;
+}
+
+
+/* Stores RGB components of image row `y` in `out` (or zeros if row is out of
+ * image). */
+static void rtPngRawRow(const RT_Bitmap *bmp, int32_t y, unsigned char *out) {
+  int32_t x;
+  uint32_t p;
+  if(y < 0) {
+    memset(out, 0, 3*bmp->width);
+    return;
+  }
+  const uint32_t *row = bmp->pixels + y*bmp->width;
+  for(x=0; x<bmp->width; x++) {
+    p = row[x];
+    *(out++) = rtColorGetR(p);
+    *(out++) = rtColorGetG(p);
+    *(out++) = rtColorGetB(p);
+  }
+}
+
+
+/* Filters raw row `cur` (with previous row `up`) choosing filter type with
+ * the smallest sum of absolute differences and stores filter type byte
+ * followed by filtered row in `out`. */
+static void rtPngFilterRow(const unsigned char *cur, const unsigned char *up, int32_t n, unsigned char *out, unsigned char *tmp) {
+  int32_t f, k, a, c, best=0;
+  uint32_t sum, best_sum=0xffffffff;
+  unsigned char v;
+
+  for(f=0; f<5; f++) {
+    sum = 0;
+    for(k=0; k<n; k++) {
+      a = k >= 3? cur[k-3]: 0;
+      c = k >= 3? up[k-3]: 0;
+      switch(f) {
+        case 0: v = cur[k]; break;
+        case 1: v = cur[k] - a; break;
+        case 2: v = cur[k] - up[k]; break;
+        case 3: v = cur[k] - ((a + up[k]) >> 1); break;
+        default: v = cur[k] - rtPaeth(a, up[k], c); break;
+      }
+      tmp[k] = v;
+      sum += v < 128? v: 256-v;
+    }
+    if(sum < best_sum) {
+      best_sum = sum;
+      best = f;
+      memcpy(out+1, tmp, n);
+    }
+  }
+  out[0] = best;
+}
+
+
+/* Filters and compresses single band (executed by thread pool workers). */
+static void rtPngCompressBand(void *arg) {
+  RT_PngBand *band = (RT_PngBand*)arg;
+  const RT_Bitmap *bmp = band->bmp;
+  int32_t y, rowlen=3*bmp->width;
+  unsigned char *filtered=NULL, *raw=NULL, *up, *cur, *tmp;
+  int32_t *head=NULL, *prev=NULL;
+  RT_BitWriter w;
+
+  band->length = (band->y1-band->y0)*(rowlen+1);
+  filtered = malloc(band->length);
+  raw = malloc(3*rowlen);
+  head = malloc((1<<RT_DEFLATE_HASH_BITS)*sizeof(int32_t));
+  prev = malloc(RT_DEFLATE_WINDOW*sizeof(int32_t));
+  // fixed Huffman codes use at most 9 bits per byte
+  band->data = malloc(band->length + band->length/8 + 64);
+  if(!filtered || !raw || !head || !prev || !band->data) {
+    band->status = E_MEMORY;
+    goto cleanup;
+  }
+
+  // filter rows (first row of band is predicted from last row of previous one)
+  up = raw;
+  cur = raw+rowlen;
+  tmp = raw+2*rowlen;
+  rtPngRawRow(bmp, band->y0-1, up);
+  for(y=band->y0; y<band->y1; y++) {
+    rtPngRawRow(bmp, y, cur);
+    rtPngFilterRow(cur, up, rowlen, filtered+(y-band->y0)*(rowlen+1), tmp);
+    unsigned char *swap = up; up = cur; cur = swap;
+  }
+  band->adler = rtAdler32(filtered, band->length);
+
+  memset(&w, 0, sizeof(w));
+  w.out = band->data;
+  rtDeflate(filtered, band->length, band->last, &w, head, prev);
+  band->size = w.size;
+
+cleanup:
+  if(filtered) free(filtered);
+  if(raw) free(raw);
+  if(head) free(head);
+  if(prev) free(prev);
+}
+
+
+/* Writes PNG chunk of given `type` made of `n` bytes of `data` preceded by
+ * `nprefix` bytes of `prefix` and followed by `nsuffix` bytes of `suffix`.
+ * Returns 1 on success or 0 on failure. */
+static int rtPngWriteChunk(FILE *fd, const uint32_t *crctable, const char *type,
+    const unsigned char *prefix, uint32_t nprefix,
+    const unsigned char *data, uint32_t n,
+    const unsigned char *suffix, uint32_t nsuffix)
+{
+  unsigned char hdr[8];
+  uint32_t crc, len=nprefix+n+nsuffix;
+  hdr[0] = len >> 24; hdr[1] = len >> 16; hdr[2] = len >> 8; hdr[3] = len;
+  memcpy(hdr+4, type, 4);
+  crc = rtCrc32(crctable, 0, hdr+4, 4);
+  crc = rtCrc32(crctable, crc, prefix, nprefix);
+  crc = rtCrc32(crctable, crc, data, n);
+  crc = rtCrc32(crctable, crc, suffix, nsuffix);
+  unsigned char tail[4] = {crc >> 24, crc >> 16, crc >> 8, crc};
+  return fwrite(hdr, 8, 1, fd) == 1 &&
+    (nprefix == 0 || fwrite(prefix, nprefix, 1, fd) == 1) &&
+    (n == 0 || fwrite(data, n, 1, fd) == 1) &&
+    (nsuffix == 0 || fwrite(suffix, nsuffix, 1, fd) == 1) &&
+    fwrite(tail, 4, 1, fd) == 1;
+}
+
+
+///////////////////////////////////////////////////////////////
+void rtBitmapSavePng(const RT_Bitmap* self, const char* filename, int32_t nthreads) {
+  static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+  static const unsigned char zhdr[2] = {0x78, 0x01};  // deflate, 32K window, no dictionary
+  uint32_t crctable[256], c, adler=1;
+  unsigned char ihdr[13], trailer[4];
+  int32_t k, i, nbands, rows;
+  RT_PngBand *bands=NULL;
+  RT_ThreadPool *pool=NULL;
+  FILE *fd=NULL;
+
+  for(k=0; k<256; k++) {
+    for(c=k, i=0; i<8; i++) {
+      c = c & 1? 0xedb88320 ^ (c >> 1): c >> 1;
+    }
+    crctable[k] = c;
+  }
+
+  // split image into bands, one per thread (but not too small)
+  if(nthreads <= 0)
+    nthreads = rtThreadPoolDefaultSize();
+  rows = (self->height+nthreads-1)/nthreads;
+  if(rows < RT_PNG_MIN_ROWS)
+    rows = RT_PNG_MIN_ROWS;
+  nbands = (self->height+rows-1)/rows;
+  if(nbands < 1)
+    nbands = 1;
+  bands = malloc(nbands*sizeof(RT_PngBand));
+  if(!bands) {
+    errno = E_MEMORY;
+    return;
+  }
+  memset(bands, 0, nbands*sizeof(RT_PngBand));
+
+  if(nbands > 1)
+    pool = rtThreadPoolCreate(nbands);
+  for(k=0; k<nbands; k++) {
+    bands[k].bmp = self;
+    bands[k].y0 = k*rows;
+    bands[k].y1 = (k+1)*rows < self->height? (k+1)*rows: self->height;
+    bands[k].last = k == nbands-1;
+    if(!pool || !rtThreadPoolSubmit(pool, rtPngCompressBand, &bands[k]))
+      rtPngCompressBand(&bands[k]);
+  }
+  if(pool) {
+    rtThreadPoolWait(pool);
+    rtThreadPoolDestroy(&pool);
+  }
+  for(k=0; k<nbands; k++) {
+    if(bands[k].status > 0) {
+      errno = bands[k].status;
+      goto garbage_collect;
+    }
+    adler = k == 0? bands[k].adler: rtAdler32Combine(adler, bands[k].adler, bands[k].length);
+  }
+
+  fd = fopen(filename, "wb");
+  if(!fd) {
+    errno = E_IO;
+    goto garbage_collect;
+  }
+
+  // image header: size, 8 bits per component, RGB, no interlace
+  ihdr[0] = self->width >> 24; ihdr[1] = self->width >> 16; ihdr[2] = self->width >> 8; ihdr[3] = self->width;
+  ihdr[4] = self->height >> 24; ihdr[5] = self->height >> 16; ihdr[6] = self->height >> 8; ihdr[7] = self->height;
+  ihdr[8] = 8;
+  ihdr[9] = 2;
+  ihdr[10] = ihdr[11] = ihdr[12] = 0;
+  trailer[0] = adler >> 24; trailer[1] = adler >> 16; trailer[2] = adler >> 8; trailer[3] = adler;
+
+  // each band is stored in separate IDAT chunk; together they form single
+  // zlib stream
+  int ok = fwrite(signature, sizeof(signature), 1, fd) == 1 &&
+    rtPngWriteChunk(fd, crctable, "IHDR", NULL, 0, ihdr, sizeof(ihdr), NULL, 0);
+  for(k=0; k<nbands && ok; k++) {
+    ok = rtPngWriteChunk(fd, crctable, "IDAT",
+        zhdr, k == 0? sizeof(zhdr): 0,
+        bands[k].data, bands[k].size,
+        trailer, bands[k].last? sizeof(trailer): 0);
+  }
+  ok = ok && rtPngWriteChunk(fd, crctable, "IEND", NULL, 0, NULL, 0, NULL, 0);
+  if(!ok) {
+    errno = E_IO;
+  }
+
+garbage_collect:
+  if(fd && fclose(fd) != 0)
+    errno = E_IO;
+  for(k=0; k<nbands; k++) {
+    if(bands[k].data) free(bands[k].data);
+  }
+  free(bands);
+}
+
+// vim: tabstop=2 shiftwidth=2 softtabstop=2
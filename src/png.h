@@ -0,0 +1,41 @@
+/*
+  PNG image encoder with self-contained deflate compressor. Image is split
+  into bands of rows compressed independently by several threads; compressed
+  bands are joined into single zlib stream (each band ends on byte boundary
+  with empty stored block, like in `pigz`).
+*/
+#ifndef __PNG_H
+#define __PNG_H
+
+#include "types.h"
+#include "bitmap.h"
+
+
+//// STRUCTURES ///////////////////////////////////////////////
+
+/* Single band of image compressed by one thread. */
+typedef struct _RT_PngBand {
+  const RT_Bitmap *bmp;   // source image
+  int32_t y0, y1;         // range of rows
+  int32_t last;           // 1 if this is last band of image
+  unsigned char *data;    // compressed data (deflate blocks)
+  uint32_t size;          // size of compressed data
+  uint32_t adler;         // Adler-32 checksum of uncompressed (filtered) rows
+  uint32_t length;        // size of uncompressed (filtered) rows
+  int status;             // errno value set while compressing band
+} RT_PngBand;
+
+
+//// FUNCTIONS ////////////////////////////////////////////////
+
+/* Saves given RT_Bitmap object into 24bpp (RGB) PNG file, compressing image
+ * with `nthreads` threads (<= 0 - one per CPU). Sets `errno` on failure.
+
+:param: self: pointer to RT_Bitmap object
+:param: filename: pointer to file name where image will be stored
+:param: nthreads: number of compression threads */
+void rtBitmapSavePng(const RT_Bitmap* self, const char* filename, int32_t nthreads);
+
+#endif
+
+// vim: tabstop=2 shiftwidth=2 softtabstop=2
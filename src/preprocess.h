@@ -5,11 +5,11 @@
 
 
 /* Performs scene preprocessing: calculations of all coefficients, domain
- * division, intersection algorithms setup etc. 
+ * division, intersection algorithms setup etc. Result does not depend on
+ * camera, so preprocessed scene can be shared by many renders.
  
-:param: scene: pointer to scene object
-:param: camera: pointer to camera object */
-RT_Scene* rtScenePreprocess(RT_Scene *scene, RT_Camera *camera);
+:param: scene: pointer to scene object */
+RT_Scene* rtScenePreprocess(RT_Scene *scene);
 
 #endif
 
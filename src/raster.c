@@ -0,0 +1,364 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <float.h>
+#include "error.h"
+#include "common.h"
+#include "threadpool.h"
+#include "raster.h"
+
+
+/* Projected triangle prepared for rasterization. Screen coords are pixel
+ * coords of primary rays (x = 0..width-1, y = 0..height-1) and depth `s` of
+ * point is its distance from observer along camera axis, in observer to
+ * screen distance units (1/s is linear in screen coords). */
+typedef struct _RT_RasterTriangle {
+  double ea[3], eb[3], ec[3];   // edges: ea*x + eb*y + ec is distance from edge (pixels, positive inside)
+  double za, zb, zc;            // plane of inverted depth: 1/s = za*x + zb*y + zc
+  double smin;                  // depth of nearest vertex
+  int32_t x0, y0, x1, y1;       // range of pixels to test (inclusive)
+  int32_t thin;                 // whole range gets `smin` depth (no edge tests)
+} RT_RasterTriangle;
+
+/* Triangles binned into tiles, shared by all tile tasks. */
+typedef struct _RT_RasterSetup {
+  RT_Raster *raster;        // result
+  RT_RasterTriangle *tris;  // projected triangles
+  int32_t *first;           // index of first item of each tile in `refs` (one more item than tiles)
+  int32_t *refs;            // indices of triangles overlapping tiles (tile after tile)
+  int32_t ntx;              // number of tiles in row
+  double u[3], v[3], w[3];  // camera: ul->ur, ul->bl and observer->ul vectors
+} RT_RasterSetup;
+
+/* Single tile rasterized by thread pool worker. */
+typedef struct _RT_RasterTile {
+  RT_RasterSetup *setup;
+  int32_t tile;
+} RT_RasterTile;
+
+
+/* Clips polygon `q` of `n` vertices (camera space coords: screen x, screen
+ * y and depth, see rtRasterCreate()) against near plane. Stores result in
+ * `out` and returns its number of vertices (0 - polygon is clipped out). */
+static int32_t rtRasterClip(double q[][3], int32_t n, double out[][3]) {
+  int32_t a, b, k, res=0;
+  double t;
+  for(a=0; a<n; a++) {
+    b = (a+1) % n;
+    if(q[a][2] >= RT_RASTER_NEAR) {
+      memcpy(out[res++], q[a], 3*sizeof(double));
+    }
+    if((q[a][2] >= RT_RASTER_NEAR) != (q[b][2] >= RT_RASTER_NEAR)) {
+      t = (RT_RASTER_NEAR - q[a][2]) / (q[b][2] - q[a][2]);
+      for(k=0; k<2; k++) {
+        out[res][k] = q[a][k] + t*(q[b][k] - q[a][k]);
+      }
+      out[res++][2] = RT_RASTER_NEAR;
+    }
+  }
+  return res;
+}
+
+
+/* Prepares projected triangle `p` (pixel coords and inverted depth of
+ * vertices) for rasterization into image of size `w`x`h`. Returns 0 if
+ * triangle covers no pixel. */
+static int rtRasterSetupTriangle(double p[3][3], int32_t w, int32_t h, RT_RasterTriangle *t) {
+  double area2, len2, maxlen2=0.0, dx, dy, inv, xmin, xmax, ymin, ymax;
+  int32_t k, a, b;
+
+  xmin = xmax = p[0][0];
+  ymin = ymax = p[0][1];
+  t->smin = 1.0 / p[0][2];
+  for(k=1; k<3; k++) {
+    if(p[k][0] < xmin) xmin = p[k][0];
+    if(p[k][0] > xmax) xmax = p[k][0];
+    if(p[k][1] < ymin) ymin = p[k][1];
+    if(p[k][1] > ymax) ymax = p[k][1];
+    if(1.0 / p[k][2] < t->smin) t->smin = 1.0 / p[k][2];
+  }
+  xmin = ceil(xmin - RT_RASTER_BAND);
+  xmax = floor(xmax + RT_RASTER_BAND);
+  ymin = ceil(ymin - RT_RASTER_BAND);
+  ymax = floor(ymax + RT_RASTER_BAND);
+  if(xmax < 0.0 || ymax < 0.0 || xmin > w-1 || ymin > h-1 || xmin > xmax || ymin > ymax)
+    return 0;
+  t->x0 = xmin > 0.0? (int32_t)xmin: 0;
+  t->y0 = ymin > 0.0? (int32_t)ymin: 0;
+  t->x1 = xmax < w-1? (int32_t)xmax: w-1;
+  t->y1 = ymax < h-1? (int32_t)ymax: h-1;
+
+  area2 = (p[1][0]-p[0][0])*(p[2][1]-p[0][1]) - (p[1][1]-p[0][1])*(p[2][0]-p[0][0]);
+  t->za = t->zb = t->zc = 0.0;
+  for(k=0; k<3; k++) {
+    // edge opposite to vertex `k`
+    a = (k+1) % 3;
+    b = (k+2) % 3;
+    dx = p[b][0] - p[a][0];
+    dy = p[b][1] - p[a][1];
+    len2 = dx*dx + dy*dy;
+    if(len2 > maxlen2)
+      maxlen2 = len2;
+    inv = len2 > 0.0? (area2 > 0.0? 1.0: -1.0) / sqrt(len2): 0.0;
+    t->ea[k] = -dy*inv;
+    t->eb[k] = dx*inv;
+    t->ec[k] = (dy*p[a][0] - dx*p[a][1])*inv;
+    if(area2 != 0.0) {
+      t->za += p[k][2]*(-dy) / area2;
+      t->zb += p[k][2]*dx / area2;
+      t->zc += p[k][2]*(dy*p[a][0] - dx*p[a][1]) / area2;
+    }
+  }
+  t->thin = fabs(area2) <= RT_RASTER_THIN*maxlen2;
+  return 1;
+}
+
+
+/* Rasterizes all triangles overlapping single tile and stores depth of its
+ * pixels (executed by thread pool workers). */
+static void rtRasterTile(void *arg) {
+  RT_RasterTile *tile = (RT_RasterTile*)arg;
+  RT_RasterSetup *setup = tile->setup;
+  RT_Raster *raster = setup->raster;
+  RT_RasterTriangle *t;
+  float s[RT_RASTER_TILE*RT_RASTER_TILE], *ptr;
+  int32_t c, k, x, y, x0, y0, x1, y1, xa, ya, xb, yb;
+  double z, e, d[3], a, b;
+
+  x0 = (tile->tile % setup->ntx) * RT_RASTER_TILE;
+  y0 = (tile->tile / setup->ntx) * RT_RASTER_TILE;
+  x1 = x0+RT_RASTER_TILE < raster->width? x0+RT_RASTER_TILE-1: raster->width-1;
+  y1 = y0+RT_RASTER_TILE < raster->height? y0+RT_RASTER_TILE-1: raster->height-1;
+  for(k=0; k<RT_RASTER_TILE*RT_RASTER_TILE; k++) {
+    s[k] = FLT_MAX;
+  }
+
+  // keep minimal depth of all triangles that may cover each pixel
+  for(c=setup->first[tile->tile]; c<setup->first[tile->tile+1]; c++) {
+    t = &setup->tris[setup->refs[c]];
+    xa = t->x0 > x0? t->x0: x0;
+    ya = t->y0 > y0? t->y0: y0;
+    xb = t->x1 < x1? t->x1: x1;
+    yb = t->y1 < y1? t->y1: y1;
+    for(y=ya; y<=yb; y++) {
+      ptr = s + (y-y0)*RT_RASTER_TILE - x0;
+      for(x=xa; x<=xb; x++) {
+        if(t->thin) {
+          z = t->smin;
+        } else {
+          for(k=0; k<3; k++) {
+            e = t->ea[k]*x + t->eb[k]*y + t->ec[k];
+            if(e < -RT_RASTER_BAND)
+              break;
+          }
+          if(k < 3)
+            continue;
+          z = t->za*x + t->zb*y + t->zc;
+          z = z > 0.0? 1.0/z: t->smin;
+        }
+        if(z < ptr[x])
+          ptr[x] = (float)z;
+      }
+    }
+  }
+
+  // convert depth to distance along (normalized) primary ray
+  for(y=y0; y<=y1; y++) {
+    ptr = s + (y-y0)*RT_RASTER_TILE - x0;
+    b = (double)y / raster->height;
+    for(x=x0; x<=x1; x++) {
+      if(ptr[x] == FLT_MAX) {
+        raster->depth[y*raster->width + x] = FLT_MAX;
+        continue;
+      }
+      a = (double)x / raster->width;
+      for(k=0; k<3; k++) {
+        d[k] = setup->w[k] + a*setup->u[k] + b*setup->v[k];
+      }
+      raster->depth[y*raster->width + x] = (float)(ptr[x] *
+          sqrt(d[0]*d[0] + d[1]*d[1] + d[2]*d[2]) * (1.0 - RT_RASTER_MARGIN));
+    }
+  }
+}
+
+
+///////////////////////////////////////////////////////////////
+RT_Raster* rtRasterCreate(RT_Scene *scene, RT_Camera *camera, int32_t nthreads) {
+  int32_t c, k, n, m, x, y, ntris=0, nrefs=0, ntiles, nty, near=0;
+  double inv[3][3], q[3][3], clipped[4][3], p[3][3], corner[3], det, len, reach=0.0, dist;
+  double *u, *v, *w;
+  RT_Triangle *t;
+  RT_RasterSetup setup;
+  RT_RasterTile *tiles=NULL;
+  RT_ThreadPool *pool=NULL;
+  int32_t *pos=NULL;
+
+  RT_Raster *res = malloc(sizeof(RT_Raster));
+  if(!res) {
+    errno = E_MEMORY;
+    return NULL;
+  }
+  res->width = camera->sw;
+  res->height = camera->sh;
+  res->depth = malloc(res->width*res->height*sizeof(float));
+  memset(&setup, 0, sizeof(setup));
+  setup.raster = res;
+  setup.ntx = (res->width + RT_RASTER_TILE-1) / RT_RASTER_TILE;
+  nty = (res->height + RT_RASTER_TILE-1) / RT_RASTER_TILE;
+  ntiles = setup.ntx*nty;
+  setup.tris = malloc(2*scene->nt*sizeof(RT_RasterTriangle) + 1);
+  setup.first = calloc(ntiles+1, sizeof(int32_t));
+  pos = malloc(ntiles*sizeof(int32_t));
+  tiles = malloc(ntiles*sizeof(RT_RasterTile));
+  if(!res->depth || !setup.tris || !setup.first || !pos || !tiles)
+    goto nomemory;
+
+  /* Camera space coords of point are (s*x/width, s*y/height, s), where `s`
+   * is its depth and x, y are pixel coords of its projection, so they are
+   * obtained by multiplying point's vector from observer by inverted matrix
+   * of u, v and w vectors. */
+  u = setup.u;
+  v = setup.v;
+  w = setup.w;
+  for(k=0; k<3; k++) {
+    u[k] = (double)camera->ur[k] - camera->ul[k];
+    v[k] = (double)camera->bl[k] - camera->ul[k];
+    w[k] = (double)camera->ul[k] - camera->ob[k];
+  }
+  for(k=0; k<3; k++) {
+    inv[0][k] = v[(k+1)%3]*w[(k+2)%3] - v[(k+2)%3]*w[(k+1)%3];
+    inv[1][k] = w[(k+1)%3]*u[(k+2)%3] - w[(k+2)%3]*u[(k+1)%3];
+    inv[2][k] = u[(k+1)%3]*v[(k+2)%3] - u[(k+2)%3]*v[(k+1)%3];
+  }
+  det = inv[0][0]*u[0] + inv[0][1]*u[1] + inv[0][2]*u[2];
+  if(det == 0.0) {
+    near = 1;  // degenerated screen
+  }
+
+  /* Parts of triangles clipped by near plane that are seen on screen lie
+   * closer to observer than `reach` (near plane distance at screen corner
+   * farthest from observer). */
+  for(k=0; k<4; k++) {
+    for(c=0; c<3; c++) {
+      corner[c] = w[c] + (k & 1? u[c]: 0.0) + (k & 2? v[c]: 0.0);
+    }
+    len = sqrt(corner[0]*corner[0] + corner[1]*corner[1] + corner[2]*corner[2]);
+    if(len > reach)
+      reach = len;
+  }
+  reach *= 1.01*RT_RASTER_NEAR;
+
+  // project and clip triangles
+  for(c=0, t=scene->t; c<scene->nt && !near; c++, t++) {
+    float *vert[3] = {t->i, t->j, t->k};
+    for(k=0; k<3; k++) {
+      for(m=0; m<3; m++) {
+        q[k][m] = (inv[m][0]*(vert[k][0] - (double)camera->ob[0]) +
+                   inv[m][1]*(vert[k][1] - (double)camera->ob[1]) +
+                   inv[m][2]*(vert[k][2] - (double)camera->ob[2])) / det;
+      }
+    }
+    if(q[0][2] <= 0.0 && q[1][2] <= 0.0 && q[2][2] <= 0.0)
+      continue;  // behind observer
+    if(q[0][2] < RT_RASTER_NEAR || q[1][2] < RT_RASTER_NEAR || q[2][2] < RT_RASTER_NEAR) {
+      for(k=0, dist=0.0; k<3; k++) {
+        double lo=MIN(t->i[k], t->j[k], t->k[k]) - (double)camera->ob[k];
+        double hi=MAX(t->i[k], t->j[k], t->k[k]) - (double)camera->ob[k];
+        if(lo > 0.0) dist += lo*lo;
+        if(hi < 0.0) dist += hi*hi;
+      }
+      if(dist < reach*reach) {
+        near = 1;
+        break;
+      }
+    }
+    n = rtRasterClip(q, 3, clipped);
+    for(k=1; k+1<n; k++) {
+      int32_t fan[3] = {0, k, k+1};
+      for(m=0; m<3; m++) {
+        p[m][0] = clipped[fan[m]][0] / clipped[fan[m]][2] * res->width;
+        p[m][1] = clipped[fan[m]][1] / clipped[fan[m]][2] * res->height;
+        p[m][2] = 1.0 / clipped[fan[m]][2];
+      }
+      if(rtRasterSetupTriangle(p, res->width, res->height, &setup.tris[ntris])) {
+        RT_RasterTriangle *rt = &setup.tris[ntris++];
+        nrefs += (rt->x1/RT_RASTER_TILE - rt->x0/RT_RASTER_TILE + 1) *
+                 (rt->y1/RT_RASTER_TILE - rt->y0/RT_RASTER_TILE + 1);
+        for(y=rt->y0/RT_RASTER_TILE; y<=rt->y1/RT_RASTER_TILE; y++) {
+          for(x=rt->x0/RT_RASTER_TILE; x<=rt->x1/RT_RASTER_TILE; x++) {
+            setup.first[y*setup.ntx + x + 1]++;
+          }
+        }
+      }
+    }
+  }
+  if(near) {
+    memset(res->depth, 0, res->width*res->height*sizeof(float));
+    RT_IINFO("rasterization: scene is too close to observer, primary rays are traced in full")
+    goto cleanup;
+  }
+
+  // bin triangles into tiles
+  setup.refs = malloc(nrefs*sizeof(int32_t) + 1);
+  if(!setup.refs)
+    goto nomemory;
+  for(k=0; k<ntiles; k++) {
+    setup.first[k+1] += setup.first[k];
+    pos[k] = setup.first[k];
+  }
+  for(c=0; c<ntris; c++) {
+    RT_RasterTriangle *rt = &setup.tris[c];
+    for(y=rt->y0/RT_RASTER_TILE; y<=rt->y1/RT_RASTER_TILE; y++) {
+      for(x=rt->x0/RT_RASTER_TILE; x<=rt->x1/RT_RASTER_TILE; x++) {
+        setup.refs[pos[y*setup.ntx + x]++] = c;
+      }
+    }
+  }
+
+  // rasterize tiles
+  if(nthreads <= 0)
+    nthreads = rtThreadPoolDefaultSize();
+  if(nthreads > 1)
+    pool = rtThreadPoolCreate(nthreads < ntiles? nthreads: ntiles);
+  for(k=0; k<ntiles; k++) {
+    tiles[k].setup = &setup;
+    tiles[k].tile = k;
+    if(!pool || !rtThreadPoolSubmit(pool, rtRasterTile, &tiles[k]))
+      rtRasterTile(&tiles[k]);  // no threads - rasterize tile in current thread
+  }
+  if(pool) {
+    rtThreadPoolWait(pool);
+    rtThreadPoolDestroy(&pool);
+  }
+  RT_INFO("rasterization: %d triangles in %d tiles", ntris, ntiles)
+
+cleanup:
+  if(setup.refs) free(setup.refs);
+  free(setup.tris);
+  free(setup.first);
+  free(pos);
+  free(tiles);
+  return res;
+
+nomemory:
+  if(setup.refs) free(setup.refs);
+  if(setup.tris) free(setup.tris);
+  if(setup.first) free(setup.first);
+  if(pos) free(pos);
+  if(tiles) free(tiles);
+  rtRasterDestroy(&res);
+  errno = E_MEMORY;
+  return NULL;
+}
+///////////////////////////////////////////////////////////////
+void rtRasterDestroy(RT_Raster **self) {
+  RT_Raster *ptr=*self;
+  if(ptr) {
+    if(ptr->depth) free(ptr->depth);
+    free(ptr);
+    *self = NULL;
+  }
+}
+
+// vim: tabstop=2 shiftwidth=2 softtabstop=2
@@ -0,0 +1,65 @@
+/*
+  Software rasterizer of primary visibility. Triangles of scene are projected
+  onto screen of pinhole camera and rasterized (in tiles, by thread pool
+  workers) into depth buffer holding, for each pixel, distance its primary
+  ray (the one traced by rtVisualizedSceneRender()) travels without hitting
+  any triangle. Coverage is tested with tolerance of RT_RASTER_BAND pixels
+  and depth is lowered by RT_RASTER_MARGIN, so buffer never overestimates
+  that distance, and grid traversal started with it
+  (rtUddFindNearestTriangleBeyond()) finds the same triangle, intersection
+  point, barycentric coords and voxel as full traversal, while intersection
+  tests of voxels in front of visible surface are skipped.
+*/
+#ifndef __RASTER_H
+#define __RASTER_H
+
+#include "types.h"
+#include "scene.h"
+
+
+//// CONSTANTS ////////////////////////////////////////////////
+
+/* Size of square tile rasterized by single task (pixels). */
+#define RT_RASTER_TILE    32
+
+/* Near clipping plane, as fraction of observer to screen distance. */
+#define RT_RASTER_NEAR    1e-3
+
+/* Pixels closer than this to triangle edge (pixels) are treated as covered. */
+#define RT_RASTER_BAND    0.01
+
+/* Relative amount depth stored in buffer is lowered by. */
+#define RT_RASTER_MARGIN  1e-3
+
+/* Triangles with projected height smaller than this fraction of their
+ * longest projected edge get depth of their nearest vertex in whole bounding
+ * box (depth interpolated across them is not accurate). */
+#define RT_RASTER_THIN    1e-3
+
+
+//// STRUCTURES ///////////////////////////////////////////////
+
+/* Depth buffer of primary visibility. */
+typedef struct _RT_Raster {
+  int32_t width;
+  int32_t height;
+  float *depth;   // distance along primary ray free of triangles (FLT_MAX - ray
+                  // hits nothing, 0 - unknown)
+} RT_Raster;
+
+
+//// FUNCTIONS ////////////////////////////////////////////////
+
+/* Rasterizes all triangles of preprocessed `scene` seen from `camera` with
+ * `nthreads` threads (<= 0 - one per CPU) and returns depth buffer of
+ * camera's resolution. When some triangle is closer to observer than near
+ * clipping plane (so it could not be projected), depth of all pixels is
+ * left unknown. Returns NULL on failure (`errno` is set). */
+RT_Raster* rtRasterCreate(RT_Scene *scene, RT_Camera *camera, int32_t nthreads);
+
+/* Releases memory occupied by given RT_Raster object. */
+void rtRasterDestroy(RT_Raster **self);
+
+#endif
+
+// vim: tabstop=2 shiftwidth=2 softtabstop=2
@@ -2,17 +2,178 @@
 #include <math.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 #include "error.h"
 #include "voxelize.h"
+#include "preprocess.h"
 #include "raytrace.h"
+#include "raster.h"
+#include "shadowmap.h"
 #include "texture.h"
 #include "vectormath.h"
+#include "fastmath.h"
 #include "rdtsc.h"
 #include "common.h"
+#include "threadpool.h"
+#include "stats.h"
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
 
 
 
 
+/* Tone mapping lookup table covers normalized values from 2^-RT_LUT_EXPONENTS
+ * to 1, with 2^RT_LUT_MANTISSA entries per power of 2. Table is indexed by
+ * upper bits of IEEE 754 representation of value, so its relative accuracy
+ * is the same in whole range. */
+#define RT_LUT_EXPONENTS  32
+#define RT_LUT_MANTISSA   7
+#define RT_LUT_SHIFT      (23-RT_LUT_MANTISSA)
+#define RT_LUT_BASE       ((127-RT_LUT_EXPONENTS) << RT_LUT_MANTISSA)
+#define RT_LUT_SIZE       ((RT_LUT_EXPONENTS << RT_LUT_MANTISSA) + 2)
+
+/* Part of image tone mapped by single thread. */
+typedef struct _RT_ToneMapBand {
+  RT_VisualizedScene *s;  // source image
+  RT_Bitmap *bmp;         // result image
+  float *lut;             // tone curve lookup table
+  float *gammas;          // gamma values used to create `lut`
+  int32_t y0, y1;         // range of rows to map
+} RT_ToneMapBand;
+
+/* Part of image traced, tone mapped and written by single thread in
+ * streaming mode. */
+typedef struct _RT_StreamBand {
+  RT_RenderContext *ctx;    // prepared scene
+  RT_Camera *camera;        // viewpoint
+  RT_BitmapStream *out;     // output file
+  float *lut;               // tone curve lookup table
+  float *gammas;            // gamma values used to create `lut`
+  float *min, *scale;       // color normalization parameters
+  int32_t y0, y1;           // range of rows
+  int status;               // errno value set while processing band
+} RT_StreamBand;
+
+/* Per-thread buffers of point light loop (grown when scene has more lights;
+ * light loop does not recurse, so one set per thread is enough). */
+typedef struct _RT_LightBuffer {
+  int32_t size;           // capacity (number of lights)
+  float *x, *y, *z;       // light positions (SoA)
+  float *flux;            // light fluxes
+  float *df, *cosr, *w;   // diffuse factors, cosines of specular angle, weights
+  float *ts;              // transparency factors of shadow rays
+  struct _RT_LightRank *rank;  // lights in order of decreasing importance
+} RT_LightBuffer;
+
+/* Estimated contribution of single light; `imp` must stay first member, so
+ * array can be sorted with lbuf_cmp(). */
+typedef struct _RT_LightRank {
+  float imp;      // contribution to brightness (if not shadowed)
+  int32_t c;      // light index
+} RT_LightRank;
+
+/* Part of image filtered by single thread in one pass of denoising filter. */
+typedef struct _RT_DenoiseBand {
+  RT_VisualizedScene *s;  // filtered image
+  RT_Scene *scene;        // scene image was rendered for
+  const float *src;       // 3 planes of input values
+  float *dst;             // 3 planes of output values
+  int32_t step;           // distance between kernel taps
+  int32_t y0, y1;         // range of rows to filter
+} RT_DenoiseBand;
+
+typedef union {
+  float f;
+  uint32_t u;
+} RT_FloatBits;
+
+
+/* Returns value of tone curve (average of `v` raised to each of `gammas`,
+ * scaled to 0..255 range) calculated directly. */
+static float rtToneCurve(float v, float *gammas) {
+  float res=0.0f;
+  int32_t k;
+  for(k=0; gammas[k] > 0.0f; k++) {
+    res += pow(v, gammas[k]) * 255.0f;
+  }
+  return k > 0? res/k: 0.0f;
+}
+
+
+/* Creates lookup table of tone curve for given NULL-terminated array of
+ * `gammas`. */
+static float* rtToneMapCreateLut(float *gammas) {
+  int32_t k;
+  RT_FloatBits v;
+  float *res = malloc(RT_LUT_SIZE*sizeof(float));
+  if(!res) {
+    errno = E_MEMORY;
+    return NULL;
+  }
+  for(k=0; k<RT_LUT_SIZE; k++) {
+    v.u = (uint32_t)(RT_LUT_BASE + k) << RT_LUT_SHIFT;
+    res[k] = rtToneCurve(v.f > 1.0f? 1.0f: v.f, gammas);
+  }
+  return res;
+}
+
+
+/* Returns tone curve value of normalized color component `v` using lookup
+ * table `lut` (values out of range covered by table are clamped to 0..1 or
+ * calculated directly). */
+static inline float rtToneMapLookup(float v, float *lut, float *gammas) {
+  RT_FloatBits b;
+  uint32_t idx;
+  if(!(v > 0.0f))  // also catches NaN
+    return 0.0f;
+  if(v >= 1.0f)
+    return lut[RT_LUT_SIZE-2];
+  b.f = v;
+  idx = b.u >> RT_LUT_SHIFT;
+  if(idx < RT_LUT_BASE)
+    return rtToneCurve(v, gammas);
+  idx -= RT_LUT_BASE;
+  float t = (b.u & ((1u << RT_LUT_SHIFT)-1)) * (1.0f / (1u << RT_LUT_SHIFT));
+  return lut[idx] + t*(lut[idx+1] - lut[idx]);
+}
+
+
+/* Returns RT_Bitmap pixel made of not normalized color `c`, normalized with
+ * `min` color and `scale` factors and mapped with lookup table `lut`. */
+static inline uint32_t rtToneMapColor(RT_Color *c, float *min, float *scale, float *lut, float *gammas) {
+  return rtColorBuildRGBA(
+    (uint32_t)rtToneMapLookup((c->c[0] - min[0]) * scale[0], lut, gammas),
+    (uint32_t)rtToneMapLookup((c->c[1] - min[1]) * scale[1], lut, gammas),
+    (uint32_t)rtToneMapLookup((c->c[2] - min[2]) * scale[2], lut, gammas), 0);
+}
+
+
+/* Tone maps rows of single band (executed by thread pool workers). */
+static void rtToneMapBand(void *arg) {
+  RT_ToneMapBand *band = (RT_ToneMapBand*)arg;
+  RT_VisualizedScene *s = band->s;
+  uint32_t *out;
+  float scale[3], range;
+  int32_t k, i, i1;
+
+  // calculate scale factors mapping minimal..maximal color to 0..1 range
+  for(k=0; k<3; k++) {
+    range = s->max.c[k] - s->min.c[k];
+    scale[k] = range > 0.0f? 1.0f/range: 0.0f;
+  }
+
+  out = band->bmp->pixels;
+  i1 = band->y1*s->width;
+  for(i=band->y0*s->width; i<i1; i++) {
+    out[i] = rtColorBuildRGBA(
+      (uint32_t)rtToneMapLookup((s->r[i] - s->min.c[0]) * scale[0], band->lut, band->gammas),
+      (uint32_t)rtToneMapLookup((s->g[i] - s->min.c[1]) * scale[1], band->lut, band->gammas),
+      (uint32_t)rtToneMapLookup((s->b[i] - s->min.c[2]) * scale[2], band->lut, band->gammas), 0);
+  }
+}
+
+
 static inline int lbuf_cmp(const void *a_, const void *b_) {
   float *a=(float*)a_, *b=(float*)b_;
   if(*a < *b) {
@@ -25,232 +186,307 @@ static inline int lbuf_cmp(const void *a_, const void *b_) {
 }
 
 
-/* Get color by bluring pixels lying on the same plane. */
-static RT_Color rtVisualizedSceneGetBluredPixel(RT_VisualizedScene* s, int x, int y) {
-  const int radius = 2;  // neighbourhood radius
-  const float delta = 0.00001f;
-  int i, j, t;
-  float tmp;
-  int miny=y-radius, maxy=y+radius;
-  int minx=x-radius, maxx=x+radius;
-  RT_Color r = {{0.0f, 0.0f, 0.0f, 0.0f}};
-  
-  RT_VisualizedScenePixel *ref = rtVisualizedSceneGetPixel(s, x, y);  // reference pixel
-  return ref->c;
-  if(!ref->t) {
-    return r;
-  }
 
-  for(j=miny, t=0; j<=maxy; j++) {
-    for(i=minx; i<=maxx; i++) {
-      if(i < 0 || j < 0)
-        continue;
-      if(i >= s->width || j >= s->height)
-        continue;
-      RT_VisualizedScenePixel *p = rtVisualizedSceneGetPixel(s, i, j);
-      if(!p->t) 
-        continue;
-      
-      // check if this pixel lies in the same plane as reference pixel
-      tmp = p->t->d - ref->t->d;
-      if(tmp < -delta || tmp > delta)
-        continue;
-      tmp = p->t->n[0] - ref->t->n[0];
-      if(tmp < -delta || tmp > delta)
-        continue;
-      tmp = p->t->n[1] - ref->t->n[1];
-      if(tmp < -delta || tmp > delta)
-        continue;
-      tmp = p->t->n[2] - ref->t->n[2];
-      if(tmp < -delta || tmp > delta)
-        continue;
 
-      t++;
-      rtVectorAdd(r.c, r.c, p->c.c);
-    }
+/* Point light loop buffers of calling thread. */
+static __thread RT_LightBuffer rtLightBuffer = {0};
+
+/* Key whose destructor releases buffers when thread pool worker exits. */
+static pthread_key_t rtLightBufferKey;
+static pthread_once_t rtLightBufferOnce = PTHREAD_ONCE_INIT;
+
+
+/* Releases point light loop buffers `arg` of exiting thread. */
+static void rtLightBufferFree(void *arg) {
+  RT_LightBuffer *b = (RT_LightBuffer*)arg;
+  free(b->x);
+  free(b->rank);
+  memset(b, 0, sizeof(RT_LightBuffer));
+}
+
+
+/* Creates key releasing point light loop buffers at thread exit. */
+static void rtLightBufferKeyCreate() {
+  pthread_key_create(&rtLightBufferKey, rtLightBufferFree);
+}
+
+
+/* Makes buffers of calling thread hold at least `n` lights (rounded up to
+ * multiple of 4, so SIMD loop needs no tail). Returns 0 if there is not
+ * enough memory. */
+static int rtLightBufferReserve(int32_t n) {
+  RT_LightBuffer *b = &rtLightBuffer;
+  float *planes;
+  RT_LightRank *rank;
+  if(n <= b->size)
+    return 1;
+  if(!b->x && !b->rank) {
+    // first buffers of this thread are released when it exits
+    pthread_once(&rtLightBufferOnce, rtLightBufferKeyCreate);
+    pthread_setspecific(rtLightBufferKey, b);
   }
+  n = (n + 3) & ~3;
+  planes = realloc(b->x, 8*(size_t)n*sizeof(float));
+  if(!planes)
+    return 0;
+  b->x = planes;
+  b->y = b->x + n;
+  b->z = b->y + n;
+  b->flux = b->z + n;
+  b->df = b->flux + n;
+  b->cosr = b->df + n;
+  b->w = b->cosr + n;
+  b->ts = b->w + n;
+  rank = realloc(b->rank, (size_t)n*sizeof(RT_LightRank));
+  if(!rank)
+    return 0;
+  b->rank = rank;
+  b->size = n;
+  return 1;
+}
+
+
+/* Width of single pixel of primary ray traced by calling thread, measured at
+ * unit distance from observer; used to choose texture mip level. */
+static __thread float rtPixelSpread = 0.0f;
 
-  rtVectorMul(r.c, r.c, 1.0f/t);
 
-  return r;
+/* Returns width of pixel of `camera` at unit distance from observer. */
+static float rtCameraPixelSpread(RT_Camera *camera, float w_inv) {
+  RT_Vertex4f tmp;
+  float dist = rtVectorLength(rtVectorMake(tmp, camera->ob, camera->ul));
+  return dist > 0.0f? rtVectorDistance(camera->ul, camera->ur) * w_inv / dist: 0.0f;
 }
 
 
-/* Apply texture. */
-static rtApplyTexture(RT_Triangle* nearest, RT_Vertex4f norm, RT_Color* out, float *o, float u, float v) {
-  float px = nearest->ti[0] + (nearest->tj[0]-nearest->ti[0])*u + (nearest->tk[0]-nearest->ti[0])*v;
-  float py = nearest->ti[1] + (nearest->tj[1]-nearest->ti[1])*u + (nearest->tk[1]-nearest->ti[1])*v;
-  
-  float bheight=0.04f, bwidth=0.10f, filling=0.005f, radius=0.005f;
-  float delta=0.002f; 
-  float vectormod[2];
+/* Applies procedural bricks texture at texture coords (`px`, `py`) in 0..1
+ * range, storing color in `out` and bending normal vector `norm` along axes
+ * `ua` and `va` texture coords are measured on (`py` grows against `va`).
+ * Surface is treated as height field given by texture brightness. */
+static void rtApplyBricks(RT_Vertex4f norm, RT_Color* out, float px, float py, int32_t ua, int32_t va, int32_t fastmath) {
+  float bheight=0.04f, bwidth=0.10f, filling=0.005f, radius=0.002f;
+  float bump=0.004f;
   float rfactor=2160.0f, gfactor=0.0f, bfactor=0.0f;
-  int blur=0;
-  
-  RT_Color cx1, cx2, cy1, cy2;
-  RT_Color avg = bricks(px, py, bheight, bwidth, filling, rfactor, gfactor, bfactor, 33, vectormod, radius);
-  if(delta > 0.0f) {
-    float tmp;
-    if((tmp=px-delta) >= 0.0f) {
-      cx1 = bricks(tmp, py, bheight, bwidth, filling, rfactor, gfactor, bfactor, 33, vectormod, radius);
-    }
-    if((tmp=px+delta) <= 1.0f) {
-      cx2 = bricks(tmp, py, bheight, bwidth, filling, rfactor, gfactor, bfactor, 33, vectormod, radius);
-    }
-    if((tmp=py-delta) >= 0.0f) {
-      cy1 = bricks(px, tmp, bheight, bwidth, filling, rfactor, gfactor, bfactor, 33, vectormod, radius);
-    }
-    if((tmp=py+delta) <= 1.0f) {
-      cy2 = bricks(px, tmp, bheight, bwidth, filling, rfactor, gfactor, bfactor, 33, vectormod, radius);
-    }
-    if(blur) {
-      rtVectorAdd(avg.c, avg.c, cx1.c);
-      rtVectorAdd(avg.c, avg.c, cx2.c);
-      rtVectorAdd(avg.c, avg.c, cy1.c);
-      rtVectorAdd(avg.c, avg.c, cy2.c);
-      rtVectorMul(avg.c, avg.c, 0.25f);
-    }
-  }
-    
-  out->c[0] = avg.c[0];
-  out->c[1] = avg.c[1];
-  out->c[2] = avg.c[2];
-  
-  float ugrad = (cx2.c[0]+cx2.c[1]+cx2.c[2])*0.333f - (cx1.c[0]+cx1.c[1]+cx1.c[2])*0.333f;
-  float vgrad = (cy2.c[0]+cy2.c[1]+cy2.c[2])*0.333f - (cy1.c[0]+cy1.c[1]+cy1.c[2])*0.333f;
-  RT_Vertex4f U, V;
+  float grad[2];
+  RT_Color color;
 
-  rtVectorMul(U, nearest->ij, ugrad);
-  rtVectorMul(V, nearest->ik, -vgrad);
-  rtVectorAdd(norm, norm, U);
-  rtVectorAdd(norm, norm, V);
-  rtVectorNorm(norm);
+  color = bricks(px, py, bheight, bwidth, filling, rfactor, gfactor, bfactor, 33, grad, radius, fastmath);
+  out->c[0] = color.c[0];
+  out->c[1] = color.c[1];
+  out->c[2] = color.c[2];
+
+  norm[ua] -= bump * grad[0];
+  norm[va] += bump * grad[1];
+  if(fastmath) {
+    rtVectorNormFast(norm);
+  } else {
+    rtVectorNorm(norm);
+  }
 }
 
 
-/* Implementation of RayTracing algorithm.
+/* Applies texture of triangle visible at `hit` point, which lies `dist` away
+ * from origin of ray. Texture is projected onto plane of two coordinate axes
+ * closest to plane of triangle and repeats every `tscale` scene units of its
+ * surface, so adjacent triangles of one surface share texture seamlessly.
+ * Procedural textures are evaluated in float precision if `fastmath` is
+ * set. */
+static void rtApplyTexture(RT_GBufferPixel *hit, float dist, int32_t fastmath) {
+  RT_Triangle *t=hit->t;
+  RT_Texture *tex=t->texture;
+  float u, v, an[3], lod;
+  int32_t a=0, ua, va;
+
+  // choose dominant axis of normal; texture lies on plane of other two,
+  // with `v` pointed down along y axis on walls
+  an[0] = fabsf(t->n[0]);
+  an[1] = fabsf(t->n[1]);
+  an[2] = fabsf(t->n[2]);
+  if(an[1] > an[a]) a = 1;
+  if(an[2] > an[a]) a = 2;
+  ua = a == 0? 2: 0;
+  va = a == 1? 2: 1;
+  u = hit->p[ua] / t->s->tscale;
+  v = -hit->p[va] / t->s->tscale;
+
+  if(tex->kind == RT_TEXTURE_BRICKS) {
+    rtApplyBricks(hit->n, &hit->nc, u - floorf(u), v - floorf(v), ua, va, fastmath);
+    return;
+  }
+
+  // mip level at which single texel covers single pixel
+  lod = log2f(dist * rtPixelSpread * tex->level[0].width / t->s->tscale);
+  rtTextureSample(tex, u, v, lod, &hit->nc);
+}
+
 
-:param: scene: pointer to scene object
-:param: udd: pointer to uniform domain division structure 
-:param: t: pointer to first triangle
-:param: maxt: limit of `t` pointer 
-:param: current: actual nearest triangle found
-:param: l: pointer to first light
-:param: maxl: limit of `l` pointer
-:param: o: ray origin
-:param: r: normalized ray direction
-:param: total_flux: sum of all lights flux, used to calculate ambient light
-:param: level: recurrency level (when reaches 0, function returns immediately) */
 static RT_Color rtRayTrace(
-    RT_Scene *scene, RT_Udd *udd,
-    RT_Triangle *t, RT_Triangle *maxt, RT_Triangle *current, 
-    RT_Light *l, RT_Light *maxl,
-    float *o, float *r, 
-    float total_flux, uint32_t level,
-    int32_t i, int32_t j, int32_t k,
-    RT_Triangle **visible) 
+    RT_Scene *scene, RT_Udd *udd, RT_Triangle *current, float *o, float *r, 
+    float total_flux, uint32_t level, int32_t i, int32_t j, int32_t k,
+    float dskip, RT_Triangle **visible, RT_Color *planar);
+
+
+/* Finds nearest triangle intersected by ray `o`+`r` (starting at voxel
+ * `i,j,k`) and prepares data needed to shade intersection point: normal
+ * vector pointed towards observer (with bump mapping applied) and surface
+ * color (with texture applied). Returns 1 if triangle was found or 0
+ * otherwise.
+
+:param: dskip: distance ray is known to travel without hitting any triangle
+  (see raster.h; 0 - unknown) */
+static int rtRayHit(
+    RT_Scene *scene, RT_Udd *udd, RT_Triangle *current,
+    float *o, float *r,
+    int32_t i, int32_t j, int32_t k, float dskip,
+    RT_GBufferPixel *hit)
 {
-  RT_Color res={{0.0f, 0.0f, 0.0f, 0.0f}}, rcolor, nc;
-  RT_Vertex4f onew, rnew, rray, tmpv, norm;
-  float dmin, df, rf, n_dot_lo, dm, ts=1.0f, u, v;
-  int32_t c, d;
+  float dmin;
+  RT_Triangle *nearest;
 
-  /* Terminate if we reached limit of recurrency level. */
-  if(level == 0) {
-    return res;
-  }
-  
   /* Traverse through grid of voxels to find nearest triangle for further
    * shading processing. */
-  RT_Triangle *nearest = rtUddFindNearestTriangle(udd, scene, current, onew, &dmin, o, r, &i, &j, &k, &u, &v);
-  if(!nearest) {
-    return res;
+  if(dskip > 0.0f) {
+    nearest = rtUddFindNearestTriangleBeyond(udd, scene, current, hit->p, &dmin, dskip, o, r, &i, &j, &k, &hit->u, &hit->v);
+  } else {
+    nearest = rtUddFindNearestTriangle(udd, scene, current, hit->p, &dmin, o, r, &i, &j, &k, &hit->u, &hit->v);
   }
-  
-  if(!*visible) {
-    *visible = nearest;
+  if(!nearest) {
+    return 0;
   }
+  hit->t = nearest;
+  hit->i = i;
+  hit->j = j;
+  hit->k = k;
+  rtVectorCopy(r, hit->r);
 
   // point normal towards current observer
-  rtVectorCopy(nearest->n, norm);
-  if(rtVectorDotp(r, norm) > 0.0f) {
-    rtVectorInverse(norm, norm);
+  rtVectorCopy(nearest->n, hit->n);
+  if(rtVectorDotp(r, hit->n) > 0.0f) {
+    rtVectorInverse(hit->n, hit->n);
   }
 
-  // bump mapping: http://www.cs.jhu.edu/~cohen/rendtech99/lectures
-  // apply texture
-  rtVectorCopy(nearest->s->color.c, nc.c);
-  if(nearest->sid == 7 && nearest->texture) {
-    rtApplyTexture(nearest, norm, &nc, onew, u, v);
+  // apply texture (and bump mapping: http://www.cs.jhu.edu/~cohen/rendtech99/lectures)
+  rtVectorCopy(nearest->s->color.c, hit->nc.c);
+  if(nearest->texture) {
+    rtApplyTexture(hit, rtVectorDistance(o, hit->p), scene->cfg.fastmath);
   }
 
-  // initialize result color with ambient color
-  if(nearest->s->ka > 0.0f) {
-    rtVectorMul(res.c, nc.c, nearest->s->ka * total_flux);
-  } 
+  return 1;
+}
 
-  // rtRayTrace reflected ray
-  if(nearest->s->kr > 0.0f) {
-    rtVectorRayReflected(rray, norm, rtVectorInverse(tmpv, r));
-    rcolor = rtRayTrace(scene, udd, t, maxt, nearest, l, maxl, onew, rray, total_flux, level-1, i, j, k, visible);
-    rtVectorAdd(res.c, res.c, rtVectorMul(rcolor.c, rcolor.c, nearest->s->kr));
-  }
 
-  // rtRayTrace refracted ray
-  if(nearest->s->kt > 0.0f) {
-    rtVectorRayRefracted(rray, norm, rtVectorInverse(tmpv, r), nearest->s->eta);
-    rcolor = rtRayTrace(scene, udd, t, maxt, nearest, l, maxl, onew, rray, total_flux, level-1, i, j, k, visible);
-    rtVectorAdd(res.c, res.c, rtVectorMul(rcolor.c, rcolor.c, nearest->s->kt));
+/* Flag of shading kernels (next to RT_SURFACE_* flags of surface) that
+ * replaces exact math functions with approximations from fastmath.h
+ * (`fastmath` config). */
+#define RT_SHADE_FASTMATH   RT_SURFACE_FEATURES
+#define RT_SHADE_KERNELS    (2*RT_SURFACE_FEATURES)
+
+
+/* Returns 1 if point of `hit` is shadowed from point light `l` and stores
+ * transparency factor of triangles between them in `ts`. Query is answered
+ * by shadow map of current render (if there is one) unless transparent
+ * triangle may lie on the way - shadow ray is traced then.
+
+:param: lindex: index of light in triangle's shadow caches and shadow map (-1
+  to bypass both) */
+static inline int rtFindShadow(
+    RT_Scene *scene, RT_Udd *udd, RT_GBufferPixel *hit,
+    RT_Light *l, int32_t lindex, float *ts)
+{
+  RT_Vertex4f r;
+  if(scene->shadows && lindex >= 0) {
+    if(hit->t->s->kt == 0.0f && rtVectorDotp(rtVectorMake(r, hit->p, l->p), hit->n) <= 0.0f) {
+      return 1;  // light is beyond opaque surface
+    }
+    switch(rtShadowMapLookup(scene->shadows, lindex, l->p, hit->p, hit->t->n, scene->cfg.epsilon)) {
+      case RT_SHADOWMAP_LIT:
+        RT_STATS_INC(shadow_map_hits);
+        *ts = 1.0f;
+        return 0;
+      case RT_SHADOWMAP_SHADOWED:
+        RT_STATS_INC(shadow_map_hits);
+        *ts = 1.0f;
+        return 1;
+    }
   }
-  
-  // some variables
-  RT_Color tmp={{0.0f, 0.0f, 0.0f, 0.0f}};
-  float a_sum=0.0f, r_sum=0.0f;
+  return rtUddFindShadow(udd, scene, hit->t, hit->n, hit->p, l, lindex, ts) != NULL;
+}
 
-  /* Process point lights. */
-  for(c=0; c<scene->nl; c++) {
-    l = &scene->l[c];
-    df = rf = 0.0f;
-    rtVectorRay(rnew, onew, l->p);
 
-    if(!rtUddFindShadow(udd, scene, nearest, onew, l, c, &ts)) {
-      n_dot_lo = rtVectorDotp(norm, rnew);
+/* Calculates contribution of point light `l` to color of `hit` point and adds
+ * it to `out`. Always inlined, so branches on constant `features` (surface's
+ * RT_SURFACE_* flags and RT_SHADE_FASTMATH) are resolved at compile time in
+ * shading kernels.
 
-      // diffusion factor
-      df = nearest->s->kd * n_dot_lo;
-      if(df < 0.0f && nearest->s->kt > 0.0f) {
-        df = -df;
-      }
+:param: lindex: index of light in triangle's shadow caches and shadow map (-1
+  to bypass both) */
+static __FORCE_INLINE void rtShadeLightKernel(
+    RT_Scene *scene, RT_Udd *udd, RT_GBufferPixel *hit, 
+    RT_Light *l, int32_t lindex, RT_Color *out, const int32_t features)
+{
+  RT_Surface *s=hit->t->s;
+  RT_Vertex4f rnew, tmpv;
+  RT_Color tmp;
+  float df, rf=0.0f, n_dot_lo, ts;
 
-      // reflection factor
-      if(nearest->s->ks > 0.0f) {
-        rf = nearest->s->ks * pow(rtVectorDotp(r, rtVectorRayReflected2(tmpv, norm, rnew, n_dot_lo)), nearest->s->g);
-        if(rf < 0.0f && nearest->s->kt > 0.0f) {
-          rf = -rf;
-        }
-      }
-      
-      // calculate color
-      rtVectorAdd(tmp.c, l->color.c, nc.c);
-      rtVectorMul(tmp.c, tmp.c, ts*l->flux*(df+rf)/(rtVectorDistance(onew, l->p)+scene->cfg.distmod));
-      rtVectorAdd(res.c, res.c, tmp.c);
+  if(features & RT_SHADE_FASTMATH) {
+    rtVectorNormFast(rtVectorMake(rnew, hit->p, l->p));
+  } else {
+    rtVectorRay(rnew, hit->p, l->p);
+  }
+  if(rtFindShadow(scene, udd, hit, l, lindex, &ts)) {
+    return;
+  }
+  n_dot_lo = rtVectorDotp(hit->n, rnew);
+
+  // diffusion factor
+  df = s->kd * n_dot_lo;
+  if((features & RT_SURFACE_TRANSPARENT) && df < 0.0f) {
+    df = -df;
+  }
+
+  // reflection factor
+  if(features & RT_SURFACE_SPECULAR) {
+    if(features & RT_SHADE_FASTMATH) {
+      rtVectorSub(tmpv, rtVectorMul(tmpv, hit->n, 2.0f*n_dot_lo), rnew);
+      rf = s->ks * rtFastPow(rtVectorDotp(hit->r, rtVectorNormFast(tmpv)), s->g);
+    } else {
+      rf = s->ks * pow(rtVectorDotp(hit->r, rtVectorRayReflected2(tmpv, hit->n, rnew, n_dot_lo)), s->g);
+    }
+    if((features & RT_SURFACE_TRANSPARENT) && rf < 0.0f) {
+      rf = -rf;
     }
   }
+  
+  // calculate color
+  rtVectorAdd(tmp.c, l->color.c, hit->nc.c);
+  rtVectorMul(tmp.c, tmp.c, ts*l->flux*(df+rf)/(rtVectorDistance(hit->p, l->p)+scene->cfg.distmod));
+  rtVectorAdd(out->c, out->c, tmp.c);
+}
 
-  /* Process planar lights. */
-  for(c=0; c<scene->npl; c++) {
-    int32_t nsamples=16;
-    RT_Color sum={{0.0f, 0.0f, 0.0f, 0.0f}};
 
-    for(d=0; d<nsamples; d++) {  // how many samples to take
-      RT_PlanarLight *pl = &scene->pl[c];
-      RT_Vertex4f ab, ac;
-      float dotp;
+/* Calculates contribution of planar lights to color of `hit` point and adds
+ * it to `out`. Each planar light is approximated by `plsamples` config value
+ * point lights placed randomly on its surface, sharing light's flux. Older
+ * versions added running sum of samples (started with last lit point light)
+ * after each sample, so planar light fluxes tuned for them (f.e. s2 scene)
+ * now give darker images with stronger planar light relative to point
+ * lights. */
+static __FORCE_INLINE void rtShadePlanarLightsKernel(
+    RT_Scene *scene, RT_Udd *udd, RT_GBufferPixel *hit, RT_Color *out,
+    const int32_t features)
+{
+  const int32_t nsamples = scene->cfg.plsamples > 0? scene->cfg.plsamples: 1;
+  int32_t c, d;
+  RT_Vertex4f ab, ac;
+  RT_Light chosen;
 
+  for(c=0; c<scene->npl; c++) {
+    RT_PlanarLight *pl = &scene->pl[c];
+    for(d=0; d<nsamples; d++) {  // how many samples to take
       float eta = rand() / (float)RAND_MAX;
       float psi = rand() / (float)RAND_MAX;
 
-      RT_Light chosen;
       chosen.flux = pl->flux / nsamples;
       rtVectorCopy(pl->color.c, chosen.color.c);
       rtVectorCopy(pl->a, chosen.p);
@@ -260,68 +496,342 @@ static RT_Color rtRayTrace(
       rtVectorAdd(chosen.p, chosen.p, ab);
       rtVectorAdd(chosen.p, chosen.p, ac);
 
-      df = rf = 0.0f;
-      rtVectorRay(rnew, onew, chosen.p);
-      if((dotp=rtVectorDotp(rnew, pl->n)) <= 0) {
-        //break;
-      }
-      
-      //printf("%.3f\n", dotp);
-      if(!rtUddFindShadow(udd, scene, nearest, onew, &chosen, -1, &ts)) {
-        n_dot_lo = rtVectorDotp(norm, rnew);
-        
-        // diffusion factor
-        df = nearest->s->kd * n_dot_lo;
-        if(df < 0.0f && nearest->s->kt > 0.0f) {
-          df = -df;
-        }
+      rtShadeLightKernel(scene, udd, hit, &chosen, -1, out, features);
+    }
+  }
+}
 
-        // reflection factor
-        if(nearest->s->ks > 0.0f) {
-          rf = nearest->s->ks * pow(rtVectorDotp(r, rtVectorRayReflected2(tmpv, norm, rnew, n_dot_lo)), nearest->s->g);
-          if(rf < 0.0f && nearest->s->kt > 0.0f) {
-            rf = -rf;
-          }
-        }
 
-        // calculate color
-        rtVectorAdd(sum.c, chosen.color.c, nc.c);
-        rtVectorMul(sum.c, sum.c, /*pow(dotp, 0.7f)**/ts*chosen.flux*(df+rf)/(rtVectorDistance(onew, chosen.p)+scene->cfg.distmod));
+/* Calculates ambient light and contribution of reflected and refracted rays
+ * to color of `hit` point and adds it to `out`. */
+static __FORCE_INLINE void rtShadeSecondaryKernel(
+    RT_Scene *scene, RT_Udd *udd, RT_GBufferPixel *hit,
+    float total_flux, uint32_t level,
+    RT_Triangle **visible, RT_Color *out, const int32_t features)
+{
+  RT_Surface *s=hit->t->s;
+  RT_Vertex4f rray, tmpv;
+  RT_Color rcolor;
+
+  // ambient color
+  if(features & RT_SURFACE_AMBIENT) {
+    rtVectorMul(rcolor.c, hit->nc.c, s->ka * total_flux);
+    rtVectorAdd(out->c, out->c, rcolor.c);
+  } 
+
+  // rtRayTrace reflected ray
+  if(features & RT_SURFACE_REFLECTIVE) {
+    rtVectorRayReflected(rray, hit->n, rtVectorInverse(tmpv, hit->r));
+    RT_STATS_INC(reflected_rays);
+    rcolor = rtRayTrace(scene, udd, hit->t, hit->p, rray, total_flux, level-1, hit->i, hit->j, hit->k, 0.0f, visible, NULL);
+    rtVectorAdd(out->c, out->c, rtVectorMul(rcolor.c, rcolor.c, s->kr));
+  }
+
+  // rtRayTrace refracted ray
+  if(features & RT_SURFACE_TRANSPARENT) {
+    rtVectorRayRefracted(rray, hit->n, rtVectorInverse(tmpv, hit->r), s->eta);
+    RT_STATS_INC(refracted_rays);
+    rcolor = rtRayTrace(scene, udd, hit->t, hit->p, rray, total_flux, level-1, hit->i, hit->j, hit->k, 0.0f, visible, NULL);
+    rtVectorAdd(out->c, out->c, rtVectorMul(rcolor.c, rcolor.c, s->kt));
+  }
+}
+
+
+/* Calculates contribution of all point lights of scene to color of `hit`
+ * point and adds it to `out` (same as rtShadeLightKernel() called for each
+ * light). Unshadowed contributions of all lights are calculated first, in
+ * loop over positions kept in SoA layout (four lights at a time with SSE). Shadow
+ * rays are then traced only for lights that contribute, in order of
+ * decreasing contribution when `lightcutoff` config is set: once untested
+ * lights add up to less than that fraction of total, they are assumed to be
+ * shadowed like tested ones (on average, weighted by contribution). */
+static __FORCE_INLINE void rtShadePointLightsKernel(
+    RT_Scene *scene, RT_Udd *udd, RT_GBufferPixel *hit, RT_Color *out,
+    const int32_t features)
+{
+  RT_LightBuffer *b=&rtLightBuffer;
+  RT_Surface *s=hit->t->s;
+  RT_Light *l;
+  RT_Color tmp;
+  const int32_t nl=scene->nl;
+  const float px=hit->p[0], py=hit->p[1], pz=hit->p[2];
+  const float nx=hit->n[0], ny=hit->n[1], nz=hit->n[2];
+  const float rx=hit->r[0], ry=hit->r[1], rz=hit->r[2];
+  const float rn=rx*nx + ry*ny + rz*nz, kd=s->kd, distmod=scene->cfg.distmod;
+  float total=0.0f, left, seen=0.0f, visible=0.0f, vis, rf;
+  int32_t c, k, nrank=0;
+
+  if(nl == 0)
+    return;
+  if(!rtLightBufferReserve(nl)) {
+    for(c=0; c<nl; c++) {
+      rtShadeLightKernel(scene, udd, hit, &scene->l[c], c, out, features);
+    }
+    return;
+  }
+
+  // gather light positions into SoA layout (padding lights lie aside of
+  // point and have no flux)
+  for(c=0, l=scene->l; c<nl; c++, l++) {
+    b->x[c] = l->p[0];
+    b->y[c] = l->p[1];
+    b->z[c] = l->p[2];
+    b->flux[c] = l->flux;
+  }
+  for(; c & 3; c++) {
+    b->x[c] = px + 1.0f;
+    b->y[c] = py;
+    b->z[c] = pz;
+    b->flux[c] = 0.0f;
+  }
+
+  // unshadowed diffuse factor, specular angle and distance falloff
+#ifdef __SSE__
+  {
+    const __m128 vpx=_mm_set1_ps(px), vpy=_mm_set1_ps(py), vpz=_mm_set1_ps(pz);
+    const __m128 vnx=_mm_set1_ps(nx), vny=_mm_set1_ps(ny), vnz=_mm_set1_ps(nz);
+    const __m128 vrx=_mm_set1_ps(rx), vry=_mm_set1_ps(ry), vrz=_mm_set1_ps(rz);
+    const __m128 vrn2=_mm_set1_ps(2.0f*rn), vkd=_mm_set1_ps(kd), vdm=_mm_set1_ps(distmod);
+    const __m128 vsign=_mm_set1_ps(-0.0f), vzero=_mm_setzero_ps();
+    __m128 vdx, vdy, vdz, vd2, vdist, vinv, vndl, vrl, vdf, vw;
+    for(c=0; c<nl; c+=4) {
+      vdx = _mm_sub_ps(_mm_loadu_ps(b->x + c), vpx);
+      vdy = _mm_sub_ps(_mm_loadu_ps(b->y + c), vpy);
+      vdz = _mm_sub_ps(_mm_loadu_ps(b->z + c), vpz);
+      vd2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vdx, vdx), _mm_mul_ps(vdy, vdy)), _mm_mul_ps(vdz, vdz));
+      vndl = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vnx, vdx), _mm_mul_ps(vny, vdy)), _mm_mul_ps(vnz, vdz));
+      vrl = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vrx, vdx), _mm_mul_ps(vry, vdy)), _mm_mul_ps(vrz, vdz));
+      if(features & RT_SHADE_FASTMATH) {
+        // reciprocal square root estimate refined with Newton-Raphson step
+        vinv = _mm_rsqrt_ps(vd2);
+        vinv = _mm_mul_ps(vinv, _mm_sub_ps(_mm_set1_ps(1.5f),
+            _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.5f), vd2), _mm_mul_ps(vinv, vinv))));
+        vdist = _mm_mul_ps(vd2, vinv);
+        vndl = _mm_mul_ps(vndl, vinv);
+        vrl = _mm_mul_ps(vrl, vinv);
+      } else {
+        vdist = _mm_sqrt_ps(vd2);
+        vndl = _mm_div_ps(vndl, vdist);
+        vrl = _mm_div_ps(vrl, vdist);
       }
-      
-      rtVectorMul(sum.c, sum.c, 1.0f/nsamples);
-      rtVectorAdd(tmp.c, tmp.c, sum.c);
-      rtVectorAdd(res.c, res.c, tmp.c);
+      vdf = _mm_mul_ps(vkd, vndl);
+      if(features & RT_SURFACE_TRANSPARENT)
+        vdf = _mm_andnot_ps(vsign, vdf);
+      _mm_storeu_ps(b->df + c, vdf);
+      _mm_storeu_ps(b->cosr + c, _mm_sub_ps(_mm_mul_ps(vrn2, vndl), vrl));
+      vw = _mm_div_ps(_mm_loadu_ps(b->flux + c), _mm_add_ps(vdist, vdm));
+      if(!(features & RT_SURFACE_TRANSPARENT))
+        vw = _mm_and_ps(vw, _mm_cmpgt_ps(vndl, vzero));  // lights behind opaque surface do not lit it
+      _mm_storeu_ps(b->w + c, vw);
+    }
+  }
+#else
+  for(c=0; c<nl; c++) {
+    float dx = b->x[c] - px, dy = b->y[c] - py, dz = b->z[c] - pz;
+    float d2 = dx*dx + dy*dy + dz*dz, dist, ndl, rl;
+    if(features & RT_SHADE_FASTMATH) {
+      float inv = rtFastRsqrt(d2);
+      dist = d2 * inv;
+      ndl = (nx*dx + ny*dy + nz*dz) * inv;
+      rl = (rx*dx + ry*dy + rz*dz) * inv;
+    } else {
+      dist = sqrtf(d2);
+      ndl = (nx*dx + ny*dy + nz*dz) / dist;
+      rl = (rx*dx + ry*dy + rz*dz) / dist;
     }
+    b->df[c] = (features & RT_SURFACE_TRANSPARENT)? fabsf(kd*ndl): kd*ndl;
+    b->cosr[c] = 2.0f*rn*ndl - rl;
+    // lights behind opaque surface do not lit it
+    b->w[c] = ((features & RT_SURFACE_TRANSPARENT) || ndl > 0.0f)? b->flux[c] / (dist + distmod): 0.0f;
   }
+#endif
 
-  return res;
+  // specular factor and contribution of each light
+  for(c=0, l=scene->l; c<nl; c++, l++) {
+    if(b->w[c] == 0.0f)
+      continue;
+    rf = 0.0f;
+    if(features & RT_SURFACE_SPECULAR) {
+      rf = s->ks * ((features & RT_SHADE_FASTMATH)? rtFastPow(b->cosr[c], s->g): pow(b->cosr[c], s->g));
+      if((features & RT_SURFACE_TRANSPARENT) && rf < 0.0f) {
+        rf = -rf;
+      }
+    }
+    b->w[c] *= b->df[c] + rf;
+    b->rank[nrank].imp = fabsf(b->w[c]) * (l->color.c[0] + l->color.c[1] + l->color.c[2] +
+        hit->nc.c[0] + hit->nc.c[1] + hit->nc.c[2]);
+    b->rank[nrank].c = c;
+    total += b->rank[nrank++].imp;
+  }
+
+  // trace shadow rays, most important lights first
+  left = total;
+  if(scene->cfg.lightcutoff > 0.0f) {
+    qsort(b->rank, nrank, sizeof(RT_LightRank), lbuf_cmp);
+  }
+  for(k=0; k<nrank; k++) {
+    // without cutoff `left` may round below zero while lights remain
+    if(scene->cfg.lightcutoff > 0.0f && left < scene->cfg.lightcutoff * total && seen > 0.0f)
+      break;
+    c = b->rank[k].c;
+    if(rtFindShadow(scene, udd, hit, &scene->l[c], c, &b->ts[c])) {
+      b->ts[c] = 0.0f;
+    }
+    seen += b->rank[k].imp;
+    visible += b->rank[k].imp * b->ts[c];
+    left -= b->rank[k].imp;
+  }
+  vis = seen > 0.0f? visible / seen: 1.0f;
+  for(; k<nrank; k++) {
+    b->ts[b->rank[k].c] = vis;
+  }
+
+  // add contributions in order of lights
+  for(k=0; k<nrank; k++) {
+    c = b->rank[k].c;
+    if(b->ts[c] == 0.0f)
+      continue;
+    l = &scene->l[c];
+    rtVectorAdd(tmp.c, l->color.c, hit->nc.c);
+    rtVectorMul(tmp.c, tmp.c, b->ts[c]*b->w[c]);
+    rtVectorAdd(out->c, out->c, tmp.c);
+  }
 }
 
 
-///////////////////////////////////////////////////////////////
-///////////////////////////////////////////////////////////////
-RT_VisualizedScene* rtVisualizedSceneRaytrace(RT_Scene *scene, RT_Camera *camera) {
-  int32_t i, j, k;
-  int32_t x, y, w=camera->sw, h=camera->sh;
-  float h_inv=1.0f/h, w_inv=1.0f/w;
-  RT_Vertex4f ray;
-  RT_Color color;
+/* Not specialized versions of shading functions (features are taken from
+ * surface of `hit` and scene config), used outside of main tracing path. */
+static void rtShadeLight(
+    RT_Scene *scene, RT_Udd *udd, RT_GBufferPixel *hit, 
+    RT_Light *l, int32_t lindex, RT_Color *out)
+{
+  rtShadeLightKernel(scene, udd, hit, l, lindex, out, hit->t->s->features | (scene->cfg.fastmath? RT_SHADE_FASTMATH: 0));
+}
+static void rtShadePlanarLights(RT_Scene *scene, RT_Udd *udd, RT_GBufferPixel *hit, RT_Color *out) {
+  rtShadePlanarLightsKernel(scene, udd, hit, out, hit->t->s->features | (scene->cfg.fastmath? RT_SHADE_FASTMATH: 0));
+}
+static void rtShadeSecondary(
+    RT_Scene *scene, RT_Udd *udd, RT_GBufferPixel *hit,
+    float total_flux, uint32_t level,
+    RT_Triangle **visible, RT_Color *out)
+{
+  rtShadeSecondaryKernel(scene, udd, hit, total_flux, level, visible, out, hit->t->s->features);
+}
+
+
+/* Shades `hit` point with all lights and secondary rays, adding result to
+ * `out` (see rtRayTrace() for meaning of `planar`). */
+typedef void (*RT_ShadeKernel)(
+    RT_Scene *scene, RT_Udd *udd, RT_GBufferPixel *hit,
+    float total_flux, uint32_t level,
+    RT_Triangle **visible, RT_Color *planar, RT_Color *out);
+
+/* Defines shading kernel specialized for surfaces with `features`. */
+#define RT_SHADE_KERNEL(features) \
+static void rtShadeKernel##features( \
+    RT_Scene *scene, RT_Udd *udd, RT_GBufferPixel *hit, \
+    float total_flux, uint32_t level, \
+    RT_Triangle **visible, RT_Color *planar, RT_Color *out) \
+{ \
+  rtShadeSecondaryKernel(scene, udd, hit, total_flux, level, visible, out, features); \
+  rtShadePointLightsKernel(scene, udd, hit, out, features); \
+  if(planar) { \
+    rtShadePlanarLightsKernel(scene, udd, hit, planar, features); \
+    rtVectorAdd(out->c, out->c, planar->c); \
+  } else { \
+    rtShadePlanarLightsKernel(scene, udd, hit, out, features); \
+  } \
+}
+
+RT_SHADE_KERNEL(0)  RT_SHADE_KERNEL(1)  RT_SHADE_KERNEL(2)  RT_SHADE_KERNEL(3)
+RT_SHADE_KERNEL(4)  RT_SHADE_KERNEL(5)  RT_SHADE_KERNEL(6)  RT_SHADE_KERNEL(7)
+RT_SHADE_KERNEL(8)  RT_SHADE_KERNEL(9)  RT_SHADE_KERNEL(10) RT_SHADE_KERNEL(11)
+RT_SHADE_KERNEL(12) RT_SHADE_KERNEL(13) RT_SHADE_KERNEL(14) RT_SHADE_KERNEL(15)
+RT_SHADE_KERNEL(16) RT_SHADE_KERNEL(17) RT_SHADE_KERNEL(18) RT_SHADE_KERNEL(19)
+RT_SHADE_KERNEL(20) RT_SHADE_KERNEL(21) RT_SHADE_KERNEL(22) RT_SHADE_KERNEL(23)
+RT_SHADE_KERNEL(24) RT_SHADE_KERNEL(25) RT_SHADE_KERNEL(26) RT_SHADE_KERNEL(27)
+RT_SHADE_KERNEL(28) RT_SHADE_KERNEL(29) RT_SHADE_KERNEL(30) RT_SHADE_KERNEL(31)
+
+/* Shading kernels indexed by RT_SURFACE_* flags of surface, combined with
+ * RT_SHADE_FASTMATH in fastmath mode. */
+static const RT_ShadeKernel rtShadeKernels[RT_SHADE_KERNELS] = {
+  rtShadeKernel0,  rtShadeKernel1,  rtShadeKernel2,  rtShadeKernel3,
+  rtShadeKernel4,  rtShadeKernel5,  rtShadeKernel6,  rtShadeKernel7,
+  rtShadeKernel8,  rtShadeKernel9,  rtShadeKernel10, rtShadeKernel11,
+  rtShadeKernel12, rtShadeKernel13, rtShadeKernel14, rtShadeKernel15,
+  rtShadeKernel16, rtShadeKernel17, rtShadeKernel18, rtShadeKernel19,
+  rtShadeKernel20, rtShadeKernel21, rtShadeKernel22, rtShadeKernel23,
+  rtShadeKernel24, rtShadeKernel25, rtShadeKernel26, rtShadeKernel27,
+  rtShadeKernel28, rtShadeKernel29, rtShadeKernel30, rtShadeKernel31
+};
+
+
+/* Implementation of RayTracing algorithm.
+
+:param: scene: pointer to scene object
+:param: udd: pointer to uniform domain division structure 
+:param: current: actual nearest triangle found
+:param: o: ray origin
+:param: r: normalized ray direction
+:param: total_flux: sum of all lights flux, used to calculate ambient light
+:param: level: recurrency level (when reaches 0, function returns immediately)
+:param: dskip: distance ray is known to travel without hitting any triangle
+  (see raster.h; 0 - unknown)
+:param: planar: if not NULL, contribution of planar lights at nearest hit
+  point (also included in result) is stored here */
+static RT_Color rtRayTrace(
+    RT_Scene *scene, RT_Udd *udd,
+    RT_Triangle *current, 
+    float *o, float *r, 
+    float total_flux, uint32_t level,
+    int32_t i, int32_t j, int32_t k, float dskip,
+    RT_Triangle **visible, RT_Color *planar) 
+{
+  RT_Color res={{0.0f, 0.0f, 0.0f, 0.0f}};
+  RT_GBufferPixel hit;
+
+  /* Terminate if we reached limit of recurrency level. */
+  if(level == 0) {
+    return res;
+  }
   
-  /* Create result object that will hold processed scene in unnormalized
-   * format. */
+  if(!rtRayHit(scene, udd, current, o, r, i, j, k, dskip, &hit)) {
+    return res;
+  }
+  if(!*visible) {
+    *visible = hit.t;
+  }
+
+  /* Ambient light, reflected and refracted rays, point and planar lights
+   * (with kernel bound to surface by rtSceneSetSurfaces()). */
+  rtShadeKernels[hit.t->s->features | (scene->cfg.fastmath? RT_SHADE_FASTMATH: 0)](scene, udd, &hit, total_flux, level, visible, planar, &res);
+
+  return res;
+}
+
+
+/* Creates empty RT_VisualizedScene object of given size. */
+static RT_VisualizedScene* rtVisualizedSceneCreate(RT_Scene *scene, int32_t w, int32_t h, float total_flux) {
+  int32_t k;
   RT_VisualizedScene *res = malloc(sizeof(RT_VisualizedScene));
   if(res) {
     res->width = w;
     res->height = h;
+    res->total_flux = total_flux;
+    res->cost = NULL;
+    res->soft = NULL;
     for(k=0; k<4; k++) {
       res->min.c[k] = FLT_MAX;
       res->max.c[k] = FLT_MIN;
     }
 
-    // allocate memory for raytraced raw color buffer
-    res->map = malloc(camera->sw*camera->sh*sizeof(RT_VisualizedScenePixel));
-    if(!res->map) {
+    // allocate memory for raytraced raw color and visible triangle planes
+    res->r = malloc(w*h*(3*sizeof(float) + sizeof(int32_t)));
+    if(res->r) {
+      res->g = res->r + w*h;
+      res->b = res->g + w*h;
+      res->tid = (int32_t*)(res->b + w*h);
+    } else {
       rtVisualizedSceneDestroy(&res);
       errno = E_MEMORY;
       return NULL;
@@ -335,10 +845,40 @@ RT_VisualizedScene* rtVisualizedSceneRaytrace(RT_Scene *scene, RT_Camera *camera
   } else {
     res->gamma = 2.5f;
   }
+  return res;
+}
+
+
+/* Returns 1 if given point lights are equal or 0 otherwise. */
+static int rtLightEquals(RT_Light *a, RT_Light *b) {
+  int32_t k;
+  for(k=0; k<3; k++) {
+    if(a->p[k] != b->p[k] || a->color.c[k] != b->color.c[k])
+      return 0;
+  }
+  return a->flux == b->flux;
+}
+
+
+///////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////
+RT_RenderContext* rtRenderContextCreate(RT_Scene *scene) {
+  int32_t i, k;
+  double start;
+
+  RT_RenderContext *res = malloc(sizeof(RT_RenderContext));
+  if(!res) {
+    errno = E_MEMORY;
+    return NULL;
+  }
+  res->scene = scene;
+  res->udd = NULL;
 
   /* At this point constant triangle coefficients are
    * calculated and correct ray->triangle intersection function is assigned. */
-  rtScenePreprocess(scene, camera);
+  start = rtStatsClock();
+  RT_STATS_START(PREPROCESS);
+  rtScenePreprocess(scene);
 
   /* Calculate light total flux (used to determine ambient light amount). Also
    * increase domain minimal and maximal size if light position is beyond
@@ -353,44 +893,319 @@ RT_VisualizedScene* rtVisualizedSceneRaytrace(RT_Scene *scene, RT_Camera *camera
         scene->dmax[i] = scene->l[k].p[i] + 0.001f;
     }
   }
+  RT_STATS_STOP(PREPROCESS);
+  res->preprocess_time = rtStatsClock() - start;
 
   /* At this step scene is divided into voxels and each triangle in scene is
    * assigned to all voxels it belongs to. */
-  RT_Udd *udd = rtUddCreate(scene);
-  if(!udd) {
-    rtVisualizedSceneDestroy(&res);
+  start = rtStatsClock();
+  RT_STATS_START(VOXELIZE);
+  res->udd = rtUddCreate(scene);
+  if(!res->udd) {
+    rtRenderContextDestroy(&res);
     return NULL;
   }
   
   RT_IINFO("starting voxelization...");
-  rtUddVoxelize(udd, scene);
+  rtUddVoxelize(res->udd, scene);
+  RT_STATS_STOP(VOXELIZE);
+  res->voxelize_time = rtStatsClock() - start;
   RT_IINFO("...voxelization finished");
-  
-  /* Generate primary rays and execute rtRayTrace procedure for each of
-   * generated primary rays. */
-  for(y=0; y<h; y++) {
-    for(x=0; x<w; x++) {
-      // calculate primary ray direction vector
-      rtVectorPrimaryRay(
-          ray,
-          camera->ul, camera->ur, camera->bl, camera->ob,
-          x, y, w_inv, h_inv
-      );
-      
-      // calculate startup/entry voxel for primary ray
-      if(!rtUddFindStartupVoxel(udd, scene, camera->ob, ray, &i, &j, &k))
+
+  return res;
+}
+///////////////////////////////////////////////////////////////
+void rtRenderContextDestroy(RT_RenderContext **self) {
+  RT_RenderContext *ptr=*self;
+  if(ptr) {
+    if(ptr->udd) rtUddDestroy(&ptr->udd);
+    free(ptr);
+    *self = NULL;
+  }
+}
+///////////////////////////////////////////////////////////////
+/* Returns depth buffer of primary visibility of `scene` seen from `camera`
+ * if `raster` config is set or NULL otherwise (also when it can not be
+ * created - primary rays are then traced in full). */
+static RT_Raster* rtRenderRaster(RT_Scene *scene, RT_Camera *camera) {
+  RT_Raster *res;
+  if(scene->cfg.raster == 0)
+    return NULL;
+  res = rtRasterCreate(scene, camera, scene->cfg.raster);
+  if(!res) {
+    RT_WWARN("not enough memory for rasterization, primary rays are traced in full")
+  }
+  return res;
+}
+///////////////////////////////////////////////////////////////
+/* Returns context rendering with shadow maps of point lights if `epsilon`
+ * config is set: copy of `ctx` stored in `local`, with copy of its scene
+ * (holding the maps) stored in `scene`. Otherwise (also when maps can not
+ * be created - shadow rays are then traced in full) returns `ctx`. Maps are
+ * released by rtRenderShadowsDestroy(). */
+static RT_RenderContext* rtRenderShadows(RT_RenderContext *ctx, RT_RenderContext *local, RT_Scene *scene) {
+  if(ctx->scene->cfg.epsilon <= 0.0f || ctx->scene->nl == 0 || ctx->scene->shadows)
+    return ctx;
+  *scene = *ctx->scene;
+  scene->shadows = rtShadowMapCreate(scene, 0);
+  if(!scene->shadows) {
+    RT_WWARN("not enough memory for shadow maps, shadow rays are traced in full")
+    return ctx;
+  }
+  *local = *ctx;
+  local->scene = scene;
+  return local;
+}
+/* Releases shadow maps of context returned by rtRenderShadows(). */
+static void rtRenderShadowsDestroy(RT_RenderContext *ctx, RT_RenderContext *local) {
+  if(ctx == local)
+    rtShadowMapDestroy(&local->scene->shadows);
+}
+///////////////////////////////////////////////////////////////
+/* Traces primary ray passing through screen point (`x`, `y`) of `camera` and
+ * returns color of that point. Triangle visible at that point (or NULL if ray
+ * does not enter scene domain) is stored in `visible`. If `planar` is given,
+ * contribution of planar lights at visible point is stored there. `dskip` is
+ * distance the ray is known to travel without hitting any triangle (taken
+ * from RT_Raster; 0 - unknown, FLT_MAX - ray hits nothing). */
+static RT_Color rtTracePixel(
+    RT_RenderContext *ctx, RT_Camera *camera,
+    float x, float y, float w_inv, float h_inv, float total_flux, float dskip,
+    RT_Triangle **visible, RT_Color *planar)
+{
+  int32_t i, j, k;
+  RT_Vertex4f ray;
+  RT_Color black={{0.0f, 0.0f, 0.0f, 0.0f}};
+
+  // calculate primary ray direction vector
+  RT_STATS_INC(primary_rays);
+  rtPixelSpread = rtCameraPixelSpread(camera, w_inv);
+  rtVectorPrimaryRay(
+      ray,
+      camera->ul, camera->ur, camera->bl, camera->ob,
+      x, y, w_inv, h_inv
+  );
+  
+  // calculate startup/entry voxel for primary ray (pixel stays black if
+  // ray does not enter domain)
+  *visible = NULL;
+  if(planar)
+    *planar = black;
+  if(dskip == FLT_MAX || !rtUddFindStartupVoxel(ctx->udd, ctx->scene, camera->ob, ray, &i, &j, &k)) {
+    return black;
+  }
+
+  // trace current ray and calculate color of current pixel.
+  return rtRayTrace(
+    ctx->scene, ctx->udd, NULL,
+    camera->ob, ray, total_flux, 5,
+    i, j, k, dskip,
+    visible, planar
+  );
+}
+/* Returns 1 if triangles `a` and `b` (any of them may be NULL) are parts of
+ * the same flat surface, so edge between them is not visible. */
+static inline int rtTrianglesCoplanar(RT_Triangle *a, RT_Triangle *b) {
+  float cosa;
+  if(a == b)
+    return 1;
+  if(!a || !b || a->s != b->s || a->texture != b->texture)
+    return 0;
+  cosa = rtVectorDotp(a->n, b->n);
+  if(cosa > 0.9999f)
+    return fabsf(a->d - b->d) < 0.0001f;
+  if(cosa < -0.9999f)
+    return fabsf(a->d + b->d) < 0.0001f;
+  return 0;
+}
+///////////////////////////////////////////////////////////////
+/* Returns index of triangle `t` in triangle array of `scene` or -1 if `t` is
+ * NULL. */
+static inline int32_t rtTriangleIndex(const RT_Scene *scene, const RT_Triangle *t) {
+  return t? (int32_t)(t - scene->t): -1;
+}
+///////////////////////////////////////////////////////////////
+/* Returns 1 if pixels `a` and `b` (indices in image `s` rendered for `scene`)
+ * differ enough to be supersampled (geometry edge between visible triangles
+ * or relative difference of any color component greater than `threshold`)
+ * or 0 otherwise. */
+static inline int rtPixelsDiffer(const RT_VisualizedScene *s, RT_Scene *scene, int32_t a, int32_t b, float threshold) {
+  const float *plane[3] = {s->r, s->g, s->b};
+  int32_t k;
+  if(s->tid[a] != s->tid[b] && !rtTrianglesCoplanar(
+        s->tid[a] < 0? NULL: &scene->t[s->tid[a]],
+        s->tid[b] < 0? NULL: &scene->t[s->tid[b]]))
+    return 1;
+  for(k=0; k<3; k++) {
+    float ca=plane[k][a], cb=plane[k][b];
+    if(fabsf(ca - cb) > threshold*0.5f*(fabsf(ca) + fabsf(cb)) + FLT_MIN)
+      return 1;
+  }
+  return 0;
+}
+///////////////////////////////////////////////////////////////
+/* Adaptive supersampling anti-aliasing of image `res` rendered with one ray
+ * per pixel. Pixels that differ from any of their neighbours are traced
+ * again with regular grid of `n`x`n` rays centered on pixel's own ray (where
+ * `n`*`n` is the greatest square not exceeding `aasamples` config value;
+ * existing ray is reused as center of grid when `n` is odd) and their color (and planar lights contribution, if image
+ * keeps it) is set to average of all rays. When `progress` is given, results
+ * are stored holding its lock and rendering stops when it is cancelled. */
+static void rtVisualizedSceneAntialias(RT_RenderContext *ctx, RT_Camera *camera, RT_VisualizedScene *res, RT_Progress *progress) {
+  int32_t a, b, c, k, x, y, w=res->width, h=res->height, nrefined=0, cancel=0;
+  int32_t n = (int32_t)sqrtf((float)ctx->scene->cfg.aasamples);
+  float h_inv=1.0f/h, w_inv=1.0f/w, n_inv, threshold=ctx->scene->cfg.aathreshold;
+  RT_Triangle *visible;
+  RT_Color color, planar, *row, *srow=NULL;
+  unsigned char *mask;
+  uint64_t cost=0;
+
+  if(n <= 1)
+    return;
+  n_inv = 1.0f / n;
+  c = (n-1) / 2;  // grid ray at offset 0 (only when `n` is odd)
+
+  mask = malloc(w*h);
+  row = malloc(w*sizeof(RT_Color));
+  if(res->soft)
+    srow = malloc(w*sizeof(RT_Color));
+  if(!mask || !row || (res->soft && !srow)) {
+    if(mask) free(mask);
+    if(row) free(row);
+    if(srow) free(srow);
+    RT_WWARN("not enough memory for anti-aliasing, image left unchanged")
+    return;
+  }
+
+  // find edges by comparing each pixel with its right and bottom neighbours
+  memset(mask, 0, w*h);
+  for(y=0; y<h; y++) {
+    for(x=0; x<w; x++) {
+      if(x+1 < w && rtPixelsDiffer(res, ctx->scene, y*w+x, y*w+x+1, threshold)) {
+        mask[y*w+x] = mask[y*w+x+1] = 1;
+      }
+      if(y+1 < h && rtPixelsDiffer(res, ctx->scene, y*w+x, (y+1)*w+x, threshold)) {
+        mask[y*w+x] = mask[(y+1)*w+x] = 1;
+      }
+    }
+  }
+
+  // supersample marked pixels
+  for(y=0; y<h && !cancel; y++) {
+    for(x=0; x<w; x++) {
+      if(!mask[y*w+x])
         continue;
+      if(res->cost)
+        cost = rtStatsCost(ctx->scene->cfg.costmetric);
+      memset(&row[x], 0, sizeof(RT_Color));
+      if(srow)
+        memset(&srow[x], 0, sizeof(RT_Color));
+      if(n & 1) {
+        rtVisualizedSceneGetPixel(res, x, y, &row[x]);
+        if(srow) {
+          srow[x].c[0] = res->soft[y*w+x];
+          srow[x].c[1] = res->soft[w*h+y*w+x];
+          srow[x].c[2] = res->soft[2*w*h+y*w+x];
+        }
+      }
+      for(b=0; b<n; b++) {
+        for(a=0; a<n; a++) {
+          if((n & 1) && a == c && b == c)
+            continue;  // pixel's own ray
+          color = rtTracePixel(ctx, camera, x+(a+0.5f)*n_inv-0.5f, y+(b+0.5f)*n_inv-0.5f, w_inv, h_inv, res->total_flux, 0.0f, &visible, srow? &planar: NULL);
+          rtVectorAdd(row[x].c, row[x].c, color.c);
+          if(srow)
+            rtVectorAdd(srow[x].c, srow[x].c, planar.c);
+        }
+      }
+      rtVectorMul(row[x].c, row[x].c, n_inv*n_inv);
+      if(srow)
+        rtVectorMul(srow[x].c, srow[x].c, n_inv*n_inv);
+      if(res->cost)
+        res->cost[y*w+x] += (float)(rtStatsCost(ctx->scene->cfg.costmetric) - cost);
+      nrefined++;
+    }
+
+    if(progress)
+      pthread_mutex_lock(&progress->lock);
+    for(x=0; x<w; x++) {
+      if(!mask[y*w+x])
+        continue;
+      for(k=0; k<3; k++) {
+        if(row[x].c[k] > res->max.c[k]) res->max.c[k]=row[x].c[k];
+        if(row[x].c[k] < res->min.c[k]) res->min.c[k]=row[x].c[k];
+      }
+      rtVisualizedSceneSetPixel(res, x, y, &row[x], res->tid[y*w+x]);
+      if(srow) {
+        res->soft[y*w+x] = srow[x].c[0];
+        res->soft[w*h+y*w+x] = srow[x].c[1];
+        res->soft[2*w*h+y*w+x] = srow[x].c[2];
+      }
+    }
+    if(progress) {
+      cancel = progress->cancel;
+      pthread_mutex_unlock(&progress->lock);
+    }
+  }
+
+  RT_INFO("anti-aliasing: %d of %d pixels supersampled with %d rays", nrefined, w*h, n*n)
+  free(row);
+  free(mask);
+  if(srow) free(srow);
+}
+///////////////////////////////////////////////////////////////
+RT_VisualizedScene* rtVisualizedSceneRender(RT_RenderContext *ctx, RT_Camera *camera) {
+  int32_t k;
+  int32_t x, y, w=camera->sw, h=camera->sh;
+  float h_inv=1.0f/h, w_inv=1.0f/w;
+  RT_Color color, planar;
+  RT_Scene *scene=ctx->scene, shadowed;
+  RT_RenderContext local;
+  RT_Raster *raster;
+  uint64_t cost=0;
+  
+  /* Create result object that will hold processed scene in unnormalized
+   * format. */
+  RT_VisualizedScene *res = rtVisualizedSceneCreate(scene, w, h, ctx->total_flux);
+  if(!res) {
+    return NULL;
+  }
+  if(scene->cfg.costmetric != RT_COST_NONE) {
+    res->cost = malloc(w*h*sizeof(float));
+    if(!res->cost) {
+      rtVisualizedSceneDestroy(&res);
+      errno = E_MEMORY;
+      return NULL;
+    }
+  }
+  if(scene->cfg.denoise > 0 && scene->npl > 0) {
+    res->soft = malloc(3*w*h*sizeof(float));
+    if(!res->soft) {
+      rtVisualizedSceneDestroy(&res);
+      errno = E_MEMORY;
+      return NULL;
+    }
+  }
+  
+  raster = rtRenderRaster(scene, camera);
+  ctx = rtRenderShadows(ctx, &local, &shadowed);
+  scene = ctx->scene;
 
-      // trace current ray and calculate color of current pixel.
+  /* Generate primary rays and execute rtRayTrace procedure for each of
+   * generated primary rays. */
+  for(y=0; y<h; y++) {
+    for(x=0; x<w; x++) {
       RT_Triangle *visible = NULL;  // holds triangle intersected by primary ray
-      color = rtRayTrace(
-        scene, udd,
-        scene->t, (RT_Triangle*)(scene->t+scene->nt), NULL,
-        scene->l, (RT_Light*)(scene->l+scene->nl),
-        camera->ob, ray, res->total_flux, 5,
-        i, j, k,
-        &visible
-      );
+      if(res->cost)
+        cost = rtStatsCost(scene->cfg.costmetric);
+      color = rtTracePixel(ctx, camera, x, y, w_inv, h_inv, res->total_flux, raster? raster->depth[y*w+x]: 0.0f, &visible, res->soft? &planar: NULL);
+      if(res->cost)
+        res->cost[y*w+x] = (float)(rtStatsCost(scene->cfg.costmetric) - cost);
+      if(res->soft) {
+        res->soft[y*w+x] = planar.c[0];
+        res->soft[w*h+y*w+x] = planar.c[1];
+        res->soft[2*w*h+y*w+x] = planar.c[2];
+      }
       
       // update minimal and maximal color
       for(k=0; k<3; k++) {
@@ -399,15 +1214,563 @@ RT_VisualizedScene* rtVisualizedSceneRaytrace(RT_Scene *scene, RT_Camera *camera
       }
 
       // save pixel color (not normalized)
-      rtVisualizedSceneSetPixel(res, x, y, &color, visible);
+      rtVisualizedSceneSetPixel(res, x, y, &color, rtTriangleIndex(scene, visible));
     }
   }
+  rtRasterDestroy(&raster);
   
+  rtVisualizedSceneAntialias(ctx, camera, res, NULL);
+  rtRenderShadowsDestroy(ctx, &local);
+
   RT_INFO("minimal color (not normalized): R=%.3f, G=%.3f, B=%.3f", res->min.c[0], res->min.c[1], res->min.c[2]);
   RT_INFO("maximal color (not normalized): R=%.3f, G=%.3f, B=%.3f", res->max.c[0], res->max.c[1], res->max.c[2]);
 
+  return res;
+}
+///////////////////////////////////////////////////////////////
+/* Filters single band of planar lights contribution (executed by thread pool
+ * workers). Each output value is weighted average of 5x5 taps placed
+ * `step` pixels apart, skipping taps that show different surface than
+ * center pixel. */
+static void rtDenoiseBand(void *arg) {
+  static const float kernel[5] = {1.0f/16, 1.0f/4, 3.0f/8, 1.0f/4, 1.0f/16};
+  RT_DenoiseBand *band = (RT_DenoiseBand*)arg;
+  RT_VisualizedScene *s = band->s;
+  RT_Triangle *t=band->scene->t;
+  int32_t w=s->width, h=s->height, n=w*h, step=band->step;
+  int32_t a, b, x, y, xx, yy, i, j, tid, other;
+  const float *src=band->src;
+  float *dst=band->dst, sum[3], wsum, wt;
+
+  for(y=band->y0; y<band->y1; y++) {
+    for(x=0; x<w; x++) {
+      i = y*w + x;
+      tid = s->tid[i];
+      if(tid < 0) {
+        dst[i] = src[i];
+        dst[n+i] = src[n+i];
+        dst[2*n+i] = src[2*n+i];
+        continue;
+      }
+      sum[0] = sum[1] = sum[2] = wsum = 0.0f;
+      for(b=0; b<5; b++) {
+        yy = y + (b-2)*step;
+        if(yy < 0 || yy >= h)
+          continue;
+        for(a=0; a<5; a++) {
+          xx = x + (a-2)*step;
+          if(xx < 0 || xx >= w)
+            continue;
+          j = yy*w + xx;
+          other = s->tid[j];
+          if(other != tid && (other < 0 || !rtTrianglesCoplanar(&t[tid], &t[other])))
+            continue;
+          wt = kernel[a]*kernel[b];
+          sum[0] += wt*src[j];
+          sum[1] += wt*src[n+j];
+          sum[2] += wt*src[2*n+j];
+          wsum += wt;
+        }
+      }
+      wsum = 1.0f / wsum;  // center tap is always included
+      dst[i] = sum[0]*wsum;
+      dst[n+i] = sum[1]*wsum;
+      dst[2*n+i] = sum[2]*wsum;
+    }
+  }
+}
+///////////////////////////////////////////////////////////////
+void rtVisualizedSceneDenoise(RT_VisualizedScene *s, RT_Scene *scene, int32_t nthreads) {
+  int32_t i, k, pass, nbands, n=s->width*s->height;
+  float *planes[3] = {s->r, s->g, s->b};
+  float *tmp, *src, *dst;
+  RT_DenoiseBand *bands;
+  RT_ThreadPool *pool=NULL;
+
+  if(!s->soft || scene->cfg.denoise <= 0)
+    return;
+  tmp = malloc(3*n*sizeof(float));
+  if(nthreads <= 0)
+    nthreads = rtThreadPoolDefaultSize();
+  nbands = nthreads < s->height? nthreads: s->height;
+  bands = malloc(nbands*sizeof(RT_DenoiseBand));
+  if(!tmp || !bands) {
+    if(tmp) free(tmp);
+    if(bands) free(bands);
+    RT_WWARN("not enough memory for denoising, image left unchanged")
+    return;
+  }
+
+  // leave only contribution of other lights in image
+  for(k=0; k<3; k++) {
+    for(i=0; i<n; i++) {
+      planes[k][i] -= s->soft[k*n+i];
+    }
+  }
+
+  if(nbands > 1)
+    pool = rtThreadPoolCreate(nbands);
+  for(pass=0, src=s->soft, dst=tmp; pass<scene->cfg.denoise; pass++) {
+    for(k=0; k<nbands; k++) {
+      bands[k].s = s;
+      bands[k].scene = scene;
+      bands[k].src = src;
+      bands[k].dst = dst;
+      bands[k].step = 1 << pass;
+      bands[k].y0 = k*s->height/nbands;
+      bands[k].y1 = (k+1)*s->height/nbands;
+      if(!pool || !rtThreadPoolSubmit(pool, rtDenoiseBand, &bands[k]))
+        rtDenoiseBand(&bands[k]);  // no threads - filter band in current thread
+    }
+    if(pool)
+      rtThreadPoolWait(pool);  // next pass reads results of whole image
+    dst = src;
+    src = (dst == tmp)? s->soft: tmp;
+  }
+  if(pool)
+    rtThreadPoolDestroy(&pool);
+  if(src != s->soft)
+    memcpy(s->soft, src, 3*n*sizeof(float));
+
+  // add filtered contribution back and find new color range
+  for(k=0; k<3; k++) {
+    s->min.c[k] = FLT_MAX;
+    s->max.c[k] = FLT_MIN;
+    for(i=0; i<n; i++) {
+      planes[k][i] += s->soft[k*n+i];
+      if(planes[k][i] > s->max.c[k]) s->max.c[k]=planes[k][i];
+      if(planes[k][i] < s->min.c[k]) s->min.c[k]=planes[k][i];
+    }
+  }
+  RT_INFO("denoising: %d passes, planar lights contribution filtered up to %d pixels away", scene->cfg.denoise, 2*((1 << scene->cfg.denoise)-1))
+
+  free(bands);
+  free(tmp);
+}
+///////////////////////////////////////////////////////////////
+RT_Progress* rtProgressCreate() {
+  RT_Progress *res = malloc(sizeof(RT_Progress));
+  if(!res) {
+    errno = E_MEMORY;
+    return NULL;
+  }
+  memset(res, 0, sizeof(RT_Progress));
+  pthread_mutex_init(&res->lock, NULL);
+  return res;
+}
+///////////////////////////////////////////////////////////////
+void rtProgressDestroy(RT_Progress **self) {
+  RT_Progress *ptr=*self;
+  if(ptr) {
+    pthread_mutex_destroy(&ptr->lock);
+    free(ptr);
+    *self = NULL;
+  }
+}
+///////////////////////////////////////////////////////////////
+void rtProgressCancel(RT_Progress *self) {
+  pthread_mutex_lock(&self->lock);
+  self->cancel = 1;
+  pthread_mutex_unlock(&self->lock);
+}
+///////////////////////////////////////////////////////////////
+RT_Bitmap* rtProgressSnapshot(RT_Progress *self, int flags, void *param1) {
+  RT_Bitmap *res = NULL;
+  pthread_mutex_lock(&self->lock);
+  if(self->image && self->step > 0) {
+    res = rtVisualizedSceneToBitmap(self->image, flags, param1);
+  }
+  pthread_mutex_unlock(&self->lock);
+  return res;
+}
+///////////////////////////////////////////////////////////////
+RT_VisualizedScene* rtVisualizedSceneRenderProgressive(RT_RenderContext *ctx, RT_Camera *camera, RT_Progress *progress) {
+  int32_t k, step, cancel=0;
+  int32_t x, y, bx, by, w=camera->sw, h=camera->sh;
+  float h_inv=1.0f/h, w_inv=1.0f/w;
+  RT_Color *row;
+  RT_Triangle **visible;
+  RT_RenderContext local;
+  RT_Scene shadowed;
+
+  RT_VisualizedScene *res = rtVisualizedSceneCreate(ctx->scene, w, h, ctx->total_flux);
+  if(!res) {
+    return NULL;
+  }
+  row = malloc(w*sizeof(RT_Color));
+  visible = malloc(w*sizeof(RT_Triangle*));
+  if(!row || !visible) {
+    if(row) free(row);
+    if(visible) free(visible);
+    rtVisualizedSceneDestroy(&res);
+    errno = E_MEMORY;
+    return NULL;
+  }
+  ctx = rtRenderShadows(ctx, &local, &shadowed);
+
+  pthread_mutex_lock(&progress->lock);
+  progress->image = res;
+  progress->step = 0;
+  pthread_mutex_unlock(&progress->lock);
+
+  /* Each pass traces pixels lying on grid of `step` pixels, skipping ones
+   * traced by previous (twice as coarse) pass, and fills `step`x`step` block
+   * of each traced pixel with its color, so image is complete (but coarse)
+   * after first pass. Last pass traces remaining pixels at full resolution,
+   * so final image is the same as the one made by rtVisualizedSceneRender().
+   * Rows are traced without holding the lock, which is only taken to store
+   * results. */
+  for(step=RT_PROGRESSIVE_STEP; step>0 && !cancel; step>>=1) {
+    for(y=0; y<h && !cancel; y+=step) {
+      int32_t coarse_row = step < RT_PROGRESSIVE_STEP && y%(2*step) == 0;
+      for(x=0; x<w; x+=step) {
+        if(coarse_row && x%(2*step) == 0)
+          continue;
+        row[x] = rtTracePixel(ctx, camera, x, y, w_inv, h_inv, res->total_flux, 0.0f, &visible[x], NULL);
+      }
+
+      pthread_mutex_lock(&progress->lock);
+      for(x=0; x<w; x+=step) {
+        if(coarse_row && x%(2*step) == 0)
+          continue;
+        for(k=0; k<3; k++) {
+          if(row[x].c[k] > res->max.c[k]) res->max.c[k]=row[x].c[k];
+          if(row[x].c[k] < res->min.c[k]) res->min.c[k]=row[x].c[k];
+        }
+        for(by=y; by<y+step && by<h; by++) {
+          for(bx=x; bx<x+step && bx<w; bx++) {
+            rtVisualizedSceneSetPixel(res, bx, by, &row[x], rtTriangleIndex(ctx->scene, visible[x]));
+          }
+        }
+      }
+      if(y+step >= h) {
+        progress->step = step;  // pass finished
+      }
+      cancel = progress->cancel;
+      pthread_mutex_unlock(&progress->lock);
+    }
+  }
+
+  if(!cancel) {
+    rtVisualizedSceneAntialias(ctx, camera, res, progress);
+  }
+
+  pthread_mutex_lock(&progress->lock);
+  progress->image = NULL;
+  pthread_mutex_unlock(&progress->lock);
+  rtRenderShadowsDestroy(ctx, &local);
+  free(visible);
+  free(row);
+
+  if(cancel) {
+    RT_INFO("rendering cancelled, finest finished pass: 1/%d resolution", progress->step)
+  }
+  RT_INFO("minimal color (not normalized): R=%.3f, G=%.3f, B=%.3f", res->min.c[0], res->min.c[1], res->min.c[2]);
+  RT_INFO("maximal color (not normalized): R=%.3f, G=%.3f, B=%.3f", res->max.c[0], res->max.c[1], res->max.c[2]);
+
+  return res;
+}
+///////////////////////////////////////////////////////////////
+RT_GBuffer* rtGBufferCreate(RT_RenderContext *ctx, RT_Camera *camera) {
+  int32_t i, j, k, c;
+  int32_t x, y, w=camera->sw, h=camera->sh;
+  float h_inv=1.0f/h, w_inv=1.0f/w;
+  RT_Vertex4f ray;
+  RT_Scene *scene=ctx->scene;
+  RT_Udd *udd=ctx->udd;
+  RT_GBufferPixel *hit;
+  RT_Raster *raster;
+  float dskip=0.0f;
+
+  RT_GBuffer *res = malloc(sizeof(RT_GBuffer));
+  if(!res) {
+    errno = E_MEMORY;
+    return NULL;
+  }
+  res->width = w;
+  res->height = h;
+  res->cfg = scene->cfg;
+  res->nl = scene->nl;
+  res->l = malloc((scene->nl+1)*sizeof(RT_Light));
+  res->map = malloc(w*h*sizeof(RT_GBufferPixel));
+  if(!res->l || !res->map) {
+    rtGBufferDestroy(&res);
+    errno = E_MEMORY;
+    return NULL;
+  }
+  memcpy(res->l, scene->l, scene->nl*sizeof(RT_Light));
+  memset(res->map, 0, w*h*sizeof(RT_GBufferPixel));
+
+  /* Trace primary rays and shade their intersection points with all lights,
+   * keeping point and planar lights contributions separately. */
+  raster = rtRenderRaster(scene, camera);
+  rtPixelSpread = rtCameraPixelSpread(camera, w_inv);
+  for(y=0, hit=res->map; y<h; y++) {
+    for(x=0; x<w; x++, hit++) {
+      rtVectorPrimaryRay(
+          ray,
+          camera->ul, camera->ur, camera->bl, camera->ob,
+          x, y, w_inv, h_inv
+      );
+      RT_STATS_INC(primary_rays);
+      if(raster)
+        dskip = raster->depth[y*w+x];
+      if(dskip == FLT_MAX || !rtUddFindStartupVoxel(udd, scene, camera->ob, ray, &i, &j, &k))
+        continue;
+      if(!rtRayHit(scene, udd, NULL, camera->ob, ray, i, j, k, dskip, hit)) {
+        hit->t = NULL;
+        continue;
+      }
+      for(c=0; c<scene->nl; c++) {
+        rtShadeLight(scene, udd, hit, &scene->l[c], c, &hit->direct);
+      }
+      rtShadePlanarLights(scene, udd, hit, &hit->fixed);
+    }
+  }
+  rtRasterDestroy(&raster);
+
+  return res;
+}
+///////////////////////////////////////////////////////////////
+void rtGBufferDestroy(RT_GBuffer **self) {
+  RT_GBuffer *ptr=*self;
+  if(ptr) {
+    if(ptr->l) free(ptr->l);
+    if(ptr->map) free(ptr->map);
+    free(ptr);
+    *self = NULL;
+  }
+}
+///////////////////////////////////////////////////////////////
+RT_VisualizedScene* rtVisualizedSceneRelight(RT_RenderContext *ctx, RT_GBuffer *gbuf, RT_Light *l, int32_t nl) {
+  int32_t c, k, nchanged=0, *changed;
+  int32_t x, y;
+  float total_flux=0.0f;
+  RT_Color color, old, new;
+  RT_GBufferPixel *hit;
+  RT_Triangle *visible;
+
+  if(nl != gbuf->nl) {
+    errno = E_INVALID_PARAM_VALUE;
+    return NULL;
+  }
+
+  /* Scene is shaded with new lights and configuration buffer was created
+   * with. Scene data arrays are shared with context's scene. */
+  RT_Scene scene = *ctx->scene;
+  scene.cfg = gbuf->cfg;
+  scene.l = l;
+  scene.nl = nl;
+  for(c=0; c<nl; c++) {
+    total_flux += l[c].flux;
+  }
+
+  // find lights that differ from ones buffer was shaded with
+  changed = malloc((nl+1)*sizeof(int32_t));
+  if(!changed) {
+    errno = E_MEMORY;
+    return NULL;
+  }
+  for(c=0; c<nl; c++) {
+    if(!rtLightEquals(&l[c], &gbuf->l[c])) {
+      changed[nchanged++] = c;
+    }
+  }
+  RT_INFO("relighting: %d of %d lights changed", nchanged, nl)
+
+  RT_VisualizedScene *res = rtVisualizedSceneCreate(&scene, gbuf->width, gbuf->height, total_flux);
+  if(!res) {
+    free(changed);
+    return NULL;
+  }
+
+  for(y=0, hit=gbuf->map; y<gbuf->height; y++) {
+    for(x=0; x<gbuf->width; x++, hit++) {
+      color.c[0] = color.c[1] = color.c[2] = color.c[3] = 0.0f;
+      if(!hit->t) {
+        rtVisualizedSceneSetPixel(res, x, y, &color, -1);
+        continue;
+      }
+
+      // replace contributions of changed lights (old ones are calculated
+      // without shadow cache, which now holds occluders of new lights)
+      for(k=0; k<nchanged; k++) {
+        c = changed[k];
+        old.c[0] = old.c[1] = old.c[2] = 0.0f;
+        new.c[0] = new.c[1] = new.c[2] = 0.0f;
+        rtShadeLight(&scene, ctx->udd, hit, &gbuf->l[c], -1, &old);
+        rtShadeLight(&scene, ctx->udd, hit, &l[c], c, &new);
+        rtVectorSub(hit->direct.c, hit->direct.c, old.c);
+        rtVectorAdd(hit->direct.c, hit->direct.c, new.c);
+      }
+
+      // reflected and refracted rays depend on all lights - trace them again
+      visible = hit->t;
+      rtShadeSecondary(&scene, ctx->udd, hit, total_flux, 5, &visible, &color);
+      rtVectorAdd(color.c, color.c, hit->direct.c);
+      rtVectorAdd(color.c, color.c, hit->fixed.c);
+
+      // update minimal and maximal color
+      for(k=0; k<3; k++) {
+        if(color.c[k] > res->max.c[k]) res->max.c[k]=color.c[k];
+        if(color.c[k] < res->min.c[k]) res->min.c[k]=color.c[k];
+      }
+      rtVisualizedSceneSetPixel(res, x, y, &color, rtTriangleIndex(&scene, hit->t));
+    }
+  }
+
+  // buffer now holds contributions of new lights
+  memcpy(gbuf->l, l, nl*sizeof(RT_Light));
+  free(changed);
+
+  return res;
+}
+/* Traces, tone maps and writes single band of streamed image (executed by
+ * thread pool workers). */
+static void rtStreamBand(void *arg) {
+  RT_StreamBand *band = (RT_StreamBand*)arg;
+  RT_Camera *camera = band->camera;
+  int32_t x, y, w=camera->sw, h=camera->sh;
+  float h_inv=1.0f/h, w_inv=1.0f/w;
+  RT_Triangle *visible;
+  RT_Color color;
+  uint32_t *pixels, *out;
+
+  errno = 0;
+  pixels = malloc((band->y1-band->y0)*w*sizeof(uint32_t));
+  if(!pixels) {
+    band->status = E_MEMORY;
+    return;
+  }
+  for(y=band->y0, out=pixels; y<band->y1; y++) {
+    for(x=0; x<w; x++) {
+      color = rtTracePixel(band->ctx, camera, x, y, w_inv, h_inv, band->ctx->total_flux, 0.0f, &visible, NULL);
+      *(out++) = rtToneMapColor(&color, band->min, band->scale, band->lut, band->gammas);
+    }
+  }
+  if(!rtBitmapStreamWrite(band->out, band->y0, band->y1-band->y0, pixels)) {
+    band->status = errno;
+  }
+  free(pixels);
+}
+///////////////////////////////////////////////////////////////
+void rtVisualizedSceneEstimateRange(RT_RenderContext *ctx, RT_Camera *camera, int32_t step, RT_Color *min, RT_Color *max) {
+  int32_t x, y, k, w=camera->sw, h=camera->sh;
+  float h_inv=1.0f/h, w_inv=1.0f/w;
+  RT_Triangle *visible;
+  RT_Color color;
+
+  for(k=0; k<4; k++) {
+    min->c[k] = FLT_MAX;
+    max->c[k] = FLT_MIN;
+  }
+  for(y=0; y<h; y+=step) {
+    for(x=0; x<w; x+=step) {
+      color = rtTracePixel(ctx, camera, x, y, w_inv, h_inv, ctx->total_flux, 0.0f, &visible, NULL);
+      for(k=0; k<3; k++) {
+        if(color.c[k] > max->c[k]) max->c[k]=color.c[k];
+        if(color.c[k] < min->c[k]) min->c[k]=color.c[k];
+      }
+    }
+  }
+}
+///////////////////////////////////////////////////////////////
+int rtVisualizedSceneRenderStream(
+    RT_RenderContext *ctx, RT_Camera *camera, const char *filename,
+    int32_t rows, RT_Color *min, RT_Color *max, float *gammas, int32_t nthreads)
+{
+  int32_t k, nbands, res=1;
+  float range, scale[3];
+  float default_gammas[] = {ctx->scene->cfg.gamma > 0.0f? ctx->scene->cfg.gamma: 2.5f, 0.0f};
+  RT_Color emin, emax;
+  RT_StreamBand *bands=NULL;
+  RT_BitmapStream *out=NULL;
+  RT_ThreadPool *pool=NULL;
+  RT_RenderContext local;
+  RT_Scene shadowed;
+  float *lut=NULL;
+
+  if(rows <= 0)
+    rows = RT_STREAM_ROWS;
+  if(!gammas)
+    gammas = default_gammas;
+  ctx = rtRenderShadows(ctx, &local, &shadowed);
+
+  // normalization range: given or estimated from low resolution pass
+  if(!min || !max) {
+    rtVisualizedSceneEstimateRange(ctx, camera, RT_PROGRESSIVE_STEP, &emin, &emax);
+    RT_INFO("estimated minimal color: R=%.3f, G=%.3f, B=%.3f", emin.c[0], emin.c[1], emin.c[2])
+    RT_INFO("estimated maximal color: R=%.3f, G=%.3f, B=%.3f", emax.c[0], emax.c[1], emax.c[2])
+    min = &emin;
+    max = &emax;
+  }
+  for(k=0; k<3; k++) {
+    range = max->c[k] - min->c[k];
+    scale[k] = range > 0.0f? 1.0f/range: 0.0f;
+  }
+
+  nbands = (camera->sh+rows-1)/rows;
+  lut = rtToneMapCreateLut(gammas);
+  bands = malloc(nbands*sizeof(RT_StreamBand));
+  if(!lut || !bands) {
+    errno = E_MEMORY;
+    res = 0;
+    goto cleanup;
+  }
+  out = rtBitmapStreamCreate(filename, camera->sw, camera->sh);
+  if(!out) {
+    res = 0;
+    goto cleanup;
+  }
+
+  /* Each band is traced, tone mapped and written by single task, so at most
+   * `nthreads` bands are kept in memory. */
+  if(nthreads != 1)
+    pool = rtThreadPoolCreate(nthreads);
+  for(k=0; k<nbands; k++) {
+    bands[k].ctx = ctx;
+    bands[k].camera = camera;
+    bands[k].out = out;
+    bands[k].lut = lut;
+    bands[k].gammas = gammas;
+    bands[k].min = min->c;
+    bands[k].scale = scale;
+    bands[k].y0 = k*rows;
+    bands[k].y1 = (k+1)*rows < camera->sh? (k+1)*rows: camera->sh;
+    bands[k].status = 0;
+    if(!pool || !rtThreadPoolSubmit(pool, rtStreamBand, &bands[k]))
+      rtStreamBand(&bands[k]);
+  }
+  if(pool) {
+    rtThreadPoolWait(pool);
+    rtThreadPoolDestroy(&pool);
+  }
+  for(k=0; k<nbands; k++) {
+    if(bands[k].status > 0) {
+      errno = bands[k].status;
+      res = 0;
+    }
+  }
+
+cleanup:
+  rtRenderShadowsDestroy(ctx, &local);
+  rtBitmapStreamClose(&out);
+  if(bands) free(bands);
+  if(lut) free(lut);
+  return res;
+}
+///////////////////////////////////////////////////////////////
+RT_VisualizedScene* rtVisualizedSceneRaytrace(RT_Scene *scene, RT_Camera *camera) {
+  RT_RenderContext *ctx = rtRenderContextCreate(scene);
+  if(!ctx) {
+    return NULL;
+  }
+  RT_VisualizedScene *res = rtVisualizedSceneRender(ctx, camera);
+  if(res)
+    rtVisualizedSceneDenoise(res, scene, 0);
+
   // release memory occupied by domain division structures
-  rtUddDestroy(&udd);
+  rtRenderContextDestroy(&ctx);
 
   return res;
 }
@@ -415,58 +1778,223 @@ RT_VisualizedScene* rtVisualizedSceneRaytrace(RT_Scene *scene, RT_Camera *camera
 void rtVisualizedSceneDestroy(RT_VisualizedScene **self) {
   RT_VisualizedScene *ptr=*self;
   if(ptr) {
-    if(ptr->map) free(ptr->map);
+    if(ptr->r) free(ptr->r);  // all planes
+    if(ptr->cost) free(ptr->cost);
+    if(ptr->soft) free(ptr->soft);
     free(ptr);
     *self = NULL;
   }
 }
 ///////////////////////////////////////////////////////////////
+void rtVisualizedSceneSavePfm(RT_VisualizedScene *s, const char *filename) {
+  int32_t x, y, i;
+  float *row=NULL, *ptr;
+  FILE *fd=NULL;
+
+  row = malloc(3*s->width*sizeof(float));
+  if(!row) {
+    errno = E_MEMORY;
+    goto garbage_collect;
+  }
+  fd = fopen(filename, "wb");
+  if(!fd) {
+    errno = E_IO;
+    goto garbage_collect;
+  }
+
+  // negative scale marks little-endian data; rows are stored bottom to top
+  if(fprintf(fd, "PF\n%d %d\n-1.0\n", s->width, s->height) < 0) {
+    errno = E_IO;
+    goto garbage_collect;
+  }
+  for(y=s->height-1; y>=0; y--) {
+    for(x=0, i=y*s->width, ptr=row; x<s->width; x++, i++) {
+      *(ptr++) = s->r[i];
+      *(ptr++) = s->g[i];
+      *(ptr++) = s->b[i];
+    }
+    if(fwrite(row, sizeof(float), 3*s->width, fd) != (size_t)(3*s->width)) {
+      errno = E_IO;
+      goto garbage_collect;
+    }
+  }
+
+garbage_collect:
+  if(fd && fclose(fd) != 0)
+    errno = E_IO;
+  if(row) free(row);
+}
+///////////////////////////////////////////////////////////////
+RT_VisualizedScene* rtVisualizedSceneLoadPfm(const char *filename) {
+  char type[3];
+  int32_t x, y, k, w, h, channels;
+  float scale, *row=NULL, *ptr;
+  RT_Color color;
+  RT_VisualizedScene *res=NULL;
+  RT_Scene defaults;
+
+  FILE *fd = fopen(filename, "rb");
+  if(!fd) {
+    errno = E_IO;
+    return NULL;
+  }
+
+  // header: `PF` (RGB) or `Pf` (grayscale), dimensions and scale, separated
+  // by single whitespace characters
+  if(fscanf(fd, "%2s %d %d %f", type, &w, &h, &scale) != 4 || fgetc(fd) == EOF ||
+      (strcmp(type, "PF") && strcmp(type, "Pf")) || w <= 0 || h <= 0 || scale == 0.0f) {
+    errno = E_INVALID_FILE_FORMAT;
+    goto garbage_collect;
+  }
+  channels = type[1] == 'F'? 3: 1;
+
+  memset(&defaults, 0, sizeof(defaults));
+  res = rtVisualizedSceneCreate(&defaults, w, h, 0.0f);
+  row = malloc(channels*w*sizeof(float));
+  if(!res || !row) {
+    errno = E_MEMORY;
+    goto error;
+  }
+
+  for(y=h-1; y>=0; y--) {
+    if(fread(row, sizeof(float), channels*w, fd) != (size_t)(channels*w)) {
+      errno = E_IO;
+      goto error;
+    }
+    if(scale > 0.0f) {  // big-endian data
+      uint32_t *u = (uint32_t*)row;
+      for(x=0; x<channels*w; x++) {
+        u[x] = __builtin_bswap32(u[x]);
+      }
+    }
+    for(x=0, ptr=row; x<w; x++, ptr+=channels) {
+      for(k=0; k<3; k++) {
+        color.c[k] = ptr[channels == 3? k: 0];
+        if(color.c[k] > res->max.c[k]) res->max.c[k]=color.c[k];
+        if(color.c[k] < res->min.c[k]) res->min.c[k]=color.c[k];
+      }
+      rtVisualizedSceneSetPixel(res, x, y, &color, -1);
+    }
+  }
+  goto garbage_collect;
+
+error:
+  rtVisualizedSceneDestroy(&res);
+garbage_collect:
+  if(row) free(row);
+  fclose(fd);
+  return res;
+}
+///////////////////////////////////////////////////////////////
 RT_Bitmap* rtVisualizedSceneToBitmap(RT_VisualizedScene *s, int flags, void* param1) {
+  return rtVisualizedSceneToBitmapParallel(s, flags, param1, 1);
+}
+///////////////////////////////////////////////////////////////
+RT_Bitmap* rtVisualizedSceneToBitmapParallel(RT_VisualizedScene *s, int flags, void* param1, int32_t nthreads) {
+  int32_t k, nbands;
+  float *lut;
+  RT_ToneMapBand *bands;
+  RT_ThreadPool *pool=NULL;
+
   RT_Bitmap *res = rtBitmapCreate(s->width, s->height, 0);
   if(!res)
     return NULL;
+  if(!(flags & F_HDR))
+    return res;
 
-  int k, x, y;
-  float delta[3];
+  // make array of gamma values
+  float default_gammas[] = {s->gamma, 0.0f};
+  float *gammas = param1? (float*)param1: default_gammas;
 
-  // calculate differences between minimal and maximal colors
-  for(k=0; k<3; k++) {
-    delta[k] = 1.0f / (s->max.c[k] - s->min.c[k]);
+  lut = rtToneMapCreateLut(gammas);
+  if(!lut) {
+    rtBitmapDestroy(&res);
+    return NULL;
   }
 
-  if(flags & F_HDR) {
-    // make array of gamma values
-    float default_gammas[] = {s->gamma, 0.0f};
-    float *gammas = param1? (float*)param1: default_gammas;
-    float *gptr = gammas;
-    int32_t total_gammas=0;
+  // split image into horizontal bands, one per thread
+  if(nthreads <= 0)
+    nthreads = rtThreadPoolDefaultSize();
+  nbands = nthreads < s->height? nthreads: s->height;
+  bands = malloc(nbands*sizeof(RT_ToneMapBand));
+  if(!bands) {
+    free(lut);
+    rtBitmapDestroy(&res);
+    return NULL;
+  }
+  for(k=0; k<nbands; k++) {
+    bands[k].s = s;
+    bands[k].bmp = res;
+    bands[k].lut = lut;
+    bands[k].gammas = gammas;
+    bands[k].y0 = k*s->height/nbands;
+    bands[k].y1 = (k+1)*s->height/nbands;
+  }
+  if(nbands > 1)
+    pool = rtThreadPoolCreate(nbands);
+  for(k=0; k<nbands; k++) {
+    if(!pool || !rtThreadPoolSubmit(pool, rtToneMapBand, &bands[k]))
+      rtToneMapBand(&bands[k]);  // no threads - map band in current thread
+  }
+  if(pool) {
+    rtThreadPoolWait(pool);
+    rtThreadPoolDestroy(&pool);
+  }
 
-    // calculate total number of gammas
-    while(*(gptr++) > 0.0f) {
-      total_gammas++;
-    }
+  free(bands);
+  free(lut);
+  return res;
+}
+///////////////////////////////////////////////////////////////
+/* Compares floats for qsort() in ascending order. */
+static int rtFloatCmp(const void *a_, const void *b_) {
+  float a=*(const float*)a_, b=*(const float*)b_;
+  return a<b? -1: (a>b? 1: 0);
+}
+///////////////////////////////////////////////////////////////
+RT_Bitmap* rtVisualizedSceneCostToBitmap(RT_VisualizedScene *s) {
+  static const float ramp[5][3] = {
+    {0.0f, 0.0f, 1.0f}, {0.0f, 1.0f, 1.0f}, {0.0f, 1.0f, 0.0f},
+    {1.0f, 1.0f, 0.0f}, {1.0f, 0.0f, 0.0f}
+  };
+  int32_t k, i, c, n=s->width*s->height;
+  float lo, hi, scale, v, f, *sorted;
+  uint32_t rgb[3];
 
-    // iterate through each pixel of image and calculate color by scaling to
-    // 0..255 range
-    for(y=0; y<s->height; y++) {
-      for(x=0; x<s->width; x++) {
-        RT_Color m = rtVisualizedSceneGetBluredPixel(s, x, y);
+  if(!s->cost) {
+    errno = E_INVALID_PARAM_VALUE;
+    return NULL;
+  }
+  RT_Bitmap *res = rtBitmapCreate(s->width, s->height, 0);
+  sorted = malloc(n*sizeof(float));
+  if(!res || !sorted) {
+    if(sorted) free(sorted);
+    rtBitmapDestroy(&res);
+    errno = E_MEMORY;
+    return NULL;
+  }
 
-        float r=0.0f, g=0.0f, b=0.0f;
-        for(k=0; k<total_gammas; k++) {
-          r += pow((m.c[0] - s->min.c[0]) * delta[0], gammas[k]) * 255.0f;
-          g += pow((m.c[1] - s->min.c[1]) * delta[1], gammas[k]) * 255.0f;
-          b += pow((m.c[2] - s->min.c[2]) * delta[2], gammas[k]) * 255.0f;
-        }
+  /* Cost range: smallest cost and 99.9th percentile (so few outliers, f.e.
+   * pixels interrupted by operating system, do not flatten whole map). */
+  memcpy(sorted, s->cost, n*sizeof(float));
+  qsort(sorted, n, sizeof(float), rtFloatCmp);
+  lo = sorted[0] > 1.0f? sorted[0]: 1.0f;
+  hi = sorted[(int32_t)(0.999f*(n-1))];
+  free(sorted);
+  scale = hi > lo? 4.0f/logf(hi/lo): 0.0f;
 
-        rtBitmapSetPixel(
-          res, x, y, rtColorBuildRGBA(
-            r/(float)total_gammas,
-            g/(float)total_gammas, 
-            b/(float)total_gammas, 0));
-      }
+  for(k=0; k<n; k++) {
+    v = s->cost[k] > lo? logf(s->cost[k]/lo)*scale: 0.0f;
+    if(v > 4.0f)
+      v = 4.0f;
+    i = v < 4.0f? (int32_t)v: 3;
+    f = v - i;
+    for(c=0; c<3; c++) {
+      rgb[c] = (uint32_t)(255.0f*(ramp[i][c] + (ramp[i+1][c]-ramp[i][c])*f) + 0.5f);
     }
+    res->pixels[k] = rtColorBuildRGBA(rgb[0], rgb[1], rgb[2], 0);
   }
+  RT_INFO("heatmap cost range: %.0f - %.0f", lo, hi)
 
   return res;
 }
@@ -3,6 +3,8 @@
 
 #include "scene.h"
 #include "bitmap.h"
+#include "voxelize.h"
+#include <pthread.h>
 
 //// rtVisualizedSceneToBitmap() FLAGS ////////////////////////
 
@@ -18,51 +20,230 @@
 #define F_HDR     2
 
 
-//// STRUCTURES ///////////////////////////////////////////////
+//// PROGRESSIVE RENDERING ////////////////////////////////////
+
+/* Pixel step of first (coarsest) pass of progressive rendering. Each next
+ * pass halves the step until full resolution is reached. */
+#define RT_PROGRESSIVE_STEP   8
+
+
+//// STREAMING ////////////////////////////////////////////////
 
-typedef struct _RT_VisualizedScenePixel {
-  RT_Color c;
-  RT_Triangle *t;
-} RT_VisualizedScenePixel;
+/* Default number of image rows traced and written at once in streaming mode. */
+#define RT_STREAM_ROWS  32
 
+
+//// STRUCTURES ///////////////////////////////////////////////
+
+/* Camera independent rendering state: preprocessed scene with its voxel grid.
+ * It is built once and can be shared by any number of renders (also running
+ * concurrently), so rendering several frames of the same scene does not
+ * repeat preprocessing and voxelization steps. */
+typedef struct _RT_RenderContext {
+  RT_Scene *scene;    // preprocessed scene (not owned by context)
+  RT_Udd *udd;        // uniform domain division structure of `scene`
+  float total_flux;   // sum of all lights flux, used to calculate ambient light
+  double preprocess_time;   // wall time of preprocessing step (seconds)
+  double voxelize_time;     // wall time of voxel grid creation and voxelization (seconds)
+} RT_RenderContext;
+
+/* Primary ray hit stored per pixel. Lets image be shaded again with changed
+ * lights without tracing primary rays (relighting). */
+typedef struct _RT_GBufferPixel {
+  RT_Triangle *t;       // visible triangle (NULL if primary ray missed scene)
+  RT_Vertex4f p;        // intersection point
+  RT_Vertex4f n;        // normal vector pointed towards observer (bump mapped)
+  RT_Vertex4f r;        // primary ray direction
+  RT_Color nc;          // surface color (texture applied)
+  float u, v;           // intersection point coords in triangle's space
+  int32_t i, j, k;      // voxel containing intersection point
+  RT_Color direct;      // sum of contributions of point lights
+  RT_Color fixed;       // contribution of planar lights (not affected by relighting)
+} RT_GBufferPixel;
+
+/* Geometry buffer of rendered image. */
+typedef struct _RT_GBuffer {
+  int32_t width;
+  int32_t height;
+  RT_SceneConfig cfg;     // renderer configuration buffer was shaded with
+  int32_t nl;             // number of point lights
+  RT_Light *l;            // copy of point lights `direct` was calculated for
+  RT_GBufferPixel *map;
+} RT_GBuffer;
+
+/* Not normalized rendered image. Pixels are kept in separate planes (color
+ * components and visible triangles), so passes reading only some of them
+ * (f.e. tone mapping) touch no more memory than needed. All planes are
+ * allocated as single block starting at `r`. */
 typedef struct _RT_VisualizedScene {
   int32_t width;
   int32_t height;
   float total_flux;
   float gamma;
   RT_Color min, max;
-  RT_VisualizedScenePixel *map;
+  float *r, *g, *b;   // planes of color components (width*height values each)
+  int32_t *tid;       // plane of visible triangles (index in scene's triangle array, -1 - none)
+  float *cost;        // per-pixel rendering cost (NULL unless `costmetric` config was set)
+  float *soft;        // 3 planes of planar lights contribution at visible points (NULL unless
+                      // `denoise` config was set and scene has planar lights)
 } RT_VisualizedScene;
 
+/* State of progressive rendering shared between renderer and observers (f.e.
+ * thread saving preview images). */
+typedef struct _RT_Progress {
+  RT_VisualizedScene *image;  // image being rendered (NULL when not rendering)
+  int32_t step;               // pixel step of finest finished pass (0 - none)
+  int32_t cancel;             // set to stop rendering after current row
+  pthread_mutex_t lock;       // protects all fields above and image pixels
+} RT_Progress;
+
 
 //// INLINE FUNCTIONS /////////////////////////////////////////
 
-/* Sets not normalized pixel at given coords. */
-static inline void rtVisualizedSceneSetPixel(RT_VisualizedScene *s, int32_t x, int32_t y, RT_Color *c, RT_Triangle *t) {
-  RT_VisualizedScenePixel *ptr = s->map + (y*s->width) + x;
-  ptr->c = *c;
-  ptr->t = t;
+/* Sets not normalized color and visible triangle index `tid` of pixel at
+ * given coords. */
+static inline void rtVisualizedSceneSetPixel(RT_VisualizedScene *s, int32_t x, int32_t y, RT_Color *c, int32_t tid) {
+  int32_t i = y*s->width + x;
+  s->r[i] = c->c[0];
+  s->g[i] = c->c[1];
+  s->b[i] = c->c[2];
+  s->tid[i] = tid;
 }
 
-/* Gets pixel. */
-static inline RT_VisualizedScenePixel* rtVisualizedSceneGetPixel(RT_VisualizedScene *s, int32_t x, int32_t y) {
-  return s->map + (y*s->width) + x;
+/* Gets not normalized color of pixel at given coords. */
+static inline void rtVisualizedSceneGetPixel(RT_VisualizedScene *s, int32_t x, int32_t y, RT_Color *c) {
+  int32_t i = y*s->width + x;
+  c->c[0] = s->r[i];
+  c->c[1] = s->g[i];
+  c->c[2] = s->b[i];
+  c->c[3] = 0.0f;
 }
 
 
 //// FUNCTIONS ////////////////////////////////////////////////
 
+/* Prepares given `scene` for rendering (preprocessing and voxelization) and
+ * returns context that can be used to render the scene from any camera. */
+RT_RenderContext* rtRenderContextCreate(RT_Scene *scene);
+
+/* Releases memory occupied by given RT_RenderContext object. Scene the
+ * context was created for is left untouched. */
+void rtRenderContextDestroy(RT_RenderContext **self);
+
+/* Performs visualization of scene prepared in `ctx` from viewpoint set in
+ * `camera` object. Can be called from several threads at once. When
+ * `denoise` config is set, contribution of planar lights is kept separately,
+ * so it can be filtered by rtVisualizedSceneDenoise(). When `raster` config
+ * is set, scene is rasterized first (see raster.h) and primary rays skip
+ * intersection tests in front of visible surfaces (image is the same). When
+ * `epsilon` config is set, shadows of point lights are looked up in shadow
+ * maps built for the render (see shadowmap.h) instead of tracing shadow rays
+ * (image is approximate; also applies to progressive and streaming modes). */
+RT_VisualizedScene* rtVisualizedSceneRender(RT_RenderContext *ctx, RT_Camera *camera);
+
+/* Reduces noise of soft shadows in image `s` rendered for `scene`. Planar
+ * lights contribution kept in `s` is filtered with `denoise` config passes
+ * of edge-preserving a-trous filter (5x5 B3 spline kernel with holes growing
+ * twice each pass), which only averages pixels showing the same flat surface
+ * (coplanar visible triangles of the same surface), and the rest of color is
+ * left untouched. Each pass is split into bands filtered by `nthreads`
+ * threads (<= 0 - one per CPU). Does nothing if `s` keeps no planar lights
+ * contribution. */
+void rtVisualizedSceneDenoise(RT_VisualizedScene *s, RT_Scene *scene, int32_t nthreads);
+
+/* Creates progressive rendering state object. */
+RT_Progress* rtProgressCreate();
+
+/* Releases memory occupied by given RT_Progress object. */
+void rtProgressDestroy(RT_Progress **self);
+
+/* Asks renderer using `self` to stop. Rendering function returns image made
+ * of already finished passes. */
+void rtProgressCancel(RT_Progress *self);
+
+/* Converts image currently rendered with `self` to RT_Bitmap (see
+ * rtVisualizedSceneToBitmap() for `flags` and `param1`). Returns NULL if
+ * nothing is rendered or first pass is not finished yet. */
+RT_Bitmap* rtProgressSnapshot(RT_Progress *self, int flags, void *param1);
+
+/* Works like rtVisualizedSceneRender(), but renders image in several passes,
+ * from coarse (every RT_PROGRESSIVE_STEP-th pixel) to full resolution, so
+ * image rendered so far can be obtained at any time with
+ * rtProgressSnapshot(). Rendering stops early if rtProgressCancel() is
+ * called. */
+RT_VisualizedScene* rtVisualizedSceneRenderProgressive(RT_RenderContext *ctx, RT_Camera *camera, RT_Progress *progress);
+
+/* Traces primary rays of scene prepared in `ctx` from viewpoint set in
+ * `camera` and stores hit data with point and planar lights contributions in
+ * geometry buffer, so image can later be relit by
+ * rtVisualizedSceneRelight(). Primary visibility is rasterized first if
+ * `raster` config is set. Shadow rays are traced in full regardless of
+ * `epsilon` config, as relighting traces them again to remove contributions
+ * of old lights. */
+RT_GBuffer* rtGBufferCreate(RT_RenderContext *ctx, RT_Camera *camera);
+
+/* Releases memory occupied by given RT_GBuffer object. */
+void rtGBufferDestroy(RT_GBuffer **self);
+
+/* Produces image from geometry buffer `gbuf` lit by `nl` point lights `l`
+ * (number of lights must match the one buffer was created with). Only lights
+ * that differ from lights stored in buffer are shaded again (together with
+ * reflected and refracted rays, which depend on all lights); primary
+ * visibility and planar lights are reused. Stored lights are updated, so
+ * subsequent calls are incremental. Lights should stay within domain of
+ * scene the context was prepared for. */
+RT_VisualizedScene* rtVisualizedSceneRelight(RT_RenderContext *ctx, RT_GBuffer *gbuf, RT_Light *l, int32_t nl);
+
+/* Estimates minimal and maximal color of image of scene prepared in `ctx`
+ * seen from `camera` by tracing every `step`-th pixel in both directions. */
+void rtVisualizedSceneEstimateRange(RT_RenderContext *ctx, RT_Camera *camera, int32_t step, RT_Color *min, RT_Color *max);
+
+/* Renders scene prepared in `ctx` from viewpoint set in `camera` directly
+ * into 24bpp BMP file `filename`, without keeping whole image in memory.
+ * Image is processed in bands of `rows` rows (<= 0 - RT_STREAM_ROWS), each
+ * traced, tone mapped and written by one of `nthreads` threads (<= 0 - one
+ * per CPU), so at most `nthreads` bands are in memory at once. Colors are
+ * normalized to `min`..`max` range (values beyond are clamped); if any of
+ * them is NULL, range is estimated by rtVisualizedSceneEstimateRange() with
+ * RT_PROGRESSIVE_STEP step. `gammas` is NULL-terminated array of gammas
+ * (NULL - gamma from scene config). Anti-aliasing is not applied. Returns
+ * 1 on success or 0 on failure. */
+int rtVisualizedSceneRenderStream(
+    RT_RenderContext *ctx, RT_Camera *camera, const char *filename,
+    int32_t rows, RT_Color *min, RT_Color *max, float *gammas, int32_t nthreads);
+
 /* Performs visualization of given `scene` from viewpoint set in `camera`
- * object using raytracing algorithm.*/
+ * object using raytracing algorithm (followed by rtVisualizedSceneDenoise()
+ * using all CPUs). */
 RT_VisualizedScene* rtVisualizedSceneRaytrace(RT_Scene *scene, RT_Camera *camera);
 
 /* Releases memory occupied by given RT_VisualizedScene object. */
 void rtVisualizedSceneDestroy(RT_VisualizedScene **self);
 
+/* Stores not normalized pixel colors of `s` in PFM (portable float map) file
+ * `filename`, so image can be tone mapped again without tracing it. Sets
+ * `errno` on failure. */
+void rtVisualizedSceneSavePfm(RT_VisualizedScene *s, const char *filename);
+
+/* Loads image stored by rtVisualizedSceneSavePfm() (or any other RGB or
+ * grayscale PFM file). Minimal and maximal colors are calculated from pixel
+ * values, visible triangles are not available (set to -1). */
+RT_VisualizedScene* rtVisualizedSceneLoadPfm(const char *filename);
+
 /* Converts not normalized pixel values to RT_Bitmap representing result image
  * that can be saved to file. */
 RT_Bitmap* rtVisualizedSceneToBitmap(RT_VisualizedScene *s, int flags, void* param1);
 
+/* Works like rtVisualizedSceneToBitmap(), but image rows are split between
+ * `nthreads` threads (<= 0 - one per CPU). */
+RT_Bitmap* rtVisualizedSceneToBitmapParallel(RT_VisualizedScene *s, int flags, void* param1, int32_t nthreads);
+
+/* Converts per-pixel rendering cost of `s` into heatmap image: costs are
+ * scaled logarithmically between smallest cost and 99.9th percentile and
+ * mapped through blue - cyan - green - yellow - red color ramp. Returns NULL and sets `errno` if image has no
+ * cost recorded. */
+RT_Bitmap* rtVisualizedSceneCostToBitmap(RT_VisualizedScene *s);
+
 #endif
 
 // vim: tabstop=2 shiftwidth=2 softtabstop=2
@@ -43,6 +43,18 @@ static __inline__ unsigned long long rdtsc(void)
   return(result);
 }
 
+#else
+
+#include <time.h>
+
+/* Other architectures: monotonic clock in nanoseconds. */
+static __inline__ unsigned long long rdtsc(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
 #endif
 
 #endif
@@ -42,6 +42,7 @@ RT_Scene* rtSceneLoad(const char *filename) {
   char *line=NULL;
   RT_Vertex4f *v=NULL;
   RT_Scene *res=NULL;
+  RT_Arena *arena=NULL;
 
   fd=fopen(filename, "r");
   if (!fd) {
@@ -56,13 +57,16 @@ RT_Scene* rtSceneLoad(const char *filename) {
     if(vcount == -1) {
       sscanf(line, "%d", &vcount);
 
-      // create RT_Scene object
-      res = malloc(sizeof(RT_Scene));
+      // create RT_Scene object in its own arena
+      arena = rtArenaCreate(0);
+      if(arena)
+        res = rtArenaAllocZero(arena, sizeof(RT_Scene));
       if (!res) {
+        rtArenaDestroy(&arena);
         errno = E_MEMORY;
         goto cleanup;
       }
-      memset(res, 0, sizeof(RT_Scene));
+      res->arena = arena;
       for(k=0; k<3; k++) {
         res->dmin[k] = FLT_MAX;
         res->dmax[k] = FLT_MIN;
@@ -107,7 +111,7 @@ RT_Scene* rtSceneLoad(const char *filename) {
       
       // create array of triangles
       res->nt = tcount;
-      res->t = malloc(tcount*sizeof(RT_Triangle));
+      res->t = rtArenaAlloc(res->arena, tcount*sizeof(RT_Triangle));
       if (!res->t) {
         rtSceneDestroy(&res);
         errno = E_MEMORY;
@@ -217,10 +221,20 @@ cleanup:
   if(fd) fclose(fd);
   
   // set default config values
-  res->cfg.epsilon = 0.0f;
-  res->cfg.gamma = 2.5f;
-  res->cfg.distmod = 2.0f;
-  res->cfg.vmode = VOX_DEFAULT;
+  if(res) {
+    res->cfg.epsilon = 0.0f;
+    res->cfg.gamma = 2.5f;
+    res->cfg.distmod = 2.0f;
+    res->cfg.vmode = VOX_DEFAULT;
+    res->cfg.aasamples = 1;
+    res->cfg.aathreshold = 0.1f;
+    res->cfg.costmetric = 0;
+    res->cfg.plsamples = 16;
+    res->cfg.denoise = 0;
+    res->cfg.lightcutoff = 0.0f;
+    res->cfg.fastmath = 0;
+    res->cfg.raster = 0;
+  }
 
   return res;
 }
@@ -262,6 +276,27 @@ RT_Scene* rtSceneConfigureRenderer(RT_Scene* self, const char *filename) {
           RT_WARN("%s: no such voxelization mode - using VOX_DEFAULT", pch)
           self->cfg.vmode = VOX_DEFAULT;
         }
+      } else if(!strcmp(pch, "aasamples")) {
+        pch = strtok(NULL, " \t");
+        sscanf(pch, "%d", &self->cfg.aasamples);
+      } else if(!strcmp(pch, "aathreshold")) {
+        pch = strtok(NULL, " \t");
+        sscanf(pch, "%f", &self->cfg.aathreshold);
+      } else if(!strcmp(pch, "plsamples")) {
+        pch = strtok(NULL, " \t");
+        sscanf(pch, "%d", &self->cfg.plsamples);
+      } else if(!strcmp(pch, "denoise")) {
+        pch = strtok(NULL, " \t");
+        sscanf(pch, "%d", &self->cfg.denoise);
+      } else if(!strcmp(pch, "lightcutoff")) {
+        pch = strtok(NULL, " \t");
+        sscanf(pch, "%f", &self->cfg.lightcutoff);
+      } else if(!strcmp(pch, "fastmath")) {
+        pch = strtok(NULL, " \t");
+        sscanf(pch, "%d", &self->cfg.fastmath);
+      } else if(!strcmp(pch, "raster")) {
+        pch = strtok(NULL, " \t");
+        sscanf(pch, "%d", &self->cfg.raster);
       } else if(!strcmp(pch, "voxparams")) {
         pch = strtok(NULL, " \t");
         sscanf(pch, "%f", &self->cfg.vcoeff[0]);
@@ -276,6 +311,56 @@ RT_Scene* rtSceneConfigureRenderer(RT_Scene* self, const char *filename) {
 
   return self;
 }
+///////////////////////////////////////////////////////////////
+int rtSceneConfigSet(const char *filename, const char *key, const char *value) {
+  char buf[1024], *tmpname, *ptr;
+  int32_t keylen=strlen(key), found=0;
+  FILE *in, *out;
+
+  tmpname = malloc(strlen(filename)+5);
+  if(!tmpname) {
+    errno = E_MEMORY;
+    return 0;
+  }
+  sprintf(tmpname, "%s.tmp", filename);
+  out = fopen(tmpname, "w");
+  if(!out) {
+    free(tmpname);
+    errno = E_IO;
+    return 0;
+  }
+
+  // copy existing lines, replacing the one holding `key`
+  in = fopen(filename, "r");
+  if(in) {
+    while(fgets(buf, sizeof(buf), in)) {
+      ptr = buf + strspn(buf, " \t");
+      if(!strncmp(ptr, key, keylen) && strchr(" \t\r\n", ptr[keylen]) && ptr[keylen]) {
+        if(!found)
+          fprintf(out, "%s %s\n", key, value);
+        found = 1;
+        continue;
+      }
+      fputs(buf, out);
+      if(buf[strlen(buf)-1] != '\n')
+        fputc('\n', out);
+    }
+    fclose(in);
+  } else {
+    errno = 0;  // file will be created
+  }
+  if(!found)
+    fprintf(out, "%s %s\n", key, value);
+
+  if(fclose(out) != 0 || rename(tmpname, filename) != 0) {
+    remove(tmpname);
+    free(tmpname);
+    errno = E_IO;
+    return 0;
+  }
+  free(tmpname);
+  return 1;
+}
 
 
 ///////////////////////////////////////////////////////////////
@@ -285,6 +370,15 @@ RT_Scene* rtSceneSetSurfaces(RT_Scene* self, RT_Surface* s, uint32_t ns) {
   self->ns = ns;
   self->s = s;
 
+  // bind each surface to shading kernel specialized for its features
+  for(i=0; i<ns; i++) {
+    s[i].features =
+      (s[i].ka > 0.0f? RT_SURFACE_AMBIENT: 0) |
+      (s[i].ks > 0.0f? RT_SURFACE_SPECULAR: 0) |
+      (s[i].kr > 0.0f? RT_SURFACE_REFLECTIVE: 0) |
+      (s[i].kt > 0.0f? RT_SURFACE_TRANSPARENT: 0);
+  }
+
   //update pointer to surface for each triangle
   for(i=0; i<self->nt; i++) {
     // check if number of surfaces is sufficient
@@ -292,8 +386,9 @@ RT_Scene* rtSceneSetSurfaces(RT_Scene* self, RT_Surface* s, uint32_t ns) {
       errno = E_NOT_ENOUGH_SURFACES;
       return NULL;
     }
-    // assign surface address to triangle
+    // assign surface address and texture to triangle
     self->t[i].s = &s[self->t[i].sid];
+    self->t[i].texture = s[self->t[i].sid].texture;
   }
 
   return self;
@@ -303,42 +398,28 @@ RT_Scene* rtSceneSetSurfaces(RT_Scene* self, RT_Surface* s, uint32_t ns) {
 ///////////////////////////////////////////////////////////////
 RT_Scene* rtSceneSetLights(RT_Scene* self, RT_Light* l, uint32_t nl) {
   int32_t k;
+  RT_Triangle **caches;
   self->nl = nl;
   self->l = l;
   
-  self->lbuf = malloc(nl*sizeof(float));
-  if(!self->lbuf) {
-    errno = E_MEMORY;
-    return NULL;
-  }
-  
-  self->tc = malloc(nl*sizeof(float));
-  if(!self->tc) {
-    errno = E_MEMORY;
-    return NULL;
+  self->lbuf = rtArenaAllocZero(self->arena, nl*sizeof(float));
+  self->tc = rtArenaAlloc(self->arena, nl*sizeof(float));
+  self->lc = rtArenaAlloc(self->arena, nl*sizeof(float));
+  if(!self->lbuf || !self->tc || !self->lc) {
+    return NULL;  // errno=E_MEMORY
   }
   for(k=0; k<nl; k++) {
     self->tc[k] = 1.0f;
-  }
-  
-  self->lc = malloc(nl*sizeof(float));
-  if(!self->lc) {
-    errno = E_MEMORY;
-    return NULL;
-  }
-  for(k=0; k<nl; k++) {
     self->lc[k] = 1.0f;
   }
-
-  memset(self->lbuf, 0, nl*sizeof(float));
   
+  // shadow caches of all triangles are parts of one array
+  caches = rtArenaAllocZero(self->arena, (size_t)self->nt*nl*sizeof(RT_Triangle*));
+  if(!caches) {
+    return NULL;  // errno=E_MEMORY
+  }
   for(k=0; k<self->nt; k++) {
-    self->t[k].shadow_cache = malloc(nl*sizeof(RT_Triangle*));
-    if(!self->t[k].shadow_cache) {
-      errno = E_MEMORY;
-      return NULL;
-    }
-    memset(self->t[k].shadow_cache, 0, nl*sizeof(RT_Triangle*));
+    self->t[k].shadow_cache = caches + (size_t)k*nl;
   }
   return self;
 }
@@ -352,27 +433,23 @@ RT_Scene* rtSceneSetPlanarLights(RT_Scene* self, RT_PlanarLight* pl, uint32_t np
 
 ///////////////////////////////////////////////////////////////
 void rtSceneDestroy(RT_Scene **self) {
-  int32_t k;
   RT_Scene *ptr=*self;
+  RT_Arena *arena;
+  int32_t k;
   if(!ptr)
     return;
-  if(ptr->t) {
-    for(k=0; k<ptr->nt; k++) {
-      free(ptr->t[k].shadow_cache);
-    }
-    free(ptr->t);
-  }
-  if(ptr->tc)
-    free(ptr->tc);
-  if(ptr->lc)
-    free(ptr->lc);
-  if(ptr->lbuf)
-    free(ptr->lbuf);
   if(ptr->l)
     free(ptr->l);
-  if(ptr->s)
+  if(ptr->pl)
+    free(ptr->pl);
+  if(ptr->s) {
+    for(k=0; k<ptr->ns; k++) {
+      rtTextureRelease(&ptr->s[k].texture);
+    }
     free(ptr->s);
-  free(ptr);
+  }
+  arena = ptr->arena;  // scene object itself is released with its arena
+  rtArenaDestroy(&arena);
   *self = NULL;
 }
 
@@ -536,6 +613,7 @@ RT_Surface* rtSurfaceLoad(const char *filename, uint32_t *n) {
         res = NULL;
         goto cleanup;
       }
+      memset(res, 0, scount*sizeof(RT_Surface));
 
       // initialize variables
       i = 0;
@@ -545,10 +623,29 @@ RT_Surface* rtSurfaceLoad(const char *filename, uint32_t *n) {
      --------------*/
     } else {
       j = 0;
-      pch = strtok(line, " \t");
-      while(pch != NULL) {
+      res[i].tscale = 1.0f;
+      pch = strtok(line, " \t\r\n");
+      while(pch != NULL && i < scount) {
+        // optional texture name and tile size (comment may follow instead)
+        if(j >= 10) {
+          if(!strncmp(pch, "//", 2))
+            break;
+          if(j == 10) {
+            res[i].texture = rtTextureAcquire(pch, filename);
+            if(!res[i].texture) {
+              RT_WARN("surface %d: unable to load texture %s: %s", i, pch, rtGetErrorDesc())
+              errno = 0;
+            }
+          } else if(sscanf(pch, "%f", &tmp) == 1 && tmp > 0.0f) {
+            res[i].tscale = tmp;
+          }
+          pch = strtok(NULL, " \t\r\n");
+          if(++j >= 12)
+            break;
+          continue;
+        }
         sscanf(pch, "%f", &tmp);
-        pch = strtok(NULL, " \t");
+        pch = strtok(NULL, " \t\r\n");
         switch(j) {
           case 0:
             res[i].kd = tmp;
@@ -581,8 +678,7 @@ RT_Surface* rtSurfaceLoad(const char *filename, uint32_t *n) {
             res[i].kr = tmp;
             break;
         }
-        if(++j >= 10)
-          break;
+        j++;
       }
       i++;
     }
@@ -666,6 +762,104 @@ cleanup:
 }
 
 
+///////////////////////////////////////////////////////////////
+RT_Camera* rtCameraLoadBatch(const char *filename, uint32_t *n) {
+  FILE *fd=NULL;
+  char *line=NULL, path[1024];
+  int32_t i, k, f, nkeys=0, maxkeys=0, total=0, *nframes=NULL, *itmp;
+  float t;
+  RT_Camera *keys=NULL, *res=NULL, *cam, *tmp;
+
+  *n = 0;
+  fd=fopen(filename, "r");
+  if (!fd) {
+    errno = E_IO;
+    goto cleanup;
+  }
+
+  /*-------------------------
+    load all key cameras 
+   --------------------------*/
+  while((line=rtReadline(fd)) != NULL) {
+    f = 1;
+    if(sscanf(line, "%1023s %d", path, &f) < 1)
+      continue;
+    if(f < 1)
+      f = 1;
+
+    // make more space for key cameras if needed
+    if(nkeys == maxkeys) {
+      maxkeys = maxkeys? 2*maxkeys: 16;
+      tmp = realloc(keys, maxkeys*sizeof(RT_Camera));
+      if(!tmp) {
+        errno = E_MEMORY;
+        goto cleanup;
+      }
+      keys = tmp;
+      itmp = realloc(nframes, maxkeys*sizeof(int32_t));
+      if(!itmp) {
+        errno = E_MEMORY;
+        goto cleanup;
+      }
+      nframes = itmp;
+    }
+
+    // `rtCameraLoad` reuses line buffer, so `path` had to be copied above
+    cam = rtCameraLoad(path);
+    if(!cam) {
+      RT_ERROR("unable to load camera %s from batch file %s", path, filename)
+      goto cleanup;
+    }
+    keys[nkeys] = *cam;
+    nframes[nkeys] = f;
+    rtCameraDestroy(&cam);
+    nkeys++;
+  }
+  if(nkeys == 0) {
+    errno = E_INVALID_PARAM_VALUE;
+    goto cleanup;
+  }
+
+  /*----------------------------------
+    interpolate frames between keys
+   -----------------------------------*/
+  nframes[nkeys-1] = 1;
+  for(i=0; i<nkeys; i++) {
+    total += nframes[i];
+  }
+  res = malloc(total*sizeof(RT_Camera));
+  if(!res) {
+    errno = E_MEMORY;
+    goto cleanup;
+  }
+  for(i=0, cam=res; i<nkeys; i++) {
+    for(f=0; f<nframes[i]; f++, cam++) {
+      *cam = keys[i];
+      if(f == 0)
+        continue;
+      t = (float)f / nframes[i];
+      for(k=0; k<3; k++) {
+        cam->ob[k] += t*(keys[i+1].ob[k] - keys[i].ob[k]);
+        cam->ul[k] += t*(keys[i+1].ul[k] - keys[i].ul[k]);
+        cam->bl[k] += t*(keys[i+1].bl[k] - keys[i].bl[k]);
+        cam->ur[k] += t*(keys[i+1].ur[k] - keys[i].ur[k]);
+      }
+    }
+  }
+  *n = total;
+
+cleanup:
+  if(fd)
+    fclose(fd);
+  if(keys)
+    free(keys);
+  if(nframes)
+    free(nframes);
+
+  return res;
+}
+
+
 ///////////////////////////////////////////////////////////////
 void rtCameraDestroy(RT_Camera **self) {
   free(*self);
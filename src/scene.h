@@ -3,11 +3,13 @@
 
 #include "types.h"
 #include "bitmap.h"
+#include "texman.h"
+#include "arena.h"
 #include <stdio.h>
 
 //// TYPES ////////////////////////////////////////////////////
 
-typedef float RT_Vertex4f[4];
+typedef float RT_Vertex4f[4] __ALIGN_16;  // x, y, z and unused 4th coord (see vectormath.h)
 typedef float RT_Vertex2f[2];
 
 typedef enum _RT_VoxelizationMode {
@@ -17,6 +19,17 @@ typedef enum _RT_VoxelizationMode {
 } RT_VoxelizationMode;
 
 
+//// SURFACE FEATURES /////////////////////////////////////////
+
+/* Features of surface material. Each combination is shaded by its own
+ * specialized kernel, bound to surface by rtSceneSetSurfaces(). */
+#define RT_SURFACE_AMBIENT      1   // ka > 0
+#define RT_SURFACE_SPECULAR     2   // ks > 0
+#define RT_SURFACE_REFLECTIVE   4   // kr > 0
+#define RT_SURFACE_TRANSPARENT  8   // kt > 0
+#define RT_SURFACE_FEATURES     16  // number of feature combinations
+
+
 //// INTERSECTION TEST COEFFS STRUCTURES //////////////////////
 
 typedef struct _RT_Int1Coeffs {
@@ -33,6 +46,9 @@ typedef struct _RT_Surface {
   RT_Color color;      // surface RGB color
   float kd, ks, g, ka;  // kd - diffusion factor, ks - specular factor, g - glitter factor, ka - ambient factor
   float kt, eta, kr;    // kt - refraction (transparency) factor, eta - refraction index, kr -reflection factor
+  RT_Texture *texture;  // texture replacing surface color (NULL - none)
+  float tscale;         // size of single texture tile in scene units
+  int32_t features;     // RT_SURFACE_* flags (set by rtSceneSetSurfaces())
 } RT_Surface;
 
 
@@ -40,7 +56,7 @@ typedef struct _RT_Surface {
 typedef struct _RT_Triangle {
   RT_Vertex4f i, j, k;          // triangle's vertices
   RT_Vertex2f ti, tj, tk;       // texture coords
-  RT_Bitmap* texture;           // pinter to texture image
+  RT_Texture* texture;          // texture of triangle's surface (NULL - none)
   RT_Surface *s;                // pointer to surface properties of this triangle
   int (*isint)(struct _RT_Triangle*, float*, float*, float*, float*, float*, float*);  // pointer to intersection test function dedicated for this triangle
   /* helpers */
@@ -65,7 +81,7 @@ typedef struct _RT_Light {
 
 /* Definition of single planar light. */
 typedef struct _RT_PlanarLight {
-  float flux;       // total flux
+  float flux;       // total flux (shared equally by point lights approximating light)
   RT_Color color;   // RGB light color
   RT_Vertex4f a, b, c;  // coordinates of light
   RT_Vertex4f ab, ac;  // a->b and a->c vectors
@@ -75,11 +91,19 @@ typedef struct _RT_PlanarLight {
 
 /* Rendering process configuration. */
 typedef struct _RT_SceneConfig {
-  float epsilon;  // epislon parameter for simplified shadow calculation (0 for normal processing)
+  float epsilon;  // depth bias of point light shadow maps (see shadowmap.h; 0 - shadow rays traced in full)
   float gamma;  // gamma correction parameter of resulting image
   float distmod;   // distance modifier used in light calculation
   RT_VoxelizationMode vmode;   // voxelization mode
   float vcoeff[3];   // voxelization coefficients (meaning depend on mode)
+  int32_t aasamples;   // maximal number of samples per pixel (1 - no anti-aliasing)
+  float aathreshold;   // relative color difference of neighbouring pixels that triggers supersampling
+  int32_t costmetric;  // per-pixel cost recorded while rendering (RT_COST_* from stats.h, 0 - none)
+  int32_t plsamples;   // number of point lights each planar light is approximated with
+  int32_t denoise;     // passes of edge-preserving filter applied to planar lights contribution (0 - none)
+  float lightcutoff;   // fraction of total point lights contribution left without shadow rays (0 - all lights tested)
+  int32_t fastmath;    // use float approximations of math functions in shading (see fastmath.h; 0 - exact)
+  int32_t raster;      // threads rasterizing primary visibility before tracing (see raster.h; 0 - disabled, < 0 - one per CPU)
 } RT_SceneConfig;
 
 
@@ -102,6 +126,8 @@ typedef struct _RT_Scene {
   RT_Light *l;    // array of lights
   RT_PlanarLight *pl;  // array of planar lights
   RT_Surface *s;  // array of surfaces
+  RT_Arena *arena;  // scene object, triangles, light buffers and shadow caches
+  struct _RT_ShadowMap *shadows;  // shadow maps of point lights used by current render (NULL - none)
 } RT_Scene;
 
 
@@ -126,15 +152,28 @@ RT_Scene* rtSceneLoad(const char *filename);
 :param: filename: path to config file for scene */
 RT_Scene* rtSceneConfigureRenderer(RT_Scene* self, const char *filename);
 
+/* Sets `key` of renderer config file to `value`, replacing line that starts
+ * with `key` or appending new line if there is no such line (file is created
+ * if it does not exist). Returns 1 on success or 0 on failure (`errno` is
+ * set).
+
+:param: filename: path to config file
+:param: key: name of config key (f.e. voxmode)
+:param: value: new value of key (f.e. MODIFIED_DEFAULT) */
+int rtSceneConfigSet(const char *filename, const char *key, const char *value);
+
 /* Sets surfaces array in given scene and applies surface pointers to all
- * triangles within that scene. 
+ * triangles within that scene. Each surface is bound to shading kernel
+ * specialized for its features (RT_SURFACE_* flags), so material parameters
+ * must not be changed later without calling this function again. 
 
 :param: self: pointer to scene object
 :param: s: array of surfaces
 :param: ns: number of items in array of surfaces */
 RT_Scene* rtSceneSetSurfaces(RT_Scene* self, RT_Surface* s, uint32_t ns);
 
-/* Sets lights array in given scene. 
+/* Sets lights array in given scene. Light buffers and shadow caches of all
+ * triangles are taken from scene's arena (in single block).
 
 :param: self: pointer to scene object
 :param: l: array of lights
@@ -160,6 +199,11 @@ RT_Light* rtLightLoad(const char *filename, uint32_t *n);
 RT_PlanarLight* rtPlanarLightLoad(const char *filename, uint32_t *n);
 
 /* Loads surface description from given file and returns array of surfaces.
+ * Each surface line holds 10 numbers (kd ks g ka R G B kt eta kr), optionally
+ * followed by texture name (path to BMP file, relative to directory of
+ * surface file, or RT_TEXTURE_BRICKS_NAME) and size of single texture tile
+ * in scene units (1 by default). Textures that can not be loaded are
+ * skipped with a warning.
 
 :param: filename: path to surface file
 :param: n: pointer to variable that will hold number of returned array's
@@ -171,6 +215,19 @@ RT_Surface* rtSurfaceLoad(const char *filename, uint32_t *n);
 :param: filename: path to camera file */
 RT_Camera* rtCameraLoad(const char *filename);
 
+/* Loads list of cameras (one rendered frame per camera) from given batch
+ * file. Each line of batch file has format `PATH [N]`, where PATH is path to
+ * camera file (relative paths are resolved against current directory) and N
+ * (default 1) is number of frames generated between this and next camera by
+ * linear interpolation of observer and screen positions. Resolution of
+ * interpolated frames is taken from camera the interpolation starts at. Last
+ * camera in file always produces exactly one frame.
+
+:param: filename: path to batch file
+:param: n: pointer to variable that will hold number of returned array's
+  items */
+RT_Camera* rtCameraLoadBatch(const char *filename, uint32_t *n);
+
 /* Releases memory occupied by given camera object. 
 
 :param: self: pointer to RT_Camera object */
@@ -0,0 +1,612 @@
+#include "server.h"
+#include "error.h"
+#include "stringtools.h"
+#include "common.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#define RT_SERVER_MAXLINE 4096
+
+/* Seconds client has to send whole request line in (and each read or write
+ * on its connection may block for), so idle clients can not hold workers. */
+#define RT_SERVER_TIMEOUT 10
+
+
+/* Single request received by server. */
+typedef struct _RT_ServerJob {
+  RT_Server *server;  // server that received request
+  int fd;             // client connection
+  int32_t id;         // job number
+  double received;    // time the connection was accepted
+} RT_ServerJob;
+
+
+/* Scene file loaders use static buffers and `strtok`, so only one scene or
+ * camera can be loaded at a time. */
+static pthread_mutex_t rtServerLoadLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* Reads single request line from client connection into `buf`. Connection
+ * carries nothing after request line, so it is read in blocks. Returns 1 on
+ * success or 0 if nothing was read or line did not arrive in
+ * RT_SERVER_TIMEOUT seconds. */
+static int rtServerReadLine(int fd, char *buf, size_t size) {
+  size_t len=0;
+  ssize_t r;
+  char *end=NULL;
+  double deadline = rtStatsClock() + RT_SERVER_TIMEOUT;
+  while(len < size-1) {
+    r = read(fd, buf+len, size-1-len);
+    if(r < 0 && errno == EINTR)
+      continue;
+    if(r <= 0)
+      break;  // closed connection, error or read timeout
+    end = memchr(buf+len, '\n', r);
+    len += r;
+    if(end) {
+      len = end - buf;
+      break;
+    }
+    if(rtStatsClock() > deadline) {
+      len = 0;  // client sending request too slowly
+      break;
+    }
+  }
+  buf[len] = 0;
+  return len > 0;
+}
+
+
+/* Sends printf-like formatted response line to client. */
+static void rtServerReply(int fd, const char *fmt, ...) {
+  char buf[RT_SERVER_MAXLINE];
+  size_t len, done=0;
+  ssize_t w;
+  va_list ap;
+
+  va_start(ap, fmt);
+  vsnprintf(buf, sizeof(buf)-1, fmt, ap);
+  va_end(ap);
+  len = strlen(buf);
+  buf[len++] = '\n';
+
+  while(done < len) {
+    w = write(fd, buf+done, len-done);
+    if(w < 0 && errno == EINTR)
+      continue;
+    if(w <= 0)
+      return;
+    done += w;
+  }
+}
+
+
+/* Releases memory occupied by resident scene. */
+static void rtServerSceneDestroy(RT_ServerScene **self) {
+  RT_ServerScene *ptr=*self;
+  if(!ptr)
+    return;
+  rtRenderContextDestroy(&ptr->ctx);
+  rtSceneDestroy(&ptr->scene);
+  if(ptr->camera)
+    rtCameraDestroy(&ptr->camera);
+  rtStringDestroy(&ptr->name);
+  free(ptr);
+  *self = NULL;
+}
+
+
+/* Loads scene files sharing given `prefix` (same files as `-s` option uses)
+ * and prepares scene for rendering. */
+static RT_ServerScene* rtServerSceneLoad(const char *name, const char *prefix) {
+  uint32_t n;
+  char *path;
+  RT_ServerScene *res = malloc(sizeof(RT_ServerScene));
+  if(!res) {
+    errno = E_MEMORY;
+    return NULL;
+  }
+  memset(res, 0, sizeof(RT_ServerScene));
+  res->name = rtStringCopy(name);
+
+  pthread_mutex_lock(&rtServerLoadLock);
+
+  // geometry and renderer configuration
+  path = rtStringConcat(prefix, ".brs");
+  res->scene = rtSceneLoad(path);
+  rtStringDestroy(&path);
+  if(!res->scene || errno > 0) {
+    goto error;
+  }
+  path = rtStringConcat(prefix, ".cfg");
+  rtSceneConfigureRenderer(res->scene, path);
+  rtStringDestroy(&path);
+  errno = 0;
+
+  // lights (optional)
+  path = rtStringConcat(prefix, ".lgt");
+  RT_Light *lgt = rtLightLoad(path, &n);
+  rtStringDestroy(&path);
+  if(errno > 0) {
+    errno = 0;
+  } else {
+    rtSceneSetLights(res->scene, lgt, n);
+  }
+  path = rtStringConcat(prefix, ".pnr");
+  RT_PlanarLight *pl = rtPlanarLightLoad(path, &n);
+  rtStringDestroy(&path);
+  if(errno > 0) {
+    errno = 0;
+  } else {
+    rtSceneSetPlanarLights(res->scene, pl, n);
+  }
+
+  // surface attributes (required)
+  path = rtStringConcat(prefix, ".atr");
+  RT_Surface *surf = rtSurfaceLoad(path, &n);
+  rtStringDestroy(&path);
+  if(errno > 0 || !rtSceneSetSurfaces(res->scene, surf, n)) {
+    goto error;
+  }
+
+  // default camera (optional, jobs may provide their own)
+  path = rtStringConcat(prefix, ".cam");
+  res->camera = rtCameraLoad(path);
+  rtStringDestroy(&path);
+  errno = 0;
+
+  pthread_mutex_unlock(&rtServerLoadLock);
+
+  res->ctx = rtRenderContextCreate(res->scene);
+  if(!res->ctx) {
+    rtServerSceneDestroy(&res);
+    return NULL;
+  }
+  return res;
+
+error:
+  pthread_mutex_unlock(&rtServerLoadLock);
+  rtServerSceneDestroy(&res);
+  return NULL;
+}
+
+
+/* Marks scene as unloaded and releases it if no job uses it anymore. Must be
+ * called with server lock held. */
+static void rtServerDetach(RT_Server *self, RT_ServerScene *scene) {
+  RT_ServerScene **ptr;
+  scene->unloaded = 1;
+  if(scene->refs > 0)
+    return;
+  for(ptr=&self->scenes; *ptr; ptr=&(*ptr)->next) {
+    if(*ptr == scene) {
+      *ptr = scene->next;
+      break;
+    }
+  }
+  rtServerSceneDestroy(&scene);
+}
+
+
+/* Finds scene of given name and marks it as used by caller. Returns NULL if
+ * there is no such scene. */
+static RT_ServerScene* rtServerAcquire(RT_Server *self, const char *name) {
+  RT_ServerScene *ptr;
+  pthread_mutex_lock(&self->lock);
+  for(ptr=self->scenes; ptr; ptr=ptr->next) {
+    if(!ptr->unloaded && !strcmp(ptr->name, name)) {
+      ptr->refs++;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&self->lock);
+  return ptr;
+}
+
+
+/* Releases scene previously acquired with `rtServerAcquire`. */
+static void rtServerRelease(RT_Server *self, RT_ServerScene *scene) {
+  pthread_mutex_lock(&self->lock);
+  scene->refs--;
+  if(scene->unloaded) {
+    rtServerDetach(self, scene);
+  }
+  pthread_mutex_unlock(&self->lock);
+}
+
+
+/* Stores pixels of given bitmap in POSIX shared memory object `name`. Returns
+ * 1 on success or 0 on failure. */
+static int rtServerSaveShm(const RT_Bitmap *bmp, const char *name) {
+  size_t size = (size_t)bmp->width*bmp->height*sizeof(uint32_t);
+  void *ptr;
+  int fd = shm_open(name, O_CREAT|O_RDWR, 0600);
+  if(fd < 0) {
+    errno = E_IO;
+    return 0;
+  }
+  if(ftruncate(fd, size) != 0) {
+    close(fd);
+    errno = E_IO;
+    return 0;
+  }
+  ptr = mmap(NULL, size, PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(ptr == MAP_FAILED) {
+    errno = E_MEMORY;
+    return 0;
+  }
+  memcpy(ptr, bmp->pixels, size);
+  munmap(ptr, size);
+  return 1;
+}
+
+
+/* Executes `load NAME PREFIX` request. */
+static void rtServerLoad(RT_ServerJob *job, char *args) {
+  char *save, *name, *prefix;
+  RT_Server *self = job->server;
+  RT_ServerScene *ptr;
+  double start=rtStatsClock();
+
+  name = strtok_r(args, " \t", &save);
+  prefix = strtok_r(NULL, " \t", &save);
+  if(!name || !prefix) {
+    rtServerReply(job->fd, "error job=%d usage: load NAME PREFIX", job->id);
+    return;
+  }
+
+  RT_ServerScene *scene = rtServerSceneLoad(name, prefix);
+  if(!scene) {
+    rtServerReply(job->fd, "error job=%d unable to load scene %s: %s", job->id, name, rtGetErrorDesc());
+    return;
+  }
+
+  // replace scene of the same name (jobs using it will finish normally)
+  pthread_mutex_lock(&self->lock);
+  for(ptr=self->scenes; ptr; ptr=ptr->next) {
+    if(!ptr->unloaded && !strcmp(ptr->name, name)) {
+      rtServerDetach(self, ptr);
+      break;
+    }
+  }
+  scene->next = self->scenes;
+  self->scenes = scene;
+  pthread_mutex_unlock(&self->lock);
+
+  RT_INFO("server: job %d: scene %s loaded from %s", job->id, name, prefix)
+  rtServerReply(job->fd, "ok job=%d scene=%s triangles=%d lights=%d queued=%.3f total=%.3f",
+      job->id, name, scene->scene->nt, scene->scene->nl, start-job->received, rtStatsClock()-start);
+}
+
+
+/* Executes `render NAME [KEY VALUE]...` request. */
+static void rtServerRender(RT_ServerJob *job, char *args) {
+  char *save, *name, *key, *value;
+  char *camera=NULL, *output=NULL, *shm=NULL;
+  float gamma=-1.0f, distmod=-1.0f, aathreshold=-1.0f, lightcutoff=-1.0f, epsilon=-1.0f;
+  int32_t width=0, height=0, aasamples=0, plsamples=0, denoise=-1, fastmath=-1, raster=-1;
+  double start=rtStatsClock(), t_render, t_tonemap, t_save;
+  RT_Camera cam, *loaded=NULL;
+  RT_VisualizedScene *vs=NULL;
+  RT_Bitmap *bmp=NULL;
+
+  name = strtok_r(args, " \t", &save);
+  if(!name) {
+    rtServerReply(job->fd, "error job=%d usage: render NAME [KEY VALUE]...", job->id);
+    return;
+  }
+  while((key=strtok_r(NULL, " \t", &save)) != NULL) {
+    value = strtok_r(NULL, " \t", &save);
+    if(!value) {
+      rtServerReply(job->fd, "error job=%d missing value of %s", job->id, key);
+      return;
+    }
+    if(!strcmp(key, "camera")) {
+      camera = value;
+    } else if(!strcmp(key, "output")) {
+      output = value;
+    } else if(!strcmp(key, "shm")) {
+      shm = value;
+    } else if(!strcmp(key, "gamma")) {
+      sscanf(value, "%f", &gamma);
+    } else if(!strcmp(key, "distmod")) {
+      sscanf(value, "%f", &distmod);
+    } else if(!strcmp(key, "aasamples")) {
+      sscanf(value, "%d", &aasamples);
+    } else if(!strcmp(key, "aathreshold")) {
+      sscanf(value, "%f", &aathreshold);
+    } else if(!strcmp(key, "plsamples")) {
+      sscanf(value, "%d", &plsamples);
+    } else if(!strcmp(key, "denoise")) {
+      sscanf(value, "%d", &denoise);
+    } else if(!strcmp(key, "lightcutoff")) {
+      sscanf(value, "%f", &lightcutoff);
+    } else if(!strcmp(key, "epsilon")) {
+      sscanf(value, "%f", &epsilon);
+    } else if(!strcmp(key, "fastmath")) {
+      sscanf(value, "%d", &fastmath);
+    } else if(!strcmp(key, "raster")) {
+      sscanf(value, "%d", &raster);
+    } else if(!strcmp(key, "width")) {
+      sscanf(value, "%d", &width);
+    } else if(!strcmp(key, "height")) {
+      sscanf(value, "%d", &height);
+    } else {
+      rtServerReply(job->fd, "error job=%d unknown render parameter: %s", job->id, key);
+      return;
+    }
+  }
+  if(!output && !shm) {
+    rtServerReply(job->fd, "error job=%d either output or shm is required", job->id);
+    return;
+  }
+
+  RT_ServerScene *ss = rtServerAcquire(job->server, name);
+  if(!ss) {
+    rtServerReply(job->fd, "error job=%d no such scene: %s", job->id, name);
+    return;
+  }
+
+  // choose camera
+  if(camera) {
+    pthread_mutex_lock(&rtServerLoadLock);
+    loaded = rtCameraLoad(camera);
+    pthread_mutex_unlock(&rtServerLoadLock);
+    if(!loaded) {
+      rtServerReply(job->fd, "error job=%d unable to load camera %s: %s", job->id, camera, rtGetErrorDesc());
+      goto cleanup;
+    }
+    cam = *loaded;
+  } else if(ss->camera) {
+    cam = *ss->camera;
+  } else {
+    rtServerReply(job->fd, "error job=%d scene %s has no default camera", job->id, name);
+    goto cleanup;
+  }
+  if(width > 0)
+    cam.sw = width;
+  if(height > 0)
+    cam.sh = height;
+
+  /* Apply config overrides to private copy of scene object. Scene data arrays
+   * stay shared, only rendering configuration differs. */
+  RT_Scene scene = *ss->scene;
+  RT_RenderContext ctx = *ss->ctx;
+  ctx.scene = &scene;
+  if(gamma > 0.0f)
+    scene.cfg.gamma = gamma;
+  if(distmod >= 0.0f)
+    scene.cfg.distmod = distmod;
+  if(aasamples > 0)
+    scene.cfg.aasamples = aasamples;
+  if(aathreshold > 0.0f)
+    scene.cfg.aathreshold = aathreshold;
+  if(plsamples > 0)
+    scene.cfg.plsamples = plsamples;
+  if(denoise >= 0)
+    scene.cfg.denoise = denoise;
+  if(lightcutoff >= 0.0f)
+    scene.cfg.lightcutoff = lightcutoff;
+  if(epsilon >= 0.0f)
+    scene.cfg.epsilon = epsilon;
+  if(fastmath >= 0)
+    scene.cfg.fastmath = fastmath;
+  if(raster >= 0)
+    scene.cfg.raster = raster;
+
+  errno = 0;
+  t_render = rtStatsClock();
+  vs = rtVisualizedSceneRender(&ctx, &cam);
+  if(!vs) {
+    rtServerReply(job->fd, "error job=%d rendering failed: %s", job->id, rtGetErrorDesc());
+    goto cleanup;
+  }
+  rtVisualizedSceneDenoise(vs, &scene, 1);
+  t_tonemap = rtStatsClock();
+  bmp = rtVisualizedSceneToBitmap(vs, F_HDR, NULL);
+  if(!bmp) {
+    errno = E_MEMORY;
+    rtServerReply(job->fd, "error job=%d unable to create result image: %s", job->id, rtGetErrorDesc());
+    goto cleanup;
+  }
+  t_save = rtStatsClock();
+  errno = 0;
+  if(output) {
+    rtBitmapSaveAs(bmp, output, 1);
+  }
+  if(shm && errno == 0) {
+    rtServerSaveShm(bmp, shm);
+  }
+  if(errno > 0) {
+    rtServerReply(job->fd, "error job=%d unable to store result image: %s", job->id, rtGetErrorDesc());
+    goto cleanup;
+  }
+
+  RT_INFO("server: job %d: scene %s rendered", job->id, name)
+  rtServerReply(job->fd,
+      "ok job=%d scene=%s width=%d height=%d queued=%.3f render=%.3f tonemap=%.3f save=%.3f total=%.3f",
+      job->id, name, cam.sw, cam.sh,
+      start-job->received, t_tonemap-t_render, t_save-t_tonemap, rtStatsClock()-t_save, rtStatsClock()-start);
+
+cleanup:
+  if(bmp)
+    rtBitmapDestroy(&bmp);
+  if(vs)
+    rtVisualizedSceneDestroy(&vs);
+  if(loaded)
+    rtCameraDestroy(&loaded);
+  rtServerRelease(job->server, ss);
+}
+
+
+/* Executes single request. Called by thread pool workers. */
+static void rtServerJob(void *arg) {
+  RT_ServerJob *job = (RT_ServerJob*)arg;
+  RT_Server *self = job->server;
+  RT_ServerScene *ptr;
+  char line[RT_SERVER_MAXLINE], *cmd, *args, *name;
+  char list[RT_SERVER_MAXLINE];
+  size_t len;
+
+  errno = 0;
+  if(!rtServerReadLine(job->fd, line, sizeof(line))) {
+    goto cleanup;
+  }
+
+  // split request into command and its arguments
+  cmd = strtok_r(line, " \t\r", &args);
+  if(!cmd) {
+    rtServerReply(job->fd, "error job=%d empty request", job->id);
+  } else if(!strcmp(cmd, "render")) {
+    rtServerRender(job, args);
+  } else if(!strcmp(cmd, "load")) {
+    rtServerLoad(job, args);
+  } else if(!strcmp(cmd, "unload")) {
+    name = strtok_r(NULL, " \t\r", &args);
+    ptr = name? rtServerAcquire(self, name): NULL;
+    if(ptr) {
+      pthread_mutex_lock(&self->lock);
+      ptr->unloaded = 1;
+      pthread_mutex_unlock(&self->lock);
+      rtServerRelease(self, ptr);
+      rtServerReply(job->fd, "ok job=%d scene=%s", job->id, name);
+    } else {
+      rtServerReply(job->fd, "error job=%d no such scene: %s", job->id, name? name: "");
+    }
+  } else if(!strcmp(cmd, "list")) {
+    list[0] = 0;
+    pthread_mutex_lock(&self->lock);
+    for(ptr=self->scenes; ptr; ptr=ptr->next) {
+      if(ptr->unloaded)
+        continue;
+      len = strlen(list);
+      snprintf(list+len, sizeof(list)-len, "%s%s", len? ",": "", ptr->name);
+    }
+    pthread_mutex_unlock(&self->lock);
+    rtServerReply(job->fd, "ok job=%d scenes=%s", job->id, list);
+  } else if(!strcmp(cmd, "shutdown")) {
+    pthread_mutex_lock(&self->lock);
+    self->shutdown = 1;
+    pthread_mutex_unlock(&self->lock);
+    rtServerReply(job->fd, "ok job=%d", job->id);
+    shutdown(self->fd, SHUT_RDWR);  // wake up `accept` in main loop
+  } else {
+    rtServerReply(job->fd, "error job=%d unknown request: %s", job->id, cmd);
+  }
+
+cleanup:
+  close(job->fd);
+  free(job);
+}
+
+
+///////////////////////////////////////////////////////////////
+int rtServerRun(const char *path, int32_t nthreads) {
+  struct sockaddr_un addr;
+  struct timeval timeout = {RT_SERVER_TIMEOUT, 0};
+  int fd, stop;
+  RT_Server server;
+  RT_ServerJob *job;
+  RT_ServerScene *ptr;
+
+  memset(&server, 0, sizeof(RT_Server));
+  memset(&addr, 0, sizeof(addr));
+  if(strlen(path) >= sizeof(addr.sun_path)) {
+    errno = E_INVALID_PARAM_VALUE;
+    return 0;
+  }
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  // create listening socket (stale socket file is removed first)
+  server.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(server.fd < 0) {
+    errno = E_IO;
+    return 0;
+  }
+  unlink(path);
+  if(bind(server.fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(server.fd, 64) != 0) {
+    close(server.fd);
+    errno = E_IO;
+    return 0;
+  }
+
+  server.pool = rtThreadPoolCreate(nthreads);
+  if(!server.pool) {
+    close(server.fd);
+    unlink(path);
+    return 0;
+  }
+  server.path = rtStringCopy(path);
+  pthread_mutex_init(&server.lock, NULL);
+
+  // clients closing connection early must not kill the server
+  signal(SIGPIPE, SIG_IGN);
+  RT_INFO("server: listening on %s with %d threads", path, server.pool->nthreads)
+
+  while(1) {
+    fd = accept(server.fd, NULL, NULL);
+    pthread_mutex_lock(&server.lock);
+    stop = server.shutdown;
+    pthread_mutex_unlock(&server.lock);
+    if(stop) {
+      if(fd >= 0)
+        close(fd);
+      break;
+    }
+    if(fd < 0) {
+      if(errno == EINTR || errno == ECONNABORTED)
+        continue;
+      RT_ERROR("server: accept failed: %s", strerror(errno))
+      break;
+    }
+
+    // client that sends nothing must not block worker forever
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    job = malloc(sizeof(RT_ServerJob));
+    if(!job) {
+      close(fd);
+      continue;
+    }
+    job->server = &server;
+    job->fd = fd;
+    job->id = ++server.njobs;
+    job->received = rtStatsClock();
+    if(!rtThreadPoolSubmit(server.pool, rtServerJob, job)) {
+      close(fd);
+      free(job);
+    }
+  }
+
+  // finish queued jobs and release resident scenes
+  rtThreadPoolWait(server.pool);
+  rtThreadPoolDestroy(&server.pool);
+  while((ptr=server.scenes) != NULL) {
+    server.scenes = ptr->next;
+    rtServerSceneDestroy(&ptr);
+  }
+  close(server.fd);
+  unlink(server.path);
+  rtStringDestroy(&server.path);
+  pthread_mutex_destroy(&server.lock);
+  RT_IINFO("server: stopped")
+
+  errno = 0;
+  return 1;
+}
+
+// vim: tabstop=2 shiftwidth=2 softtabstop=2
@@ -0,0 +1,86 @@
+/*
+  Render server. Keeps named scenes resident (loaded, preprocessed and
+  voxelized) and executes render jobs received over Unix domain socket.
+
+  Each connection carries exactly one request line and receives exactly one
+  response line. Request line has to arrive within 10 seconds of connecting
+  (RT_SERVER_TIMEOUT), otherwise connection is closed. Requests:
+
+    load NAME PREFIX      load PREFIX.brs, .atr, .lgt, .pnr, .cfg and .cam
+                          files and keep them as scene NAME
+    render NAME [KEY VALUE]...
+                          render scene NAME; keys:
+                            camera PATH    camera file (default: PREFIX.cam)
+                            output PATH    store result in image file PATH (PNG, PPM
+                                           or BMP, by extension)
+                            shm NAME       store result as RGBA pixels in POSIX
+                                           shared memory object NAME
+                            gamma G        override gamma correction
+                            distmod D      override light distance modifier
+                            aasamples N    override anti-aliasing rays per pixel
+                            aathreshold T  override anti-aliasing threshold
+                            plsamples N    override point lights per planar light
+                            denoise N      override soft shadow filter passes
+                            lightcutoff T  override fraction of point lights
+                                           contribution left without shadow rays
+                            epsilon E      override depth bias of point light
+                                           shadow maps (0 - shadow rays are
+                                           traced)
+                            fastmath 0|1   override use of approximated math
+                            raster N       override number of threads
+                                           rasterizing primary visibility
+                                           (0 - primary rays are traced)
+                            width W        override camera resolution
+                            height H
+    unload NAME           release scene NAME
+    list                  list resident scenes
+    shutdown              stop server
+
+  Responses start with `ok` or `error`, followed by `key=value` pairs (f.e.
+  per-stage job timings in seconds).
+*/
+#ifndef __SERVER_H
+#define __SERVER_H
+
+#include "types.h"
+#include "scene.h"
+#include "raytrace.h"
+#include "threadpool.h"
+#include <pthread.h>
+
+
+//// STRUCTURES ///////////////////////////////////////////////
+
+/* Scene kept resident by server. */
+typedef struct _RT_ServerScene {
+  char *name;                     // name used by clients to refer to scene
+  RT_Scene *scene;                // loaded scene
+  RT_Camera *camera;              // default camera (may be NULL)
+  RT_RenderContext *ctx;          // preprocessed and voxelized scene
+  int32_t refs;                   // number of jobs currently using this scene
+  int32_t unloaded;               // set when scene should be released after last job
+  struct _RT_ServerScene *next;   // next scene in list
+} RT_ServerScene;
+
+/* Render server state. */
+typedef struct _RT_Server {
+  int fd;                   // listening socket
+  char *path;               // socket path
+  int32_t njobs;            // number of jobs received so far
+  int32_t shutdown;         // set to 1 when server should stop
+  RT_ThreadPool *pool;      // pool executing jobs
+  RT_ServerScene *scenes;   // list of resident scenes
+  pthread_mutex_t lock;     // protects `njobs`, `shutdown` and `scenes`
+} RT_Server;
+
+
+//// FUNCTIONS ////////////////////////////////////////////////
+
+/* Runs render server listening on Unix domain socket `path`, executing jobs
+ * on `nthreads` worker threads (<= 0 - one per CPU). Returns when `shutdown`
+ * request is received: 1 on clean shutdown, 0 if server could not start. */
+int rtServerRun(const char *path, int32_t nthreads);
+
+#endif
+
+// vim: tabstop=2 shiftwidth=2 softtabstop=2
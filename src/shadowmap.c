@@ -0,0 +1,264 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <float.h>
+#include "error.h"
+#include "common.h"
+#include "threadpool.h"
+#include "shadowmap.h"
+
+
+/* Single cube face rasterized by thread pool worker. */
+typedef struct _RT_ShadowMapFace {
+  RT_ShadowMap *map;      // result
+  RT_Scene *scene;        // rasterized scene
+  const float *radius;    // length of light to texel center vector of face at unit distance (per texel)
+  int32_t light, face;
+} RT_ShadowMapFace;
+
+
+/* Clips polygon `q` of `n` vertices (face coords: two coords along face and
+ * distance from light along face axis) against near plane. Stores result in
+ * `out` and returns its number of vertices (0 - polygon is clipped out). */
+static int32_t rtShadowMapClip(double q[][3], int32_t n, double out[][3]) {
+  int32_t a, b, k, res=0;
+  double t;
+  for(a=0; a<n; a++) {
+    b = (a+1) % n;
+    if(q[a][2] >= RT_SHADOWMAP_NEAR) {
+      memcpy(out[res++], q[a], 3*sizeof(double));
+    }
+    if((q[a][2] >= RT_SHADOWMAP_NEAR) != (q[b][2] >= RT_SHADOWMAP_NEAR)) {
+      t = (RT_SHADOWMAP_NEAR - q[a][2]) / (q[b][2] - q[a][2]);
+      for(k=0; k<2; k++) {
+        out[res][k] = q[a][k] + t*(q[b][k] - q[a][k]);
+      }
+      out[res++][2] = RT_SHADOWMAP_NEAR;
+    }
+  }
+  return res;
+}
+
+
+/* Rasterizes projected triangle `p` (texel coords and inverted distance
+ * along face axis of vertices) into face `buf` of size `n`x`n`, keeping
+ * maximal inverted distance in texels whose centers it covers. */
+static void rtShadowMapTriangle(double p[3][3], float *buf, int32_t n) {
+  double ea[3], eb[3], ec[3], za=0.0, zb=0.0, zc=0.0, area2, dx, dy, sign, z;
+  double xmin, xmax, ymin, ymax, lo, hi, e;
+  int32_t k, a, b, x, y, x0, y0, x1, y1;
+
+  xmin = MIN(p[0][0], p[1][0], p[2][0]);
+  xmax = MAX(p[0][0], p[1][0], p[2][0]);
+  ymin = MIN(p[0][1], p[1][1], p[2][1]);
+  ymax = MAX(p[0][1], p[1][1], p[2][1]);
+  xmin = ceil(xmin);
+  xmax = floor(xmax);
+  ymin = ceil(ymin);
+  ymax = floor(ymax);
+  if(xmax < 0.0 || ymax < 0.0 || xmin > n-1 || ymin > n-1 || xmin > xmax || ymin > ymax)
+    return;
+  x0 = xmin > 0.0? (int32_t)xmin: 0;
+  y0 = ymin > 0.0? (int32_t)ymin: 0;
+  x1 = xmax < n-1? (int32_t)xmax: n-1;
+  y1 = ymax < n-1? (int32_t)ymax: n-1;
+
+  // triangles seen edge-on occlude nothing
+  area2 = (p[1][0]-p[0][0])*(p[2][1]-p[0][1]) - (p[1][1]-p[0][1])*(p[2][0]-p[0][0]);
+  if(area2 == 0.0)
+    return;
+  sign = area2 > 0.0? 1.0: -1.0;
+  for(k=0; k<3; k++) {
+    // edge opposite to vertex `k`
+    a = (k+1) % 3;
+    b = (k+2) % 3;
+    dx = p[b][0] - p[a][0];
+    dy = p[b][1] - p[a][1];
+    ea[k] = -dy*sign;
+    eb[k] = dx*sign;
+    ec[k] = (dy*p[a][0] - dx*p[a][1])*sign;
+    za += p[k][2]*(-dy) / area2;
+    zb += p[k][2]*dx / area2;
+    zc += p[k][2]*(dy*p[a][0] - dx*p[a][1]) / area2;
+  }
+
+  // span of texel centers inside all edges is found for each row
+  for(y=y0; y<=y1; y++) {
+    lo = x0;
+    hi = x1;
+    for(k=0; k<3; k++) {
+      e = eb[k]*y + ec[k];
+      if(ea[k] > 0.0) {
+        e = ceil(-e/ea[k]);
+        if(e > lo) lo = e;
+      } else if(ea[k] < 0.0) {
+        e = floor(e/-ea[k]);
+        if(e < hi) hi = e;
+      } else if(e < 0.0) {
+        hi = lo - 1.0;
+      }
+    }
+    for(x=(int32_t)lo; x<=(int32_t)hi; x++) {
+      z = za*x + zb*y + zc;
+      if(z > buf[y*n + x])
+        buf[y*n + x] = (float)z;
+    }
+  }
+}
+
+
+/* Rasterizes all triangles of scene into single cube face (executed by
+ * thread pool workers). */
+static void rtShadowMapFace(void *arg) {
+  RT_ShadowMapFace *task = (RT_ShadowMapFace*)arg;
+  RT_ShadowMap *map = task->map;
+  RT_Scene *scene = task->scene;
+  RT_Triangle *t;
+  int32_t c, k, m, nclipped, n=map->size;
+  int32_t a=task->face/2, ua=(a+1)%3, va=(a+2)%3;
+  double sign=task->face & 1? -1.0: 1.0, q[3][3], clipped[4][3], p[3][3];
+  float *l = scene->l[task->light].p;
+  size_t offset = (size_t)(6*task->light + task->face)*n*n;
+  float *opaque = map->opaque + offset;
+  float *transparent = map->transparent? map->transparent + offset: NULL;
+
+  memset(opaque, 0, n*n*sizeof(float));
+  if(transparent)
+    memset(transparent, 0, n*n*sizeof(float));
+
+  for(c=0, t=scene->t; c<scene->nt; c++, t++) {
+    float *vert[3] = {t->i, t->j, t->k};
+    for(k=0; k<3; k++) {
+      q[k][0] = (double)vert[k][ua] - l[ua];
+      q[k][1] = (double)vert[k][va] - l[va];
+      q[k][2] = sign*((double)vert[k][a] - l[a]);
+    }
+    if(q[0][2] < RT_SHADOWMAP_NEAR && q[1][2] < RT_SHADOWMAP_NEAR && q[2][2] < RT_SHADOWMAP_NEAR)
+      continue;  // behind face
+    for(m=0; m<2; m++) {
+      if(q[0][m] > q[0][2] && q[1][m] > q[1][2] && q[2][m] > q[2][2])
+        break;
+      if(q[0][m] < -q[0][2] && q[1][m] < -q[1][2] && q[2][m] < -q[2][2])
+        break;
+    }
+    if(m < 2)
+      continue;  // aside of face
+    nclipped = rtShadowMapClip(q, 3, clipped);
+    for(k=1; k+1<nclipped; k++) {
+      int32_t fan[3] = {0, k, k+1};
+      for(m=0; m<3; m++) {
+        p[m][0] = (clipped[fan[m]][0] / clipped[fan[m]][2] + 1.0) * 0.5*n - 0.5;
+        p[m][1] = (clipped[fan[m]][1] / clipped[fan[m]][2] + 1.0) * 0.5*n - 0.5;
+        p[m][2] = 1.0 / clipped[fan[m]][2];
+      }
+      rtShadowMapTriangle(p, t->s->kt > 0.0f? transparent: opaque, n);
+    }
+  }
+
+  // convert inverted distance along face axis to distance from light
+  for(k=0; k<n*n; k++) {
+    opaque[k] = opaque[k] > 0.0f? task->radius[k] / opaque[k]: FLT_MAX;
+    if(transparent)
+      transparent[k] = transparent[k] > 0.0f? task->radius[k] / transparent[k]: FLT_MAX;
+  }
+}
+
+
+///////////////////////////////////////////////////////////////
+RT_ShadowMap* rtShadowMapCreate(RT_Scene *scene, int32_t nthreads) {
+  int32_t c, k, x, y, n, ntasks=6*scene->nl;
+  size_t texels;
+  double u, v;
+  float *radius=NULL;
+  RT_ShadowMapFace *faces=NULL;
+  RT_ThreadPool *pool=NULL;
+
+  RT_ShadowMap *res = malloc(sizeof(RT_ShadowMap));
+  if(!res) {
+    errno = E_MEMORY;
+    return NULL;
+  }
+  memset(res, 0, sizeof(RT_ShadowMap));
+
+  res->nl = scene->nl;
+  if(ntasks == 0)
+    return res;  // no point lights - nothing to rasterize
+
+  /* Face size is the largest one that keeps opaque maps of all lights within
+   * RT_SHADOWMAP_TEXELS. */
+  n = (int32_t)sqrt((double)RT_SHADOWMAP_TEXELS / ntasks);
+  res->size = n < RT_SHADOWMAP_SIZE? n: RT_SHADOWMAP_SIZE;
+  n = res->size;
+  texels = (size_t)ntasks*n*n;
+
+  res->opaque = malloc(texels*sizeof(float));
+  if(!res->opaque)
+    goto nomemory;
+  for(c=0; c<scene->nt; c++) {
+    if(scene->t[c].s->kt > 0.0f) {
+      res->transparent = malloc(texels*sizeof(float));
+      if(!res->transparent)
+        goto nomemory;
+      break;
+    }
+  }
+  radius = malloc(n*n*sizeof(float));
+  if(!radius)
+    goto nomemory;
+  faces = malloc(ntasks*sizeof(RT_ShadowMapFace));
+  if(!faces)
+    goto nomemory;
+
+  // texel centers lie on face placed at unit distance from light
+  for(y=0; y<n; y++) {
+    v = (y + 0.5) * 2.0/n - 1.0;
+    for(x=0; x<n; x++) {
+      u = (x + 0.5) * 2.0/n - 1.0;
+      radius[y*n + x] = (float)sqrt(1.0 + u*u + v*v);
+    }
+  }
+
+  // rasterize faces
+  if(nthreads <= 0)
+    nthreads = rtThreadPoolDefaultSize();
+  if(nthreads > 1 && ntasks > 1)
+    pool = rtThreadPoolCreate(nthreads < ntasks? nthreads: ntasks);
+  for(k=0; k<ntasks; k++) {
+    faces[k].map = res;
+    faces[k].scene = scene;
+    faces[k].radius = radius;
+    faces[k].light = k/6;
+    faces[k].face = k%6;
+    if(!pool || !rtThreadPoolSubmit(pool, rtShadowMapFace, &faces[k]))
+      rtShadowMapFace(&faces[k]);  // no threads - rasterize face in current thread
+  }
+  if(pool) {
+    rtThreadPoolWait(pool);
+    rtThreadPoolDestroy(&pool);
+  }
+  RT_INFO("shadow maps: %d lights, %dx%d texels per face", res->nl, n, n)
+
+  free(radius);
+  free(faces);
+  return res;
+
+nomemory:
+  if(radius) free(radius);
+  if(faces) free(faces);
+  rtShadowMapDestroy(&res);
+  errno = E_MEMORY;
+  return NULL;
+}
+///////////////////////////////////////////////////////////////
+void rtShadowMapDestroy(RT_ShadowMap **self) {
+  RT_ShadowMap *ptr=*self;
+  if(ptr) {
+    if(ptr->opaque) free(ptr->opaque);
+    if(ptr->transparent) free(ptr->transparent);
+    free(ptr);
+    *self = NULL;
+  }
+}
+
+// vim: tabstop=2 shiftwidth=2 softtabstop=2
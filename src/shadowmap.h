@@ -0,0 +1,118 @@
+/*
+  Shadow maps of point lights, used for approximate shadows when `epsilon`
+  config is set. Each light gets depth cube map (6 faces of `size`x`size`
+  texels, face 2*a+s looks along axis `a`, towards its negative side when `s`
+  is 1) holding, per texel, distance from light to nearest opaque triangle
+  seen through texel center. Transparent triangles are rasterized into
+  separate map, so shadow query answered by map lookup falls back to grid
+  traversal (rtUddFindShadow()) only when point may lie behind transparent
+  triangle, whose transparency factor has to be gathered along the ray.
+*/
+#ifndef __SHADOWMAP_H
+#define __SHADOWMAP_H
+
+#include <math.h>
+#include "types.h"
+#include "scene.h"
+
+
+//// CONSTANTS ////////////////////////////////////////////////
+
+/* Maximal size of cube face (texels). */
+#define RT_SHADOWMAP_SIZE     512
+
+/* Maximal number of texels of all opaque maps; face size is lowered for
+ * scenes with many lights. */
+#define RT_SHADOWMAP_TEXELS   (1 << 24)
+
+/* Parts of triangles closer to light than this (along face axis, in scene
+ * units) are clipped. */
+#define RT_SHADOWMAP_NEAR     1e-4
+
+/* Maximal tangent of angle between surface normal and direction towards
+ * light used to scale depth bias (see rtShadowMapLookup()). */
+#define RT_SHADOWMAP_SLOPE    10.0f
+
+/* Results of rtShadowMapLookup(). */
+#define RT_SHADOWMAP_LIT      0   // nothing between point and light
+#define RT_SHADOWMAP_SHADOWED 1   // opaque triangle between point and light
+#define RT_SHADOWMAP_UNKNOWN  2   // transparent triangle may lie between point and light
+
+
+//// STRUCTURES ///////////////////////////////////////////////
+
+/* Depth cube maps of all point lights of scene. */
+typedef struct _RT_ShadowMap {
+  int32_t size;         // size of cube face (texels)
+  int32_t nl;           // number of lights
+  float *opaque;        // distance from light to nearest opaque triangle per texel
+                        // (light after light, face after face; FLT_MAX - none)
+  float *transparent;   // like above, for transparent triangles (NULL - scene has none)
+} RT_ShadowMap;
+
+
+//// INLINE FUNCTIONS /////////////////////////////////////////
+
+/* Tells whether point `p` of surface with normal `n` is seen from light `l`
+ * of index `lindex`. Point is shadowed if it lies farther from light than
+ * triangle stored in map texel by more than `bias` plus depth difference
+ * surface can have across single texel (so surfaces facing light at steep
+ * angle do not shadow themselves). */
+static inline int rtShadowMapLookup(
+    const RT_ShadowMap *self, int32_t lindex, const float *l, const float *p,
+    const float *n, float bias)
+{
+  float d[3], m, dist, cosa, slope;
+  int32_t a, x, y, size=self->size;
+  size_t offset;
+
+  d[0] = p[0] - l[0];
+  d[1] = p[1] - l[1];
+  d[2] = p[2] - l[2];
+  if(fabsf(d[0]) >= fabsf(d[1]))
+    a = fabsf(d[0]) >= fabsf(d[2])? 0: 2;
+  else
+    a = fabsf(d[1]) >= fabsf(d[2])? 1: 2;
+  m = fabsf(d[a]);
+  if(m == 0.0f)
+    return RT_SHADOWMAP_UNKNOWN;  // point at light position
+
+  // texel of face hit by light to point direction
+  x = (int32_t)((d[(a+1)%3]/m + 1.0f) * 0.5f * size);
+  y = (int32_t)((d[(a+2)%3]/m + 1.0f) * 0.5f * size);
+  if(x < 0) x = 0;
+  if(x > size-1) x = size-1;
+  if(y < 0) y = 0;
+  if(y > size-1) y = size-1;
+  offset = ((size_t)(6*lindex + 2*a + (d[a] < 0.0f))*size + y)*size + x;
+
+  // texel is about 2/size wide at unit distance from light
+  dist = sqrtf(d[0]*d[0] + d[1]*d[1] + d[2]*d[2]);
+  cosa = fabsf(n[0]*d[0] + n[1]*d[1] + n[2]*d[2]) / dist;
+  if(cosa*RT_SHADOWMAP_SLOPE > sqrtf(1.0f - cosa*cosa))
+    slope = sqrtf(1.0f - cosa*cosa) / cosa;
+  else
+    slope = RT_SHADOWMAP_SLOPE;
+  bias += slope * dist * 2.0f / size;
+
+  if(dist > self->opaque[offset] + bias)
+    return RT_SHADOWMAP_SHADOWED;
+  if(self->transparent && dist > self->transparent[offset] + bias)
+    return RT_SHADOWMAP_UNKNOWN;
+  return RT_SHADOWMAP_LIT;
+}
+
+
+//// FUNCTIONS ////////////////////////////////////////////////
+
+/* Rasterizes all triangles of preprocessed `scene` into cube maps of its
+ * point lights with `nthreads` threads (<= 0 - one per CPU), one face per
+ * task. Returns NULL on failure (`errno` is set). */
+RT_ShadowMap* rtShadowMapCreate(RT_Scene *scene, int32_t nthreads);
+
+/* Releases memory occupied by given RT_ShadowMap object. */
+void rtShadowMapDestroy(RT_ShadowMap **self);
+
+#endif
+
+// vim: tabstop=2 shiftwidth=2 softtabstop=2
@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "error.h"
+#include "common.h"
+#include "stats.h"
+
+
+/* Names of stages used in reports (indexed by RT_STAGE_*). */
+static const char *rtStatsStageNames[RT_STAGE_COUNT] = {
+  "load", "preprocess", "voxelize", "trace", "tonemap", "save"
+};
+
+#if RT_STATS
+
+__thread RT_Stats rtStatsLocal;
+
+static RT_Stats rtStatsTotal;
+static pthread_mutex_t rtStatsLock = PTHREAD_MUTEX_INITIALIZER;
+static double rtStatsWall0;       // wall clock at last reset
+static uint64_t rtStatsTsc0;      // time stamp counter at last reset
+
+
+/* Adds all counters of `b` to `a`. */
+static void rtStatsAdd(RT_Stats *a, const RT_Stats *b) {
+  int32_t k;
+  a->primary_rays += b->primary_rays;
+  a->reflected_rays += b->reflected_rays;
+  a->refracted_rays += b->refracted_rays;
+  a->shadow_rays += b->shadow_rays;
+  a->shadow_cache_hits += b->shadow_cache_hits;
+  a->shadow_map_hits += b->shadow_map_hits;
+  a->voxels += b->voxels;
+  a->triangle_tests += b->triangle_tests;
+  a->texture_evals += b->texture_evals;
+  for(k=0; k<RT_STAGE_COUNT; k++) {
+    a->cycles[k] += b->cycles[k];
+  }
+}
+
+
+/* Returns estimated frequency of time stamp counter (cycles per second). */
+static double rtStatsTscFrequency() {
+  double wall = rtStatsClock() - rtStatsWall0;
+  if(rtStatsWall0 == 0.0 || wall <= 0.0)
+    return 0.0;
+  return (rdtsc() - rtStatsTsc0) / wall;
+}
+
+#endif
+
+
+///////////////////////////////////////////////////////////////
+double rtStatsClock() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+///////////////////////////////////////////////////////////////
+void rtStatsFlush() {
+#if RT_STATS
+  pthread_mutex_lock(&rtStatsLock);
+  rtStatsAdd(&rtStatsTotal, &rtStatsLocal);
+  pthread_mutex_unlock(&rtStatsLock);
+  memset(&rtStatsLocal, 0, sizeof(RT_Stats));
+#endif
+}
+///////////////////////////////////////////////////////////////
+void rtStatsReset() {
+#if RT_STATS
+  pthread_mutex_lock(&rtStatsLock);
+  memset(&rtStatsTotal, 0, sizeof(RT_Stats));
+  rtStatsWall0 = rtStatsClock();
+  rtStatsTsc0 = rdtsc();
+  pthread_mutex_unlock(&rtStatsLock);
+  memset(&rtStatsLocal, 0, sizeof(RT_Stats));
+#endif
+}
+///////////////////////////////////////////////////////////////
+void rtStatsGet(RT_Stats *out) {
+  memset(out, 0, sizeof(RT_Stats));
+#if RT_STATS
+  rtStatsFlush();
+  pthread_mutex_lock(&rtStatsLock);
+  *out = rtStatsTotal;
+  pthread_mutex_unlock(&rtStatsLock);
+#endif
+}
+///////////////////////////////////////////////////////////////
+void rtStatsWriteJson(FILE *fd) {
+#if RT_STATS
+  RT_Stats s;
+  int32_t k;
+  double hz = rtStatsTscFrequency();
+  rtStatsGet(&s);
+  uint64_t rays = s.primary_rays + s.reflected_rays + s.refracted_rays + s.shadow_rays;
+
+  fprintf(fd, "{\"enabled\": true, \"primary_rays\": %lu, \"reflected_rays\": %lu, "
+      "\"refracted_rays\": %lu, \"shadow_rays\": %lu, \"rays\": %lu, "
+      "\"shadow_cache_hits\": %lu, \"shadow_map_hits\": %lu, \"voxels\": %lu, "
+      "\"triangle_tests\": %lu, \"texture_evals\": %lu, \"voxels_per_ray\": %.3f, "
+      "\"tests_per_ray\": %.3f, \"tsc_hz\": %.0f, \"stages\": {",
+      s.primary_rays, s.reflected_rays, s.refracted_rays, s.shadow_rays, rays,
+      s.shadow_cache_hits, s.shadow_map_hits, s.voxels, s.triangle_tests, s.texture_evals,
+      rays? (double)s.voxels/rays: 0.0, rays? (double)s.triangle_tests/rays: 0.0, hz);
+  for(k=0; k<RT_STAGE_COUNT; k++) {
+    fprintf(fd, "%s\"%s\": {\"cycles\": %lu, \"seconds\": %.6f}", k? ", ": "",
+        rtStatsStageNames[k], s.cycles[k], hz > 0.0? s.cycles[k]/hz: 0.0);
+  }
+  fprintf(fd, "}}");
+#else
+  fprintf(fd, "{\"enabled\": false}");
+#endif
+}
+///////////////////////////////////////////////////////////////
+int32_t rtStatsCostMetric(const char *name) {
+  if(!strcmp(name, "cycles"))
+    return RT_COST_CYCLES;
+  if(!strcmp(name, "rays"))
+    return RT_COST_RAYS;
+  if(!strcmp(name, "tests"))
+    return RT_COST_TESTS;
+  return RT_COST_NONE;
+}
+///////////////////////////////////////////////////////////////
+void rtStatsPrint() {
+#if RT_STATS
+  RT_Stats s;
+  int32_t k;
+  double hz = rtStatsTscFrequency();
+  rtStatsGet(&s);
+  RT_INFO("rays: primary=%lu, reflected=%lu, refracted=%lu, shadow=%lu",
+      s.primary_rays, s.reflected_rays, s.refracted_rays, s.shadow_rays)
+  RT_INFO("shadow cache hits: %lu, shadow map hits: %lu, voxels visited: %lu, triangle tests: %lu, texture evaluations: %lu",
+      s.shadow_cache_hits, s.shadow_map_hits, s.voxels, s.triangle_tests, s.texture_evals)
+  for(k=0; k<RT_STAGE_COUNT; k++) {
+    if(s.cycles[k] > 0) {
+      RT_INFO("stage %s: %lu cycles (%.3f seconds)", rtStatsStageNames[k],
+          s.cycles[k], hz > 0.0? s.cycles[k]/hz: 0.0)
+    }
+  }
+#else
+  (void)rtStatsStageNames;
+#endif
+}
+///////////////////////////////////////////////////////////////
+void rtStatsSave(const char *filename) {
+  FILE *fd = strcmp(filename, "-") == 0? stdout: fopen(filename, "w");
+  if(!fd) {
+    errno = E_IO;
+    return;
+  }
+  rtStatsWriteJson(fd);
+  fprintf(fd, "\n");
+  if(fd != stdout)
+    fclose(fd);
+}
+
+// vim: tabstop=2 shiftwidth=2 softtabstop=2
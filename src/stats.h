@@ -0,0 +1,141 @@
+/*
+  Optional rendering statistics: ray and intersection counters and per-stage
+  cycle timers. Enabled by compiling with `-DRT_STATS=1` (`make STATS=1`);
+  otherwise all RT_STATS_* macros expand to nothing and cost nothing.
+
+  Counters are kept per thread and merged into global totals by
+  rtStatsFlush(), which thread pool workers call after each task.
+*/
+#ifndef __STATS_H
+#define __STATS_H
+
+#include <stdio.h>
+#include "types.h"
+#include "rdtsc.h"
+
+#ifndef RT_STATS
+#define RT_STATS 0
+#endif
+
+
+//// STAGES ///////////////////////////////////////////////////
+
+/* Stages may nest: when render context is created by rendering function
+ * (f.e. rtVisualizedSceneRaytrace()), trace stage includes preprocess and
+ * voxelize stages. */
+
+#define RT_STAGE_LOAD         0   // loading scene files
+#define RT_STAGE_PREPROCESS   1   // preprocessing of triangles
+#define RT_STAGE_VOXELIZE     2   // creation of voxel grid
+#define RT_STAGE_TRACE        3   // tracing rays
+#define RT_STAGE_TONEMAP      4   // conversion of float image to bitmap
+#define RT_STAGE_SAVE         5   // encoding and writing result image
+#define RT_STAGE_COUNT        6
+
+
+//// PER-PIXEL COST METRICS ///////////////////////////////////
+
+#define RT_COST_NONE      0   // cost is not recorded
+#define RT_COST_CYCLES    1   // time stamp counter cycles (always available)
+#define RT_COST_RAYS      2   // rays of all kinds (requires RT_STATS)
+#define RT_COST_TESTS     3   // ray-triangle intersection tests (requires RT_STATS)
+
+
+//// STRUCTURES ///////////////////////////////////////////////
+
+/* Set of rendering statistics. */
+typedef struct _RT_Stats {
+  uint64_t primary_rays;        // rays shot from observer
+  uint64_t reflected_rays;      // secondary rays in mirror direction
+  uint64_t refracted_rays;      // secondary rays passing through transparent surfaces
+  uint64_t shadow_rays;         // rays shot from intersection points towards lights
+  uint64_t shadow_cache_hits;   // shadow rays resolved by triangle's shadow cache
+  uint64_t shadow_map_hits;     // shadow queries answered by shadow maps (no ray traced)
+  uint64_t voxels;              // voxels visited by all rays
+  uint64_t triangle_tests;      // ray-triangle intersection tests
+  uint64_t texture_evals;       // evaluations of procedural texture
+  uint64_t cycles[RT_STAGE_COUNT];  // time stamp counter cycles spent in each stage
+} RT_Stats;
+
+
+//// MACROS ///////////////////////////////////////////////////
+
+#if RT_STATS
+
+/* Counters of calling thread (merged into totals by rtStatsFlush()). */
+extern __thread RT_Stats rtStatsLocal;
+
+/* Increases counter `name` of calling thread by 1 or by `n`. */
+#define RT_STATS_INC(name) (rtStatsLocal.name++)
+#define RT_STATS_ADD(name, n) (rtStatsLocal.name += (n))
+
+/* Measures time stamp counter cycles spent between RT_STATS_START() and
+ * RT_STATS_STOP() with the same `stage` (RT_STAGE_* suffix) in one block. */
+#define RT_STATS_START(stage) uint64_t rtStatsStart_##stage = rdtsc()
+#define RT_STATS_STOP(stage) (rtStatsLocal.cycles[RT_STAGE_##stage] += rdtsc() - rtStatsStart_##stage)
+
+/* Merges counters of calling thread into totals. */
+#define RT_STATS_FLUSH() rtStatsFlush()
+
+#else
+
+#define RT_STATS_INC(name)
+#define RT_STATS_ADD(name, n)
+#define RT_STATS_START(stage)
+#define RT_STATS_STOP(stage)
+#define RT_STATS_FLUSH()
+
+#endif
+
+
+//// INLINE FUNCTIONS /////////////////////////////////////////
+
+/* Returns current value of per-pixel cost `metric` (RT_COST_*) of calling
+ * thread; cost of some work is difference of values taken after and before
+ * it. Falls back to cycles for metrics that are not compiled in. */
+static inline uint64_t rtStatsCost(int32_t metric) {
+#if RT_STATS
+  if(metric == RT_COST_RAYS)
+    return rtStatsLocal.primary_rays + rtStatsLocal.reflected_rays +
+      rtStatsLocal.refracted_rays + rtStatsLocal.shadow_rays;
+  if(metric == RT_COST_TESTS)
+    return rtStatsLocal.triangle_tests;
+#endif
+  return rdtsc();
+}
+
+
+//// FUNCTIONS ////////////////////////////////////////////////
+
+/* Returns monotonic wall clock time in seconds (available also when
+ * statistics are compiled out). */
+double rtStatsClock();
+
+/* Merges counters of calling thread into totals and clears them. */
+void rtStatsFlush();
+
+/* Clears totals (and counters of calling thread) and restarts wall clock
+ * used to estimate time stamp counter frequency. */
+void rtStatsReset();
+
+/* Stores totals (including counters of calling thread) in `out`. */
+void rtStatsGet(RT_Stats *out);
+
+/* Writes totals as single JSON object (`{"enabled": false}` when statistics
+ * are compiled out). */
+void rtStatsWriteJson(FILE *fd);
+
+/* Returns RT_COST_* metric of given name (`cycles`, `rays` or `tests`) or
+ * RT_COST_NONE if name is not known. */
+int32_t rtStatsCostMetric(const char *name);
+
+/* Prints totals using RT_INFO messages. */
+void rtStatsPrint();
+
+/* Writes totals as JSON to file `filename` (`-` - standard output). Sets
+ * `errno` on failure. */
+void rtStatsSave(const char *filename);
+
+#endif
+
+// vim: tabstop=2 shiftwidth=2 softtabstop=2
@@ -0,0 +1,323 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "error.h"
+#include "common.h"
+#include "stringtools.h"
+#include "texman.h"
+
+
+/* All cached textures. */
+static RT_Texture *rtTextureCache = NULL;
+static pthread_mutex_t rtTextureCacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* Reads little-endian values from unaligned memory. */
+static inline uint32_t rtTextureRead32(const unsigned char *p) {
+  return p[0] | (p[1]<<8) | (p[2]<<16) | ((uint32_t)p[3]<<24);
+}
+static inline uint16_t rtTextureRead16(const unsigned char *p) {
+  return p[0] | (p[1]<<8);
+}
+
+
+/* Memory-maps BMP file `path` and uses its pixels as base level of `self`
+ * if it is uncompressed 32 bit bitmap. Returns 1 if file was mapped, 0 if it
+ * has other format (and must be decoded) or -1 if it could not be read. */
+static int rtTextureMapBmp(RT_Texture *self, const char *path) {
+  struct stat st;
+  const unsigned char *base;
+  uint32_t offset;
+  int32_t w, h;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if(fd < 0)
+    return -1;
+  if(fstat(fd, &st) != 0 || st.st_size < 54) {
+    close(fd);
+    return -1;
+  }
+  base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);  // mapping stays valid
+  if(base == MAP_FAILED)
+    return -1;
+
+  offset = rtTextureRead32(base+10);
+  w = (int32_t)rtTextureRead32(base+18);
+  h = (int32_t)rtTextureRead32(base+22);
+  if(base[0] != 'B' || base[1] != 'M' || rtTextureRead32(base+14) < 40 ||
+      rtTextureRead16(base+28) != 32 || rtTextureRead32(base+30) != 0 ||
+      w <= 0 || h == 0 || offset + (uint64_t)w*(h>0? h: -h)*4 > (uint64_t)st.st_size) {
+    munmap((void*)base, st.st_size);
+    return 0;
+  }
+
+  // rows are stored bottom to top unless height is negative
+  self->map = (void*)base;
+  self->map_size = st.st_size;
+  self->level[0].width = w;
+  self->level[0].height = h>0? h: -h;
+  self->level[0].stride = h>0? -4*(ptrdiff_t)w: 4*(ptrdiff_t)w;
+  self->level[0].row0 = base + offset + (h>0? (ptrdiff_t)(h-1)*4*w: 0);
+  return 1;
+}
+
+
+/* Decodes bitmap file `path` of any format supported by rtBitmapLoad() into
+ * base level of `self`. Returns 1 on success or 0 on failure. */
+static int rtTextureDecodeBmp(RT_Texture *self, const char *path) {
+  RT_Bitmap *bmp = rtBitmapLoad(path);
+  unsigned char *p;
+  uint32_t c;
+  int32_t k, n;
+
+  if(!bmp)
+    return 0;
+  n = bmp->width*bmp->height;
+  self->texels = malloc(4*(size_t)n);
+  if(!self->texels) {
+    rtBitmapDestroy(&bmp);
+    errno = E_MEMORY;
+    return 0;
+  }
+  for(k=0, p=self->texels; k<n; k++, p+=4) {
+    c = bmp->pixels[k];
+    p[0] = rtColorGetB(c);
+    p[1] = rtColorGetG(c);
+    p[2] = rtColorGetR(c);
+    p[3] = rtColorGetA(c);
+  }
+  self->level[0].width = bmp->width;
+  self->level[0].height = bmp->height;
+  self->level[0].stride = 4*(ptrdiff_t)bmp->width;
+  self->level[0].row0 = self->texels;
+  rtBitmapDestroy(&bmp);
+  return 1;
+}
+
+
+/* Builds all mip levels of `self` (each one is box filtered previous level)
+ * unless they are built already. Safe to call from several threads. */
+static void rtTextureBuildMips(RT_Texture *self) {
+  int32_t k, x, y, c, w, h, sx, sy, nlevels;
+  size_t size=0;
+  unsigned char *dst, *ptr;
+  const unsigned char *s00, *s01, *s10, *s11;
+  RT_TextureLevel *src;
+
+  pthread_mutex_lock(&self->lock);
+  if(self->nlevels > 1 || self->mips) {
+    pthread_mutex_unlock(&self->lock);
+    return;
+  }
+
+  // count levels and memory needed for all of them
+  w = self->level[0].width;
+  h = self->level[0].height;
+  for(nlevels=1; nlevels<RT_TEXTURE_MAX_LEVELS && (w > 1 || h > 1); nlevels++) {
+    w = w > 1? w/2: 1;
+    h = h > 1? h/2: 1;
+    size += 4*(size_t)w*h;
+  }
+  self->mips = malloc(size > 0? size: 1);
+  if(!self->mips) {
+    pthread_mutex_unlock(&self->lock);
+    RT_WWARN("not enough memory for texture mip levels, base level is used")
+    return;
+  }
+
+  for(k=1, dst=self->mips; k<nlevels; k++) {
+    src = &self->level[k-1];
+    w = src->width > 1? src->width/2: 1;
+    h = src->height > 1? src->height/2: 1;
+    for(y=0, ptr=dst; y<h; y++) {
+      sy = 2*y+1 < src->height? 2*y+1: 2*y;
+      for(x=0; x<w; x++, ptr+=4) {
+        sx = 2*x+1 < src->width? 2*x+1: 2*x;
+        s00 = src->row0 + 2*y*src->stride + 8*x;
+        s01 = src->row0 + 2*y*src->stride + 4*sx;
+        s10 = src->row0 + sy*src->stride + 8*x;
+        s11 = src->row0 + sy*src->stride + 4*sx;
+        for(c=0; c<4; c++) {
+          ptr[c] = (s00[c] + s01[c] + s10[c] + s11[c] + 2) >> 2;
+        }
+      }
+    }
+    self->level[k].width = w;
+    self->level[k].height = h;
+    self->level[k].stride = 4*(ptrdiff_t)w;
+    self->level[k].row0 = dst;
+    dst += 4*(size_t)w*h;
+  }
+
+  // publish levels only after all of them are complete
+  __atomic_store_n(&self->nlevels, nlevels, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&self->lock);
+}
+
+
+/* Bilinearly filtered color of level `l` at coords (`u`, `v`) in 0..1
+ * range; result is added to `out` with weight `weight`. */
+static void rtTextureBilinear(const RT_TextureLevel *l, float u, float v, float weight, RT_Color *out) {
+  float x=u*l->width - 0.5f, y=v*l->height - 0.5f, fx, fy, w[4];
+  int32_t x0, y0, x1, y1, k, c;
+  const unsigned char *p[4];
+
+  x0 = (int32_t)floorf(x);
+  y0 = (int32_t)floorf(y);
+  fx = x - x0;
+  fy = y - y0;
+
+  // wrap around texture borders
+  x0 = x0 < 0? x0 + l->width: x0;
+  y0 = y0 < 0? y0 + l->height: y0;
+  x0 = x0 < l->width? x0: l->width-1;
+  y0 = y0 < l->height? y0: l->height-1;
+  x1 = x0+1 < l->width? x0+1: 0;
+  y1 = y0+1 < l->height? y0+1: 0;
+
+  p[0] = l->row0 + y0*l->stride + 4*x0;
+  p[1] = l->row0 + y0*l->stride + 4*x1;
+  p[2] = l->row0 + y1*l->stride + 4*x0;
+  p[3] = l->row0 + y1*l->stride + 4*x1;
+  w[0] = (1.0f-fx)*(1.0f-fy);
+  w[1] = fx*(1.0f-fy);
+  w[2] = (1.0f-fx)*fy;
+  w[3] = fx*fy;
+  weight *= 1.0f/255.0f;
+  for(k=0; k<4; k++) {
+    for(c=0; c<3; c++) {
+      out->c[c] += p[k][2-c] * w[k] * weight;  // texels are BGRA
+    }
+  }
+}
+
+
+///////////////////////////////////////////////////////////////
+RT_Texture* rtTextureAcquire(const char *name, const char *base) {
+  RT_Texture *res;
+  const char *slash;
+  char *path;
+  int mapped;
+
+  // resolve path against directory of `base` file
+  slash = base? strrchr(base, '/'): NULL;
+  if(!strcmp(name, RT_TEXTURE_BRICKS_NAME) || name[0] == '/' || !slash) {
+    path = rtStringCopy(name);
+  } else {
+    path = rtStringCreate((slash-base) + 1 + strlen(name));
+    if(path) {
+      memcpy(path, base, slash-base+1);
+      strcpy(path+(slash-base+1), name);
+    }
+  }
+  if(!path)
+    return NULL;  // errno=E_MEMORY
+
+  pthread_mutex_lock(&rtTextureCacheLock);
+  for(res=rtTextureCache; res; res=res->next) {
+    if(!strcmp(res->name, path)) {
+      res->refs++;
+      pthread_mutex_unlock(&rtTextureCacheLock);
+      free(path);
+      return res;
+    }
+  }
+
+  // not cached yet - load it (holding the lock, so it is loaded only once)
+  res = malloc(sizeof(RT_Texture));
+  if(!res) {
+    pthread_mutex_unlock(&rtTextureCacheLock);
+    free(path);
+    errno = E_MEMORY;
+    return NULL;
+  }
+  memset(res, 0, sizeof(RT_Texture));
+  res->name = path;
+  res->refs = 1;
+  res->nlevels = 1;
+  if(!strcmp(path, RT_TEXTURE_BRICKS_NAME)) {
+    res->kind = RT_TEXTURE_BRICKS;
+  } else {
+    res->kind = RT_TEXTURE_IMAGE;
+    mapped = rtTextureMapBmp(res, path);
+    if(mapped < 0 || (mapped == 0 && !rtTextureDecodeBmp(res, path))) {
+      pthread_mutex_unlock(&rtTextureCacheLock);
+      if(mapped < 0)
+        errno = E_IO;
+      free(path);
+      free(res);
+      return NULL;
+    }
+    RT_INFO("texture %s: %dx%d, %s", path, res->level[0].width, res->level[0].height,
+        res->map? "memory-mapped": "decoded")
+  }
+  pthread_mutex_init(&res->lock, NULL);
+  res->next = rtTextureCache;
+  rtTextureCache = res;
+  pthread_mutex_unlock(&rtTextureCacheLock);
+  return res;
+}
+///////////////////////////////////////////////////////////////
+void rtTextureRelease(RT_Texture **self) {
+  RT_Texture *ptr=*self, **link;
+  if(!ptr)
+    return;
+  *self = NULL;
+
+  pthread_mutex_lock(&rtTextureCacheLock);
+  if(--ptr->refs > 0) {
+    pthread_mutex_unlock(&rtTextureCacheLock);
+    return;
+  }
+  for(link=&rtTextureCache; *link; link=&(*link)->next) {
+    if(*link == ptr) {
+      *link = ptr->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&rtTextureCacheLock);
+
+  if(ptr->map) munmap(ptr->map, ptr->map_size);
+  if(ptr->texels) free(ptr->texels);
+  if(ptr->mips) free(ptr->mips);
+  pthread_mutex_destroy(&ptr->lock);
+  free(ptr->name);
+  free(ptr);
+}
+///////////////////////////////////////////////////////////////
+void rtTextureSample(RT_Texture *self, float u, float v, float lod, RT_Color *out) {
+  int32_t nlevels, l;
+  float f;
+
+  u -= floorf(u);
+  v -= floorf(v);
+  out->c[0] = out->c[1] = out->c[2] = out->c[3] = 0.0f;
+  if(!(lod > 0.0f)) {
+    rtTextureBilinear(&self->level[0], u, v, 1.0f, out);
+    return;
+  }
+
+  nlevels = __atomic_load_n(&self->nlevels, __ATOMIC_ACQUIRE);
+  if(nlevels == 1 && !self->mips) {
+    rtTextureBuildMips(self);
+    nlevels = __atomic_load_n(&self->nlevels, __ATOMIC_ACQUIRE);
+  }
+  if(lod >= nlevels-1) {
+    rtTextureBilinear(&self->level[nlevels-1], u, v, 1.0f, out);
+    return;
+  }
+  l = (int32_t)lod;
+  f = lod - l;
+  rtTextureBilinear(&self->level[l], u, v, 1.0f-f, out);
+  rtTextureBilinear(&self->level[l+1], u, v, f, out);
+}
+
+// vim: tabstop=2 shiftwidth=2 softtabstop=2
@@ -0,0 +1,77 @@
+/*
+  Texture manager. Textures are declared per surface in attribute (*.atr)
+  files and loaded once into process-wide cache shared by all scenes (f.e.
+  by all scenes resident in render server); surfaces hold references.
+
+  Texels of image textures are kept as rows of BGRA bytes. Uncompressed 32
+  bit BMP files are memory-mapped and used in place, other bitmaps are
+  decoded once. Mip levels (box filtered) are built on first sample that
+  needs them and sampled with trilinear filtering.
+*/
+#ifndef __TEXMAN_H
+#define __TEXMAN_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include "types.h"
+#include "bitmap.h"
+
+
+//// CONSTANTS ////////////////////////////////////////////////
+
+#define RT_TEXTURE_IMAGE    0   // image loaded from BMP file
+#define RT_TEXTURE_BRICKS   1   // procedural bricks with bump mapping
+
+/* Name used in attribute files for procedural bricks texture. */
+#define RT_TEXTURE_BRICKS_NAME  "@bricks"
+
+/* Maximal number of mip levels (enough for 65536x65536 textures). */
+#define RT_TEXTURE_MAX_LEVELS   17
+
+
+//// STRUCTURES ///////////////////////////////////////////////
+
+/* Single level of image texture. */
+typedef struct _RT_TextureLevel {
+  int32_t width;
+  int32_t height;
+  const unsigned char *row0;  // first (top) row of BGRA texels
+  ptrdiff_t stride;           // distance between rows in bytes (negative for bottom-up files)
+} RT_TextureLevel;
+
+/* Texture shared by surfaces. */
+typedef struct _RT_Texture {
+  char *name;             // cache key: resolved path or procedural texture name
+  int32_t kind;           // RT_TEXTURE_*
+  int32_t refs;           // number of references held (protected by cache lock)
+  int32_t nlevels;        // number of built levels (1 until mip levels are needed)
+  RT_TextureLevel level[RT_TEXTURE_MAX_LEVELS];
+  void *map;              // memory-mapped file (NULL if texels were decoded)
+  size_t map_size;        // size of mapping
+  unsigned char *texels;  // decoded base level (NULL if mapped)
+  unsigned char *mips;    // all levels above base in one block
+  pthread_mutex_t lock;   // serializes building of mip levels
+  struct _RT_Texture *next;  // next texture in cache
+} RT_Texture;
+
+
+//// FUNCTIONS ////////////////////////////////////////////////
+
+/* Returns texture `name` from cache, loading it if it is not cached yet, and
+ * takes reference to it. `name` is either RT_TEXTURE_BRICKS_NAME or path to
+ * BMP file; relative paths are resolved against directory of `base` file
+ * (NULL - current directory). Returns NULL on failure (`errno` is set). */
+RT_Texture* rtTextureAcquire(const char *name, const char *base);
+
+/* Drops reference to texture; texture is removed from cache and released
+ * when last reference is dropped. */
+void rtTextureRelease(RT_Texture **self);
+
+/* Samples image texture at coords (`u`, `v`) (texture repeats outside 0..1
+ * range) with trilinear filtering, using mip level `lod` (0 - base level,
+ * each next one is twice as small), and stores color in `out`. */
+void rtTextureSample(RT_Texture *self, float u, float v, float lod, RT_Color *out);
+
+#endif
+
+// vim: tabstop=2 shiftwidth=2 softtabstop=2
@@ -9,6 +9,7 @@
 #include "vectormath.h"
 #include "rdtsc.h"
 #include "common.h"
+#include "stats.h"
 
 static int myPerlin[] = { 151,160,137,91,90,15,
       131,13,201,95,96,53,194,233,7,225,140,36,103,30,69,142,8,99,37,240,21,10,23,
@@ -86,14 +87,177 @@ double noise(double x, double y, double z)
                            grad(myPerlin[BB+1], x-1, y-1, z-1 ))));
 }
 
-RT_Color bricks(float x, float y, float bheight, float bwidth, float filling, float rfactor, float gfactor, float bfactor, float brickpos, float* vectormod, float smoothRadius) {           
+/* Derivative of fade(). */
+static double fadeDeriv(double t)
+{
+  return 30 * t * t * (t * (t - 2) + 1);
+}
+
+/* Gradient vectors grad() takes dot products with (indexed by low 4 bits of
+ * hash). */
+static const double gradVec[16][3] = {
+  { 1, 1, 0}, {-1, 1, 0}, { 1,-1, 0}, {-1,-1, 0},
+  { 1, 0, 1}, {-1, 0, 1}, { 1, 0,-1}, {-1, 0,-1},
+  { 0, 1, 1}, { 0,-1, 1}, { 0, 1,-1}, { 0,-1,-1},
+  { 1, 1, 0}, {-1, 1, 0}, { 0, 1,-1}, { 0,-1,-1}
+};
+
+/* Trilinear interpolation of values `c` in cube corners (x varies fastest). */
+static inline double trilerp(double u, double v, double w, const double *c)
+{
+  return lerp(w, lerp(v, lerp(u, c[0], c[1]), lerp(u, c[2], c[3])),
+                 lerp(v, lerp(u, c[4], c[5]), lerp(u, c[6], c[7])));
+}
+
+double noiseGrad(double x, double y, double z, double *d)
+{
+  int X = (int)floor(x) & 255,
+      Y = (int)floor(y) & 255,
+      Z = (int)floor(z) & 255;
+  int k, hash[8];
+  const double *g;
+  double n[8], gx[8], gy[8], gz[8], k1, k2, k3;
+  x -= floor(x);
+  y -= floor(y);
+  z -= floor(z);
+  double u = fade(x), v = fade(y), w = fade(z);
+  int A = myPerlin[X]+Y,
+      AA = myPerlin[A]+Z,
+      AB = myPerlin[A+1]+Z,
+      B = myPerlin[X+1]+Y,
+      BA = myPerlin[B]+Z,
+      BB = myPerlin[B+1]+Z;
+
+  // the same corners (and order of interpolation) as noise()
+  hash[0] = myPerlin[AA];   hash[1] = myPerlin[BA];
+  hash[2] = myPerlin[AB];   hash[3] = myPerlin[BB];
+  hash[4] = myPerlin[AA+1]; hash[5] = myPerlin[BA+1];
+  hash[6] = myPerlin[AB+1]; hash[7] = myPerlin[BB+1];
+  for(k=0; k<8; k++) {
+    g = gradVec[hash[k] & 15];
+    gx[k] = g[0];
+    gy[k] = g[1];
+    gz[k] = g[2];
+    n[k] = g[0]*(x - (k&1)) + g[1]*(y - ((k>>1)&1)) + g[2]*(z - (k>>2));
+  }
+
+  /* Derivative along each axis: change of corner values blended with fade
+   * curve derivative plus blended corner gradients. */
+  k1 = lerp(w, lerp(v, n[1]-n[0], n[3]-n[2]), lerp(v, n[5]-n[4], n[7]-n[6]));
+  k2 = lerp(w, lerp(u, n[2]-n[0], n[3]-n[1]), lerp(u, n[6]-n[4], n[7]-n[5]));
+  k3 = lerp(v, lerp(u, n[4]-n[0], n[5]-n[1]), lerp(u, n[6]-n[2], n[7]-n[3]));
+  d[0] = trilerp(u, v, w, gx) + fadeDeriv(x) * k1;
+  d[1] = trilerp(u, v, w, gy) + fadeDeriv(y) * k2;
+  d[2] = trilerp(u, v, w, gz) + fadeDeriv(z) * k3;
+
+  return trilerp(u, v, w, n);
+}
+
+/* Float versions of fade(), lerp() and gradVec used by fast noise. */
+static inline float fadef(float t)
+{
+  return t * t * t * (t * (t * 6 - 15) + 10);
+}
+
+static inline float lerpf(float t, float a, float b)
+{
+  return a + t * (b - a);
+}
+
+static inline float fadeDerivf(float t)
+{
+  return 30 * t * t * (t * (t - 2) + 1);
+}
+
+static inline float floorfastf(float t)
+{
+  float f = (float)(int)t;
+  return f > t ? f - 1 : f;
+}
+
+static const float gradVecf[16][3] = {
+  { 1, 1, 0}, {-1, 1, 0}, { 1,-1, 0}, {-1,-1, 0},
+  { 1, 0, 1}, {-1, 0, 1}, { 1, 0,-1}, {-1, 0,-1},
+  { 0, 1, 1}, { 0,-1, 1}, { 0, 1,-1}, { 0,-1,-1},
+  { 1, 1, 0}, {-1, 1, 0}, { 0, 1,-1}, { 0,-1,-1}
+};
+
+float noiseGradf(float x, float y, float z, float *d)
+{
+  float fx = floorfastf(x), fy = floorfastf(y), fz = floorfastf(z);
+  int X = (int)fx & 255,
+      Y = (int)fy & 255,
+      Z = (int)fz & 255;
+  int k, A, B, hash[8];
+  const float *g;
+  float n[8], gx[8], gy[8], gz[8], u, v, w, k1, k2, k3;
+  x -= fx;
+  y -= fy;
+  z -= fz;
+  u = fadef(x);
+  v = fadef(y);
+  w = fadef(z);
+  A = myPerlin[X]+Y;
+  B = myPerlin[X+1]+Y;
+
+  // the same corners (and order of interpolation) as noise()
+  hash[0] = myPerlin[myPerlin[A]+Z];     hash[1] = myPerlin[myPerlin[B]+Z];
+  hash[2] = myPerlin[myPerlin[A+1]+Z];   hash[3] = myPerlin[myPerlin[B+1]+Z];
+  hash[4] = myPerlin[myPerlin[A]+Z+1];   hash[5] = myPerlin[myPerlin[B]+Z+1];
+  hash[6] = myPerlin[myPerlin[A+1]+Z+1]; hash[7] = myPerlin[myPerlin[B+1]+Z+1];
+  for(k=0; k<8; k++) {
+    g = gradVecf[hash[k] & 15];
+    gx[k] = g[0];
+    gy[k] = g[1];
+    gz[k] = g[2];
+    n[k] = g[0]*(x - (k&1)) + g[1]*(y - ((k>>1)&1)) + g[2]*(z - (k>>2));
+  }
+
+  if(d) {
+    k1 = lerpf(w, lerpf(v, n[1]-n[0], n[3]-n[2]), lerpf(v, n[5]-n[4], n[7]-n[6]));
+    k2 = lerpf(w, lerpf(u, n[2]-n[0], n[3]-n[1]), lerpf(u, n[6]-n[4], n[7]-n[5]));
+    k3 = lerpf(v, lerpf(u, n[4]-n[0], n[5]-n[1]), lerpf(u, n[6]-n[2], n[7]-n[3]));
+    d[0] = lerpf(w, lerpf(v, lerpf(u, gx[0], gx[1]), lerpf(u, gx[2], gx[3])),
+                    lerpf(v, lerpf(u, gx[4], gx[5]), lerpf(u, gx[6], gx[7]))) + fadeDerivf(x) * k1;
+    d[1] = lerpf(w, lerpf(v, lerpf(u, gy[0], gy[1]), lerpf(u, gy[2], gy[3])),
+                    lerpf(v, lerpf(u, gy[4], gy[5]), lerpf(u, gy[6], gy[7]))) + fadeDerivf(y) * k2;
+    d[2] = lerpf(w, lerpf(v, lerpf(u, gz[0], gz[1]), lerpf(u, gz[2], gz[3])),
+                    lerpf(v, lerpf(u, gz[4], gz[5]), lerpf(u, gz[6], gz[7]))) + fadeDerivf(z) * k3;
+  }
+
+  return lerpf(w, lerpf(v, lerpf(u, n[0], n[1]), lerpf(u, n[2], n[3])),
+                  lerpf(v, lerpf(u, n[4], n[5]), lerpf(u, n[6], n[7])));
+}
+
+/* Noise and its gradient in precision chosen by bricks() caller. */
+static inline double bricksNoise(double x, double y, double z, double *d, int fastmath)
+{
+  float df[3];
+  double n;
+  if(!fastmath)
+    return d? noiseGrad(x, y, z, d): noise(x, y, z);
+  n = noiseGradf((float)x, (float)y, (float)z, d? df: NULL);
+  if(d) {
+    d[0] = df[0];
+    d[1] = df[1];
+    d[2] = df[2];
+  }
+  return n;
+}
+
+RT_Color bricks(float x, float y, float bheight, float bwidth, float filling, float rfactor, float gfactor, float bfactor, float brickpos, float* grad, float smoothRadius, int fastmath) {           
     RT_Color color;
+    RT_STATS_INC(texture_evals);
     float w = 2*filling+bwidth;         
     float h = 2*filling+bheight; 
     
     RT_Color brickColor = {{173 / 255.0f, 106 / 255.0f, 64 / 255.0f, 0.0f}};
     RT_Color fillColor = {{215 / 255.0f, 205 / 255.0f, 178 / 255.0f, 0.0f}};
     float basef = 0.7f, derf = 0.4f;       
+    float factor[3] = {rfactor, gfactor, bfactor};
+    float step, ramp = 0.5f / smoothRadius;
+    double n, dn[3];
+    int c;
        
     double ay = y / h;       
     int row = floor(ay);
@@ -104,52 +268,58 @@ RT_Color bricks(float x, float y, float bheight, float bwidth, float filling, fl
     ay = ay - row;
         
     float posmod[4];
-    posmod[0] = 0.2f*noise(brickpos * row, brickpos * col, 0.435);
-    posmod[1] = 0.2f*noise(brickpos * row, brickpos * col, 0.645);
-    posmod[2] = 0.2f*noise(brickpos * row, brickpos * col, 0.354);
-    posmod[3] = 0.2f*noise(brickpos * row, brickpos * col, 0.768);   
+    posmod[0] = 0.2f*bricksNoise(brickpos * row, brickpos * col, 0.435, NULL, fastmath);
+    posmod[1] = 0.2f*bricksNoise(brickpos * row, brickpos * col, 0.645, NULL, fastmath);
+    posmod[2] = 0.2f*bricksNoise(brickpos * row, brickpos * col, 0.354, NULL, fastmath);
+    posmod[3] = 0.2f*bricksNoise(brickpos * row, brickpos * col, 0.768, NULL, fastmath);   
     
     float boundleft = filling/w + posmod[0] * filling/w;
     float boundright = (w - filling)/w + posmod[1] * (w - filling)/w;
     float boundtop = filling/h + posmod[2] * filling/h;
     float boundbottom = (h - filling)/h + posmod[3] * (h - filling)/h;
     
-    if (ax < boundleft) {
+    // brightness noise of brick (the same for all components)
+    n = bricksNoise(row*x, col*y, row*col, dn, fastmath);
+    grad[0] = grad[1] = 0.0f;
+
+    if (ax < boundleft || ax > boundright || ay < boundtop || ay > boundbottom) {
        color = fillColor;
-    } else if ( ax > boundright) {
-       color = fillColor;  
-    } else if ( ay < boundtop){
-       color = fillColor; 
-    } else if ( ay > boundbottom){
-       color = fillColor;  
     } else {
        color = brickColor;    
-       color.c[0] += basef * (float)noise(row*x, col*y, row*col);
-       color.c[1] += basef * (float)noise(row*x, col*y, row*col);
-       color.c[2] += basef * (float)noise(row*x, col*y, row*col); 
+       color.c[0] += basef * (float)n;
+       color.c[1] += basef * (float)n;
+       color.c[2] += basef * (float)n;
+       grad[0] += basef * row * dn[0];
+       grad[1] += basef * col * dn[1];
     }
     
+    // brightness step between mortar and brick, spread over edge ramps
+    step = (brickColor.c[0] + brickColor.c[1] + brickColor.c[2] -
+            fillColor.c[0] - fillColor.c[1] - fillColor.c[2]) / 3.0f + basef * (float)n;
     if (ay > boundtop && ay < boundbottom){
-        if ( ax > boundleft - smoothRadius && ax < boundleft + smoothRadius){
-           vectormod[0] = - cos(boundleft-ax/smoothRadius);
-        }
-        if ( ax > boundright - smoothRadius && ax < boundright + smoothRadius){
-           vectormod[0] = cos(boundright - ax/smoothRadius);
-        }
+        if (fabsf((ax - boundleft)*w) < smoothRadius)
+           grad[0] += step * ramp;
+        if (fabsf((ax - boundright)*w) < smoothRadius)
+           grad[0] -= step * ramp;
     }
-    
-    if (ax > boundleft && ay < boundright){
-       if ( ay > boundtop - smoothRadius && ay < boundtop + smoothRadius){
-           vectormod[1] = - cos(boundtop-ay/smoothRadius);
-       }
-       if ( ay > boundbottom - smoothRadius && ay < boundbottom + smoothRadius){
-           vectormod[1] = cos(boundbottom-ay/smoothRadius);
-       }
+    if (ax > boundleft && ax < boundright){
+       if (fabsf((ay - boundtop)*h) < smoothRadius)
+           grad[1] += step * ramp;
+       if (fabsf((ay - boundbottom)*h) < smoothRadius)
+           grad[1] -= step * ramp;
     }
 
-    color.c[0] += derf * (float)noise(rfactor * x, rfactor * y, row * col);
-    color.c[1] += derf * (float)noise(gfactor * x, gfactor*y, row * col);
-    color.c[2] += derf * (float)noise(bfactor * x, bfactor*y, row * col);
+    // gradient of noise finer than edge ramps is band-limited to ramp scale
+    for(c=0; c<3; c++) {
+       if(factor[c] == 0.0f) {
+          color.c[c] += derf * (float)bricksNoise(0.0, 0.0, row * col, NULL, fastmath);
+          continue;
+       }
+       n = bricksNoise(factor[c] * x, factor[c] * y, row * col, dn, fastmath);
+       color.c[c] += derf * (float)n;
+       grad[0] += derf * fminf(factor[c], ramp) * dn[0] / 3.0f;
+       grad[1] += derf * fminf(factor[c], ramp) * dn[1] / 3.0f;
+    }
     
     return color;
 }
@@ -14,19 +14,26 @@ typedef struct _perlin
   int p[512];
 } perlin;
 
-//// INLINE FUNCTIONS /////////////////////////////////////////
-
-static inline double fade(double t);
-static inline double lerp(double t, double a, double b);
-static inline double grad(int hash, double x, double y, double z);
-
 //// FUNCTIONS ////////////////////////////////////////////////
 
 perlin initPerlin();
 double noise(double x, double y, double z);
 
+/* Perlin noise at point (`x`, `y`, `z`) (like noise()) with its analytic
+ * gradient stored in `d` (3 items). */
+double noiseGrad(double x, double y, double z, double *d);
+
+/* Float version of noiseGrad() (used in fastmath mode); `d` may be NULL if
+ * gradient is not needed. */
+float noiseGradf(float x, float y, float z, float *d);
+
+/* Procedural bricks texture at point (`x`, `y`). Gradient of brightness
+ * (average of color components) along x and y is stored in `grad` (2 items);
+ * steps at brick edges are spread over ramps of `smoothRadius` half-width, so
+ * mortar joints show up as grooves when gradient is used for bump mapping.
+ * Noise is evaluated in float precision if `fastmath` is set. */
 RT_Color bricks(float x, float y, float bheight, float bwidth, float filling, 
                 float rfactor, float gfactor, float bfactor, float brickpos, 
-                float* vectormod, float smoothRadius);
+                float* grad, float smoothRadius, int fastmath);
 
 #endif
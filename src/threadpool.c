@@ -0,0 +1,155 @@
+#include "threadpool.h"
+#include "error.h"
+#include "stats.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+/* Worker thread main loop. Takes tasks from queue and executes them until pool
+ * is shut down and queue is empty. */
+static void* rtThreadPoolWorker(void *arg) {
+  RT_ThreadPool *self = (RT_ThreadPool*)arg;
+  RT_ThreadPoolTask *task;
+
+  while(1) {
+    pthread_mutex_lock(&self->lock);
+    while(!self->head && !self->shutdown) {
+      pthread_cond_wait(&self->queued, &self->lock);
+    }
+    if(!self->head) {  // shutdown requested and nothing left to do
+      pthread_mutex_unlock(&self->lock);
+      return NULL;
+    }
+    task = self->head;
+    self->head = task->next;
+    if(!self->head) {
+      self->tail = NULL;
+    }
+    pthread_mutex_unlock(&self->lock);
+
+    task->fn(task->arg);
+    free(task);
+    RT_STATS_FLUSH();  // before task is reported finished
+
+    pthread_mutex_lock(&self->lock);
+    if(--self->pending == 0) {
+      pthread_cond_broadcast(&self->finished);
+    }
+    pthread_mutex_unlock(&self->lock);
+  }
+}
+
+
+///////////////////////////////////////////////////////////////
+int32_t rtThreadPoolDefaultSize() {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0? (int32_t)n: 1;
+}
+
+
+///////////////////////////////////////////////////////////////
+RT_ThreadPool* rtThreadPoolCreate(int32_t nthreads) {
+  int32_t k;
+  RT_ThreadPool *res;
+
+  if(nthreads <= 0) {
+    nthreads = rtThreadPoolDefaultSize();
+  }
+
+  res = malloc(sizeof(RT_ThreadPool));
+  if(!res) {
+    errno = E_MEMORY;
+    return NULL;
+  }
+  memset(res, 0, sizeof(RT_ThreadPool));
+  pthread_mutex_init(&res->lock, NULL);
+  pthread_cond_init(&res->queued, NULL);
+  pthread_cond_init(&res->finished, NULL);
+
+  res->threads = malloc(nthreads*sizeof(pthread_t));
+  if(!res->threads) {
+    rtThreadPoolDestroy(&res);
+    errno = E_MEMORY;
+    return NULL;
+  }
+
+  // start workers (pool is usable even if only some of them were created)
+  for(k=0; k<nthreads; k++) {
+    if(pthread_create(&res->threads[k], NULL, rtThreadPoolWorker, res) != 0) {
+      break;
+    }
+    res->nthreads++;
+  }
+  if(res->nthreads == 0) {
+    rtThreadPoolDestroy(&res);
+    errno = E_MEMORY;
+    return NULL;
+  }
+
+  return res;
+}
+
+
+///////////////////////////////////////////////////////////////
+void rtThreadPoolDestroy(RT_ThreadPool **self) {
+  int32_t k;
+  RT_ThreadPool *ptr=*self;
+  if(!ptr)
+    return;
+
+  pthread_mutex_lock(&ptr->lock);
+  ptr->shutdown = 1;
+  pthread_cond_broadcast(&ptr->queued);
+  pthread_mutex_unlock(&ptr->lock);
+  for(k=0; k<ptr->nthreads; k++) {
+    pthread_join(ptr->threads[k], NULL);
+  }
+
+  pthread_cond_destroy(&ptr->finished);
+  pthread_cond_destroy(&ptr->queued);
+  pthread_mutex_destroy(&ptr->lock);
+  if(ptr->threads)
+    free(ptr->threads);
+  free(ptr);
+  *self = NULL;
+}
+
+
+///////////////////////////////////////////////////////////////
+int rtThreadPoolSubmit(RT_ThreadPool *self, void (*fn)(void*), void *arg) {
+  RT_ThreadPoolTask *task = malloc(sizeof(RT_ThreadPoolTask));
+  if(!task) {
+    errno = E_MEMORY;
+    return 0;
+  }
+  task->fn = fn;
+  task->arg = arg;
+  task->next = NULL;
+
+  pthread_mutex_lock(&self->lock);
+  if(self->tail) {
+    self->tail->next = task;
+  } else {
+    self->head = task;
+  }
+  self->tail = task;
+  self->pending++;
+  pthread_cond_signal(&self->queued);
+  pthread_mutex_unlock(&self->lock);
+
+  return 1;
+}
+
+
+///////////////////////////////////////////////////////////////
+void rtThreadPoolWait(RT_ThreadPool *self) {
+  pthread_mutex_lock(&self->lock);
+  while(self->pending > 0) {
+    pthread_cond_wait(&self->finished, &self->lock);
+  }
+  pthread_mutex_unlock(&self->lock);
+}
+
+// vim: tabstop=2 shiftwidth=2 softtabstop=2
@@ -0,0 +1,56 @@
+/*
+  Simple pool of worker threads executing queued tasks.
+*/
+#ifndef __THREADPOOL_H
+#define __THREADPOOL_H
+
+#include "types.h"
+#include <pthread.h>
+
+
+//// STRUCTURES ///////////////////////////////////////////////
+
+/* Single task waiting in pool's queue. */
+typedef struct _RT_ThreadPoolTask {
+  void (*fn)(void*);                // task function
+  void *arg;                        // argument passed to task function
+  struct _RT_ThreadPoolTask *next;  // next task in queue
+} RT_ThreadPoolTask;
+
+/* Pool of worker threads. Tasks are executed in order they were submitted. */
+typedef struct _RT_ThreadPool {
+  int32_t nthreads;           // number of worker threads
+  int32_t pending;            // number of submitted but not yet finished tasks
+  int32_t shutdown;           // set to 1 when workers should exit
+  pthread_t *threads;         // array of worker threads
+  RT_ThreadPoolTask *head;    // first task in queue
+  RT_ThreadPoolTask *tail;    // last task in queue
+  pthread_mutex_t lock;       // protects all fields above
+  pthread_cond_t queued;      // signalled when new task is queued
+  pthread_cond_t finished;    // signalled when `pending` reaches 0
+} RT_ThreadPool;
+
+
+//// FUNCTIONS ////////////////////////////////////////////////
+
+/* Returns number of online processors (at least 1). */
+int32_t rtThreadPoolDefaultSize();
+
+/* Creates pool of `nthreads` worker threads. When `nthreads` is <= 0, number
+ * of threads is set to number of online processors. */
+RT_ThreadPool* rtThreadPoolCreate(int32_t nthreads);
+
+/* Stops all worker threads (after finishing queued tasks) and releases memory
+ * occupied by pool. */
+void rtThreadPoolDestroy(RT_ThreadPool **self);
+
+/* Queues task `fn` to be called with `arg` by one of worker threads. Returns
+ * 1 on success or 0 on failure. */
+int rtThreadPoolSubmit(RT_ThreadPool *self, void (*fn)(void*), void *arg);
+
+/* Blocks until all submitted tasks are finished. */
+void rtThreadPoolWait(RT_ThreadPool *self);
+
+#endif
+
+// vim: tabstop=2 shiftwidth=2 softtabstop=2
@@ -0,0 +1,134 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "error.h"
+#include "common.h"
+#include "stats.h"
+#include "tune.h"
+
+
+/* Clears shadow caches of all triangles, so each measured grid starts with
+ * the same (cold) caches. */
+static void rtTuneClearShadowCaches(RT_Scene *scene) {
+  int32_t k;
+  if(scene->nl == 0)
+    return;
+  for(k=0; k<scene->nt; k++) {
+    memset(scene->t[k].shadow_cache, 0, scene->nl*sizeof(RT_Triangle*));
+  }
+}
+
+
+///////////////////////////////////////////////////////////////
+void rtUddQuality(const RT_Udd *udd, const RT_Scene *scene, RT_GridQuality *q) {
+  int32_t k;
+  float steps;
+
+  q->nv[0] = udd->nv[0];
+  q->nv[1] = udd->nv[1];
+  q->nv[2] = udd->nv[2];
+  q->nvoxels = udd->nv[0]*udd->nv[1]*udd->nv[2];
+  q->nempty = 0;
+  q->refs = 0;
+  for(k=0; k<q->nvoxels; k++) {
+    if(udd->v[k].nt == 0)
+      q->nempty++;
+    q->refs += udd->v[k].nt;
+  }
+  q->empty_ratio = (float)q->nempty / q->nvoxels;
+  q->avg_list = q->nempty < q->nvoxels? (float)q->refs / (q->nvoxels - q->nempty): 0.0f;
+  q->duplication = scene->nt > 0? (float)q->refs / scene->nt: 0.0f;
+
+  steps = (udd->nv[0] + udd->nv[1] + udd->nv[2]) / 3.0f;
+  q->est_cost = steps * (RT_TUNE_COST_STEP + RT_TUNE_COST_TEST * (float)q->refs / q->nvoxels);
+}
+///////////////////////////////////////////////////////////////
+int32_t rtGridTune(RT_RenderContext *ctx, RT_Camera *camera, int32_t step, RT_GridQuality *res, int32_t n, int32_t *best) {
+  const float coeffs[RT_TUNE_NCOEFFS] = RT_TUNE_COEFFS;
+  RT_Scene *scene=ctx->scene;
+  RT_Udd *original=ctx->udd, *udd;
+  RT_SceneConfig cfg=scene->cfg;
+  RT_Camera sample;
+  float dmin[3], dmax[3], orig_dmin[3], orig_dmax[3];
+  int32_t c, k, count=0;
+  double start;
+
+  if(camera && step > 0) {
+    sample = *camera;
+    sample.sw = camera->sw / step > 0? camera->sw / step: 1;
+    sample.sh = camera->sh / step > 0? camera->sh / step: 1;
+  }
+
+  /* rtUddCreate() enlarges domain a little; restore domain of original grid
+   * before building each candidate, so all of them cover the same space. */
+  for(k=0; k<3; k++) {
+    orig_dmin[k] = scene->dmin[k];
+    orig_dmax[k] = scene->dmax[k];
+    dmin[k] = scene->dmin[k] + 0.001f;
+    dmax[k] = scene->dmax[k] - 0.001f;
+  }
+
+  *best = -1;
+  for(c=0; c<RT_TUNE_NCOEFFS && count<n; c++) {
+    RT_GridQuality *q = &res[count];
+    memset(q, 0, sizeof(RT_GridQuality));
+    q->coeff = coeffs[c];
+    q->trace_time = -1.0;
+
+    for(k=0; k<3; k++) {
+      scene->dmin[k] = dmin[k];
+      scene->dmax[k] = dmax[k];
+      scene->cfg.vcoeff[k] = coeffs[c];
+    }
+    scene->cfg.vmode = VOX_MODIFIED_DEFAULT;
+
+    start = rtStatsClock();
+    udd = rtUddCreate(scene);
+    if(!udd)
+      break;
+    if((int64_t)udd->nv[0]*udd->nv[1]*udd->nv[2] > RT_TUNE_MAX_VOXELS) {
+      RT_INFO("grid %dx%dx%d skipped: too many voxels", udd->nv[0], udd->nv[1], udd->nv[2])
+      rtUddDestroy(&udd);
+      continue;
+    }
+    rtUddVoxelize(udd, scene);
+    q->build_time = rtStatsClock() - start;
+    rtUddQuality(udd, scene, q);
+
+    // measure grid with sample of primary rays
+    if(camera && step > 0) {
+      rtTuneClearShadowCaches(scene);
+      ctx->udd = udd;
+      start = rtStatsClock();
+      RT_VisualizedScene *vs = rtVisualizedSceneRender(ctx, &sample);
+      q->trace_time = rtStatsClock() - start;
+      ctx->udd = original;
+      if(!vs) {
+        rtUddDestroy(&udd);
+        break;
+      }
+      rtVisualizedSceneDestroy(&vs);
+    }
+    rtUddDestroy(&udd);
+
+    if(*best < 0 ||
+        (q->trace_time >= 0.0 && q->trace_time < res[*best].trace_time) ||
+        (q->trace_time < 0.0 && q->est_cost < res[*best].est_cost)) {
+      *best = count;
+    }
+    count++;
+  }
+
+  // restore configuration and domain of original grid
+  scene->cfg = cfg;
+  for(k=0; k<3; k++) {
+    scene->dmin[k] = orig_dmin[k];
+    scene->dmax[k] = orig_dmax[k];
+  }
+  ctx->udd = original;
+  rtTuneClearShadowCaches(scene);
+
+  return count;
+}
+
+// vim: tabstop=2 shiftwidth=2 softtabstop=2
@@ -0,0 +1,68 @@
+/*
+  Voxel grid quality report and automatic choice of voxelization parameters.
+  Grid is built with several densities (VOX_MODIFIED_DEFAULT mode with equal
+  coefficients), each is described with occupancy statistics and estimated
+  traversal cost and optionally measured by tracing sample of primary rays.
+*/
+#ifndef __TUNE_H
+#define __TUNE_H
+
+#include "types.h"
+#include "scene.h"
+#include "voxelize.h"
+#include "raytrace.h"
+
+
+//// CONSTANTS ////////////////////////////////////////////////
+
+/* Density coefficients tried by rtGridTune() (1 - default grid). */
+#define RT_TUNE_COEFFS  {0.25f, 0.5f, 0.75f, 1.0f, 1.25f, 1.5f, 2.0f, 3.0f, 4.0f}
+#define RT_TUNE_NCOEFFS 9
+
+/* Grids with more voxels are not tried. */
+#define RT_TUNE_MAX_VOXELS    (64*1024*1024)
+
+/* Relative costs of single voxel step and single ray-triangle test used by
+ * estimated traversal cost. */
+#define RT_TUNE_COST_STEP     1.0f
+#define RT_TUNE_COST_TEST     2.0f
+
+
+//// STRUCTURES ///////////////////////////////////////////////
+
+/* Quality of single voxel grid. */
+typedef struct _RT_GridQuality {
+  float coeff;          // VOX_MODIFIED_DEFAULT coefficient used in all directions
+  int32_t nv[3];        // grid size
+  int32_t nvoxels;      // total number of voxels
+  int32_t nempty;       // number of voxels without triangles
+  int64_t refs;         // number of triangle references in all voxels
+  float empty_ratio;    // nempty/nvoxels
+  float avg_list;       // average number of triangles in non-empty voxel
+  float duplication;    // average number of voxels single triangle belongs to
+  float est_cost;       // estimated cost of ray crossing whole grid (relative units)
+  double build_time;    // wall time of grid creation and voxelization (seconds)
+  double trace_time;    // wall time of tracing ray sample (seconds, < 0 - not measured)
+} RT_GridQuality;
+
+
+//// FUNCTIONS ////////////////////////////////////////////////
+
+/* Calculates occupancy statistics and estimated traversal cost of `udd` built
+ * for `scene`, storing them in `q` (timings are left untouched). Estimated
+ * cost assumes ray crosses on average (nx+ny+nz)/3 voxels, each with average
+ * number of triangle references. */
+void rtUddQuality(const RT_Udd *udd, const RT_Scene *scene, RT_GridQuality *q);
+
+/* Builds voxel grids of several densities for `scene` (already preprocessed,
+ * f.e. by rtRenderContextCreate() of `ctx`) and describes each one in `res`
+ * array of at least `n` items. When `camera` is given and `step` > 0, every
+ * `step`-th primary ray in both directions is traced with each grid and time
+ * is measured. Grid of `ctx` is restored before returning. Returns number of
+ * described grids and stores index of best one (lowest measured time or, if
+ * not measured, lowest estimated cost) in `best`. */
+int32_t rtGridTune(RT_RenderContext *ctx, RT_Camera *camera, int32_t step, RT_GridQuality *res, int32_t n, int32_t *best);
+
+#endif
+
+// vim: tabstop=2 shiftwidth=2 softtabstop=2
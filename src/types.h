@@ -8,6 +8,7 @@
 #endif
 
 #define __ALIGN_16 __attribute__((aligned(16)))
+#define __FORCE_INLINE inline __attribute__((always_inline))
 
 
 //// DATA TYPES SHORTCUTS /////////////////////////////////////
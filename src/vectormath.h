@@ -1,8 +1,92 @@
+/*
+  Inline operations on 3D vectors. All vectors are stored in 4 floats
+  (RT_Vertex4f or RT_Color, both aligned to 16 bytes) and, unless RT_SIMD is
+  set to 0 at compile time, whole 4 float vectors are processed with SSE (x86)
+  or NEON (ARM) instructions. The 4th coord is not used for anything, but it
+  is read and written by SIMD backend, so vectors must never point to 3 float
+  arrays. Scalar implementation is kept as reference: both give bit identical
+  results. Square roots are taken in double precision, like before SIMD
+  backend was added, so rendered images do not change.
+*/
 #ifndef __VECTORMATH_H
 #define __VECTORMATH_H
 
 #include <math.h>
 
+#ifndef RT_SIMD
+#define RT_SIMD 1
+#endif
+
+#if RT_SIMD && defined(__SSE__)
+#define RT_VECTOR_SSE 1
+#include <xmmintrin.h>
+#elif RT_SIMD && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+#define RT_VECTOR_NEON 1
+#include <arm_neon.h>
+#endif
+
+
+//// SIMD PRIMITIVES //////////////////////////////////////////
+
+#if defined(RT_VECTOR_SSE)
+
+typedef __m128 RT_Vector;
+
+#define rtVLoad(p)      _mm_load_ps(p)
+#define rtVStore(p, a)  _mm_store_ps((p), (a))
+#define rtVSet1(t)      _mm_set1_ps(t)
+#define rtVAdd(a, b)    _mm_add_ps((a), (b))
+#define rtVSub(a, b)    _mm_sub_ps((a), (b))
+#define rtVMul(a, b)    _mm_mul_ps((a), (b))
+#define rtVNeg(a)       _mm_xor_ps((a), _mm_set1_ps(-0.0f))
+
+/* Returns x+y+z of vector `a` (summed in that order). */
+static inline float rtVSum3(RT_Vector a) {
+  __m128 s=_mm_add_ss(a, _mm_shuffle_ps(a, a, _MM_SHUFFLE(1, 1, 1, 1)));
+  return _mm_cvtss_f32(_mm_add_ss(s, _mm_movehl_ps(a, a)));
+}
+
+/* Returns vector with coords of `a` rotated left (y, z, x, w). */
+#define rtVYZX(a)       _mm_shuffle_ps((a), (a), _MM_SHUFFLE(3, 0, 2, 1))
+
+#elif defined(RT_VECTOR_NEON)
+
+typedef float32x4_t RT_Vector;
+
+#define rtVLoad(p)      vld1q_f32(p)
+#define rtVStore(p, a)  vst1q_f32((p), (a))
+#define rtVSet1(t)      vdupq_n_f32(t)
+#define rtVAdd(a, b)    vaddq_f32((a), (b))
+#define rtVSub(a, b)    vsubq_f32((a), (b))
+#define rtVMul(a, b)    vmulq_f32((a), (b))
+#define rtVNeg(a)       vnegq_f32(a)
+
+/* Returns x+y+z of vector `a` (summed in that order). */
+static inline float rtVSum3(RT_Vector a) {
+  return (vgetq_lane_f32(a, 0) + vgetq_lane_f32(a, 1)) + vgetq_lane_f32(a, 2);
+}
+
+/* Returns vector with coords of `a` rotated left (y, z, x, w). */
+static inline RT_Vector rtVYZX(RT_Vector a) {
+  float32x4_t r=vextq_f32(a, a, 1);  // y z w x
+  return vsetq_lane_f32(vgetq_lane_f32(a, 3), vsetq_lane_f32(vgetq_lane_f32(a, 0), r, 2), 3);
+}
+
+#endif
+
+#if defined(RT_VECTOR_SSE) || defined(RT_VECTOR_NEON)
+#define RT_VECTOR_SIMD 1
+
+/* Cross product: a.yzx*b.zxy - a.zxy*b.yzx, computed as
+ * (a*b.yzx - a.yzx*b).yzx. */
+static inline RT_Vector rtVCrossp(RT_Vector a, RT_Vector b) {
+  return rtVYZX(rtVSub(rtVMul(a, rtVYZX(b)), rtVMul(rtVYZX(a), b)));
+}
+#endif
+
+
+//// VECTOR OPERATIONS ////////////////////////////////////////
+
 /* Builds vector from coords. */
 static inline float* rtVectorCreate(float *out, float x, float y, float z) {
   out[0] = x;
@@ -13,87 +97,134 @@ static inline float* rtVectorCreate(float *out, float x, float y, float z) {
 
 /* Copies source vector to dest vector and returns dest vector. */
 static inline float* rtVectorCopy(float *src, float *dest) {
+#ifdef RT_VECTOR_SIMD
+  rtVStore(dest, rtVLoad(src));
+#else
   dest[0] = src[0];  //x
   dest[1] = src[1];  //y
   dest[2] = src[2];  //z
+#endif
   return dest;
 }
 
 /* Subtracts vector `b` from vector `a` and stores result in vector `out`. */
 static inline float* rtVectorSub(float *out, float *a, float *b) {
+#ifdef RT_VECTOR_SIMD
+  rtVStore(out, rtVSub(rtVLoad(a), rtVLoad(b)));
+#else
   out[0] = a[0] - b[0];
   out[1] = a[1] - b[1];
   out[2] = a[2] - b[2];
+#endif
   return out;
 }
 
 /* Creates vector from vertex `a` towards vertex `b` and stores result in
  * `out`. Returns `out`. */
 static inline float* rtVectorMake(float *out, float *a, float *b) {
+#ifdef RT_VECTOR_SIMD
+  rtVStore(out, rtVSub(rtVLoad(b), rtVLoad(a)));
+#else
   out[0] = b[0] - a[0];
   out[1] = b[1] - a[1];
   out[2] = b[2] - a[2];
+#endif
   return out;
 }
 
 /* Returns length of given vector. */
 static inline float rtVectorLength(float *v) {
+#ifdef RT_VECTOR_SIMD
+  RT_Vector a=rtVLoad(v);
+  return sqrt(rtVSum3(rtVMul(a, a)));
+#else
   return sqrt(v[0]*v[0] + v[1]*v[1] + v[2]*v[2]);
+#endif
 }
 
 /* Calculates distance between vertex `a` and `b`. */
 static inline float rtVectorDistance(float *a, float *b) {
+#ifdef RT_VECTOR_SIMD
+  RT_Vector d=rtVSub(rtVLoad(a), rtVLoad(b));
+  return sqrt(rtVSum3(rtVMul(d, d)));
+#else
   float dx=a[0]-b[0], dy=a[1]-b[1], dz=a[2]-b[2];
   return sqrt(dx*dx + dy*dy + dz*dz);
+#endif
 }
 
 /* Changes direction of given vector `v` and stores result in `out`. Returns
  * `out`. */
 static inline float* rtVectorInverse(float *out, float *v) {
+#ifdef RT_VECTOR_SIMD
+  rtVStore(out, rtVNeg(rtVLoad(v)));
+#else
   out[0] = -v[0];
   out[1] = -v[1];
   out[2] = -v[2];
+#endif
   return out;
 }
 
 /* Normalizes given vector "inplace". Returns `v`. */
 static inline float* rtVectorNorm(float *v) {
+#ifdef RT_VECTOR_SIMD
+  RT_Vector a=rtVLoad(v);
+  rtVStore(v, rtVMul(a, rtVSet1(1.0f/sqrt(rtVSum3(rtVMul(a, a))))));
+#else
   float inv_len=1.0f/sqrt(v[0]*v[0] + v[1]*v[1] + v[2]*v[2]);
   v[0] *= inv_len;
   v[1] *= inv_len;
   v[2] *= inv_len;
+#endif
   return v;
 }
 
 /* Multiplicates vector `v` by scalar `t` and stores result in `out`. Returns
  * `out`. */
 static inline float* rtVectorMul(float *out, float *v, float t) {
+#ifdef RT_VECTOR_SIMD
+  rtVStore(out, rtVMul(rtVLoad(v), rtVSet1(t)));
+#else
   out[0] = v[0] * t;
   out[1] = v[1] * t;
   out[2] = v[2] * t;
+#endif
   return out;
 }
 
 /* Adds vector `b` to vector `a` and stores result in `out`. Returns `out`. */
 static inline float* rtVectorAdd(float *out, float *a, float *b) {
+#ifdef RT_VECTOR_SIMD
+  rtVStore(out, rtVAdd(rtVLoad(a), rtVLoad(b)));
+#else
   out[0] = a[0] + b[0];
   out[1] = a[1] + b[1];
   out[2] = a[2] + b[2];
+#endif
   return out;
 }
 
 /* Calculates cross product of vectors `a` and `b` and stores result in `out`.
  * Returns `out`. */
 static inline float* rtVectorCrossp(float *out, float *a, float *b) {
+#ifdef RT_VECTOR_SIMD
+  rtVStore(out, rtVCrossp(rtVLoad(a), rtVLoad(b)));
+#else
   out[0] = a[1]*b[2] - a[2]*b[1];
   out[1] = a[2]*b[0] - a[0]*b[2];
   out[2] = a[0]*b[1] - a[1]*b[0];
+#endif
   return out;
 }
 
 /* Calculates dot product of vectors `a` and `b`. */
 static inline float rtVectorDotp(float *a, float *b) {
+#ifdef RT_VECTOR_SIMD
+  return rtVSum3(rtVMul(rtVLoad(a), rtVLoad(b)));
+#else
   return a[0]*b[0] + a[1]*b[1] + a[2]*b[2];
+#endif
 }
 
 /* Calculates normalized primary ray direction vector.
@@ -111,60 +242,72 @@ static inline float* rtVectorPrimaryRay(
     float x, float y, float w_inv, float h_inv) 
 {
   float x_coef=x*w_inv, y_coef=y*h_inv;
+#ifdef RT_VECTOR_SIMD
+  RT_Vector vul=rtVLoad(ul);
+  rtVStore(out, rtVSub(rtVAdd(rtVAdd(
+      rtVMul(rtVSet1(x_coef), rtVSub(rtVLoad(ur), vul)),
+      rtVMul(rtVSet1(y_coef), rtVSub(rtVLoad(bl), vul))), vul), rtVLoad(o)));
+#else
   out[0] = x_coef*(ur[0] - ul[0]) + y_coef*(bl[0] - ul[0]) + ul[0] - o[0];
   out[1] = x_coef*(ur[1] - ul[1]) + y_coef*(bl[1] - ul[1]) + ul[1] - o[1];
   out[2] = x_coef*(ur[2] - ul[2]) + y_coef*(bl[2] - ul[2]) + ul[2] - o[2];
+#endif
   return rtVectorNorm(out);
 }
 
 /* Calculates normalized ray vector pointing from `a` towards `b` and stores
  * result in `out`. Returns `out`. */
 static inline float* rtVectorRay(float *out, float *a, float *b) {
-  out[0] = b[0] - a[0];
-  out[1] = b[1] - a[1];
-  out[2] = b[2] - a[2];
-  return rtVectorNorm(out);
+  return rtVectorNorm(rtVectorMake(out, a, b));
 }
 
 /* Solves parametric ray equation out=o+dr for given `o`, `r` and `d` params
  * and stores result in `out`. Returns `out`. */
 static inline float* rtVectorRaypoint(float *out, float *o, float *r, float d) {
+#ifdef RT_VECTOR_SIMD
+  rtVStore(out, rtVAdd(rtVLoad(o), rtVMul(rtVSet1(d), rtVLoad(r))));
+#else
   out[0] = o[0] + d*r[0];
   out[1] = o[1] + d*r[1];
   out[2] = o[2] + d*r[2];
+#endif
   return out;
 }
 
-/* Calculate normalized vector representing reflected ray by solving equation:
- * Z=2N(N*L)-L. 
-
-:param: out: result vector pointer
-:param: n: surface's normal vector 
-:param: l: normalized vector from light towards current intersection point */
-static inline float* rtVectorRayReflected(float *out, float *n, float *l) {
-  float n_dot_l = rtVectorDotp(n, l);
-  out[0] = 2.0f * n[0] * n_dot_l - l[0];
-  out[1] = 2.0f * n[1] * n_dot_l - l[1];
-  out[2] = 2.0f * n[2] * n_dot_l - l[2];
-  return rtVectorNorm(out);
-}
-
 /* Same as `vec_vector_ray_reflected` but requires dot product between `n` and
  * `l` to be calculated outside and to be passed as `n_dot_l`. */
 static inline float* rtVectorRayReflected2(float *out, float *n, float *l, float n_dot_l) {
+#ifdef RT_VECTOR_SIMD
+  rtVStore(out, rtVSub(rtVMul(rtVMul(rtVSet1(2.0f), rtVLoad(n)), rtVSet1(n_dot_l)), rtVLoad(l)));
+#else
   out[0] = 2.0f * n[0] * n_dot_l - l[0];
   out[1] = 2.0f * n[1] * n_dot_l - l[1];
   out[2] = 2.0f * n[2] * n_dot_l - l[2];
+#endif
   return rtVectorNorm(out);
 }
 
+/* Calculate normalized vector representing reflected ray by solving equation:
+ * Z=2N(N*L)-L. 
+
+:param: out: result vector pointer
+:param: n: surface's normal vector 
+:param: l: normalized vector from light towards current intersection point */
+static inline float* rtVectorRayReflected(float *out, float *n, float *l) {
+  return rtVectorRayReflected2(out, n, l, rtVectorDotp(n, l));
+}
+
 /* Calculate normalized vector representing refracted ray. */
 static inline float* rtVectorRayRefracted(float *out, float *n, float *l, float eta) {
   float n_dotp_l=rtVectorDotp(n, l);
   float f=eta*n_dotp_l - sqrt(1.0f - (eta*eta) * (1.0f - n_dotp_l*n_dotp_l));
+#ifdef RT_VECTOR_SIMD
+  rtVStore(out, rtVSub(rtVMul(rtVSet1(f), rtVLoad(n)), rtVMul(rtVSet1(eta), rtVLoad(l))));
+#else
   out[0] = f*n[0] - eta*l[0];
   out[1] = f*n[1] - eta*l[1];
   out[2] = f*n[2] - eta*l[2];
+#endif
   return rtVectorNorm(out);
 }
 
@@ -3,6 +3,7 @@
 #include "intersection.h"
 #include "error.h"
 #include "common.h"
+#include "stats.h"
 #include <string.h>
 #include <errno.h>
 #include <stdlib.h>
@@ -10,45 +11,14 @@
 #include <float.h>
 
 
-/* Used to add triangle to given voxel, reallocating memory if needed. Returns
- * 1 on success or 0 on failure (that means memory allocation error). */
-static int rtVoxelAddTriangle(RT_Voxel *v, RT_Triangle *t, int32_t bufsize) {
-  /* Array has not been allocated yet - do this now. */
-  if(!v->t) {
-    v->t = malloc(bufsize*sizeof(RT_Triangle*));
-    if(!v->t) {
-      errno = E_MEMORY;
-      return 0;
-    }
-    memset(v->t, 0, bufsize*sizeof(RT_Triangle*));
-    v->p = bufsize;  // number of space left
-
-  /* There is no more place to keep another triangle - reallocate memory by
-   * `bufsize` step and make `bufsize` number of place. */
-  } else if(v->p == 0) {
-    // create new buffer
-    RT_Triangle **tmp = malloc((v->nt+bufsize)*sizeof(RT_Triangle*));
-    if(!tmp) {
-      errno = E_MEMORY;
-      return 0;
-    }
-    memset(tmp, 0, (v->nt+bufsize)*sizeof(RT_Triangle*));
-
-    // copy triangle list to newly allocated buffer and destroy old one
-    memcpy(tmp, v->t, v->nt*sizeof(RT_Triangle*));
-    free(v->t);
-
-    // update attributes
-    v->t = tmp;
-    v->p = bufsize;
-  }
-
-  /* At this point triangle list is ready to keep another triangle. Add given
-   * triangle to list of triangles of given voxel then. */
-  v->t[v->nt++] = t;
-  v->p--;  // decrease number of space left (if it reaches 0 memory is reallocated)
-
-  return 1;
+/* Used to add triangle to given voxel. Voxelization is done twice: first
+ * pass (`fill` = 0) only counts triangles of each voxel, so lists of all
+ * voxels can be placed in one array, and second pass stores triangles in
+ * lists. */
+static inline void rtVoxelAddTriangle(RT_Voxel *v, RT_Triangle *t, int fill) {
+  if(fill)
+    v->t[v->nt] = t;
+  v->nt++;
 }
 
 
@@ -127,13 +97,18 @@ RT_Udd* rtUddCreate(RT_Scene* scene) {
   int k;
   float ds[3], v, tmp;
   RT_Udd *res=NULL;
+  RT_Arena *arena;
 
-  // create result object
-  res = malloc(sizeof(RT_Udd));
+  // create result object in its own arena
+  arena = rtArenaCreate(0);
+  if(arena)
+    res = rtArenaAllocZero(arena, sizeof(RT_Udd));
   if(!res) {
+    rtArenaDestroy(&arena);
     errno = E_MEMORY;
     return NULL;
   }
+  res->arena = arena;
 
   // calculate domain size
   for(k=0; k<3; k++) {
@@ -168,7 +143,7 @@ RT_Udd* rtUddCreate(RT_Scene* scene) {
       for(k=0; k<3; k++) {
         if(scene->cfg.vcoeff[k] <= 0.0f) {
           RT_EERROR("none of voxelization coeffs can be <= 0 in VOX_MODIFIED_DEFAULT voxelization mode")
-          free(res);
+          rtArenaDestroy(&arena);
           errno = E_INVALID_PARAM_VALUE;
           return NULL;
         }
@@ -186,7 +161,7 @@ RT_Udd* rtUddCreate(RT_Scene* scene) {
       for(k=0; k<3; k++) {
         if(scene->cfg.vcoeff[k] <= 0.0f) {
           RT_EERROR("none of voxelization coeffs can be <= 0 in VOX_MODIFIED_DEFAULT voxelization mode")
-          free(res);
+          rtArenaDestroy(&arena);
           errno = E_INVALID_PARAM_VALUE;
           return NULL;
         }
@@ -207,47 +182,30 @@ RT_Udd* rtUddCreate(RT_Scene* scene) {
 
   // create voxel grid array
   tmp = res->nv[0] * res->nv[1] * res->nv[2];
-  res->v = malloc(tmp*sizeof(RT_Voxel));
+  res->v = rtArenaAllocZero(arena, (size_t)tmp*sizeof(RT_Voxel));
   if(!res->v) {
-    free(res);
+    rtArenaDestroy(&arena);
     errno = E_MEMORY;
     return NULL;
   }
-  memset(res->v, 0, tmp*sizeof(RT_Voxel));
 
   return res;
 }
 ///////////////////////////////////////////////////////////////
 void rtUddDestroy(RT_Udd **self) {
-  RT_Udd *ptr = *self;
-  int32_t k, s=ptr->nv[0]*ptr->nv[1]*ptr->nv[2];
-  if(ptr->v) {
-    for(k=0; k<s; k++) {
-      if(ptr->v[k].t) {
-        free(ptr->v[k].t);
-      }
-    }
-    free(ptr->v);
-  }
-  free(ptr);
+  RT_Arena *arena = (*self)->arena;  // grid object itself is released with its arena
+  rtArenaDestroy(&arena);
   *self = NULL;
 }
 ///////////////////////////////////////////////////////////////
-void rtUddVoxelize(RT_Udd *self, RT_Scene *scene) {
-  const int32_t BUFSIZE = 10;  // number of space to add after each reallocation
+/* Single pass of voxelization: adds each triangle of `scene` to all voxels
+ * of its bounding box (see rtVoxelAddTriangle() for meaning of `fill`). */
+static void rtUddVoxelizePass(RT_Udd *self, RT_Scene *scene, int fill) {
   int32_t i, j, k;
   RT_Vertex4f p;
   RT_Voxel *vptr=NULL;
-  RT_Triangle *t=scene->t, *maxt=(RT_Triangle*)(scene->t + scene->nt), **tmp;
+  RT_Triangle *t=scene->t, *maxt=(RT_Triangle*)(scene->t + scene->nt);
 
-  // make temporary storage for assigned triangles
-  tmp = malloc(scene->nt*sizeof(RT_Triangle*));
-  if(!tmp) {
-    errno = E_MEMORY;
-    return;
-  }
-  memset(tmp, 0, scene->nt*sizeof(RT_Triangle*));
-  
   // iterate through array of triangles
   while(t < maxt) {
     //if(t->sid == 34) {t++; continue;}
@@ -269,7 +227,7 @@ void rtUddVoxelize(RT_Udd *self, RT_Scene *scene) {
     // if minimal and maximal are equal, triangle is added to exactly one voxel
     if(min[0]==max[0] && min[1]==max[1] && min[2]==max[2]) {
       vptr = (RT_Voxel*)(self->v + rtVoxelArrayOffset(self, min[0], min[1], min[2]));
-      rtVoxelAddTriangle(vptr, t, BUFSIZE);
+      rtVoxelAddTriangle(vptr, t, fill);
       t++;
       continue;
     }
@@ -280,7 +238,7 @@ void rtUddVoxelize(RT_Udd *self, RT_Scene *scene) {
         for(k=min[2]; k<=max[2]; k++) {
           // add triangle to current voxel
           vptr = (RT_Voxel*)(self->v + rtVoxelArrayOffset(self, i, j, k));
-          rtVoxelAddTriangle(vptr, t, BUFSIZE);
+          rtVoxelAddTriangle(vptr, t, fill);
           continue;
 
           /* Triangle is included in the voxel if at least one of following
@@ -405,7 +363,7 @@ void rtUddVoxelize(RT_Udd *self, RT_Scene *scene) {
 
           // add triangle to current voxel
           vptr = (RT_Voxel*)(self->v + rtVoxelArrayOffset(self, i, j, k));
-          rtVoxelAddTriangle(vptr, t, BUFSIZE);
+          rtVoxelAddTriangle(vptr, t, fill);
         }
       }
     }
@@ -414,6 +372,34 @@ void rtUddVoxelize(RT_Udd *self, RT_Scene *scene) {
   }
 }
 ///////////////////////////////////////////////////////////////
+void rtUddVoxelize(RT_Udd *self, RT_Scene *scene) {
+  int32_t k, nv=self->nv[0]*self->nv[1]*self->nv[2];
+  int64_t nrefs=0;
+  RT_Triangle **refs;
+
+  rtUddVoxelizePass(self, scene, 0);
+
+  /* Split single array between lists of all voxels and clear counters, so
+   * filling pass stores triangles from the start of each list. */
+  for(k=0; k<nv; k++) {
+    nrefs += self->v[k].nt;
+  }
+  refs = rtArenaAlloc(self->arena, nrefs*sizeof(RT_Triangle*));
+  if(!refs) {
+    for(k=0; k<nv; k++) {
+      self->v[k].nt = 0;  // leave grid empty, but consistent
+    }
+    return;  // errno=E_MEMORY
+  }
+  for(k=0; k<nv; k++) {
+    self->v[k].t = refs;
+    refs += self->v[k].nt;
+    self->v[k].nt = 0;
+  }
+
+  rtUddVoxelizePass(self, scene, 1);
+}
+///////////////////////////////////////////////////////////////
 int rtUddFindStartupVoxel(
     RT_Udd *self, RT_Scene *scene, 
     float *o, float *r, 
@@ -533,11 +519,15 @@ int rtUddCheckVoxelIntersection(
   return 0;
 }
 ///////////////////////////////////////////////////////////////
-RT_Triangle* rtUddFindNearestTriangle(
+/* Common part of rtUddFindNearestTriangle() and
+ * rtUddFindNearestTriangleBeyond(). Always inlined, so `skip` test is
+ * removed when it is constant 0. */
+static __FORCE_INLINE RT_Triangle* rtUddFindNearestTriangleKernel(
   RT_Udd *self, RT_Scene *scene, 
   RT_Triangle *current,
   float *ipoint,
   float *dmin,
+  float dskip, int skip,
   float *o, float *r, 
   int32_t *i_, int32_t *j_, int32_t *k_,
   float *u, float *v)
@@ -565,7 +555,10 @@ RT_Triangle* rtUddFindNearestTriangle(
   while(1) {
     // check intersections in current voxel
     RT_Voxel *voxel = (RT_Voxel*)(self->v + rtVoxelArrayOffset(self, i, j, k));
-    if(voxel->nt > 0) {
+    RT_STATS_INC(voxels);
+    // (voxels ray leaves before `dskip` can not contain intersection)
+    if(voxel->nt > 0 && (!skip || MIN(tx+dtx, ty+dty, tz+dtz) > dskip)) {
+      RT_STATS_ADD(triangle_tests, voxel->nt);
       *dmin = MIN(tx+dtx, ty+dty, tz+dtz);
       nearest = NULL;
       for(c=0; c<voxel->nt; c++) {
@@ -612,9 +605,34 @@ RT_Triangle* rtUddFindNearestTriangle(
   }
 }
 ///////////////////////////////////////////////////////////////
+RT_Triangle* rtUddFindNearestTriangle(
+  RT_Udd *self, RT_Scene *scene, 
+  RT_Triangle *current,
+  float *ipoint,
+  float *dmin,
+  float *o, float *r, 
+  int32_t *i, int32_t *j, int32_t *k,
+  float *u, float *v)
+{
+  return rtUddFindNearestTriangleKernel(self, scene, current, ipoint, dmin, 0.0f, 0, o, r, i, j, k, u, v);
+}
+///////////////////////////////////////////////////////////////
+RT_Triangle* rtUddFindNearestTriangleBeyond(
+  RT_Udd *self, RT_Scene *scene, 
+  RT_Triangle *current,
+  float *ipoint,
+  float *dmin,
+  float dskip,
+  float *o, float *r, 
+  int32_t *i, int32_t *j, int32_t *k,
+  float *u, float *v)
+{
+  return rtUddFindNearestTriangleKernel(self, scene, current, ipoint, dmin, dskip, 1, o, r, i, j, k, u, v);
+}
+///////////////////////////////////////////////////////////////
 RT_Triangle* rtUddFindShadow(
   RT_Udd *self, RT_Scene *scene,
-  RT_Triangle *current,
+  RT_Triangle *current, float *n,
   float *a, RT_Light *l, int32_t lindex, float *ts)
 {
   int32_t aidx[3], bidx[3];
@@ -638,25 +656,29 @@ RT_Triangle* rtUddFindShadow(
   // check if light is beyond current surface (100% sure that light is not
   // visible from such surface if so)
   if(current->s->kt == 0.0f) {
-    if(rtVectorDotp(r, current->n) <= 0.0f) {
+    if(rtVectorDotp(r, n) <= 0.0f) {
       return current;
     }
   }
   
-  // check if ray intersects cached object
+  // calculate distance between points
+  dmax = rtVectorDistance(a, b);
+  RT_STATS_INC(shadow_rays);
+
+  // check if ray intersects cached object between point and light (cache is
+  // shared by all rendering threads, so it is accessed atomically)
   if(lindex >= 0) {
-    RT_Triangle *cache = current->shadow_cache[lindex];
+    RT_Triangle *cache = __atomic_load_n(&current->shadow_cache[lindex], __ATOMIC_RELAXED);
     if(cache != NULL) {
-      if(cache->isint(cache, a, r, &d, &dmin, &u, &v)) {
+      RT_STATS_INC(triangle_tests);
+      if(cache->isint(cache, a, r, &d, &dmin, &u, &v) && d > 0.00001f && d < dmax) {
+        RT_STATS_INC(shadow_cache_hits);
         return cache;
       }
-      current->shadow_cache[lindex] = NULL;
+      __atomic_store_n(&current->shadow_cache[lindex], NULL, __ATOMIC_RELAXED);
     }
   }
 
-  // calculate distance between points
-  dmax = rtVectorDistance(a, b);
-
   // find voxel for point `a`
   if(!rtVertexGetVoxel(scene, self, a, &aidx[0], &aidx[1], &aidx[2])) {
     RT_ERROR("rtUddFindShadow(): vertex `a` outside of domain: x=%.3f, y=%.3f, z=%.3f", a[0], a[1], a[2])
@@ -695,9 +717,11 @@ RT_Triangle* rtUddFindShadow(
   while(1) {
     // check intersections in current voxel
     RT_Voxel *voxel = (RT_Voxel*)(self->v + rtVoxelArrayOffset(self, i, j, k));
+    RT_STATS_INC(voxels);
     if(voxel->nt > 0) {
       for(c=0; c<voxel->nt; c++) {
         t = voxel->t[c];
+        RT_STATS_INC(triangle_tests);
         if(t->isint(t, a, r, &d, &dmin, &u, &v)) {
           if(t != current) {
             if(t->s->kt > 0.0f) {  // found transparent or semi-transparent triangle
@@ -706,7 +730,7 @@ RT_Triangle* rtUddFindShadow(
             }
             if(d > 0.00001f && d < dmax) {
               if(lindex >= 0) {
-                current->shadow_cache[lindex] = t;
+                __atomic_store_n(&current->shadow_cache[lindex], t, __ATOMIC_RELAXED);
               }
               return t;
             }
@@ -12,8 +12,7 @@
 /* Structure that represents single voxel. */
 typedef struct _RT_Voxel {
   int32_t nt;       // number of triangles in this voxel
-  int32_t p;        // number of free indices left in `t` array (when 0, `t` must be reallocated)
-  RT_Triangle **t;  // array of triangle pointers
+  RT_Triangle **t;  // array of triangle pointers (part of array shared by all voxels)
 } RT_Voxel;
 
 /* Structure that groups all voxels in one place. "UDD" stands for "Uniform
@@ -22,6 +21,7 @@ typedef struct _RT_Udd {
   float s[3];     // size of single voxel (x, y, z)
   int32_t nv[3];  // voxel grid size (nv[0]*nv[1]*nv[2] is number of items in `v` array)
   RT_Voxel *v;    // array of voxels mapped from 3D array to 1D array
+  RT_Arena *arena;  // grid object, voxels and their triangle lists
 } RT_Udd;
 
 
@@ -99,6 +99,25 @@ RT_Triangle* rtUddFindNearestTriangle(
   float *u, float *v
 );
 
+/* Works like rtUddFindNearestTriangle(), but voxels ray leaves at distance
+ * not greater than `dskip` are passed without intersection tests. Result is
+ * the same as the one of rtUddFindNearestTriangle() as long as no triangle
+ * is intersected closer than `dskip` (f.e. when `dskip` is taken from
+ * depth buffer made by rtRasterCreate()).
+
+:param: dskip: distance from ray origin (along `r`) ray is known to travel
+  without hitting any triangle */
+RT_Triangle* rtUddFindNearestTriangleBeyond(
+  RT_Udd *self, RT_Scene *scene, 
+  RT_Triangle *current,
+  float *ipoint,
+  float *dmin,
+  float dskip,
+  float *o, float *r,
+  int32_t *i, int32_t *j, int32_t *k,
+  float *u, float *v
+);
+
 /* Returns first found triangle that is intersected by ray that starts at
  * vertex `a` and is directed towards vertex `b` (the light location). When
  * such triangle is found, point `a` is said to be "in shadow" of found
@@ -107,13 +126,14 @@ RT_Triangle* rtUddFindNearestTriangle(
 :param: self: pointer to RT_Udd object
 :param: scene: pointer to RT_Scene object
 :param: current: pointer to triangle that point `a` belongs to
+:param: n: normal vector of `current` pointed towards observer
 :param: a: intersection point tested against shadow
 :param: l: light location
 :param: ts: modifier used to "darken" pixel due to shadow from semi-transparent
   object */
 RT_Triangle* rtUddFindShadow(
   RT_Udd *self, RT_Scene *scene,
-  RT_Triangle *current,
+  RT_Triangle *current, float *n,
   float *a, RT_Light *l, int32_t lindex, float *ts
 );
 